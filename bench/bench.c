@@ -0,0 +1,244 @@
+/* Measure the parts of btrroll that grow with the number of snapshots, on a
+ * tree made by bench-gen:
+ *
+ *   scan   snapshot_menu's collection phase (snapshot_list_scan)
+ *   match  get_compatible_boot_entries, for up to MATCH_MAX snapshots
+ *
+ * Each phase runs twice in a child process: once as is, for its wall time and
+ * peak RSS, and once under ptrace, for the number of syscalls it makes. Only
+ * the phase itself is counted; the child marks its start and end by raising
+ * SIGUSR1 and SIGUSR2. Processes it spawns (i.e. bootctl) are not counted.
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boot.h>
+#include <constants.h>
+#include <macros.h>
+#include <path.h>
+#include <snaplist.h>
+#include <snapshot.h>
+
+#define MATCH_MAX 100
+
+typedef struct result {
+  uint64_t ns;
+  size_t items; // snapshots collected, or snapshots matched
+} result_t;
+
+typedef int (*phase_fn_t)(const char *tree, result_t *result);
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void phase_start(result_t *result) {
+  raise(SIGUSR1);
+  result->ns = now_ns();
+}
+
+static void phase_end(result_t *result) {
+  result->ns = now_ns() - result->ns;
+  raise(SIGUSR2);
+}
+
+static int phase_scan(const char *tree, result_t *result) {
+  // As snapshot_menu does, from the snapshots directory
+  char *root_subvol_dir = pathcat(tree, "root.d");
+  char *snapshots = root_subvol_dir ? pathcat(root_subvol_dir, SUBVOL_SNAP_NAME) : NULL;
+  if (!snapshots || chdir(snapshots)) {
+    perror("chdir");
+    return -1;
+  }
+
+  snapshot_list_t list = { 0 };
+  phase_start(result);
+  const int ret = snapshot_list_scan(&list, ".", root_subvol_dir);
+  phase_end(result);
+
+  result->items = list.len;
+  snapshot_list_free(&list);
+  free(snapshots);
+  free(root_subvol_dir);
+  return ret;
+}
+
+static int phase_match(const char *tree, result_t *result) {
+  char *snapshots = pathcat(tree, "root.d/" SUBVOL_SNAP_NAME);
+  char *esp = pathcat(tree, "esp");
+  snapshot_list_t list = { 0 };
+  if (!snapshots || !esp || snapshot_list_index(&list, snapshots)) {
+    perror("snapshot_list_index");
+    return -1;
+  }
+
+  int ret = 0;
+  phase_start(result);
+  for (size_t i = 0; i < list.len && i < MATCH_MAX && !ret; ++i) {
+    char *snapshot = pathcat(snapshots, list.entries[i].path);
+    bootctl_entry_t entries[32];
+    const int num_entries = snapshot
+      ? get_compatible_boot_entries(snapshot, esp, entries, lenof(entries)) : -1;
+    if (num_entries <= 0)
+      ret = -1; // every generated snapshot has a compatible entry
+    for (int j = 0; j < num_entries; ++j)
+      bootctl_entry_free(entries + j);
+    free(snapshot);
+    ++result->items;
+  }
+  phase_end(result);
+
+  snapshot_list_free(&list);
+  free(esp);
+  free(snapshots);
+  return ret;
+}
+
+// Follow the child `pid` and its threads, counting syscalls between the marks
+static long count_syscalls(pid_t pid) {
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status) ||
+      ptrace(PTRACE_SETOPTIONS, pid, 0,
+        PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL) ||
+      ptrace(PTRACE_SYSCALL, pid, 0, 0))
+  {
+    perror("ptrace");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+
+  // Every syscall stops once on entry and once on exit
+  bool counting = false;
+  long stops = 0;
+  pid_t tid;
+  while ((tid = waitpid(-1, &status, __WALL)) > 0) {
+    if (!WIFSTOPPED(status))
+      continue;
+
+    int sig = WSTOPSIG(status);
+    if (sig == (SIGTRAP | 0x80)) {
+      stops += counting;
+      sig = 0;
+    } else if (status >> 16) {
+      sig = 0; // a new thread; it is followed from its first stop
+    } else if (sig == SIGUSR1 || sig == SIGUSR2) {
+      counting = sig == SIGUSR1;
+      sig = 0;
+    } else if (sig == SIGSTOP) {
+      sig = 0;
+    }
+    ptrace(PTRACE_SYSCALL, tid, 0, sig);
+  }
+
+  return stops / 2;
+}
+
+/* Run `phase` in a child process, storing its result in `result`, its peak RSS
+ * in KiB in `rss`, and (if `traced`) its syscall count in `syscalls`.
+ */
+static int run_phase(
+    phase_fn_t phase, const char *tree, bool traced,
+    result_t *result, long *rss, long *syscalls)
+{
+  result_t * const shared = mmap(NULL, sizeof(result_t),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  memset(shared, 0, sizeof(result_t));
+
+  fflush(stdout);
+  const pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    munmap(shared, sizeof(result_t));
+    return -1;
+  }
+  if (pid == 0) {
+    // btrroll narrates a lot on stderr, which is not what's being measured
+    if (!getenv("BENCH_VERBOSE"))
+      freopen("/dev/null", "w", stderr);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    if (traced && (ptrace(PTRACE_TRACEME, 0, 0, 0) || raise(SIGSTOP)))
+      _exit(2);
+    _exit(phase(tree, shared) ? 1 : 0);
+  }
+
+  if (traced)
+    *syscalls = count_syscalls(pid);
+
+  int status;
+  struct rusage usage;
+  const pid_t waited = wait4(pid, &status, 0, &usage);
+  int ret = 0;
+  if (traced) {
+    // count_syscalls already reaped it
+    ret = *syscalls < 0 ? -1 : 0;
+  } else if (waited < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    eprintf("bench: phase failed (rerun with BENCH_VERBOSE=1 for details)\n");
+    ret = -1;
+  } else {
+    *rss = usage.ru_maxrss;
+  }
+
+  if (!traced)
+    *result = *shared;
+  munmap(shared, sizeof(result_t));
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    eprintf("usage: %s <tree made by bench-gen>\n", argv[0]);
+    return 2;
+  }
+
+  static const struct {
+    const char *name;
+    phase_fn_t fn;
+  } PHASES[] = {
+    { "scan", phase_scan },
+    { "match", phase_match },
+  };
+
+  int ret = 0;
+  printf("%s\n", argv[1]);
+  printf("  %-6s %9s %12s %14s %12s %14s\n",
+      "phase", "items", "wall (ms)", "per item (us)", "syscalls", "peak RSS (KiB)");
+  for (size_t i = 0; i < lenof(PHASES); ++i) {
+    result_t result;
+    long rss = 0, syscalls = -1;
+    if (run_phase(PHASES[i].fn, argv[1], false, &result, &rss, &syscalls)) {
+      ret = 1;
+      continue;
+    }
+    if (run_phase(PHASES[i].fn, argv[1], true, &result, &rss, &syscalls))
+      syscalls = -1; // ptrace may be forbidden here; report the rest anyway
+
+    char syscalls_str[0x20] = "n/a";
+    if (syscalls >= 0)
+      snprintf(arr_and_size(syscalls_str), "%ld", syscalls);
+    printf("  %-6s %9zu %12.2f %14.2f %12s %14ld\n",
+        PHASES[i].name, result.items, result.ns / 1e6,
+        result.items ? result.ns / 1e3 / result.items : 0.0,
+        syscalls_str, rss);
+  }
+
+  return ret;
+}
@@ -0,0 +1,215 @@
+#!/bin/sh
+# Measure what btrroll adds to the time it takes to get to sysroot.mount. A
+# throwaway disk is booted under QEMU and OVMF, through systemd-boot and an
+# initrd with the btrroll hook, with `btrroll.trace` on the command line; the
+# times of btrroll's phases (see trace.h) and of the root being mounted are then
+# read off the serial console. On a fresh copy of the disk each time, this
+# runs $BENCH_RUNS times each of:
+#
+#   idle      no action; btrroll waits out btrroll.timeout=1 and boots as normal
+#   boot      btrroll.action=boot:latest, which reboots
+#   continue  the boot after that, where snapshot_continue boots `temp`
+#   restore   btrroll.action=restore:latest, which reboots
+#
+# This needs root (for loop devices), qemu-system-x86_64, OVMF, mkinitcpio,
+# systemd-boot, btrfs-progs, dosfstools, util-linux and a static busybox. It
+# tests the installed btrroll and hook, so run `make install` first. Serial logs
+# are kept in $BENCH_DIR/logs.
+
+set -e
+cd "$(dirname "$0")/.."
+
+: "${BENCH_RUNS:=3}"
+: "${BENCH_DIR:=/tmp/btrroll-boot}"
+: "${BENCH_KERNEL:=/boot/vmlinuz-linux}"
+: "${BENCH_TIMEOUT:=120}" # seconds per boot
+: "${BENCH_OVMF_CODE:=/usr/share/edk2/x64/OVMF_CODE.4m.fd}"
+: "${BENCH_OVMF_VARS:=/usr/share/edk2/x64/OVMF_VARS.4m.fd}"
+SYSTEMD_BOOT=/usr/lib/systemd/boot/efi/systemd-bootx64.efi
+
+# Every scenario boots with these, and an action if it has one
+OPTIONS="rw console=ttyS0 printk.devkmsg=on systemd.log_target=kmsg \
+systemd.log_level=info btrroll.trace"
+
+die() {
+    echo "bench: $*" >&2
+    exit 1
+}
+
+[ "$(id -u)" = 0 ] || die "must be run as root, for loop devices"
+for tool in qemu-system-x86_64 mkinitcpio mkfs.btrfs mkfs.fat sfdisk losetup blkid file busybox; do
+    command -v "$tool" >/dev/null || die "$tool is missing"
+done
+for file in "$BENCH_KERNEL" "$BENCH_OVMF_CODE" "$BENCH_OVMF_VARS" "$SYSTEMD_BOOT"; do
+    [ -e "$file" ] || die "$file is missing"
+done
+busybox=$(command -v busybox)
+! ldd "$busybox" >/dev/null 2>&1 || die "$busybox must be linked statically"
+cmp -s bin/btrroll /usr/bin/btrroll || die "/usr/bin/btrroll isn't bin/btrroll; run make install"
+
+accel=kvm
+if [ ! -w /dev/kvm ]; then
+    echo "bench: warning: no KVM; times under emulation are much noisier" >&2
+    accel=tcg
+fi
+
+# The version of the kernel, which the root needs modules for to be bootable
+kver=$(file -bL "$BENCH_KERNEL" | sed -n 's/.*version \([^ ]*\).*/\1/p')
+[ -n "$kver" ] || die "$BENCH_KERNEL is not a kernel image"
+
+logs="$BENCH_DIR/logs"
+mkdir -p "$logs"
+work=$(mktemp -d "$BENCH_DIR/work.XXXXXX")
+mnt="$work/mnt"
+mkdir "$mnt"
+loop=
+
+cleanup() {
+    if mountpoint -q "$mnt"; then
+        umount "$mnt"
+    fi
+    if [ -n "$loop" ]; then
+        losetup -d "$loop"
+    fi
+    rm -rf "$work"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Attach the disk image $1 with its partitions as $loop
+attach() {
+    loop=$(losetup -fP --show "$1")
+    udevadm settle 2>/dev/null || true
+}
+
+detach() {
+    losetup -d "$loop"
+    loop=
+}
+
+# Make the disk image $1 boot the entry for scenario $2
+set_default() {
+    attach "$1"
+    mount "${loop}p1" "$mnt"
+    printf 'default %s.conf\ntimeout 0\n' "$2" > "$mnt/loader/loader.conf"
+    umount "$mnt"
+    detach
+}
+
+# Boot the disk image $1 with the firmware variables in $2, logging to $3
+boot() {
+    timeout "$BENCH_TIMEOUT" qemu-system-x86_64 \
+        -machine q35,accel="$accel" -m 1G -smp 2 -no-reboot \
+        -drive if=pflash,format=raw,readonly=on,file="$BENCH_OVMF_CODE" \
+        -drive if=pflash,format=raw,file="$2" \
+        -drive if=virtio,format=raw,file="$1" \
+        -display none -monitor none -serial file:"$3" \
+        || echo "bench: $3: QEMU exited with $?" >&2
+}
+
+# Print the times in the log $3 of run $2 of scenario $1, in ms
+report() {
+    awk -v scenario="$1" -v run="$2" '
+        function time(  t) {
+            t = $0
+            sub(/^\[ */, "", t)
+            return t + 0
+        }
+        function ms(from, to) {
+            if (!(from in at) || !(to in at))
+                return "-"
+            return sprintf("%.1f", (at[to] - at[from]) * 1000)
+        }
+        BEGIN { at["boot"] = 0 }
+        { sub(/\r$/, "") }
+        /btrroll: trace / { at[$NF] = time() }
+        /Mounted .*[Ss]ysroot/ && !("sysroot" in at) { at["sysroot"] = time() }
+        END {
+            end = ("exit" in at) ? "exit" : "restart"
+            printf "  %-9s %3d %9s %9s %9s %9s %9s %9s %9s\n", scenario, run,
+                ms("boot", "start"), ms("start", "mounted"), ms("continue", "continue-done"),
+                ms("gate", "gate-done"), ms("action", "restart"), ms("start", end),
+                ms("boot", "sysroot")
+        }' "$3"
+}
+
+echo "Building the initrd..."
+cat > "$work/mkinitcpio.conf" << EOF
+MODULES=(btrfs vfat virtio_blk virtio_pci)
+HOOKS=(base systemd modconf block filesystems btrroll)
+EOF
+mkinitcpio -c "$work/mkinitcpio.conf" -k "$BENCH_KERNEL" -g "$work/initrd.img" >/dev/null
+
+echo "Building the disk..."
+disk="$work/disk.img"
+truncate -s 1G "$disk"
+printf 'label: gpt\nsize=128MiB, type=U\ntype=L\n' | sfdisk -q "$disk"
+attach "$disk"
+mkfs.fat -F 32 -n ESP "${loop}p1" >/dev/null
+mkfs.btrfs -q -f "${loop}p2"
+partuuid=$(blkid -s PARTUUID -o value "${loop}p2")
+
+# The ESP: systemd-boot, with an entry for each scenario
+mount "${loop}p1" "$mnt"
+install -Dm0644 "$SYSTEMD_BOOT" "$mnt/EFI/BOOT/BOOTX64.EFI"
+install -Dm0644 "$BENCH_KERNEL" "$mnt/vmlinuz-bench"
+install -Dm0644 "$work/initrd.img" "$mnt/initrd-bench.img"
+mkdir -p "$mnt/loader/entries"
+for scenario in idle boot restore; do
+    case "$scenario" in
+        idle) extra="btrroll.timeout=1" ;;
+        *) extra="btrroll.timeout=0 btrroll.action=$scenario:latest" ;;
+    esac
+    cat > "$mnt/loader/entries/$scenario.conf" << EOF
+title btrroll benchmark ($scenario)
+linux /vmlinuz-bench
+initrd /initrd-bench.img
+options root=PARTUUID=$partuuid rootflags=subvol=root $OPTIONS $extra
+EOF
+done
+umount "$mnt"
+
+# The root, provisioned as btrroll does it, with one snapshot. Its init just
+# powers off, since the boot has been measured by then.
+mount "${loop}p2" "$mnt"
+mkdir -p "$mnt/root.d/snapshots"
+btrfs subvolume create "$mnt/root.d/current" >/dev/null
+ln -s root.d/current "$mnt/root"
+root="$mnt/root.d/current"
+mkdir -p "$root/bin" "$root/sbin" "$root/usr/lib/modules/$kver"
+install -m0755 "$busybox" "$root/bin/busybox"
+cat > "$root/sbin/init" << 'EOF'
+#!/bin/busybox sh
+echo '<5>btrroll-bench: init' > /dev/kmsg
+exec /bin/busybox poweroff -f
+EOF
+chmod 0755 "$root/sbin/init"
+btrfs subvolume snapshot -r "$root" "$mnt/root.d/snapshots/bench" >/dev/null
+umount "$mnt"
+detach
+
+echo "Times in ms; start and sysroot are since the kernel started."
+printf "  %-9s %3s %9s %9s %9s %9s %9s %9s %9s\n" \
+    scenario run start mount continue gate action btrroll sysroot
+run=1
+while [ "$run" -le "$BENCH_RUNS" ]; do
+    for scenario in idle boot restore; do
+        image="$work/$scenario.img"
+        vars="$work/$scenario.vars"
+        cp --sparse=always "$disk" "$image"
+        cp "$BENCH_OVMF_VARS" "$vars"
+
+        set_default "$image" "$scenario"
+        boot "$image" "$vars" "$logs/$scenario-$run.log"
+        report "$scenario" "$run" "$logs/$scenario-$run.log"
+
+        # The boot scenario leaves the state for the next boot to continue
+        if [ "$scenario" = boot ]; then
+            set_default "$image" idle
+            boot "$image" "$vars" "$logs/continue-$run.log"
+            report continue "$run" "$logs/continue-$run.log"
+        fi
+        rm -f "$image" "$vars"
+    done
+    run=$((run + 1))
+done
@@ -0,0 +1,204 @@
+/* Generate a synthetic tree for the benchmarks:
+ *
+ *   <dir>/.btrfs-toplevel              the top-level subvolume (see the shim)
+ *   <dir>/root.d/current/              the running root
+ *   <dir>/root.d/snapshots/<n>/        <count> snapshots, every tenth in weekly/
+ *   <dir>/esp/                         bzImage kernels with BLS entries, UKIs,
+ *                                      and what `bootctl list` says about them
+ *
+ * Each snapshot has an info file, an init, an fstab and modules for one or two
+ * of KERNELS_LEN kernel versions, half of which have BLS entries and half UKIs.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <btrfsutil.h>
+#include <macros.h>
+
+#define KERNELS_LEN 8
+#define KERNEL_LEN 0x400
+#define PE_HEADER_LEN 0x200
+
+static char dir[PATH_MAX];
+
+// Create the directory `path` below `dir`, and its parents
+static int make_dirs(const char *path) {
+  char buf[PATH_MAX];
+  snprintf(buf, sizeof(buf), "%s/%s", dir, path);
+  for (char *p = buf + strlen(dir) + 1; (p = strchr(p, '/')); ++p) {
+    *p = '\0';
+    if (mkdir(buf, 0755) && errno != EEXIST) {
+      perror(buf);
+      return -1;
+    }
+    *p = '/';
+  }
+  if (mkdir(buf, 0755) && errno != EEXIST) {
+    perror(buf);
+    return -1;
+  }
+  return 0;
+}
+
+// Write the file `path` below `dir`
+static int write_file(const char *path, const void *data, size_t len, mode_t mode) {
+  char buf[PATH_MAX];
+  snprintf(buf, sizeof(buf), "%s/%s", dir, path);
+  const int fd = open(buf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+  if (fd < 0 || write(fd, data, len) != (ssize_t) len) {
+    perror(buf);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return close(fd);
+}
+
+static void kernel_version(size_t k, char *buf, size_t len) {
+  snprintf(buf, len, "6.1.%zu-bench", k);
+}
+
+// A bzImage with nothing but its version string, as kver reads it
+static void make_bzimage(uint8_t *buf, const char *version) {
+  memset(buf, 0, KERNEL_LEN);
+  memcpy(buf + 0x202, "HdrS", 4);
+  const int16_t offset = 0x100;
+  memcpy(buf + 0x20E, &offset, sizeof(offset));
+  snprintf((char *) buf + 0x200 + offset, KERNEL_LEN - 0x200 - offset,
+      "%s (bench@btrroll) #1 SMP PREEMPT_DYNAMIC", version);
+}
+
+// A PE image with a single .linux section holding a bzImage, as kver_pe reads it
+static void make_uki(uint8_t *buf, const char *version) {
+  memset(buf, 0, PE_HEADER_LEN);
+  memcpy(buf, "MZ", 2);
+  const int32_t pe_offset = 0x80, linux_offset = PE_HEADER_LEN;
+  const int16_t num_sections = 1;
+  memcpy(buf + 0x3C, &pe_offset, sizeof(pe_offset));
+  memcpy(buf + pe_offset, "PE\0\0", 4);
+  memcpy(buf + pe_offset + 0x6, &num_sections, sizeof(num_sections));
+  memcpy(buf + pe_offset + 0x18, ".linux", 6); // no optional header
+  memcpy(buf + pe_offset + 0x18 + 0x14, &linux_offset, sizeof(linux_offset));
+  make_bzimage(buf + PE_HEADER_LEN, version);
+}
+
+static int make_esp(void) {
+  char esp[PATH_MAX];
+  snprintf(esp, sizeof(esp), "%s/esp", dir);
+  if (make_dirs("esp/loader/entries") || make_dirs("esp/EFI/Linux"))
+    return -1;
+
+  char list[0x4000] = "Boot Loader Entries:\n";
+  uint8_t image[PE_HEADER_LEN + KERNEL_LEN];
+  for (size_t k = 0; k < KERNELS_LEN; ++k) {
+    char version[0x40], path[0x100], entry[0x400];
+    kernel_version(k, arr_and_size(version));
+
+    if (k < KERNELS_LEN / 2) {
+      make_bzimage(image, version);
+      snprintf(path, sizeof(path), "esp/vmlinuz-%s", version);
+      if (write_file(path, image, KERNEL_LEN, 0644))
+        return -1;
+
+      snprintf(entry, sizeof(entry),
+          "title Linux %s\nversion %s\nlinux /vmlinuz-%s\noptions root=/dev/bench rw\n",
+          version, version, version);
+      snprintf(path, sizeof(path), "esp/loader/entries/bench-%s.conf", version);
+      if (write_file(path, entry, strlen(entry), 0644))
+        return -1;
+
+      snprintf(list + strlen(list), sizeof(list) - strlen(list),
+          "        title: Linux %s\n"
+          "           id: bench-%s.conf\n"
+          "       source: %s/loader/entries/bench-%s.conf\n"
+          "        linux: /vmlinuz-%s\n"
+          "      options: root=/dev/bench rw\n\n",
+          version, version, esp, version, version);
+    } else {
+      make_uki(image, version);
+      snprintf(path, sizeof(path), "esp/EFI/Linux/bench-%s.efi", version);
+      if (write_file(path, image, sizeof(image), 0644))
+        return -1;
+
+      snprintf(list + strlen(list), sizeof(list) - strlen(list),
+          "        title: Linux %s (UKI)\n"
+          "           id: bench-%s.efi\n"
+          "       source: %s/EFI/Linux/bench-%s.efi\n\n",
+          version, version, esp, version);
+    }
+  }
+
+  return write_file("esp/.bootctl-list", list, strlen(list), 0644);
+}
+
+// A root filesystem with just what btrroll looks at, and modules for `kernels`
+// kernel versions, starting with the `k`th
+static int make_root(const char *root, size_t k, size_t kernels) {
+  char path[PATH_MAX], version[0x40];
+  static const char FSTAB[] = "UUID=00000000-0000-0000-0000-000000000000 / btrfs "
+    "subvol=/root.d/current,noatime 0 0\n";
+
+  for (size_t i = 0; i < kernels; ++i) {
+    kernel_version((k + i) % KERNELS_LEN, arr_and_size(version));
+    snprintf(path, sizeof(path), "%s/usr/lib/modules/%s", root, version);
+    if (make_dirs(path))
+      return -1;
+  }
+
+  snprintf(path, sizeof(path), "%s/sbin", root);
+  if (make_dirs(path))
+    return -1;
+  snprintf(path, sizeof(path), "%s/etc", root);
+  if (make_dirs(path))
+    return -1;
+
+  snprintf(path, sizeof(path), "%s/" SHIM_SUBVOL_MARKER, root);
+  if (write_file(path, "", 0, 0644))
+    return -1;
+  snprintf(path, sizeof(path), "%s/sbin/init", root);
+  if (write_file(path, "#!/bin/sh\n", 10, 0755))
+    return -1;
+  snprintf(path, sizeof(path), "%s/etc/fstab", root);
+  return write_file(path, FSTAB, strlen(FSTAB), 0644);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <dir> <snapshots>\n", argv[0]);
+    return 2;
+  }
+  // Sources in the bootctl listing must be absolute to be recognized as on the ESP
+  if ((mkdir(argv[1], 0755) && errno != EEXIST) || !realpath(argv[1], dir)) {
+    perror(argv[1]);
+    return 1;
+  }
+  const size_t count = strtoul(argv[2], NULL, 10);
+
+  if (make_dirs("root.d/snapshots/weekly") ||
+      write_file(SHIM_TOPLEVEL_MARKER, "", 0, 0644) ||
+      make_root("root.d/current", 0, 1) ||
+      make_esp())
+    return 1;
+
+  for (size_t i = 0; i < count; ++i) {
+    char name[0x40], path[PATH_MAX], info[0x100];
+    snprintf(name, sizeof(name), i % 10 == 9 ? "weekly/%06zu" : "%06zu", i);
+    snprintf(path, sizeof(path), "root.d/snapshots/%s", name);
+    if (make_root(path, i, 1 + i % 2))
+      return 1;
+
+    snprintf(info, sizeof(info), "Snapshot %zu, made by the benchmark generator\n", i);
+    snprintf(path, sizeof(path), "root.d/snapshots/%s/.btrroll-info", name);
+    if (write_file(path, info, strlen(info), 0644))
+      return 1;
+  }
+
+  return 0;
+}
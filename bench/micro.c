@@ -0,0 +1,352 @@
+/* Micro-benchmarks of the parsers on the boot path, over the corpus in
+ * bench/corpus:
+ *
+ *   cmdline/  kernel command lines, for cmdline_parse
+ *   bootctl/  `bootctl list` output, for bootctl_parse_list
+ *   kernels/  kernel image headers (`.efi` for UKIs), for kver and kver_pe
+ *
+ * and a few typical pathcat calls. Each is reported in ns and allocations per
+ * call. Given a baseline, this fails if any call allocates more than it did
+ * there; with -u, the baseline is rewritten instead.
+ *
+ * Timings vary too much from run to run (let alone from machine to machine) to
+ * fail on by default. With BENCH_TOLERANCE set, this also fails if a call is
+ * slower than in the baseline by more than that many percent, once both are
+ * scaled by a calibration loop timed in the same run.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boot.h>
+#include <cmdline.h>
+#include <kver.h>
+#include <macros.h>
+#include <path.h>
+#include <xxhash.h>
+
+// Keep going until a batch of calls takes this long, then take the median batch
+#define BATCH_NS 10000000ull
+#define BATCHES 9
+#define CALIBRATION_LEN 0x1000
+
+#define BENCHES_MAX 0x40
+#define CORPUS_FILE_MAX 0x10000
+
+/* Count every allocation, including those made inside libc (e.g. by strdup),
+ * by interposing on the allocator.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_size_t allocs;
+
+void *malloc(size_t size) {
+  atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+typedef struct bench {
+  char name[0x100];
+  int (*call)(const struct bench *bench);
+  char path[PATH_MAX];
+  char *data;               // the corpus file's contents
+  const char *root, *child; // for pathcat
+} bench_t;
+
+static int call_cmdline_parse(const bench_t *bench) {
+  cmdline_t cmdline;
+  if (cmdline_parse(&cmdline, bench->data))
+    return -1;
+  cmdline_free(&cmdline);
+  return 0;
+}
+
+static int call_bootctl_parse_list(const bench_t *bench) {
+  // The parser works in place, so it needs a fresh copy every time
+  static char buf[CORPUS_FILE_MAX];
+  strcpy(buf, bench->data);
+
+  bootctl_entry_t entries[32];
+  const int len = bootctl_parse_list(buf, entries, lenof(entries));
+  for (int i = 0; i < len; ++i)
+    bootctl_entry_free(entries + i);
+  return len > 0 ? 0 : -1;
+}
+
+static int call_kver(const bench_t *bench) {
+  char version[0x100];
+  return kver(bench->path, arr_and_size(version));
+}
+
+static int call_kver_pe(const bench_t *bench) {
+  char version[0x100];
+  return kver_pe(bench->path, arr_and_size(version));
+}
+
+// A fixed amount of work, to tell how fast this machine is right now
+static int call_calibration(const bench_t *bench) {
+  static unsigned char buf[CALIBRATION_LEN];
+  xxh64_state_t state;
+  xxh64_reset(&state, 0);
+  xxh64_update(&state, buf, sizeof(buf));
+  buf[0] = xxh64_digest(&state); // so the work can't be skipped
+  return 0;
+}
+
+static int call_pathcat(const bench_t *bench) {
+  char * const path = pathcat(bench->root, bench->child);
+  free(path);
+  return path ? 0 : -1;
+}
+
+static char *read_file(const char *path) {
+  FILE * const fp = fopen(path, "r");
+  char * const buf = fp ? malloc(CORPUS_FILE_MAX) : NULL;
+  if (!buf) {
+    perror(path);
+    if (fp)
+      fclose(fp);
+    return NULL;
+  }
+
+  const size_t len = fread(buf, 1, CORPUS_FILE_MAX - 1, fp);
+  buf[len] = '\0';
+  fclose(fp);
+  return buf;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+// Add a benchmark for each file in the corpus directory `kind`
+static int add_corpus(
+    bench_t *benches, size_t *len, const char *corpus, const char *kind,
+    const char *name, int (*call)(const bench_t *), int (*call_efi)(const bench_t *))
+{
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s/%s", corpus, kind);
+  DIR * const dp = opendir(dir);
+  if (!dp) {
+    perror(dir);
+    return -1;
+  }
+
+  char *files[BENCHES_MAX];
+  size_t files_len = 0;
+  struct dirent *ep;
+  while ((ep = readdir(dp)) && files_len < lenof(files))
+    if (ep->d_name[0] != '.')
+      files[files_len++] = strdup(ep->d_name);
+  closedir(dp);
+  qsort(files, files_len, sizeof(char *), compare_names);
+
+  int ret = 0;
+  for (size_t i = 0; i < files_len; ++i) {
+    if (*len == BENCHES_MAX || !files[i]) {
+      ret = -1;
+      continue;
+    }
+
+    bench_t * const bench = benches + (*len)++;
+    const char * const ext = strrchr(files[i], '.');
+    const bool efi = ext && !strcmp(ext, ".efi");
+    bench->call = efi && call_efi ? call_efi : call;
+    snprintf(bench->name, sizeof(bench->name), "%s/%s",
+        efi && call_efi ? "kver_pe" : name, files[i]);
+    snprintf(bench->path, sizeof(bench->path), "%s/%s", dir, files[i]);
+    if (call != call_kver && !(bench->data = read_file(bench->path)))
+      ret = -1;
+    free(files[i]);
+  }
+  return ret;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  const double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Measure one call's allocations and the median time per call over BATCHES batches
+static int measure(const bench_t *bench, double *ns, size_t *allocs_per_call) {
+  if (bench->call(bench)) // warm up, and make sure it works at all
+    return -1;
+
+  const size_t before = atomic_load(&allocs);
+  bench->call(bench);
+  *allocs_per_call = atomic_load(&allocs) - before;
+
+  size_t calls = 1;
+  uint64_t elapsed;
+  while (true) {
+    const uint64_t start = now_ns();
+    for (size_t i = 0; i < calls; ++i)
+      bench->call(bench);
+    if ((elapsed = now_ns() - start) >= BATCH_NS)
+      break;
+    calls *= 2;
+  }
+
+  double batch_ns[BATCHES];
+  batch_ns[0] = (double) elapsed / calls;
+  for (size_t batch = 1; batch < BATCHES; ++batch) {
+    const uint64_t start = now_ns();
+    for (size_t i = 0; i < calls; ++i)
+      bench->call(bench);
+    batch_ns[batch] = (double) (now_ns() - start) / calls;
+  }
+  qsort(batch_ns, BATCHES, sizeof(double), compare_doubles);
+  *ns = batch_ns[BATCHES / 2];
+  return 0;
+}
+
+typedef struct baseline {
+  char name[0x100];
+  double ns;
+  size_t allocs;
+} baseline_t;
+
+// Read `name ns allocs` lines; a missing file is an empty baseline
+static size_t read_baseline(const char *path, baseline_t *baselines, size_t len) {
+  FILE * const fp = fopen(path, "r");
+  if (!fp)
+    return 0;
+
+  size_t count = 0;
+  char line[0x200];
+  while (count < len && fgets(line, sizeof(line), fp)) {
+    baseline_t * const b = baselines + count;
+    if (line[0] != '#' && sscanf(line, "%255s %lf %zu", b->name, &b->ns, &b->allocs) == 3)
+      ++count;
+  }
+  fclose(fp);
+  return count;
+}
+
+int main(int argc, char **argv) {
+  const bool update = argc == 4 && !strcmp(argv[1], "-u");
+  if (argc != 3 && !update) {
+    eprintf("usage: %s [-u] <corpus> <baseline>\n", argv[0]);
+    return 2;
+  }
+  const char * const corpus = argv[argc - 2], * const baseline_path = argv[argc - 1];
+
+  // Timings are only checked if asked to
+  const char * const tolerance_str = getenv("BENCH_TOLERANCE");
+  const double tolerance = tolerance_str ? strtod(tolerance_str, NULL) : 0;
+
+  // The calibration loop comes first, so the others can be scaled by it
+  static bench_t benches[BENCHES_MAX];
+  size_t len = 0;
+  snprintf(benches[len].name, sizeof(benches[len].name), "calibration");
+  benches[len++].call = call_calibration;
+  if (add_corpus(benches, &len, corpus, "cmdline", "cmdline_parse", call_cmdline_parse, NULL) ||
+      add_corpus(benches, &len, corpus, "bootctl", "bootctl_parse_list",
+        call_bootctl_parse_list, NULL) ||
+      add_corpus(benches, &len, corpus, "kernels", "kver", call_kver, call_kver_pe))
+    return 1;
+
+  // As btrroll uses it: snapshots, ESP entries and state files
+  static const struct { const char *name, *root, *child; } PATHS[] = {
+    { "snapshot", "/btrfs_root/root.d/snapshots", "2024-01-01_weekly" },
+    { "esp", "/esp/", "/loader/entries/arch.conf" },
+    { "state", "/btrfs_root/root.d/", ".btrroll-state" },
+  };
+  for (size_t i = 0; i < lenof(PATHS) && len < BENCHES_MAX; ++i) {
+    bench_t * const bench = benches + len++;
+    snprintf(bench->name, sizeof(bench->name), "pathcat/%s", PATHS[i].name);
+    bench->call = call_pathcat;
+    bench->root = PATHS[i].root;
+    bench->child = PATHS[i].child;
+  }
+
+  baseline_t baselines[BENCHES_MAX];
+  const size_t baselines_len = update
+    ? 0 : read_baseline(baseline_path, baselines, lenof(baselines));
+
+  FILE *out = NULL;
+  if (update && !(out = fopen(baseline_path, "w"))) {
+    perror(baseline_path);
+    return 1;
+  }
+  if (out)
+    fprintf(out, "# benchmark ns/call allocs/call (see bench/micro.c)\n");
+
+  // btrroll narrates on stderr, which is not what's being measured
+  if (!getenv("BENCH_VERBOSE"))
+    freopen("/dev/null", "w", stderr);
+
+  int ret = 0;
+  double scale = 1; // how much slower this run is than the baseline's
+  printf("  %-36s %10s %8s %10s %8s\n", "benchmark", "ns/call", "allocs", "baseline", "");
+  for (size_t i = 0; i < len; ++i) {
+    const bench_t * const bench = benches + i;
+    double ns;
+    size_t allocs_per_call;
+    if (measure(bench, &ns, &allocs_per_call)) {
+      printf("  %-36s %10s %8s %10s %8s\n", bench->name, "-", "-", "-", "FAILED");
+      ret = 1;
+      continue;
+    }
+    if (out)
+      fprintf(out, "%s %.1f %zu\n", bench->name, ns, allocs_per_call);
+
+    const baseline_t *baseline = NULL;
+    for (size_t j = 0; j < baselines_len && !baseline; ++j)
+      if (!strcmp(baselines[j].name, bench->name))
+        baseline = baselines + j;
+
+    const char *verdict = "";
+    char baseline_str[0x20] = "-";
+    if (baseline && bench->call == call_calibration && baseline->ns > 0)
+      scale = ns / baseline->ns;
+    if (baseline) {
+      // The baseline as it would have been measured on this run
+      const double baseline_ns = baseline->ns * scale;
+      snprintf(arr_and_size(baseline_str), "%.1f", baseline_ns);
+      if (allocs_per_call > baseline->allocs)
+        verdict = "ALLOCS";
+      else if (tolerance_str && ns > baseline_ns * (1 + tolerance / 100))
+        verdict = "SLOWER";
+      ret |= verdict[0] != '\0';
+    }
+    printf("  %-36s %10.1f %8zu %10s %8s\n",
+        bench->name, ns, allocs_per_call, baseline_str, verdict);
+  }
+
+  if (out && fclose(out)) {
+    perror(baseline_path);
+    ret = 1;
+  }
+  printf("Baselines are scaled by %.2f, going by the calibration loop.\n", scale);
+  if (ret && !update)
+    printf("Regressed past the baseline; see above.\n");
+  return ret;
+}
@@ -0,0 +1,85 @@
+/* Check probe.c's fstab check on a tree of shim subvolumes (see
+ * bench/shim/btrfsutil.h): fstab entries naming a subvolume that exists must
+ * pass, and ones naming a missing subvolume or a plain directory must not.
+ *
+ * The filesystem's UUID comes from an ioctl that only Btrfs answers, so this
+ * includes probe.c to call check_fstab_entries with a made-up one.
+ */
+#include "../src/probe.c"
+
+#include <limits.h>
+
+#define FSID "0f0e0d0c-0b0a-0908-0706-050403020100"
+
+static const struct {
+  const char *fstab;
+  bool missing;
+} CASES[] = {
+  { "UUID=" FSID " / btrfs subvol=/root.d/current,noatime 0 0\n", false },
+  { "UUID=" FSID " /home btrfs rw,subvol=home 0 0\n", false },
+  { "UUID=" FSID " /home btrfs subvol=/missing 0 0\n", true },
+  { "UUID=" FSID " /home btrfs noatime,subvol=/plain,compress=zstd 0 0\n", true },
+  { "UUID=" FSID " /home btrfs subvol=/missing,nofail 0 0\n", false },
+  { "UUID=ffffffff-0000-0000-0000-000000000000 /home btrfs subvol=/missing 0 0\n", false },
+  { "/dev/sda2 /home ext4 subvol=/missing 0 0\n", false },
+};
+
+static int make(const char *dir, const char *path, bool subvol) {
+  char buf[PATH_MAX];
+  snprintf(buf, sizeof(buf), "%s/%s", dir, path);
+  if (mkdir(buf, 0755) && errno != EEXIST)
+    return -1;
+  if (!subvol)
+    return 0;
+
+  snprintf(buf, sizeof(buf), "%s/%s/" SHIM_SUBVOL_MARKER, dir, path);
+  const int fd = open(buf, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  return close(fd);
+}
+
+int main(void) {
+  char dir[] = "/tmp/btrroll-probe.XXXXXX";
+  if (!mkdtemp(dir) || make(dir, "root.d", false) || make(dir, "root.d/current", true) ||
+      make(dir, "home", true) || make(dir, "plain", false))
+  {
+    perror("mkdir");
+    return 1;
+  }
+
+  const int top_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (top_fd < 0) {
+    perror(dir);
+    return 1;
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < lenof(CASES); ++i) {
+    FILE * const fp = fmemopen((void *) CASES[i].fstab, strlen(CASES[i].fstab), "r");
+    if (!fp) {
+      perror("fmemopen");
+      return 1;
+    }
+
+    int problems = 0;
+    check_fstab_entries(fp, top_fd, FSID, &problems);
+    fclose(fp);
+
+    const bool missing = problems & PROBE_MISSING_SUBVOL;
+    if (missing != CASES[i].missing) {
+      fprintf(stderr, "FAIL: %s  expected %s\n", CASES[i].fstab,
+          CASES[i].missing ? "a missing subvolume" : "no problems");
+      ++failed;
+    }
+  }
+
+  close(top_fd);
+  char cmd[PATH_MAX + 0x10];
+  snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+  if (system(cmd))
+    fprintf(stderr, "could not remove %s\n", dir);
+
+  printf("%zu fstab checks, %d failed\n", lenof(CASES), failed);
+  return !!failed;
+}
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Benchmark btrroll on synthetic trees with each number of snapshots in
+# $BENCH_SIZES. Trees are generated under $BENCH_DIR the first time and reused
+# after that; delete them to start over.
+
+set -e
+cd "$(dirname "$0")/.."
+
+: "${BENCH_SIZES:=10 1000 100000}"
+: "${BENCH_DIR:=/tmp/btrroll-bench}"
+
+# The fake bootctl lists the generated entries
+PATH="$PWD/bench:$PATH"
+export PATH
+
+for size in $BENCH_SIZES; do
+    tree="$BENCH_DIR/$size"
+    if [ ! -e "$tree/.complete" ]; then
+        echo "Generating $size snapshots in $tree..."
+        rm -rf "$tree"
+        mkdir -p "$BENCH_DIR"
+        bin/bench-gen "$tree" "$size"
+        touch "$tree/.complete"
+    fi
+    bin/bench "$tree"
+done
@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <btrfsutil.h>
+
+static const char * const MESSAGES[] = {
+  [BTRFS_UTIL_OK] = "Success",
+  [BTRFS_UTIL_ERROR_STOP_ITERATION] = "Stop iteration",
+  [BTRFS_UTIL_ERROR_NO_MEMORY] = "Cannot allocate memory",
+  [BTRFS_UTIL_ERROR_INVALID_ARGUMENT] = "Invalid argument",
+  [BTRFS_UTIL_ERROR_NOT_BTRFS] = "Not a Btrfs filesystem (shim)",
+  [BTRFS_UTIL_ERROR_NOT_SUBVOLUME] = "Not a Btrfs subvolume",
+  [BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND] = "Subvolume not found",
+  [BTRFS_UTIL_ERROR_OPEN_FAILED] = "Could not open",
+  [BTRFS_UTIL_ERROR_STAT_FAILED] = "Could not stat",
+};
+
+const char *btrfs_util_strerror(enum btrfs_util_error err) {
+  return err < sizeof(MESSAGES)/sizeof(MESSAGES[0]) ? MESSAGES[err] : NULL;
+}
+
+// What the shim can't do, it refuses to, as libbtrfsutil would off Btrfs
+static enum btrfs_util_error unsupported(void) {
+  errno = EOPNOTSUPP;
+  return BTRFS_UTIL_ERROR_NOT_BTRFS;
+}
+
+// Fill in `subvol` for the directory open on `fd`, if it is a subvolume
+static enum btrfs_util_error info_fd(int fd, struct btrfs_util_subvolume_info *subvol) {
+  struct stat sb;
+  if (fstat(fd, &sb))
+    return BTRFS_UTIL_ERROR_STAT_FAILED;
+  if (!S_ISDIR(sb.st_mode) || faccessat(fd, SHIM_SUBVOL_MARKER, F_OK, 0)) {
+    errno = EINVAL;
+    return BTRFS_UTIL_ERROR_NOT_SUBVOLUME;
+  }
+  if (!subvol)
+    return BTRFS_UTIL_OK;
+
+  // Stable, distinct values are all that matter
+  memset(subvol, 0, sizeof(*subvol));
+  subvol->id = sb.st_ino;
+  subvol->parent_id = 5;
+  subvol->generation = subvol->ctransid = subvol->otransid = sb.st_mtime;
+  subvol->ctime = sb.st_ctim;
+  subvol->otime = sb.st_mtim;
+  memcpy(subvol->uuid, &sb.st_ino, sizeof(sb.st_ino));
+  memcpy(subvol->uuid + sizeof(sb.st_ino), &sb.st_dev, sizeof(sb.st_dev));
+  return BTRFS_UTIL_OK;
+}
+
+enum btrfs_util_error btrfs_util_is_subvolume_fd(int fd) {
+  return info_fd(fd, NULL);
+}
+
+enum btrfs_util_error btrfs_util_subvolume_info_fd(
+    int fd, uint64_t id, struct btrfs_util_subvolume_info *subvol)
+{
+  if (id)
+    return BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND;
+  return info_fd(fd, subvol);
+}
+
+enum btrfs_util_error btrfs_util_subvolume_info(
+    const char *path, uint64_t id, struct btrfs_util_subvolume_info *subvol)
+{
+  if (id)
+    return BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND;
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return BTRFS_UTIL_ERROR_OPEN_FAILED;
+  const enum btrfs_util_error err = info_fd(fd, subvol);
+  close(fd);
+  return err;
+}
+
+enum btrfs_util_error btrfs_util_subvolume_id(const char *path, uint64_t *id_ret) {
+  struct btrfs_util_subvolume_info subvol;
+  const enum btrfs_util_error err = btrfs_util_subvolume_info(path, 0, &subvol);
+  if (!err)
+    *id_ret = subvol.id;
+  return err;
+}
+
+// Whether the directory `dir` contains `name`
+static bool contains(const char *dir, const char *name) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  return !access(path, F_OK);
+}
+
+enum btrfs_util_error btrfs_util_subvolume_path(
+    const char *path, uint64_t id, char **path_ret)
+{
+  if (id)
+    return BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND;
+
+  char *real = realpath(path, NULL);
+  char *dir = real ? strdup(real) : NULL;
+  if (!dir) {
+    free(real);
+    return BTRFS_UTIL_ERROR_OPEN_FAILED;
+  }
+
+  // The subvolume containing `path`, relative to the top level above it
+  enum btrfs_util_error err = BTRFS_UTIL_ERROR_NOT_BTRFS;
+  size_t subvol_len = 0;
+  for (size_t len = strlen(dir); len > 0; len = strrchr(dir, '/') - dir) {
+    dir[len] = '\0';
+    if (contains(dir, SHIM_TOPLEVEL_MARKER)) {
+      *path_ret = subvol_len
+        ? strndup(real + len + 1, subvol_len - len - 1) : strdup("");
+      err = *path_ret ? BTRFS_UTIL_OK : BTRFS_UTIL_ERROR_NO_MEMORY;
+      break;
+    }
+    if (!subvol_len && contains(dir, SHIM_SUBVOL_MARKER))
+      subvol_len = len;
+  }
+
+  free(dir);
+  free(real);
+  if (err == BTRFS_UTIL_ERROR_NOT_BTRFS)
+    errno = EOPNOTSUPP;
+  return err;
+}
+
+enum btrfs_util_error btrfs_util_start_sync_fd(int fd, uint64_t *transid) {
+  return unsupported();
+}
+
+enum btrfs_util_error btrfs_util_wait_sync_fd(int fd, uint64_t transid) {
+  return unsupported();
+}
+
+enum btrfs_util_error btrfs_util_set_subvolume_read_only(const char *path, bool read_only) {
+  return unsupported();
+}
+
+enum btrfs_util_error btrfs_util_get_default_subvolume(const char *path, uint64_t *id_ret) {
+  return unsupported();
+}
+
+enum btrfs_util_error btrfs_util_create_snapshot(
+    const char *source, const char *path, int flags, uint64_t *async_transid,
+    struct btrfs_util_qgroup_inherit *qgroup_inherit)
+{
+  return unsupported();
+}
+
+enum btrfs_util_error btrfs_util_delete_subvolume(const char *path, int flags) {
+  return unsupported();
+}
+
+enum btrfs_util_error btrfs_util_delete_subvolume_fd(
+    int parent_fd, const char *name, int flags)
+{
+  return unsupported();
+}
+
+enum btrfs_util_error btrfs_util_create_subvolume_iterator(
+    const char *path, uint64_t top, int flags,
+    struct btrfs_util_subvolume_iterator **ret)
+{
+  return unsupported();
+}
+
+void btrfs_util_destroy_subvolume_iterator(struct btrfs_util_subvolume_iterator *iter) {
+}
+
+enum btrfs_util_error btrfs_util_subvolume_iterator_next_info(
+    struct btrfs_util_subvolume_iterator *iter, char **path_ret,
+    struct btrfs_util_subvolume_info *subvol)
+{
+  return BTRFS_UTIL_ERROR_STOP_ITERATION;
+}
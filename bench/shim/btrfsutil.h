@@ -0,0 +1,80 @@
+#ifndef BTRFS_UTIL_H
+#define BTRFS_UTIL_H
+
+/* Just enough of libbtrfsutil's API for btrroll to build against, backed by
+ * plain directories so the benchmarks run on any filesystem without root. A
+ * directory is a subvolume if it contains a file named SHIM_SUBVOL_MARKER, and
+ * the top-level subvolume is the nearest directory above it containing
+ * SHIM_TOPLEVEL_MARKER. Subvolumes can be inspected but not created, deleted
+ * or looked up by ID.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define SHIM_SUBVOL_MARKER ".btrfs-subvol"
+#define SHIM_TOPLEVEL_MARKER ".btrfs-toplevel"
+
+enum btrfs_util_error {
+  BTRFS_UTIL_OK,
+  BTRFS_UTIL_ERROR_STOP_ITERATION,
+  BTRFS_UTIL_ERROR_NO_MEMORY,
+  BTRFS_UTIL_ERROR_INVALID_ARGUMENT,
+  BTRFS_UTIL_ERROR_NOT_BTRFS,
+  BTRFS_UTIL_ERROR_NOT_SUBVOLUME,
+  BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND,
+  BTRFS_UTIL_ERROR_OPEN_FAILED,
+  BTRFS_UTIL_ERROR_STAT_FAILED,
+};
+
+struct btrfs_util_subvolume_info {
+  uint64_t id, parent_id, dir_id, flags;
+  uint8_t uuid[16], parent_uuid[16], received_uuid[16];
+  uint64_t generation, ctransid, otransid, stransid, rtransid;
+  struct timespec ctime, otime, stime, rtime;
+};
+
+struct btrfs_util_qgroup_inherit;
+struct btrfs_util_subvolume_iterator;
+
+#define BTRFS_UTIL_CREATE_SNAPSHOT_RECURSIVE (1 << 0)
+#define BTRFS_UTIL_CREATE_SNAPSHOT_READ_ONLY (1 << 1)
+#define BTRFS_UTIL_DELETE_SUBVOLUME_RECURSIVE (1 << 0)
+#define BTRFS_UTIL_SUBVOLUME_ITERATOR_POST_ORDER (1 << 0)
+
+const char *btrfs_util_strerror(enum btrfs_util_error err);
+
+enum btrfs_util_error btrfs_util_start_sync_fd(int fd, uint64_t *transid);
+enum btrfs_util_error btrfs_util_wait_sync_fd(int fd, uint64_t transid);
+
+enum btrfs_util_error btrfs_util_is_subvolume_fd(int fd);
+enum btrfs_util_error btrfs_util_subvolume_id(const char *path, uint64_t *id_ret);
+enum btrfs_util_error btrfs_util_subvolume_path(
+    const char *path, uint64_t id, char **path_ret);
+enum btrfs_util_error btrfs_util_subvolume_info(
+    const char *path, uint64_t id, struct btrfs_util_subvolume_info *subvol);
+enum btrfs_util_error btrfs_util_subvolume_info_fd(
+    int fd, uint64_t id, struct btrfs_util_subvolume_info *subvol);
+
+enum btrfs_util_error btrfs_util_set_subvolume_read_only(const char *path, bool read_only);
+enum btrfs_util_error btrfs_util_get_default_subvolume(const char *path, uint64_t *id_ret);
+
+enum btrfs_util_error btrfs_util_create_snapshot(
+    const char *source, const char *path, int flags, uint64_t *async_transid,
+    struct btrfs_util_qgroup_inherit *qgroup_inherit);
+enum btrfs_util_error btrfs_util_delete_subvolume(const char *path, int flags);
+enum btrfs_util_error btrfs_util_delete_subvolume_fd(
+    int parent_fd, const char *name, int flags);
+
+enum btrfs_util_error btrfs_util_create_subvolume_iterator(
+    const char *path, uint64_t top, int flags,
+    struct btrfs_util_subvolume_iterator **ret);
+void btrfs_util_destroy_subvolume_iterator(struct btrfs_util_subvolume_iterator *iter);
+enum btrfs_util_error btrfs_util_subvolume_iterator_next_info(
+    struct btrfs_util_subvolume_iterator *iter, char **path_ret,
+    struct btrfs_util_subvolume_info *subvol);
+
+#endif
@@ -1,22 +1,53 @@
 #ifndef __BOOT_H__
 #define __BOOT_H__
 
+#include <stddef.h>
+
 typedef struct bootctl_entry {
   char *id,
        *title,
        *source,
        *kernel,
-       *options;
+       *options,
+       *version; // kernel version; only set by get_compatible_boot_entries
 } bootctl_entry_t;
 
 void bootctl_entry_free(bootctl_entry_t *entry);
 
 int bootctl_list(const char *esp_path, bootctl_entry_t *entries, size_t entries_len);
 
+/* Parse the output of `bootctl list` in `buf` (which is modified) into
+ * `entries`, as bootctl_list does. Returns the number of entries.
+ */
+int bootctl_parse_list(char *buf, bootctl_entry_t *entries, size_t entries_len);
+
 int bootctl_set_oneshot(const char *esp_path, const char *id);
 int bootctl_set_default(const char *esp_path, const char *id);
 
-int mount_esp(char *mountpoint);
+// Ask bootctl where the ESP is mounted on the running system
+int bootctl_esp_path(char *buf, size_t len);
+
+/* Read a string-valued EFI variable from the systemd boot loader interface
+ * (e.g. `LoaderEntrySelected`) into `buf`. Returns 0 on success, or -1
+ * otherwise.
+ */
+int efivar_read_string(const char *name, char *buf, size_t len);
+
+// As efivar_read_string, for a variable of any vendor
+int efivar_read_string_guid(const char *name, const char *guid, char *buf, size_t len);
+
+/* Delete an EFI variable, clearing the immutable flag efivarfs puts on it
+ * first. Returns 0 on success, or -1 otherwise (ENOENT if it doesn't exist).
+ */
+int efivar_delete(const char *name, const char *guid);
+
+/* Parse the boot counter of a systemd-boot entry ID such as `arch+2-1.conf`
+ * (two tries left, one done) into `left` and `done`. Returns 1 if the ID has a
+ * counter, or 0 otherwise.
+ */
+int bootctl_entry_tries(const char *id, int *left, int *done);
+
+int mount_esp(const char *mountpoint);
 
 void restart();
 void shutdown();
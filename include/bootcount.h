@@ -0,0 +1,43 @@
+#ifndef __BOOTCOUNT_H__
+#define __BOOTCOUNT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Boot counting state, kept in `subvol.d/.btrroll-boot`. The file only exists
+ * once a boot has been confirmed (see `btrroll confirm`), so systems which
+ * don't confirm their boots are never rolled back.
+ */
+typedef struct bootcount {
+  unsigned long attempts; // boots started since the last confirmed one
+  char rollback[0x100];   // snapshot last rolled back to, if not yet confirmed
+} bootcount_t;
+
+int bootcount_read(const char *root_subvol_dir, bootcount_t *count);
+int bootcount_write(const char *root_subvol_dir, const bootcount_t *count);
+
+// Mark the running boot as successful, resetting the count
+int bootcount_confirm(const char *root_subvol_dir);
+
+/* Find the newest known-good snapshot in `snapshots` that looks bootable, and
+ * put its name in `buf`. If `skip_from` names a known-good snapshot (the one
+ * last rolled back to, if that was not confirmed), only older ones are
+ * considered, so that a bad snapshot is not retried forever.
+ */
+int bootcount_find_known_good(const char *snapshots, const char *skip_from, char *buf, size_t len);
+
+/* Count a boot attempt of `root_subvol`. If the previous boot was confirmed
+ * and `btrroll.known_good=N` is on the kernel command line, first snapshot
+ * `current` as a known-good rollback target, keeping the newest N.
+ *
+ * If the allowed tries have all been used without a confirmation, restore the
+ * newest known-good snapshot without any interaction and reboot into it. That
+ * is `btrroll.tries=N` on the kernel command line (3 by default), or fewer if
+ * the entry in LoaderEntrySelected has a systemd-boot counter (`+left-done`)
+ * allowing fewer; the last try is always given the chance to be confirmed.
+ *
+ * Returns 0 if the boot should go ahead as normal, or -1 on error.
+ */
+int bootcount_continue(char *root_subvol, const char *esp_path);
+
+#endif
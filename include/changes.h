@@ -0,0 +1,29 @@
+#ifndef __CHANGES_H__
+#define __CHANGES_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum change_type {
+  CHANGE_ADDED,    // the inode was created after the given transaction
+  CHANGE_MODIFIED, // the inode existed before, but has since been modified
+} change_type_t;
+
+/* Called by find_new once for each path to a changed inode, relative to the
+ * searched subvolume. Returns 0 to continue, or nonzero to stop the search.
+ */
+typedef int (*change_fn_t)(
+    change_type_t type, const char *path, bool is_dir, void *arg);
+
+/* Find every inode in the subvolume at `subvol` that was created or modified
+ * in a transaction after `transid`, like `btrfs subvolume find-new`. This is a
+ * single tree search filtered by generation, so the cost is proportional to
+ * the amount of change rather than to the size of the subvolume. Deletions
+ * are not reported. Results are passed to `fn` as they are found.
+ *
+ * Returns 0 on success, the callback's return value if it stopped the search,
+ * or -1 on error.
+ */
+int find_new(const char *subvol, uint64_t transid, change_fn_t fn, void *arg);
+
+#endif
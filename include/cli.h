@@ -0,0 +1,10 @@
+#ifndef __CLI_H__
+#define __CLI_H__
+
+/* Run a command given on the command line, for use on the booted system
+ * rather than in the initrd (e.g. `btrroll manifest <snapshot>`). `argv[1]`
+ * is the name of the command. Returns the process's exit status.
+ */
+int cli_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __CLONE_H__
+#define __CLONE_H__
+
+#include <sys/types.h>
+
+/* Copy the contents of one file into another. Data extents are shared via
+ * FICLONE where the filesystem allows it; otherwise this falls back to
+ * copy_file_range, and then to a plain read/write loop.
+ */
+int clone_file_data(int in_fd, int out_fd, off_t len);
+
+/* Clone the file or directory tree at `src` to the (not yet existing) path
+ * `dest`, preserving ownership, permissions, timestamps and xattrs.
+ * Subdirectories are walked in parallel. Hard links are not preserved.
+ */
+int clone_tree(const char *src, const char *dest);
+
+/* Replace `path` in the tree at `dest_root` with a clone of `path` in the
+ * tree at `src_root`. In both, `path` is looked up as if the tree were the root
+ * directory, so that absolute symlinks don't lead out of it. The clone is
+ * staged next to the destination and swapped in with a single rename, so it
+ * is never seen half-restored.
+ */
+int restore_path(const char *src_root, const char *dest_root, const char *path);
+
+// Recursively delete the file or directory tree at `path`
+int remove_tree(const char *path);
+
+#endif
@@ -3,32 +3,52 @@
 
 #include <stddef.h>
 
-/* Read /proc/cmdline into a buffer. Returns 0 on success, -1 otherwise.
+// The options btrroll knows about; see OPTIONS in cmdline.c for their keys
+typedef enum cmdline_option {
+  CMDLINE_ROOT,
+  CMDLINE_ROOTFLAGS,
+  CMDLINE_BTRROLL_ACTION,
+  CMDLINE_BTRROLL_CONSOLE,
+  CMDLINE_BTRROLL_ENTRY,
+  CMDLINE_BTRROLL_ESP,
+  CMDLINE_BTRROLL_KNOWN_GOOD,
+  CMDLINE_BTRROLL_ROOT,
+  CMDLINE_BTRROLL_TIMEOUT,
+  CMDLINE_BTRROLL_TRACE,
+  CMDLINE_BTRROLL_TRIES,
+  CMDLINE_OPTIONS_LEN
+} cmdline_option_t;
+
+/* A command line, parsed once into the value of each known option. Values
+ * point into `buf` and are never modified afterwards, so the same cmdline_t
+ * can be read from anywhere.
+ */
+typedef struct cmdline {
+  char *buf;
+  const char *values[CMDLINE_OPTIONS_LEN]; // NULL if absent; "" if no value
+} cmdline_t;
+
+/* Parse space-separated `key=value` pairs as the kernel does: double quotes
+ * group spaces into a value (`"rootflags=a b"` or `rootflags="a b"`) and are
+ * dropped, and a bare `--` ends the options. `rd.btrroll.*` is the same as
+ * `btrroll.*`. Where an option is given more than once, the last one wins, and
+ * numeric options with non-numeric values are warned about and ignored.
+ * Returns 0 on success, or -1 otherwise.
  */
-int cmdline_read(
-    char * const buf,
-    const size_t len);
-
-/* Find a key=value pair in a set of pairs separated by the delimiter `delim`.
- * Returns a pointer to the start of the key within the string if found; NULL
- * othewise. If there is a value, it will be copied into `buf`. If multiple
- * pairs with the same key are present, the last one will be returned.
+int cmdline_parse(cmdline_t *cmdline, const char *str);
+void cmdline_free(cmdline_t *cmdline);
+
+/* The kernel command line from /proc/cmdline, parsed the first time it is
+ * needed. Never returns NULL; if it can't be read, no options are set.
  */
-char *cmdline_find_delim(
-    char * const cmdline,
-    const char * const key,
-    char * const buf,
-    const size_t len,
-    char delim);
-
-// Same as the above, but assumes the delimiter to be a space character
-static inline char *cmdline_find(
-    char * const cmdline,
-    const char * const key,
-    char * const buf,
-    const size_t len)
-{
-  return cmdline_find_delim(cmdline, key, buf, len, ' ');
+const cmdline_t *cmdline_kernel(void);
+
+static inline const char *cmdline_get(const cmdline_t *cmdline, cmdline_option_t option) {
+  return cmdline->values[option];
 }
 
+// The value of a numeric option, or `def` if it is absent
+unsigned long cmdline_get_ulong(
+    const cmdline_t *cmdline, cmdline_option_t option, unsigned long def);
+
 #endif
@@ -0,0 +1,57 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONFIG_PATH "/etc/btrroll.conf"
+#define CONFIG_BLOB_PATH "/etc/btrroll.bin" // compiled into the initrd
+#define CONFIG_MAGIC "btrroll\x01"
+#define CONFIG_GROUP_MAX 16
+#define CONFIG_VALUE_MAX 0x100
+
+/* The configuration, laid out the same in memory and in the compiled blob: in
+ * the initrd, the blob written by config_compile is mapped and used as it is.
+ * It's only ever read by the same build of btrroll that wrote it, so it's
+ * native-endian, and `size` is there to catch a mismatch.
+ */
+typedef struct config {
+  char magic[8];
+  uint32_t size; // sizeof(config_t)
+
+  // Seconds to wait for Enter at boot before going ahead, from `timeout`
+  uint32_t timeout;
+
+  // Where the btrfs root and the ESP are mounted in the initrd, from `root`
+  // and `esp`
+  char root[CONFIG_VALUE_MAX];
+  char esp[CONFIG_VALUE_MAX];
+
+  // Subvolumes rolled back along with the root, relative to the top-level
+  // subvolume (e.g. `@var`), from `group = @var @srv`
+  uint32_t group_len;
+  char group[CONFIG_GROUP_MAX][CONFIG_VALUE_MAX];
+} config_t;
+
+/* Parse the `key = value` lines of the config file at `path` into `config`.
+ * A missing file leaves the defaults in place. Problems with the file are
+ * warned about and skipped. Returns 0 on success, or -1 otherwise.
+ */
+int config_load(const char *path, config_t *config);
+void config_free(config_t *config);
+
+/* Check the config file at `path` strictly, and write it out as a blob to
+ * `dest` (atomically). Returns 0 on success, or -1 if the file has any
+ * problems or can't be written.
+ */
+int config_compile(const char *path, const char *dest);
+
+/* Get the configuration, loading it the first time: the blob at
+ * CONFIG_BLOB_PATH if there is one, otherwise the file at CONFIG_PATH. Any of
+ * `btrroll.timeout`, `btrroll.root` and `btrroll.esp` on the kernel command
+ * line override what's there. Never returns NULL; if neither can be read, the
+ * defaults are used.
+ */
+const config_t *config_get(void);
+
+#endif
@@ -3,12 +3,31 @@
 
 #define INFO_FILE ".btrroll-info"
 #define STATE_FILE ".btrroll-state"
+#define BOOT_COUNT_FILE ".btrroll-boot"
+#define JOURNAL_FILE ".btrroll-journal"
+#define ACTION_DONE_FILE ".btrroll-action"
 #define INITRD_RELEASE_PATH "/etc/initrd-release"
 #define BTRFS_MOUNTPOINT "/btrfs_root"
+#define HOST_MOUNTPOINT "/run/btrroll/root"
+#define ESP_MOUNTPOINT "/esp"
 #define SUBVOL_DIR_SUFFIX ".d"
 #define SUBVOL_CUR_NAME "current"
 #define SUBVOL_TMP_NAME "temp"
+#define SUBVOL_OLD_NAME "old"
+#define SUBVOL_NEW_NAME "new"
 #define SUBVOL_SNAP_NAME "snapshots"
+#define MANIFEST_DIR ".manifests"
+#define KNOWN_GOOD_PREFIX ".known-good-"
+#define FAILED_PREFIX "failed-"
+#define PRE_RESTORE_PREFIX "pre-restore-"
+
+// One-shot EFI variable holding unattended options (see unattended.h)
+#define ACTION_EFIVAR_NAME "BtrrollAction"
+#define ACTION_EFIVAR_GUID "a4cf730f-cfd3-4724-a442-e9d7f13fd8e8"
+
+#define BOOT_TRIES_DEFAULT 3
+#define TIMEOUT_DEFAULT 1 // seconds
+#define GROUP_MATCH_WINDOW 300 // seconds
 
 #define STATE_BOOT_TEMP "boot"
 #define STATE_BOOT_TEMP_CLEANUP "cleanup"
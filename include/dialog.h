@@ -3,6 +3,8 @@
 
 #include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
 
 typedef enum dialog_response {
   DIALOG_RESPONSE_OK = 0,
@@ -34,6 +36,9 @@ typedef struct dialog_buttons {
 typedef struct dialog {
   dialog_labels_t labels;
   dialog_buttons_t buttons;
+  bool serial; // use the line-oriented frontend in serial.h instead of `dialog`
+  FILE *args_file; // widget arguments for `dialog --file`; see dialog.c
+  char args_path[0x20];
 } dialog_t;
 
 void dialog_init(dialog_t * const dialog);
@@ -65,6 +70,31 @@ int dialog_view_file(
     const char * title,
     const char * const filepath);
 
+/* Called by dialog_stream to write the text to display into `out`. Output
+ * appears on screen as it is flushed. Returns 0 on success, -1 otherwise.
+ */
+typedef int (*dialog_producer_t)(FILE *out, void *arg);
+
+int dialog_stream(
+    dialog_t * const dialog,
+    const char * title,
+    dialog_producer_t producer, void *arg);
+
+typedef struct dialog_gauge {
+  pid_t pid;
+  FILE *fp;
+  void (*sigpipe)(int);
+  bool serial;
+  int percent; // last shown, on a serial console
+} dialog_gauge_t;
+
+int dialog_gauge_open(
+    dialog_t * const dialog,
+    dialog_gauge_t * const gauge,
+    const char *title, const char *format, ...);
+int dialog_gauge_update(dialog_gauge_t * const gauge, int percent);
+int dialog_gauge_close(dialog_gauge_t * const gauge);
+
 int dialog_clear(dialog_t * const dialog);
 
 #endif
@@ -0,0 +1,78 @@
+#ifndef __GROUP_H__
+#define __GROUP_H__
+
+#include <stddef.h>
+#include <time.h>
+
+#include <config.h>
+#include <snapshot.h>
+
+typedef struct group_member {
+  char *subvol; // where the member is mounted from, e.g. `/btrfs_root/@var`
+  char *dir;    // its `.d` directory
+  char *rel;    // its `.d` directory relative to the top-level subvolume
+} group_member_t;
+
+/* A rollback group: the root subvolume (always the first member) and the
+ * subvolumes listed with `group =` in the config file, which are restored
+ * along with it.
+ */
+typedef struct group {
+  group_member_t members[CONFIG_GROUP_MAX + 1];
+  size_t len;
+} group_t;
+
+int group_load(group_t *group, const char *root_subvol_dir);
+void group_free(group_t *group);
+
+// Provision any member that is not yet set up for use with btrroll
+int group_provision(group_t *group);
+
+/* Find the snapshot of `member` that goes with the root snapshot `name`: one
+ * with the same name (as taken by group_snapshot) if there is one, otherwise
+ * the one created closest to `otime`, within GROUP_MATCH_WINDOW seconds.
+ */
+int group_match_snapshot(
+    const group_member_t *member, const char *name, time_t otime,
+    char *buf, size_t len);
+
+/* Snapshot `current` of every member as `snapshots/<name>` at once. If the
+ * name already exists in a member, that member is skipped.
+ */
+int group_snapshot(group_t *group, const char *name, int flags);
+
+// Delete `snapshots/<name>` of every member except the root
+int group_delete_snapshot(group_t *group, const char *name);
+
+/* Get a restore of the group from `snapshot` (a snapshot of the root) ready,
+ * without touching any `current`: the new tree of every member with a
+ * matching snapshot is created, and the replacements to make are journaled in
+ * the root's `.d` directory for group_recover to carry out. The backups, if
+ * any, are all named after `backup`.
+ */
+int group_prepare(
+    group_t *group, const char *snapshot, const char *backup,
+    snapshot_nested_t nested);
+
+/* Restore every member of the group from the snapshots that match `snapshot`,
+ * as snapshot_restore does for the root alone: group_prepare, then
+ * group_recover straight away. If the replacements are interrupted, they are
+ * finished on the next boot. Members without a matching snapshot are left
+ * alone. Reboots on success.
+ */
+int group_restore(
+    group_t *group, const char *snapshot, const char *backup,
+    snapshot_nested_t nested);
+
+/* Carry out a group restore left in the journal of `root_subvol_dir`, whether
+ * it was interrupted or prepared ahead of time. Returns 0 if there was none, 1
+ * if one was finished, or -1 on error.
+ */
+int group_recover(const char *root_subvol_dir);
+
+/* Drop a prepared group restore: delete the new trees and the journal. Returns
+ * 0 if there was none, 1 if one was dropped, or -1 on error.
+ */
+int group_cancel(const char *root_subvol_dir);
+
+#endif
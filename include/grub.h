@@ -0,0 +1,55 @@
+#ifndef __GRUB_H__
+#define __GRUB_H__
+
+#include <stddef.h>
+
+#include <boot.h>
+
+#define GRUBENV_SIZE 1024
+#define GRUBENV_VARS_MAX 64
+
+/* GRUB's environment block (`grubenv`): a file of exactly GRUBENV_SIZE bytes
+ * holding `key=value` lines, which GRUB itself can rewrite but never resize.
+ */
+typedef struct grubenv {
+  char *keys[GRUBENV_VARS_MAX], *values[GRUBENV_VARS_MAX];
+  size_t len;
+} grubenv_t;
+
+/* Read the block at `path`. A missing file reads as an empty block. Returns 0
+ * on success, or -1 otherwise (EINVAL if it isn't an environment block).
+ */
+int grubenv_read(const char *path, grubenv_t *env);
+void grubenv_free(grubenv_t *env);
+
+// The value of `key`, or NULL if it isn't set
+const char *grubenv_get(const grubenv_t *env, const char *key);
+
+// Set `key`, or unset it if `value` is NULL. Returns 0 on success, or -1.
+int grubenv_set(grubenv_t *env, const char *key, const char *value);
+
+/* Rewrite the block at `path` in place, without changing its size (GRUB finds
+ * it by its blocks on disk), and sync it. Returns 0 on success, or -1 (ENOSPC
+ * if the variables don't fit).
+ */
+int grubenv_write(const char *path, const grubenv_t *env);
+
+/* Find GRUB's config on the ESP (i.e. with /boot on the ESP), storing its
+ * directory in `buf`. Returns 0 if there is one, or -1 otherwise.
+ */
+int grub_find(const char *esp_path, char *buf, size_t len);
+
+/* List the menu entries in `<grub_dir>/grub.cfg` as bootctl_list does. IDs
+ * are what GRUB accepts in `next_entry` and `saved_entry`: the entry's `--id`
+ * (or its title), prefixed with its submenus' as `submenu>entry`. Kernels are
+ * relative to the ESP.
+ */
+int grub_list(const char *grub_dir, bootctl_entry_t *entries, size_t entries_len);
+
+// Boot the entry `id` next time only, as `grub-reboot` does
+int grub_set_oneshot(const char *grub_dir, const char *id);
+
+// Boot the entry `id` by default, as `grub-set-default` does
+int grub_set_default(const char *grub_dir, const char *id);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __KSTORE_H__
+#define __KSTORE_H__
+
+#include <stddef.h>
+
+/* Copy the kernel `version` that ships inside `snapshot`
+ * (`usr/lib/modules/<version>/vmlinuz`), and its initramfs, onto the ESP and
+ * write a systemd-boot entry for them, so the snapshot can be booted even when
+ * no existing entry has a compatible kernel.
+ *
+ * Files are kept in a store on the ESP named by a hash of their contents, so
+ * snapshots sharing a kernel share a single copy; nothing is copied if it is
+ * already there. The kernel and initramfs are checked against the free space
+ * on the ESP together first, and each copy is renamed into place once
+ * complete. Files in the store that no entry refers to any more are deleted.
+ * The entry takes its options from the entry that was booted (or failing
+ * that, any entry with options).
+ *
+ * Returns 0 with the new entry's ID in `id`, or -1 otherwise (ENOENT if the
+ * snapshot has no such kernel or initramfs; EOPNOTSUPP on GRUB installs).
+ */
+int kstore_provision(
+    const char *snapshot, const char *esp_path, const char *version,
+    char *id, size_t id_len);
+
+#endif
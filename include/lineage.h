@@ -0,0 +1,34 @@
+#ifndef __LINEAGE_H__
+#define __LINEAGE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <snaplist.h>
+
+typedef struct lineage_group {
+  size_t first, len; // the group's members are order[first..first+len)
+  bool is_live;      // the members were taken of the running root
+} lineage_group_t;
+
+/* Snapshots grouped by descent. A snapshot descends from the one its
+ * `parent_uuid` names (or that was received as it); snapshots whose common
+ * ancestor is not in the list, such as those taken of the running root, are
+ * grouped by that ancestor.
+ */
+typedef struct lineage {
+  size_t *order;  // indices into the list, each group's members together in pre-order
+  size_t *depth;  // depth of each entry (by list index) below the top of its group
+  lineage_group_t *groups; // the running root's first, then by their first member
+  size_t groups_len;
+} lineage_t;
+
+/* Build the lineage of every snapshot in `list` with a single pass over a
+ * hash map of UUIDs. `live_uuid`, if given, is the UUID of the running root.
+ * Returns 0 on success, or -1 otherwise.
+ */
+int lineage_build(lineage_t *lineage, const snapshot_list_t *list, const uint8_t *live_uuid);
+void lineage_free(lineage_t *lineage);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+typedef enum manifest_status {
+  MANIFEST_MISSING,  // no (current) manifest exists for the snapshot
+  MANIFEST_INTACT,   // nothing recorded in the manifest has changed
+  MANIFEST_MODIFIED, // files have changed since the manifest was made
+} manifest_status_t;
+
+/* Get the path of the manifest for the snapshot at `snapshot`, which lives
+ * beside it in a hidden `.manifests` directory, since snapshots themselves
+ * are usually read-only. The result must be freed.
+ */
+char *manifest_path(const char *snapshot);
+
+/* Record the type, size, mtime, inode and content hash of every file and
+ * directory below the boot-critical paths of `snapshot`, along with the
+ * subvolume's current generation. Directories are hashed by their entries.
+ * Returns 0 on success, or -1 otherwise.
+ */
+int manifest_create(const char *snapshot);
+
+/* Check a snapshot against its manifest. Only inodes written in a
+ * transaction after the manifest's generation are looked at (see
+ * find_new), so an unchanged snapshot is checked without reading any file.
+ * An entry counts as changed if its type, inode, size, mtime or hash differ,
+ * or if it no longer exists.
+ *
+ * Returns a manifest_status_t, or -1 on error.
+ */
+int manifest_check(const char *snapshot);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __PACKAGES_H__
+#define __PACKAGES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PACMAN_LOCAL_DB "var/lib/pacman/local"
+
+typedef struct package {
+  char *name;
+  char *version; // [epoch:]pkgver-pkgrel
+} package_t;
+
+typedef struct package_db {
+  uint64_t subvol_id, generation; // cache key; both 0 if not cacheable
+  package_t *packages;            // sorted by name
+  size_t len;
+  size_t refs; // the cache's and every caller's
+} package_db_t;
+
+/* Load the list of packages installed in the root filesystem tree at `root`
+ * from its pacman local database. Results are cached by subvolume ID and
+ * generation, so a tree that has not changed is only ever read once.
+ *
+ * The returned database stays valid across later loads, until it is handed
+ * back with package_db_release. Returns NULL on error (see errno); ENOENT means
+ * the tree has no pacman database.
+ */
+const package_db_t *package_db_load(const char *root);
+
+// Release a database returned by package_db_load. `db` may be NULL.
+void package_db_release(const package_db_t *db);
+
+/* Compare two package versions the way pacman does (see vercmp(8)). Returns
+ * <0, 0 or >0 if `a` is older than, equal to, or newer than `b`.
+ */
+int package_vercmp(const char *a, const char *b);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef __PROBE_H__
+#define __PROBE_H__
+
+#include <stddef.h>
+
+// Reasons a snapshot is unlikely to boot
+typedef enum probe_problem {
+  PROBE_NO_INIT        = 1 << 0, // /sbin/init is missing or not executable
+  PROBE_NO_MODULES     = 1 << 1, // /usr/lib/modules is missing or empty
+  PROBE_NO_FSTAB       = 1 << 2, // /etc/fstab is missing
+  PROBE_MISSING_SUBVOL = 1 << 3, // /etc/fstab mounts a nonexistent subvolume
+} probe_problem_t;
+
+/* Check that the snapshot at `snapshot` has what it needs to boot. This only
+ * looks up a few fixed paths relative to the snapshot and reads its fstab, so
+ * it takes microseconds. Subvolumes referenced by the fstab are looked up
+ * relative to `toplevel`, the mountpoint of the filesystem's top-level
+ * subvolume; if it is NULL, they are not checked.
+ *
+ * Returns a bitmask of probe_problem_t (0 if none were found), or -1 on error.
+ */
+int probe_snapshot(const char *snapshot, const char *toplevel);
+
+// Summarize the problems found by probe_snapshot in `buf`, e.g. `no init`
+void probe_describe(int problems, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef __PRUNE_H__
+#define __PRUNE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <snaplist.h>
+
+/* Which snapshots to keep. A snapshot is kept if any rule keeps it; if no
+ * retention rule is set at all, every snapshot is kept, and only `min_free`
+ * can cause deletions.
+ */
+typedef struct prune_policy {
+  unsigned long keep_last; // the newest N snapshots
+  unsigned long hourly;    // the newest snapshot in each of the last N hours with one
+  unsigned long daily;     // ...days
+  unsigned long weekly;    // ...weeks
+  uint64_t min_free;       // bytes; delete the oldest kept snapshots to reach this
+} prune_policy_t;
+
+/* Parse a policy from `key=value` words, e.g. `keep-last=10 daily=7
+ * min-free=20G`. Returns 0 on success, or -1 with errno set to EINVAL.
+ */
+int prune_policy_parse(prune_policy_t *policy, const char *spec);
+
+/* Decide which snapshots of `list` (as indexed from the directory `path`) to
+ * delete under `policy`, entirely in memory; nothing is deleted yet.
+ * `doomed[i]` is set for each entry to be deleted. Space freed by deletions
+ * is estimated from qgroup exclusive sizes, so `min_free` only takes effect
+ * with quotas enabled. Returns the number of snapshots to delete, or -1.
+ */
+int prune_plan(
+    const snapshot_list_t *list, const char *path,
+    const prune_policy_t *policy, bool *doomed);
+
+/* Delete the doomed snapshots of `list` in one batch, then wait for a single
+ * transaction commit covering all of them. Returns the number of snapshots
+ * that failed to be deleted (0 on success), or -1 on error.
+ */
+int prune_apply(const snapshot_list_t *list, const char *path, const bool *doomed);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef __QGROUP_H__
+#define __QGROUP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct qgroup_usage {
+  uint64_t id; // level-0 qgroup ID, which is the same as the subvolume ID
+  uint64_t referenced, exclusive; // in bytes
+} qgroup_usage_t;
+
+typedef struct qgroup_table {
+  uint64_t generation; // of the quota status item when the table was read
+  bool inconsistent;   // a rescan is needed or running; numbers may be off
+  qgroup_usage_t *entries; // sorted by ID
+  size_t len;
+} qgroup_table_t;
+
+/* Get the space usage of every subvolume on the filesystem containing `path`
+ * from its level-0 qgroups, with a single batched tree search of the quota
+ * tree. The table is cached and only re-read when the quota generation moves.
+ *
+ * Never falls back to walking the filesystem: if quotas are disabled, this
+ * returns NULL with errno set to ENOTSUP. The returned table belongs to the
+ * cache and remains valid until the next call.
+ */
+const qgroup_table_t *qgroup_table_load(const char *path);
+
+// Look up a subvolume's usage in a table; returns NULL if not present
+const qgroup_usage_t *qgroup_table_find(const qgroup_table_t *table, uint64_t id);
+
+#endif
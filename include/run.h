@@ -1,6 +1,8 @@
 #ifndef __RUN_H__
 #define __RUN_H__
 
+#include <sys/types.h>
+
 /* Run an external program, optionally piping its stdout/err to buffers
  * 
  * If a buf is non-null and its length is non-zero, stdout/err will be
@@ -23,4 +25,15 @@ static inline int run(char *program, const char **args) {
   return run_pipe(program, args, NULL, 0, NULL, 0);
 }
 
+/* Start an external program without waiting for it. The program's stdin is
+ * connected to a pipe, the write end of which is stored in `stdin_fd`; the
+ * caller must close it once done writing.
+ *
+ * Returns the PID of the child, or -1 on error.
+ */
+pid_t run_spawn(char *program, const char **args, int *stdin_fd);
+
+// Wait for a program started by run_spawn; returns the same values as run_pipe
+int run_wait(pid_t pid);
+
 #endif
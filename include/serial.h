@@ -0,0 +1,51 @@
+#ifndef __SERIAL_H__
+#define __SERIAL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <dialog.h>
+
+/* A line-oriented frontend for slow serial consoles, standing in for `dialog`
+ * behind the dialog_* functions. Nothing is drawn but plain text: menus are
+ * numbered, shown a page at a time, and answered with a line of input, so
+ * each keystroke costs about as many bytes however long a list is.
+ *
+ * The functions below take the message already formatted, and return the same
+ * responses as their dialog_* counterparts.
+ */
+
+/* Whether to use it: as set by `btrroll.console=serial|dialog` on the kernel
+ * command line, or else if standard input is a serial port.
+ */
+bool serial_detect(void);
+
+int serial_choose(
+    const dialog_t * const dialog,
+    const char **items, const char **help,
+    size_t items_len, size_t *choice,
+    const char *title, const char *msg);
+
+int serial_confirm(
+    const dialog_t * const dialog, bool default_,
+    const char *title, const char *msg);
+
+int serial_input(
+    const char *init, char *out, const size_t out_len,
+    const char *title, const char *msg);
+
+int serial_ok(const dialog_t * const dialog, const char *title, const char *msg);
+
+int serial_view_file(
+    const dialog_t * const dialog,
+    const char *title, const char *filepath);
+
+int serial_stream(
+    const dialog_t * const dialog,
+    const char *title, dialog_producer_t producer, void *arg);
+
+int serial_gauge_open(dialog_gauge_t * const gauge, const char *title, const char *msg);
+int serial_gauge_update(dialog_gauge_t * const gauge, int percent);
+int serial_gauge_close(dialog_gauge_t * const gauge);
+
+#endif
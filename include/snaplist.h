@@ -0,0 +1,50 @@
+#ifndef __SNAPLIST_H__
+#define __SNAPLIST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct btrfs_util_subvolume_info;
+
+typedef struct snapshot_entry {
+  char *name;        // how it is listed, e.g. `weekly/foo` or `snapper/42`
+  char *path;        // where it is; relative to the scanned directory if relative
+  char *comment;     // what the tool that took it says about it, if anything
+  char *description; // last-modified time, kernel versions and integrity
+  uint64_t id;       // subvolume ID
+  uint64_t generation;
+  time_t otime;      // creation time
+  uint8_t uuid[16], parent_uuid[16], received_uuid[16];
+  int problems;      // reasons it may not boot (see probe_snapshot)
+} snapshot_entry_t;
+
+typedef struct snapshot_list {
+  snapshot_entry_t *entries; // sorted by name
+  size_t len, cap;
+} snapshot_list_t;
+
+/* Append a snapshot to `list`, filling in its subvolume details from `info`.
+ * Returns the new entry, or NULL on failure.
+ */
+snapshot_entry_t *snapshot_list_add(
+    snapshot_list_t *list, const char *name, const char *path,
+    const struct btrfs_util_subvolume_info *info);
+
+/* Collect every snapshot (i.e. non-hidden subvolume) in the directory `path`,
+ * or in any non-hidden directory under it that is not itself a subvolume,
+ * into `list`, which must be zero-initialized. Only the subvolume details are
+ * filled in; the descriptions are left NULL. Returns 0 on success, or -1
+ * otherwise; entries collected before an error are kept in the list.
+ */
+int snapshot_list_index(snapshot_list_t *list, const char *path);
+
+/* As snapshot_list_index, and also describe each snapshot and probe it for
+ * bootability, in parallel. If `root_subvol_dir` is given, the snapshots that
+ * other tools keep of that root are listed too (see snapshot_sources_scan).
+ */
+int snapshot_list_scan(snapshot_list_t *list, const char *path, const char *root_subvol_dir);
+
+void snapshot_list_free(snapshot_list_t *list);
+
+#endif
@@ -1,10 +1,31 @@
 #ifndef __SNAPSHOT_H__
 #define __SNAPSHOT_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+
 struct bootctl_entry;
 
-int snapshot_restore(char *root_subvol_dir, const char *snapshot, const char *backup);
+// What to do with subvolumes nested inside `current` when restoring over it
+typedef enum snapshot_nested {
+  SNAPSHOT_NESTED_NONE,   // leave them alone (only possible with a backup)
+  SNAPSHOT_NESTED_DELETE, // delete them recursively, in parallel
+  SNAPSHOT_NESTED_MOVE,   // rename them into the restored tree
+} snapshot_nested_t;
+
+int snapshot_restore(
+    char *root_subvol_dir, const char *snapshot, const char *backup,
+    snapshot_nested_t nested);
 int snapshot_boot(char *root_subvol_dir, const char *snapshot);
+
+/* Get `snapshot` ready to be booted once, as snapshot_boot does, without
+ * rebooting: snapshot_continue carries it out on the next boot.
+ */
+int snapshot_prepare_boot(const char *root_subvol_dir, const char *snapshot);
+
+// Undo snapshot_prepare_boot, deleting `temp` and the state file
+int snapshot_cancel_boot(const char *root_subvol_dir);
+
 int snapshot_continue(char *root_subvol);
 int get_kernel_versions(const char *snapshot, char **versions, size_t versions_len);
 
@@ -12,4 +33,23 @@ int get_compatible_boot_entries(
     const char *snapshot, const char *esp_path,
     struct bootctl_entry *entries, const size_t entries_len);
 
+// Whether the snapshot has modules for the running kernel
+bool snapshot_supports_running_kernel(const char *snapshot);
+
+/* Find a boot entry to boot `snapshot` with. Returns 1 (leaving `buf` empty)
+ * if the snapshot supports the running kernel, so any entry for it will do; 0
+ * with the ID of a compatible entry in `buf`; or -1 if there is none.
+ */
+int snapshot_compatible_entry(
+    const char *snapshot, const char *esp_path, char *buf, size_t len);
+
+
+/* Work out the path of the snapshot in `snapshots` that `target` refers to:
+ * `known-good`, `latest`, or a name. `latest` is the most recently created
+ * snapshot other than the roots btrroll set aside itself (`pre-restore-*` and
+ * `failed-*`), so that repeating a restore doesn't undo it. Returns NULL if
+ * there is no such snapshot.
+ */
+char *snapshot_resolve(const char *snapshots, const char *target);
+
 #endif
@@ -0,0 +1,18 @@
+#ifndef __SOURCES_H__
+#define __SOURCES_H__
+
+#include <snaplist.h>
+
+/* Add the snapshots that other tools keep of the root in `root_subvol_dir` to
+ * `list`, each listed as `<tool>/<name>` with an absolute path:
+ *
+ * - snapper: `.snapshots/<N>/snapshot`, described by the `info.xml` next to
+ *   it, either inside the root or as `@snapshots` at the top level
+ * - Timeshift: `timeshift-btrfs/snapshots/<date>/@` at the top level
+ *
+ * Sources that don't exist are skipped. Returns 0 on success, or -1 if any
+ * source could not be read.
+ */
+int snapshot_sources_scan(snapshot_list_t *list, const char *root_subvol_dir);
+
+#endif
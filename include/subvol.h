@@ -1,6 +1,15 @@
 #ifndef __SUBVOL_H__
 #define __SUBVOL_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct nested_subvol {
+  char *path;   // relative to the containing subvolume
+  uint64_t id;
+  size_t depth; // 1 for subvolumes directly inside the containing one
+} nested_subvol_t;
+
 char * get_btrfs_root_subvol_path(
     const char * const mountpoint,
     char *flags);
@@ -8,7 +17,34 @@ char * get_btrfs_root_subvol_path(
 char * get_subvol_dir_path(char *subvol_path);
 
 int is_subvol_toplevel(char *path);
+
+/* Find where the top-level subvolume of the filesystem containing the
+ * subvolume `subvol` is mounted, assuming it is mounted above it (as in the
+ * initrd). Returns NULL with errno set to ENOENT if it is not reachable. The
+ * result must be freed.
+ */
+char * get_toplevel_path(const char *subvol);
 int is_subvol_provisioned(char *path);
 int provision_subvol(char *path);
 
+/* List the subvolumes nested (at any depth) inside the subvolume at `path`, in
+ * pre-order. Returns the number found, or -1 on error. The list must be freed
+ * with nested_subvols_free.
+ */
+int get_nested_subvols(const char *path, nested_subvol_t **subvols);
+void nested_subvols_free(nested_subvol_t *subvols, size_t len);
+
+/* Delete the given nested subvolumes of `path`. Subvolumes at the same depth
+ * are deleted in parallel, deepest first, so that no subvolume is deleted
+ * before its own children.
+ */
+int delete_nested_subvols(const char *path, nested_subvol_t *subvols, size_t len);
+
+/* Move the outermost nested subvolumes of `src` (and, with them, everything
+ * nested inside them) to the same relative locations inside `dest`.
+ */
+int move_nested_subvols(
+    const char *src, const char *dest,
+    nested_subvol_t *subvols, size_t len);
+
 #endif
@@ -0,0 +1,10 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/* With `btrroll.trace` on the kernel command line, log `btrroll: trace <event>`
+ * to the kernel log, which timestamps it (see bench/boot.sh); otherwise, do
+ * nothing.
+ */
+void trace(const char *event);
+
+#endif
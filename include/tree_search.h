@@ -0,0 +1,30 @@
+#ifndef __TREE_SEARCH_H__
+#define __TREE_SEARCH_H__
+
+#include <linux/btrfs.h>
+
+/* Called for each item found by tree_search. `item` points to the item's
+ * data, which is `header->len` bytes long and in on-disk (little-endian)
+ * byte order. Returns 0 to continue, or nonzero to stop the search.
+ */
+typedef int (*tree_search_fn_t)(
+    const struct btrfs_ioctl_search_header *header,
+    const void *item,
+    void *arg);
+
+/* Find every item in the key range described by `key` with
+ * BTRFS_IOC_TREE_SEARCH, resuming the ioctl until the range is exhausted.
+ * Nodes and leaves older than `key->min_transid` are skipped by the kernel
+ * without being read, which is what makes generation-based searches cheap.
+ * `fd` is any file within the filesystem; a `tree_id` of 0 searches the
+ * subvolume that contains it.
+ *
+ * Returns 0 once the range is exhausted, the callback's return value if it
+ * stopped the search, or -1 on error (see errno).
+ */
+int tree_search(
+    int fd,
+    const struct btrfs_ioctl_search_key *key,
+    tree_search_fn_t fn, void *arg);
+
+#endif
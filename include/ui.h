@@ -2,11 +2,29 @@
 #define __UI_H__
 
 #include <dialog.h>
+#include <snaplist.h>
+#include <snapshot.h>
 #include <stdbool.h>
 
 int main_menu(dialog_t *dialog, char *root_subvol);
 void snapshot_menu(dialog_t *dialog, char *root_subvol_dir);
+void prune_menu(dialog_t *dialog, char *root_subvol_dir);
+void snapshot_size_labels(dialog_t *dialog, snapshot_list_t *list, char **labels);
 int snapshot_detail_menu(dialog_t *dialog, const char *snapshot);
-char * boot_entry_menu(dialog_t *dialog, const char *snapshot, const char *esp_path);
+void snapshot_actions_menu(
+    dialog_t *dialog, const char *root_subvol_dir, const char *snapshot);
+void restore_paths_menu(
+    dialog_t *dialog, const char *root_subvol_dir, const char *snapshot);
+void changes_view(
+    dialog_t *dialog, const char *root_subvol_dir, const char *snapshot);
+void package_changes_view(
+    dialog_t *dialog, const char *root_subvol_dir, const char *snapshot);
+int nested_subvol_menu(
+    dialog_t *dialog, const char *root_subvol_dir, bool backup,
+    snapshot_nested_t *nested);
+char * boot_entry_menu(
+    dialog_t *dialog, const char *snapshot, const char *esp_path,
+    char **version);
+int verify_menu(dialog_t *dialog, const char *snapshot, const char *version);
 
 #endif
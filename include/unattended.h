@@ -0,0 +1,43 @@
+#ifndef __UNATTENDED_H__
+#define __UNATTENDED_H__
+
+typedef enum unattended_action {
+  UNATTENDED_NONE,
+  UNATTENDED_BOOT,    // boot the snapshot once, leaving `current` alone
+  UNATTENDED_RESTORE, // restore `current` from the snapshot
+} unattended_action_t;
+
+typedef struct unattended {
+  unattended_action_t action;
+  char target[0x100];    // snapshot name, `latest` or `known-good`
+  char entry[0x100];     // boot entry to use, if not picked automatically
+  unsigned long timeout; // seconds to wait for Enter before going ahead
+  char cmdline_action[0x100]; // the command line's btrroll.action, if it's the one to do
+} unattended_t;
+
+/* Read the unattended options:
+ *
+ * - `btrroll.action=boot|restore:<snapshot|latest|known-good>`
+ * - `btrroll.entry=<boot entry ID>`
+ * - `btrroll.timeout=<seconds>`
+ *
+ * from the kernel command line, and then from the one-shot EFI variable
+ * ACTION_EFIVAR_NAME, which holds the same options as a UTF-16 string and
+ * takes precedence. The variable is deleted as soon as it has been read, so
+ * that it applies to a single boot whatever happens. Returns 0 on success,
+ * or -1 (with the action reset) if the options are invalid.
+ *
+ * An action on the command line is carried out once too: unattended_run
+ * records it in ACTION_DONE_FILE in the subvolume directory of `root_subvol`,
+ * and it is ignored for as long as it stays on the command line unchanged.
+ */
+int unattended_read(unattended_t *plan, char *root_subvol);
+
+/* Carry out `plan` on `root_subvol` without any interaction. Boot entries are
+ * picked as the console would: `entry` if given, otherwise one compatible with
+ * the snapshot if the running kernel isn't. A restore keeps the old root as
+ * `snapshots/pre-restore-<date>`. Reboots on success; returns -1 otherwise.
+ */
+int unattended_run(const unattended_t *plan, char *root_subvol, const char *esp_path);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct verify verify_t;
+
+typedef struct verify_result {
+  size_t files, failed;  // files read, and how many of those failed
+  size_t files_total;    // files to read, if not cancelled
+  uint64_t bytes;        // bytes read
+  bool cancelled;
+  char *failures[16];    // paths of (up to) the first few failed files
+} verify_result_t;
+
+/* Start reading back every regular file below the given paths (relative to
+ * `root`) on a pool of threads, so that BTRFS verifies the checksum of every
+ * extent along the way. Cached pages are dropped first so that the data really
+ * comes from disk. Paths which do not exist are skipped.
+ *
+ * Returns a handle to the running verification, or NULL on error.
+ */
+verify_t *verify_start(const char *root, const char * const *paths, size_t paths_len);
+
+// Percentage of bytes verified so far
+int verify_progress(verify_t *verify);
+
+bool verify_done(verify_t *verify);
+
+// Ask the workers to stop as soon as possible; verify_done becomes true soon
+void verify_cancel(verify_t *verify);
+
+/* Wait for the verification to end, store its outcome in `result` and free
+ * the handle. The result must be freed with verify_result_free.
+ */
+void verify_finish(verify_t *verify, verify_result_t *result);
+
+void verify_result_free(verify_result_t *result);
+
+#endif
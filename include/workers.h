@@ -0,0 +1,26 @@
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include <stddef.h>
+
+typedef void (*worker_fn_t)(void *arg);
+
+typedef struct workers workers_t;
+
+/* Create a pool of `count` worker threads. If `count` is zero, one thread per
+ * online CPU is started. Returns NULL on failure (see errno).
+ */
+workers_t *workers_create(size_t count);
+
+/* Queue `fn(arg)` to be run on one of the workers. Jobs may themselves submit
+ * further jobs. Returns 0 on success, -1 otherwise.
+ */
+int workers_submit(workers_t *workers, worker_fn_t fn, void *arg);
+
+// Block until the queue is empty and every worker is idle
+void workers_wait(workers_t *workers);
+
+// Wait for all outstanding jobs, then stop and free the pool
+void workers_destroy(workers_t *workers);
+
+#endif
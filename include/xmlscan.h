@@ -0,0 +1,22 @@
+#ifndef __XMLSCAN_H__
+#define __XMLSCAN_H__
+
+#include <stdio.h>
+
+#define XML_PATH_MAX 0x100
+#define XML_TEXT_MAX 0x1000
+
+/* Called with the path of each element (e.g. `snapshot/num`) as it closes,
+ * along with its text. Returning nonzero stops the scan.
+ */
+typedef int (*xml_text_fn)(const char *path, const char *text, void *arg);
+
+/* Scan the XML document in `fp` in a single pass, without building a tree.
+ * Only the text after an element's last child is kept, up to XML_TEXT_MAX
+ * bytes, with entities decoded; attributes, comments and processing
+ * instructions are skipped. Returns 0 at the end of the document, whatever
+ * `fn` returned if it stopped the scan, or -1 if the document is malformed.
+ */
+int xml_scan(FILE *fp, xml_text_fn fn, void *arg);
+
+#endif
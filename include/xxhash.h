@@ -0,0 +1,25 @@
+#ifndef __XXHASH_H__
+#define __XXHASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Streaming XXH64 (https://github.com/Cyan4973/xxHash). It is not
+ * cryptographic, but it runs at memory speed, which is what matters for
+ * noticing that a file has changed.
+ */
+typedef struct xxh64_state {
+  uint64_t total_len;
+  uint64_t v[4];
+  uint8_t buf[32];
+  size_t buf_len;
+  uint64_t seed;
+} xxh64_state_t;
+
+void xxh64_reset(xxh64_state_t *state, uint64_t seed);
+void xxh64_update(xxh64_state_t *state, const void *data, size_t len);
+uint64_t xxh64_digest(const xxh64_state_t *state);
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif
@@ -1,20 +1,26 @@
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
 #include <linux/magic.h>
 #include <linux/reboot.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/reboot.h>
 #include <unistd.h>
 
 #include <boot.h>
+#include <grub.h>
 #include <macros.h>
 #include <run.h>
+#include <trace.h>
 
 // See https://www.freedesktop.org/wiki/Software/systemd/BootLoaderInterface/
 #define EFI_VENDOR_ID "4a67b082-0a4c-41cf-b6c7-440b29bb8c4f"
+#define EFIVARS_PATH "/sys/firmware/efi/efivars"
 
 void bootctl_entry_free(bootctl_entry_t *entry) {
   free(entry->id);
@@ -22,10 +28,16 @@ void bootctl_entry_free(bootctl_entry_t *entry) {
   free(entry->source);
   free(entry->kernel);
   free(entry->options);
+  free(entry->version);
 }
 
 // TODO: Untested code!
 int bootctl_list(const char *esp_path, bootctl_entry_t *entries, size_t entries_len) {
+  // GRUB installs are handled natively; bootctl only knows about its own
+  char grub_dir[0x100];
+  if (!grub_find(esp_path, arr_and_size(grub_dir)))
+    return grub_list(grub_dir, entries, entries_len);
+
   const char *args[] = {
     "bootctl",
     "--esp-path", esp_path,
@@ -33,13 +45,19 @@ int bootctl_list(const char *esp_path, bootctl_entry_t *entries, size_t entries_
     NULL
   };
 
+  // The output isn't terminated for us
   char buf[0x6000];
-  int status = run_pipe("bootctl", args, buf, sizeof(buf), NULL, 0);
+  memset(buf, 0, sizeof(buf));
+  int status = run_pipe("bootctl", args, buf, sizeof(buf) - 1, NULL, 0);
   if (status) {
     errno = status;
     return -1;
   }
 
+  return bootctl_parse_list(buf, entries, entries_len);
+}
+
+int bootctl_parse_list(char *buf, bootctl_entry_t *entries, size_t entries_len) {
   memset(entries, 0, entries_len * sizeof(bootctl_entry_t));
   bootctl_entry_t *entry = entries;
   char *p = buf;
@@ -48,38 +66,41 @@ int bootctl_list(const char *esp_path, bootctl_entry_t *entries, size_t entries_
     *p_end = '\0';
 
     if (p == p_end) {
-      ++entry;
-      --entries_len;
+      // Blank lines separate entries (and may come before the first one)
+      if (entry->id) {
+        ++entry;
+        --entries_len;
+      }
     } else {
       // Strip leading whitespace
       char *key = p + strspn(p, " \t");
 
-      // Isolate the key
-      char *key_end = strchr(p, ':');
-      if (!key_end)
-        continue;
-      *key_end = '\0';
-
-      // Isolate the value
-      char *value = key_end + 2;
-
-      if (!strcmp("id", key))
-        entry->id = strdup(value);
-      else if (!strcmp("title", key))
-        entry->title = strdup(value);
-      else if (!strcmp("source", key))
-        entry->source = strdup(value);
-      else if (!strcmp("linux", key) || !strcmp("kernel", key))
-        entry->kernel = strdup(value);
-      else if (!strcmp("options", key))
-        entry->options = strdup(value);
+      // Isolate the key; lines without one (e.g. headings) are skipped
+      char *key_end = strchr(key, ':');
+      if (key_end && key_end[1] == ' ') {
+        *key_end = '\0';
+
+        // Isolate the value
+        char *value = key_end + 2;
+
+        if (!strcmp("id", key))
+          entry->id = strdup(value);
+        else if (!strcmp("title", key))
+          entry->title = strdup(value);
+        else if (!strcmp("source", key))
+          entry->source = strdup(value);
+        else if (!strcmp("linux", key) || !strcmp("kernel", key))
+          entry->kernel = strdup(value);
+        else if (!strcmp("options", key))
+          entry->options = strdup(value);
+      }
     }
 
     p = p_end+1;
   }
 
   // Count the last entry if one was found
-  if (entry->id)
+  if (entries_len && entry->id)
     ++entry;
 
   return entry - entries;
@@ -87,6 +108,10 @@ int bootctl_list(const char *esp_path, bootctl_entry_t *entries, size_t entries_
 
 // TODO: validate id?
 int bootctl_set_oneshot(const char *esp_path, const char *id) {
+  char grub_dir[0x100];
+  if (!grub_find(esp_path, arr_and_size(grub_dir)))
+    return grub_set_oneshot(grub_dir, id);
+
   const char *args[] = {
     "bootctl",
     "--esp-path", esp_path,
@@ -103,6 +128,10 @@ int bootctl_set_oneshot(const char *esp_path, const char *id) {
 
 // TODO: validate id?
 int bootctl_set_default(const char *esp_path, const char *id) {
+  char grub_dir[0x100];
+  if (!grub_find(esp_path, arr_and_size(grub_dir)))
+    return grub_set_default(grub_dir, id);
+
   const char *args[] = {
     "bootctl",
     "--esp-path", esp_path,
@@ -116,56 +145,151 @@ int bootctl_set_default(const char *esp_path, const char *id) {
   return err;
 }
 
-// TODO: Untested code!
-int mount_esp(char *mountpoint) {
-  CLEANUP_DECLARE(ret);
+int bootctl_esp_path(char *buf, size_t len) {
+  const char *args[] = {
+    "bootctl",
+    "--print-esp-path",
+    NULL
+  };
 
-  // Get the partition UUID of the ESP
-  FILE * const fp = fopen(
-      "/sys/firmware/efi/efivars/LoaderDevicePartUUID-" EFI_VENDOR_ID,
-      "r");
+  // The output isn't terminated for us
+  memset(buf, 0, len);
+  int status = run_pipe("bootctl", args, buf, len - 1, NULL, 0);
+  if (status) {
+    errno = status;
+    return -1;
+  }
 
-  if (!fp) {
-    perror("fopen");
-    FAIL(ret);
+  buf[strcspn(buf, "\n")] = '\0';
+  if (!buf[0]) {
+    errno = ENOENT;
+    return -1;
   }
+  return 0;
+}
+
+int efivar_read_string(const char *name, char *buf, size_t len) {
+  return efivar_read_string_guid(name, EFI_VENDOR_ID, buf, len);
+}
+
+int efivar_read_string_guid(const char *name, const char *guid, char *buf, size_t len) {
+  CLEANUP_DECLARE(ret);
+
+  if (!name || !guid || !buf || !len) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  char path[0x100];
+  snprintf(path, sizeof(path), EFIVARS_PATH "/%s-%s", name, guid);
+  FILE * const fp = fopen(path, "r");
+  if (!fp)
+    return -1;
 
   // The EFI var in question is formatted with 2 leading shorts worth of metadata,
   // followed by shorts representing char values. We can't just read it a string;
   // have to do some conversion. TODO: Make sure this is not implementation-dependent.
+  short raw[0x200];
+  size_t sz = fread(raw, sizeof(short), lenof(raw), fp);
+  if (!sz && ferror(fp)) {
+    perror("fread");
+    FAIL(ret);
+  }
+
+  char *p = buf;
+  for (size_t i = 2; i < sz && p < buf + len - 1; ++i) {
+    const short c = raw[i];
+    if (c)
+      *p++ = (char) c;
+  }
+  *p = '\0';
+
+CLEANUP:
+  if (fclose(fp))
+    perror("fclose");
+
+  return ret;
+}
+
+int efivar_delete(const char *name, const char *guid) {
+  char path[0x100];
+  snprintf(path, sizeof(path), EFIVARS_PATH "/%s-%s", name, guid);
+
+  // efivarfs makes variables immutable, so that they aren't deleted by mistake
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  int flags;
+  if (!ioctl(fd, FS_IOC_GETFLAGS, &flags) && (flags & FS_IMMUTABLE_FL)) {
+    flags &= ~FS_IMMUTABLE_FL;
+    if (ioctl(fd, FS_IOC_SETFLAGS, &flags))
+      perror("ioctl");
+  }
+  if (close(fd))
+    perror("close");
+
+  if (unlink(path)) {
+    perror("unlink");
+    return -1;
+  }
+  return 0;
+}
+
+int bootctl_entry_tries(const char *id, int *left, int *done) {
+  // The counter comes just before the extension, e.g. `arch+2-1.conf`
+  const char * const ext = strrchr(id, '.');
+  const char * const end = ext ? ext : id + strlen(id);
+  const char *plus = NULL;
+  for (const char *p = id; p < end; ++p)
+    if (*p == '+')
+      plus = p;
+  if (!plus)
+    return 0;
+
+  char *num_end;
+  const long l = strtol(plus + 1, &num_end, 10);
+  if (num_end == plus + 1 || l < 0)
+    return 0;
+
+  long d = 0;
+  if (*num_end == '-') {
+    const char * const done_str = num_end + 1;
+    d = strtol(done_str, &num_end, 10);
+    if (num_end == done_str || d < 0)
+      return 0;
+  }
+  if (num_end != end)
+    return 0;
+
+  *left = l;
+  *done = d;
+  return 1;
+}
+
+// TODO: Untested code!
+int mount_esp(const char *mountpoint) {
+  // Get the partition UUID of the ESP
   char partuuid[64];
-  {
-    short buf[128];
-    size_t sz = fread(buf, 1, sizeof(buf), fp);
-    if (!sz && ferror(fp)) {
-      perror("fread");
-      FAIL(ret);
-    }
-    char *p = partuuid;
-    for (size_t i = 2; i < sz; ++i) {
-      const short c = buf[i];
-      if (c)
-        *p++ = tolower((char) c);
-    }
-    *p = '\0';
+  if (efivar_read_string("LoaderDevicePartUUID", arr_and_size(partuuid))) {
+    perror("efivar_read_string");
+    return -1;
   }
+  for (char *p = partuuid; *p; ++p)
+    *p = tolower(*p);
 
   // Mount the ESP by partition UUID
   char esp[64];
   snprintf(esp, sizeof(esp), "/dev/disk/by-partuuid/%s", partuuid);
   if (mount(esp, mountpoint, "vfat", MS_NOATIME, "")) {
     perror("mount");
-    FAIL(ret);
+    return -1;
   }
 
-CLEANUP:
-  if (fclose(fp))
-    perror("fclose");
-
-  return ret;
+  return 0;
 }
 
 void restart() {
+  trace("restart");
   // TODO: Make sure this does not cause any data loss
   sync();
   reboot(LINUX_REBOOT_CMD_RESTART);
@@ -0,0 +1,342 @@
+#include <btrfsutil.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boot.h>
+#include <bootcount.h>
+#include <cmdline.h>
+#include <constants.h>
+#include <group.h>
+#include <macros.h>
+#include <path.h>
+#include <probe.h>
+#include <snapshot.h>
+#include <subvol.h>
+
+int bootcount_read(const char *root_subvol_dir, bootcount_t *count) {
+  memset(count, 0, sizeof(bootcount_t));
+
+  char *path = pathcat(root_subvol_dir, BOOT_COUNT_FILE);
+  FILE * const fp = path ? fopen(path, "r") : NULL;
+  free(path);
+  if (!fp)
+    return -1;
+
+  char line[0x200];
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (!strncmp(line, "attempts=", 9))
+      count->attempts = strtoul(line + 9, NULL, 10);
+    else if (!strncmp(line, "rollback=", 9))
+      snprintf(count->rollback, sizeof(count->rollback), "%s", line + 9);
+  }
+
+  if (fclose(fp))
+    perror("fclose");
+  return 0;
+}
+
+int bootcount_write(const char *root_subvol_dir, const bootcount_t *count) {
+  CLEANUP_DECLARE(ret);
+
+  char *path = pathcat(root_subvol_dir, BOOT_COUNT_FILE);
+  char *tmp_path = pathcat(root_subvol_dir, BOOT_COUNT_FILE ".tmp");
+  FILE *fp = NULL;
+  if (!path || !tmp_path) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  if (!(fp = fopen(tmp_path, "w"))) {
+    perror("fopen");
+    FAIL(ret);
+  }
+
+  fprintf(fp, "attempts=%lu\n", count->attempts);
+  if (count->rollback[0])
+    fprintf(fp, "rollback=%s\n", count->rollback);
+
+  // The count has to survive the very crash it is meant to detect
+  if (fflush(fp) || fsync(fileno(fp))) {
+    perror("fsync");
+    FAIL(ret);
+  }
+  if (fclose(fp)) {
+    fp = NULL;
+    perror("fclose");
+    FAIL(ret);
+  }
+  fp = NULL;
+
+  if (rename(tmp_path, path)) {
+    perror("rename");
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (fp)
+    fclose(fp);
+  free(tmp_path);
+  free(path);
+  return ret;
+}
+
+int bootcount_confirm(const char *root_subvol_dir) {
+  const bootcount_t count = { 0 };
+  return bootcount_write(root_subvol_dir, &count);
+}
+
+int bootcount_find_known_good(const char *snapshots, const char *skip_from, char *buf, size_t len) {
+  const size_t prefix_len = strlen(KNOWN_GOOD_PREFIX);
+  uint64_t limit = UINT64_MAX, best = 0;
+  if (!strncmp(skip_from, KNOWN_GOOD_PREFIX, prefix_len))
+    limit = strtoull(skip_from + prefix_len, NULL, 10);
+
+  DIR * const dp = opendir(snapshots);
+  if (!dp) {
+    perror("opendir");
+    return -1;
+  }
+
+  char *toplevel = get_toplevel_path(snapshots);
+
+  struct dirent *ep;
+  while ((ep = readdir(dp))) {
+    if (strncmp(ep->d_name, KNOWN_GOOD_PREFIX, prefix_len))
+      continue;
+
+    char *end;
+    const uint64_t gen = strtoull(ep->d_name + prefix_len, &end, 10);
+    if (*end || gen >= limit || gen <= best)
+      continue;
+
+    char *snapshot = pathcat(snapshots, ep->d_name);
+    if (snapshot && !probe_snapshot(snapshot, toplevel)) {
+      best = gen;
+      snprintf(buf, len, "%s", ep->d_name);
+    }
+    free(snapshot);
+  }
+
+  free(toplevel);
+  if (closedir(dp))
+    perror("closedir");
+  return best ? 0 : -1;
+}
+
+static int roll_back(char *root_subvol_dir, const char *esp_path, bootcount_t *count) {
+  CLEANUP_DECLARE(ret);
+
+  char *snapshots = pathcat(root_subvol_dir, SUBVOL_SNAP_NAME);
+  char *snapshot = NULL, *backup = NULL;
+  char name[0x100];
+  group_t group = { 0 };
+  const bootcount_t before = *count;
+  if (!snapshots) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  if (bootcount_find_known_good(snapshots, count->rollback, arr_and_size(name))) {
+    eprintf("btrroll: boot failed %lu times, but there is no known-good "
+        "snapshot to roll back to\n", count->attempts);
+    FAIL(ret);
+  }
+  snapshot = pathcat(snapshots, name);
+
+  // Keep the failed root around for inspection
+  char failed[0x40];
+  const time_t now = time(NULL);
+  strftime(failed, sizeof(failed), FAILED_PREFIX "%Y%m%d-%H%M%S", gmtime(&now));
+  backup = pathcat(snapshots, failed);
+
+  if (!snapshot || !backup) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  // The restored root must boot with a kernel it has modules for
+  char entry[0x100];
+  const int compatible = snapshot_compatible_entry(snapshot, esp_path, arr_and_size(entry));
+  if (compatible < 0 || (!compatible && bootctl_set_default(esp_path, entry))) {
+    eprintf("btrroll: no boot entry is compatible with `%s`\n", name);
+    FAIL(ret);
+  }
+
+  eprintf("btrroll: boot failed %lu times; rolling back to `%s`\n", count->attempts, name);
+
+  // Record the rollback first, since a successful restore reboots. Should the
+  // restore fail, the caller writes back the count as it was, so that the
+  // failed root isn't given more tries and the snapshot isn't skipped later.
+  count->attempts = 0;
+  snprintf(count->rollback, sizeof(count->rollback), "%s", name);
+  if (bootcount_write(root_subvol_dir, count)) {
+    FAIL(ret);
+  }
+
+  if (group_load(&group, root_subvol_dir)) {
+    perror("group_load");
+    FAIL(ret);
+  }
+  if (group_restore(&group, snapshot, backup, SNAPSHOT_NESTED_MOVE)) {
+    perror("group_restore");
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (ret)
+    *count = before;
+  group_free(&group);
+  free(backup);
+  free(snapshot);
+  free(snapshots);
+  return ret;
+}
+
+static int compare_gens(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Snapshot `current` as `snapshots/.known-good-<ctransid>`, keeping at most
+ * `keep` of them. The ctransid only moves when the contents of a subvolume
+ * change (unlike its generation, which snapshotting it bumps), so nothing is
+ * done at all if nothing changed since the last one.
+ */
+static int known_good_snapshot(const char *root_subvol_dir, unsigned long keep) {
+  CLEANUP_DECLARE(ret);
+
+  char *current = pathcat(root_subvol_dir, SUBVOL_CUR_NAME);
+  char *snapshots = pathcat(root_subvol_dir, SUBVOL_SNAP_NAME);
+  uint64_t gens[0x100];
+  size_t gens_len = 0;
+  DIR *dp = NULL;
+  group_t group = { 0 };
+
+  if (!current || !snapshots) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+  if (group_load(&group, root_subvol_dir)) {
+    perror("group_load");
+    FAIL(ret);
+  }
+
+  struct btrfs_util_subvolume_info info;
+  enum btrfs_util_error err = btrfs_util_subvolume_info(current, 0, &info);
+  if (err != BTRFS_UTIL_OK) {
+    eprintf("error: %s\n", btrfs_util_strerror(err));
+    FAIL(ret);
+  }
+
+  // Collect the existing ring, leaving room for the new one
+  if (!(dp = opendir(snapshots))) {
+    perror("opendir");
+    FAIL(ret);
+  }
+
+  const size_t prefix_len = strlen(KNOWN_GOOD_PREFIX);
+  struct dirent *ep;
+  while ((ep = readdir(dp)) && gens_len < lenof(gens) - 1) {
+    char *end;
+    if (strncmp(ep->d_name, KNOWN_GOOD_PREFIX, prefix_len))
+      continue;
+    const uint64_t gen = strtoull(ep->d_name + prefix_len, &end, 10);
+    if (!*end)
+      gens[gens_len++] = gen;
+  }
+  qsort(gens, gens_len, sizeof(uint64_t), compare_gens);
+
+  if (gens_len && gens[gens_len - 1] >= info.ctransid)
+    goto CLEANUP; // unchanged since the last one
+
+  // The rest of the rollback group is snapshotted under the same name, so
+  // that a rollback can find the matching snapshots
+  char name[0x40];
+  snprintf(name, sizeof(name), KNOWN_GOOD_PREFIX "%" PRIu64, info.ctransid);
+  if (group_snapshot(&group, name, BTRFS_UTIL_CREATE_SNAPSHOT_READ_ONLY)) {
+    FAIL(ret);
+  }
+  gens[gens_len++] = info.ctransid;
+
+  // Drop the oldest beyond the limit. Deletion is queued for the cleaner
+  // thread rather than committed, so this doesn't hold up the boot.
+  for (size_t i = 0; gens_len - i > keep; ++i) {
+    snprintf(name, sizeof(name), KNOWN_GOOD_PREFIX "%" PRIu64, gens[i]);
+    if ((err = btrfs_util_delete_subvolume_fd(dirfd(dp), name, 0)) != BTRFS_UTIL_OK)
+      eprintf("error: %s: %s\n", name, btrfs_util_strerror(err));
+    group_delete_snapshot(&group, name);
+  }
+
+CLEANUP:
+  group_free(&group);
+  if (dp && closedir(dp))
+    perror("closedir");
+  free(snapshots);
+  free(current);
+  return ret;
+}
+
+int bootcount_continue(char *root_subvol, const char *esp_path) {
+  CLEANUP_DECLARE(ret);
+
+  char *root_subvol_dir = get_subvol_dir_path(root_subvol);
+  if (!root_subvol_dir) {
+    perror("get_subvol_dir_path");
+    return -1;
+  }
+
+  bootcount_t count;
+  if (bootcount_read(root_subvol_dir, &count)) {
+    if (errno != ENOENT) {
+      perror("bootcount_read");
+      FAIL(ret);
+    }
+    goto CLEANUP; // boots are not being confirmed
+  }
+
+  // The previous boot was confirmed (and wasn't an unconfirmed rollback), so
+  // what's in `current` is known to work
+  const unsigned long keep = cmdline_get_ulong(cmdline_kernel(), CMDLINE_BTRROLL_KNOWN_GOOD, 0);
+  if (count.attempts == 0 && !count.rollback[0] && keep &&
+      known_good_snapshot(root_subvol_dir, keep))
+    perror("known_good_snapshot");
+
+  ++count.attempts;
+
+  // systemd-boot's own counter may allow fewer tries than ours. It takes a try
+  // off before booting the entry, so `+0-N` is the last try, still going on:
+  // the entry allows `left + done` tries in all, just as `tries` does. This
+  // relies on LoaderEntrySelected keeping the `+N-M` suffix; without one,
+  // only our own count applies.
+  unsigned long tries = cmdline_get_ulong(cmdline_kernel(), CMDLINE_BTRROLL_TRIES, BOOT_TRIES_DEFAULT);
+  char entry[0x100];
+  int left, done;
+  if (!efivar_read_string("LoaderEntrySelected", arr_and_size(entry)) &&
+      bootctl_entry_tries(entry, &left, &done) &&
+      (unsigned long) (left + done) < tries)
+    tries = left + done;
+
+  if (count.attempts > tries) {
+    if (roll_back(root_subvol_dir, esp_path, &count)) {
+      // Keep counting, in case a snapshot turns up later
+      bootcount_write(root_subvol_dir, &count);
+      FAIL(ret);
+    }
+    goto CLEANUP;
+  }
+
+  if (bootcount_write(root_subvol_dir, &count)) {
+    FAIL(ret);
+  }
+
+CLEANUP:
+  free(root_subvol_dir);
+  return ret;
+}
@@ -0,0 +1,122 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <changes.h>
+#include <macros.h>
+#include <tree_search.h>
+
+#define INO_PATHS_LEN 0x10000
+
+typedef struct find_new_ctx {
+  int fd;
+  uint64_t transid;
+  change_fn_t fn;
+  void *arg;
+  struct btrfs_data_container *paths;
+} find_new_ctx_t;
+
+static int find_new_item(
+    const struct btrfs_ioctl_search_header *header,
+    const void *item,
+    void *arg)
+{
+  find_new_ctx_t * const ctx = arg;
+
+  // The key range also spans every other item type; only inodes matter here
+  if (header->type != BTRFS_INODE_ITEM_KEY ||
+      header->len < sizeof(struct btrfs_inode_item))
+    return 0;
+
+  struct btrfs_inode_item inode;
+  memcpy(&inode, item, sizeof(inode));
+
+  // Leaves are filtered by generation, but not the items within them
+  if (le64toh(inode.transid) <= ctx->transid)
+    return 0;
+
+  const change_type_t type = le64toh(inode.generation) > ctx->transid
+    ? CHANGE_ADDED : CHANGE_MODIFIED;
+  const bool is_dir = S_ISDIR(le32toh(inode.mode));
+
+  // The subvolume's own root directory has no name
+  if (header->objectid == BTRFS_FIRST_FREE_OBJECTID)
+    return ctx->fn(type, "/", is_dir, ctx->arg);
+
+  // Resolve the inode number to the path(s) that link to it
+  struct btrfs_ioctl_ino_path_args args = {
+    .inum = header->objectid,
+    .size = INO_PATHS_LEN,
+    .fspath = (uintptr_t) ctx->paths,
+  };
+  if (ioctl(ctx->fd, BTRFS_IOC_INO_PATHS, &args) < 0) {
+    // Unlinked, but not yet cleaned up (e.g. an open temporary file)
+    if (errno == ENOENT)
+      return 0;
+    perror("ioctl");
+    return -1;
+  }
+
+  const struct btrfs_data_container * const paths = ctx->paths;
+  for (uint32_t i = 0; i < paths->elem_cnt; ++i) {
+    const char *path = (const char *) paths->val + paths->val[i];
+    int ret = ctx->fn(type, path, is_dir, ctx->arg);
+    if (ret)
+      return ret;
+  }
+
+  return 0;
+}
+
+int find_new(const char *subvol, uint64_t transid, change_fn_t fn, void *arg) {
+  CLEANUP_DECLARE(ret);
+
+  if (!subvol || !fn) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  find_new_ctx_t ctx = { -1, transid, fn, arg, malloc(INO_PATHS_LEN) };
+  if (!ctx.paths) {
+    perror("malloc");
+    FAIL(ret);
+  }
+
+  ctx.fd = open(subvol, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (ctx.fd < 0) {
+    perror("open");
+    FAIL(ret);
+  }
+
+  // Every inode in the subvolume, in leaves written after `transid`
+  const struct btrfs_ioctl_search_key key = {
+    .tree_id = 0,
+    .min_objectid = BTRFS_FIRST_FREE_OBJECTID,
+    .max_objectid = BTRFS_LAST_FREE_OBJECTID,
+    .min_type = BTRFS_INODE_ITEM_KEY,
+    .max_type = BTRFS_INODE_ITEM_KEY,
+    .min_offset = 0,
+    .max_offset = UINT64_MAX,
+    .min_transid = transid + 1,
+    .max_transid = UINT64_MAX,
+  };
+
+  ret = tree_search(ctx.fd, &key, find_new_item, &ctx);
+  if (ret < 0)
+    perror("tree_search");
+
+CLEANUP:
+  if (ctx.fd >= 0)
+    close(ctx.fd);
+  free(ctx.paths);
+  return ret;
+}
@@ -0,0 +1,500 @@
+#include <btrfsutil.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boot.h>
+#include <bootcount.h>
+#include <cli.h>
+#include <config.h>
+#include <constants.h>
+#include <group.h>
+#include <macros.h>
+#include <manifest.h>
+#include <path.h>
+#include <prune.h>
+#include <root.h>
+#include <snaplist.h>
+#include <snapshot.h>
+#include <subvol.h>
+#include <verify.h>
+
+typedef struct command {
+  const char *name, *args, *help;
+  int min_args;
+  int (*fn)(int argc, char **argv);
+} command_t;
+
+/* On the booted system, only the root subvolume itself is mounted. Mount the
+ * top-level subvolume of the root filesystem at HOST_MOUNTPOINT, and get the
+ * path of the root subvolume's `.d` directory within it. The result must be
+ * freed, and the mount undone with unmount_toplevel.
+ */
+static char *mount_toplevel(void) {
+  char root[0x1000], flags[0x1000];
+  if (get_root(arr_and_size(root), arr_and_size(flags))) {
+    perror("get_root");
+    return NULL;
+  }
+
+  if ((mkdir("/run/btrroll", 0700) && errno != EEXIST) ||
+      (mkdir(HOST_MOUNTPOINT, 0700) && errno != EEXIST))
+  {
+    perror("mkdir");
+    return NULL;
+  }
+
+  if (mount_root(HOST_MOUNTPOINT, "btrfs", root, "subvolid=5")) {
+    perror("mount_root");
+    return NULL;
+  }
+
+  char *root_subvol = get_btrfs_root_subvol_path(HOST_MOUNTPOINT, flags);
+  char *path = root_subvol ? pathcat(HOST_MOUNTPOINT, root_subvol) : NULL;
+  char *root_subvol_dir = path ? get_subvol_dir_path(path) : NULL;
+  free(root_subvol);
+  free(path);
+
+  if (!root_subvol_dir) {
+    perror("get_btrfs_root_subvol_path");
+    umount(HOST_MOUNTPOINT);
+  }
+  return root_subvol_dir;
+}
+
+static void unmount_toplevel(char *root_subvol_dir) {
+  free(root_subvol_dir);
+  if (umount(HOST_MOUNTPOINT))
+    perror("umount");
+}
+
+static int cmd_confirm(int argc, char **argv) {
+  char * const root_subvol_dir = mount_toplevel();
+  if (!root_subvol_dir)
+    return EXIT_FAILURE;
+
+  int ret = EXIT_SUCCESS;
+  if (bootcount_confirm(root_subvol_dir)) {
+    eprintf("btrroll: failed to confirm the boot: %s\n", strerror(errno));
+    ret = EXIT_FAILURE;
+  }
+
+  unmount_toplevel(root_subvol_dir);
+  return ret;
+}
+
+static int cmd_manifest(int argc, char **argv) {
+  int ret = EXIT_SUCCESS;
+  for (int i = 0; i < argc; ++i) {
+    if (manifest_create(argv[i])) {
+      eprintf("btrroll: failed to create a manifest for `%s`: %s\n",
+          argv[i], strerror(errno));
+      ret = EXIT_FAILURE;
+    }
+  }
+  return ret;
+}
+
+static int cmd_check(int argc, char **argv) {
+  int ret = EXIT_SUCCESS;
+  for (int i = 0; i < argc; ++i) {
+    switch (manifest_check(argv[i])) {
+      case MANIFEST_INTACT:
+        printf("%s: intact\n", argv[i]);
+        break;
+      case MANIFEST_MODIFIED:
+        printf("%s: modified\n", argv[i]);
+        ret = EXIT_FAILURE;
+        break;
+      case MANIFEST_MISSING:
+        printf("%s: no manifest\n", argv[i]);
+        ret = EXIT_FAILURE;
+        break;
+      default:
+        eprintf("btrroll: failed to check `%s`: %s\n", argv[i], strerror(errno));
+        ret = EXIT_FAILURE;
+        break;
+    }
+  }
+  return ret;
+}
+
+static int cmd_prune(int argc, char **argv) {
+  CLEANUP_DECLARE(ret);
+
+  // Everything but the flag is part of the policy
+  bool dry_run = false;
+  char spec[0x400] = "";
+  for (int i = 0; i < argc; ++i) {
+    if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--dry-run")) {
+      dry_run = true;
+      continue;
+    }
+    strncat(spec, argv[i], sizeof(spec) - strlen(spec) - 2);
+    strcat(spec, " ");
+  }
+
+  prune_policy_t policy;
+  if (prune_policy_parse(&policy, spec)) {
+    eprintf("btrroll: invalid policy `%s`\n", spec);
+    return EXIT_FAILURE;
+  }
+
+  char *root_subvol_dir = mount_toplevel(), *snapshots = NULL;
+  snapshot_list_t list = { 0 };
+  bool *doomed = NULL;
+  if (!root_subvol_dir)
+    return EXIT_FAILURE;
+
+  if (!(snapshots = pathcat(root_subvol_dir, SUBVOL_SNAP_NAME)) ||
+      snapshot_list_index(&list, snapshots) ||
+      !(doomed = calloc(list.len ? list.len : 1, sizeof(bool))))
+  {
+    perror("snapshot_list_index");
+    FAIL(ret);
+  }
+
+  const int count = prune_plan(&list, snapshots, &policy, doomed);
+  if (count < 0) {
+    perror("prune_plan");
+    FAIL(ret);
+  }
+
+  for (size_t i = 0; i < list.len; ++i)
+    if (doomed[i])
+      printf("%s %s\n", dry_run ? "would delete" : "deleting", list.entries[i].name);
+
+  if (!dry_run && count && prune_apply(&list, snapshots, doomed)) {
+    eprintf("btrroll: failed to delete some snapshots\n");
+    FAIL(ret);
+  }
+
+CLEANUP:
+  free(doomed);
+  snapshot_list_free(&list);
+  free(snapshots);
+  unmount_toplevel(root_subvol_dir);
+  return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Read back the files the snapshot needs to boot, as the console offers to
+static int verify_snapshot(const char *snapshot, const char *version) {
+  char modules[0x200];
+  snprintf(arr_and_size(modules), "usr/lib/modules/%s", version ? version : "");
+  const char *paths[] = { version ? modules : "usr/lib/modules", "usr/lib/systemd", "etc" };
+
+  verify_t * const verify = verify_start(snapshot, arr_and_size(paths));
+  if (!verify) {
+    perror("verify_start");
+    return -1;
+  }
+
+  verify_result_t result;
+  verify_finish(verify, &result);
+
+  printf("verified %zu files (%.1f MiB) of `%s`\n",
+      result.files, result.bytes / 1048576.0, snapshot);
+  for (size_t i = 0; i < lenof(result.failures) && result.failures[i]; ++i)
+    eprintf("btrroll: could not read back `%s` intact\n", result.failures[i]);
+
+  const int ret = result.failed ? -1 : 0;
+  if (result.failed)
+    eprintf("btrroll: %zu of %zu files failed verification\n", result.failed, result.files);
+  verify_result_free(&result);
+  return ret;
+}
+
+// Drop whatever was scheduled for the next boot
+static int schedule_cancel(const char *root_subvol_dir, const char *esp_path) {
+  CLEANUP_DECLARE(ret);
+
+  char *state_path = pathcat(root_subvol_dir, STATE_FILE);
+  if (!state_path) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  char state[0x100] = "";
+  FILE *fp = fopen(state_path, "r");
+  if (fp) {
+    if (!fgets(state, sizeof(state), fp))
+      state[0] = '\0';
+    fclose(fp);
+  }
+
+  bool cancelled = false;
+  if (!strcmp(state, STATE_BOOT_TEMP)) {
+    if (snapshot_cancel_boot(root_subvol_dir)) {
+      perror("snapshot_cancel_boot");
+      FAIL(ret);
+    }
+    if (esp_path && bootctl_set_oneshot(esp_path, ""))
+      perror("bootctl_set_oneshot");
+    printf("cancelled the scheduled boot\n");
+    cancelled = true;
+  } else if (state[0]) {
+    eprintf("btrroll: a snapshot is being booted; there is nothing to cancel\n");
+  }
+
+  const int found = group_cancel(root_subvol_dir);
+  if (found < 0) {
+    perror("group_cancel");
+    FAIL(ret);
+  } else if (found) {
+    printf("cancelled the scheduled restore (the default boot entry is left as it is)\n");
+    cancelled = true;
+  }
+
+  if (!cancelled)
+    printf("nothing is scheduled\n");
+
+CLEANUP:
+  free(state_path);
+  return ret;
+}
+
+/* Do the slow parts of booting or restoring a snapshot (finding a kernel for
+ * it, verifying it and making its new tree) on the running system, and leave
+ * the rest to snapshot_continue on the next boot.
+ */
+static int cmd_schedule(int argc, char **argv) {
+  CLEANUP_DECLARE(ret);
+
+  const char *action = argv[0], *target = NULL, *entry_arg = NULL, *esp_arg = NULL;
+  bool no_verify = false, force = false;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--entry") && i + 1 < argc)
+      entry_arg = argv[++i];
+    else if (!strcmp(argv[i], "--esp") && i + 1 < argc)
+      esp_arg = argv[++i];
+    else if (!strcmp(argv[i], "--no-verify"))
+      no_verify = true;
+    else if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--force"))
+      force = true;
+    else if (!target && argv[i][0] != '-')
+      target = argv[i];
+    else {
+      eprintf("btrroll: unexpected argument `%s`\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  const bool boot = !strcmp(action, "boot"), restore = !strcmp(action, "restore");
+  if (!boot && !restore && strcmp(action, "cancel")) {
+    eprintf("btrroll: expected boot, restore or cancel, not `%s`\n", action);
+    return EXIT_FAILURE;
+  }
+  if ((boot || restore) && !target) {
+    eprintf("btrroll: which snapshot should be %s?\n", boot ? "booted" : "restored");
+    return EXIT_FAILURE;
+  }
+
+  char esp_path[0x1000];
+  if (esp_arg)
+    snprintf(esp_path, sizeof(esp_path), "%s", esp_arg);
+  else if (bootctl_esp_path(arr_and_size(esp_path))) {
+    if (boot || restore) {
+      eprintf("btrroll: could not find the ESP; pass --esp <path>\n");
+      return EXIT_FAILURE;
+    }
+    esp_path[0] = '\0';
+  }
+
+  char *root_subvol_dir = mount_toplevel();
+  char *snapshots = NULL, *snapshot = NULL, *backup = NULL, *state_path = NULL;
+  char *journal_path = NULL;
+  group_t group = { 0 };
+  if (!root_subvol_dir)
+    return EXIT_FAILURE;
+
+  if (!boot && !restore) {
+    if (schedule_cancel(root_subvol_dir, esp_path[0] ? esp_path : NULL)) {
+      FAIL(ret);
+    }
+    goto CLEANUP;
+  }
+
+  if (!(snapshots = pathcat(root_subvol_dir, SUBVOL_SNAP_NAME)) ||
+      !(state_path = pathcat(root_subvol_dir, STATE_FILE)) ||
+      !(journal_path = pathcat(root_subvol_dir, JOURNAL_FILE)))
+  {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  // One thing at a time: the next boot can only carry out a single plan
+  if (!access(state_path, F_OK) || !access(journal_path, F_OK)) {
+    eprintf("btrroll: something is already scheduled; see `btrroll schedule cancel`\n");
+    FAIL(ret);
+  }
+
+  if (!(snapshot = snapshot_resolve(snapshots, target))) {
+    FAIL(ret);
+  }
+
+  // Pick the boot entry, unless the running kernel will do
+  char entry[0x100];
+  const char *version = NULL;
+  struct utsname uts;
+  if (entry_arg) {
+    snprintf(entry, sizeof(entry), "%s", entry_arg);
+  } else {
+    const int found = snapshot_compatible_entry(snapshot, esp_path, arr_and_size(entry));
+    if (found < 0) {
+      eprintf("btrroll: no boot entry is compatible with `%s`\n", snapshot);
+      FAIL(ret);
+    }
+    if (found && !uname(&uts))
+      version = uts.release;
+  }
+  printf("`%s` will boot with %s\n", snapshot,
+      entry[0] ? entry : "the running kernel's entry");
+
+  if (!no_verify && verify_snapshot(snapshot, version) && !force) {
+    eprintf("btrroll: not scheduling a snapshot that failed verification "
+        "(use --force to anyway)\n");
+    FAIL(ret);
+  }
+
+  if (boot) {
+    // The entry only once `temp` is ready; `current` may not boot with it
+    if (snapshot_prepare_boot(root_subvol_dir, snapshot)) {
+      perror("snapshot_prepare_boot");
+      FAIL(ret);
+    }
+    if (entry[0] && bootctl_set_oneshot(esp_path, entry)) {
+      perror("bootctl_set_oneshot");
+      schedule_cancel(root_subvol_dir, NULL);
+      FAIL(ret);
+    }
+    printf("`%s` will be booted once on the next boot\n", snapshot);
+  } else {
+    char name[0x40];
+    const time_t now = time(NULL);
+    strftime(name, sizeof(name), PRE_RESTORE_PREFIX "%Y%m%d-%H%M%S", gmtime(&now));
+    if (!(backup = pathcat(snapshots, name))) {
+      perror("pathcat");
+      FAIL(ret);
+    }
+
+    if (group_load(&group, root_subvol_dir)) {
+      perror("group_load");
+      FAIL(ret);
+    }
+    if (group_prepare(&group, snapshot, backup, SNAPSHOT_NESTED_MOVE)) {
+      perror("group_prepare");
+      FAIL(ret);
+    }
+    if (entry[0] && bootctl_set_default(esp_path, entry)) {
+      perror("bootctl_set_default");
+      group_cancel(root_subvol_dir);
+      FAIL(ret);
+    }
+    printf("`%s` will be restored on the next boot, keeping the running root as "
+        "`%s`\n", snapshot, name);
+  }
+
+CLEANUP:
+  group_free(&group);
+  free(journal_path);
+  free(state_path);
+  free(backup);
+  free(snapshot);
+  free(snapshots);
+  unmount_toplevel(root_subvol_dir);
+  return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int cmd_config(int argc, char **argv) {
+  const bool compile = !strcmp(argv[0], "compile");
+  if (!compile && strcmp(argv[0], "check")) {
+    eprintf("btrroll: expected check or compile, not `%s`\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // The blob is meant for the initrd, so there's no default place for it
+  const char *path = argc > (compile ? 2 : 1) ? argv[1] : CONFIG_PATH;
+  const char *dest = compile ? argv[argc - 1] : NULL;
+  if (compile && argc < 2) {
+    eprintf("usage: btrroll config compile [<config>] <blob>\n");
+    return EXIT_FAILURE;
+  }
+
+  char tmp_path[] = "/tmp/btrroll-config.XXXXXX";
+  if (!compile) {
+    // Checking is compiling without keeping the result
+    const int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+      perror("mkstemp");
+      return EXIT_FAILURE;
+    }
+    close(fd);
+    dest = tmp_path;
+  }
+
+  const int err = config_compile(path, dest);
+  if (!compile)
+    remove(tmp_path);
+  if (err) {
+    eprintf("btrroll: %s is not a valid configuration\n", path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static const command_t COMMANDS[] = {
+  { "manifest", "<snapshot>...",
+    "Record the boot-critical files of each snapshot for later checks", 1, cmd_manifest },
+  { "check", "<snapshot>...",
+    "Check each snapshot against its manifest", 1, cmd_check },
+  { "confirm", "",
+    "Mark the running boot as successful (see btrroll-confirm.service)", 0, cmd_confirm },
+  { "prune", "[-n] <policy>...",
+    "Delete snapshots not kept by a policy, e.g. `keep-last=10 daily=7 min-free=20G`",
+    1, cmd_prune },
+  { "schedule", "boot|restore <snapshot> [--entry <id>] [--esp <path>] [--no-verify] [-f]",
+    "Get a snapshot ready to boot or restore on the next boot; `schedule cancel` undoes it",
+    1, cmd_schedule },
+  { "config", "check|compile [<config>] [<blob>]",
+    "Check the config file, or compile it into the blob the initrd reads", 1, cmd_config },
+};
+
+static void usage(FILE *fp) {
+  fprintf(fp, "usage: btrroll [<command> [<args>]]\n\n"
+      "With no command, run the interactive console (from within the initrd).\n\n"
+      "Commands:\n");
+  for (size_t i = 0; i < lenof(COMMANDS); ++i)
+    fprintf(fp, "  %-10s %-16s %s\n", COMMANDS[i].name, COMMANDS[i].args, COMMANDS[i].help);
+}
+
+int cli_main(int argc, char **argv) {
+  if (argc < 2)
+    return EXIT_FAILURE;
+
+  if (!strcmp(argv[1], "help") || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+    usage(stdout);
+    return EXIT_SUCCESS;
+  }
+
+  for (size_t i = 0; i < lenof(COMMANDS); ++i) {
+    if (strcmp(argv[1], COMMANDS[i].name))
+      continue;
+
+    if (argc - 2 < COMMANDS[i].min_args) {
+      eprintf("usage: btrroll %s %s\n", COMMANDS[i].name, COMMANDS[i].args);
+      return EXIT_FAILURE;
+    }
+    return COMMANDS[i].fn(argc - 2, argv + 2);
+  }
+
+  eprintf("btrroll: unknown command `%s`\n\n", argv[1]);
+  usage(stderr);
+  return EXIT_FAILURE;
+}
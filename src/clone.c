@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <clone.h>
+#include <macros.h>
+#include <path.h>
+#include <workers.h>
+
+#define STAGING_SUFFIX ".btrroll-new"
+
+typedef struct clone_dir {
+  struct clone_ctx *ctx;
+  char *src, *dest;
+  struct stat sb;
+  struct clone_dir *next;
+} clone_dir_t;
+
+typedef struct clone_ctx {
+  workers_t *workers;
+  atomic_int failures;
+
+  // Directories whose metadata is applied once everything below them exists
+  pthread_mutex_t lock;
+  clone_dir_t *dirs;
+} clone_ctx_t;
+
+int clone_file_data(int in_fd, int out_fd, off_t len) {
+  // Share the extents outright if possible
+  if (!ioctl(out_fd, FICLONE, in_fd))
+    return 0;
+  if (errno != EXDEV && errno != EOPNOTSUPP && errno != EINVAL && errno != ENOTTY) {
+    perror("ioctl");
+    return -1;
+  }
+
+  // Let the kernel do the copy (and possibly still reflink, e.g. over NFS)
+  while (len > 0) {
+    ssize_t n = copy_file_range(in_fd, NULL, out_fd, NULL, len, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+        break;
+      perror("copy_file_range");
+      return -1;
+    }
+    if (n == 0)
+      return 0; // the file shrank underneath us
+    len -= n;
+  }
+
+  // Last resort: copy through userspace
+  char buf[0x10000];
+  while (len > 0) {
+    ssize_t n = read(in_fd, buf, sizeof(buf));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("read");
+      return -1;
+    }
+    if (n == 0)
+      break;
+    for (ssize_t done = 0; done < n;) {
+      ssize_t m = write(out_fd, buf + done, n - done);
+      if (m < 0) {
+        if (errno == EINTR)
+          continue;
+        perror("write");
+        return -1;
+      }
+      done += m;
+    }
+    len -= n;
+  }
+
+  return 0;
+}
+
+// Copy all extended attributes (ACLs, capabilities, SELinux labels, ...)
+static int copy_xattrs(int src_fd, int dest_fd) {
+  char names[0x10000];
+  ssize_t names_len = flistxattr(src_fd, names, sizeof(names));
+  if (names_len < 0)
+    return errno == ENOTSUP ? 0 : -1;
+
+  char value[0x10000];
+  for (char *name = names; name < names + names_len; name += strlen(name) + 1) {
+    ssize_t value_len = fgetxattr(src_fd, name, value, sizeof(value));
+    if (value_len < 0 || fsetxattr(dest_fd, name, value, value_len, 0))
+      return -1;
+  }
+
+  return 0;
+}
+
+// Apply ownership, permissions, xattrs and timestamps from `sb` to `fd`
+static int copy_metadata(int src_fd, int dest_fd, const struct stat *sb) {
+  // Permissions go after ownership, since chown clears setuid/setgid bits
+  if (fchown(dest_fd, sb->st_uid, sb->st_gid) ||
+      fchmod(dest_fd, sb->st_mode & 07777) ||
+      copy_xattrs(src_fd, dest_fd))
+    return -1;
+
+  const struct timespec times[] = { sb->st_atim, sb->st_mtim };
+  return futimens(dest_fd, times);
+}
+
+static int clone_regular(const char *src, const char *dest, const struct stat *sb) {
+  CLEANUP_DECLARE(ret);
+
+  int in_fd = -1, out_fd = -1;
+  if ((in_fd = open(src, O_RDONLY | O_CLOEXEC)) < 0 ||
+      (out_fd = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0)
+  {
+    eprintf("error: %s: %s\n", in_fd < 0 ? src : dest, strerror(errno));
+    FAIL(ret);
+  }
+
+  if (clone_file_data(in_fd, out_fd, sb->st_size) ||
+      copy_metadata(in_fd, out_fd, sb))
+  {
+    eprintf("error: %s: %s\n", dest, strerror(errno));
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (in_fd >= 0)
+    close(in_fd);
+  if (out_fd >= 0 && close(out_fd))
+    perror("close");
+  return ret;
+}
+
+static int clone_symlink(const char *src, const char *dest, const struct stat *sb) {
+  char target[PATH_MAX];
+  ssize_t len = readlink(src, target, sizeof(target) - 1);
+  if (len < 0) {
+    perror("readlink");
+    return -1;
+  }
+  target[len] = '\0';
+
+  const struct timespec times[] = { sb->st_atim, sb->st_mtim };
+  if (symlink(target, dest) ||
+      lchown(dest, sb->st_uid, sb->st_gid) ||
+      utimensat(AT_FDCWD, dest, times, AT_SYMLINK_NOFOLLOW))
+  {
+    eprintf("error: %s: %s\n", dest, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+// Devices, FIFOs and sockets
+static int clone_special(const char *src, const char *dest, const struct stat *sb) {
+  const struct timespec times[] = { sb->st_atim, sb->st_mtim };
+  if (mknod(dest, sb->st_mode, sb->st_rdev) ||
+      lchown(dest, sb->st_uid, sb->st_gid) ||
+      chmod(dest, sb->st_mode & 07777) ||
+      utimensat(AT_FDCWD, dest, times, AT_SYMLINK_NOFOLLOW))
+  {
+    eprintf("error: %s: %s\n", dest, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static void clone_dir_free(clone_dir_t *dir) {
+  free(dir->src);
+  free(dir->dest);
+  free(dir);
+}
+
+static int clone_dir_submit(clone_ctx_t *ctx, char *src, char *dest, const struct stat *sb);
+
+// Worker job: clone the contents of a single directory
+static void clone_dir_contents(void *arg) {
+  clone_dir_t * const dir = arg;
+  clone_ctx_t * const ctx = dir->ctx;
+
+  DIR * const dp = opendir(dir->src);
+  if (!dp) {
+    eprintf("error: %s: %s\n", dir->src, strerror(errno));
+    atomic_fetch_add(&ctx->failures, 1);
+    return;
+  }
+
+  struct dirent *ep;
+  while ((ep = readdir(dp))) {
+    if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
+      continue;
+
+    char *src = pathcat(dir->src, ep->d_name);
+    char *dest = pathcat(dir->dest, ep->d_name);
+    struct stat sb;
+    int err;
+
+    if (!src || !dest || fstatat(dirfd(dp), ep->d_name, &sb, AT_SYMLINK_NOFOLLOW))
+      err = -1;
+    else if (S_ISDIR(sb.st_mode)) {
+      // Ownership of the paths passes to the subdirectory's own job
+      err = clone_dir_submit(ctx, src, dest, &sb);
+      if (!err)
+        continue;
+    }
+    else if (S_ISREG(sb.st_mode))
+      err = clone_regular(src, dest, &sb);
+    else if (S_ISLNK(sb.st_mode))
+      err = clone_symlink(src, dest, &sb);
+    else
+      err = clone_special(src, dest, &sb);
+
+    if (err)
+      atomic_fetch_add(&ctx->failures, 1);
+    free(src);
+    free(dest);
+  }
+
+  if (closedir(dp))
+    perror("closedir");
+}
+
+static int clone_dir_submit(clone_ctx_t *ctx, char *src, char *dest, const struct stat *sb) {
+  // Stay private until the final permissions are applied at the end
+  if (mkdir(dest, 0700)) {
+    eprintf("error: %s: %s\n", dest, strerror(errno));
+    return -1;
+  }
+
+  clone_dir_t * const dir = malloc(sizeof(clone_dir_t));
+  if (!dir)
+    return -1;
+  *dir = (clone_dir_t) { ctx, src, dest, *sb, NULL };
+
+  pthread_mutex_lock(&ctx->lock);
+  dir->next = ctx->dirs;
+  ctx->dirs = dir;
+  pthread_mutex_unlock(&ctx->lock);
+
+  // Do the work in this thread if it cannot be queued
+  if (workers_submit(ctx->workers, clone_dir_contents, dir))
+    clone_dir_contents(dir);
+  return 0;
+}
+
+int clone_tree(const char *src, const char *dest) {
+  if (!src || !dest) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct stat sb;
+  if (lstat(src, &sb)) {
+    perror("lstat");
+    return -1;
+  }
+
+  if (S_ISREG(sb.st_mode))
+    return clone_regular(src, dest, &sb);
+  if (S_ISLNK(sb.st_mode))
+    return clone_symlink(src, dest, &sb);
+  if (!S_ISDIR(sb.st_mode))
+    return clone_special(src, dest, &sb);
+
+  clone_ctx_t ctx = { .failures = 0, .dirs = NULL };
+  pthread_mutex_init(&ctx.lock, NULL);
+  if (!(ctx.workers = workers_create(0))) {
+    pthread_mutex_destroy(&ctx.lock);
+    return -1;
+  }
+
+  char *root_src = strdup(src), *root_dest = strdup(dest);
+  if (!root_src || !root_dest || clone_dir_submit(&ctx, root_src, root_dest, &sb)) {
+    free(root_src);
+    free(root_dest);
+    atomic_fetch_add(&ctx.failures, 1);
+  }
+
+  workers_wait(ctx.workers);
+  workers_destroy(ctx.workers);
+
+  // Only now that nothing more will be written below them can the
+  // directories get their final permissions and timestamps.
+  for (clone_dir_t *dir = ctx.dirs, *next; dir; dir = next) {
+    next = dir->next;
+
+    int src_fd = open(dir->src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int dest_fd = open(dir->dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (src_fd < 0 || dest_fd < 0 || copy_metadata(src_fd, dest_fd, &dir->sb)) {
+      eprintf("error: %s: %s\n", dir->dest, strerror(errno));
+      atomic_fetch_add(&ctx.failures, 1);
+    }
+    if (src_fd >= 0)
+      close(src_fd);
+    if (dest_fd >= 0)
+      close(dest_fd);
+
+    clone_dir_free(dir);
+  }
+
+  pthread_mutex_destroy(&ctx.lock);
+
+  if (ctx.failures) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/* Open the directory `path` inside `root_fd` without leaving it. Symlinks are
+ * resolved as if `root_fd` were the root directory; before Linux 5.6, which
+ * can't do that, they are refused instead.
+ */
+static int open_dir_in_root(int root_fd, const char *path) {
+  struct open_how how = {
+    .flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+    .resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS,
+  };
+  int fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+  if (fd >= 0 || errno != ENOSYS)
+    return fd;
+
+  char *copy = strdup(path), *save = NULL;
+  if (!copy)
+    return -1;
+  fd = dup(root_fd);
+  for (char *part = strtok_r(copy, "/", &save); part && fd >= 0;
+      part = strtok_r(NULL, "/", &save))
+  {
+    const int next = openat(fd, part, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    close(fd);
+    fd = next;
+  }
+  free(copy);
+  return fd;
+}
+
+/* Find where `path` really is inside the tree at `root`, following symlinks
+ * in its parent directories within the tree (e.g. `/lib -> usr/lib` on one
+ * side, but not `/var/run -> /run` out into the initrd). The last component is
+ * left as it is, since it is what gets replaced.
+ */
+static char *resolve_in_root(const char *root, const char *path) {
+  char *parent = strdup(path), *real = NULL, *resolved = NULL;
+  int root_fd = -1, fd = -1;
+  if (!parent)
+    return NULL;
+
+  // Split off the last component, ignoring any trailing slashes
+  size_t len = strlen(parent);
+  while (len > 1 && parent[len - 1] == '/')
+    parent[--len] = '\0';
+  char * const slash = strrchr(parent, '/');
+  const char * const name = slash ? slash + 1 : parent;
+  if (slash)
+    *slash = '\0';
+  if (!*name || !strcmp(name, ".") || !strcmp(name, "..")) {
+    errno = EINVAL;
+    goto CLEANUP;
+  }
+
+  if ((root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+      (fd = open_dir_in_root(root_fd, slash && *parent ? parent : ".")) < 0)
+    goto CLEANUP;
+
+  char link[0x20];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  if (!(real = malloc(PATH_MAX)))
+    goto CLEANUP;
+  const ssize_t real_len = readlink(link, real, PATH_MAX - 1);
+  if (real_len < 0)
+    goto CLEANUP;
+  real[real_len] = '\0';
+
+  resolved = pathcat(real, name);
+
+CLEANUP:
+  if (fd >= 0)
+    close(fd);
+  if (root_fd >= 0)
+    close(root_fd);
+  free(real);
+  free(parent);
+  return resolved;
+}
+
+int restore_path(const char *src_root, const char *dest_root, const char *path) {
+  CLEANUP_DECLARE(ret);
+
+  char *src = resolve_in_root(src_root, path);
+  char *dest = resolve_in_root(dest_root, path);
+  char *staging = dest ? malloc(strlen(dest) + sizeof(STAGING_SUFFIX)) : NULL;
+  if (!src || !dest) {
+    eprintf("error: %s: %s\n", path, strerror(errno));
+    FAIL(ret);
+  }
+  if (!staging) {
+    perror("malloc");
+    FAIL(ret);
+  }
+  sprintf(staging, "%s" STAGING_SUFFIX, dest);
+
+  // Clear out the leftovers of any interrupted restore
+  struct stat sb;
+  if (!lstat(staging, &sb) && remove_tree(staging)) {
+    perror("remove_tree");
+    FAIL(ret);
+  }
+
+  if (clone_tree(src, staging)) {
+    perror("clone_tree");
+    remove_tree(staging);
+    FAIL(ret);
+  }
+
+  if (lstat(dest, &sb)) {
+    // Nothing to replace; just move the clone into place
+    if (errno != ENOENT || rename(staging, dest)) {
+      perror("rename");
+      FAIL(ret);
+    }
+  } else {
+    // Atomically swap the clone and the original, then discard the original
+    if (renameat2(AT_FDCWD, staging, AT_FDCWD, dest, RENAME_EXCHANGE)) {
+      perror("renameat2");
+      FAIL(ret);
+    }
+    if (remove_tree(staging))
+      perror("remove_tree");
+  }
+
+CLEANUP:
+  free(staging);
+  free(dest);
+  free(src);
+  return ret;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  if (remove(path)) {
+    eprintf("error: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int remove_tree(const char *path) {
+  return nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
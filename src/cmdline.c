@@ -1,100 +1,170 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <cmdline.h>
+#include <macros.h>
 
 #define CMDLINE_PATH "/proc/cmdline"
 
-// Read the contents of the kernel command line into the given buffer
-int cmdline_read(
-    char * const buf,
-    const size_t len)
-{
-  if (!buf || !len) {
-    errno = EINVAL;
-    return -1;
-  }
+typedef enum option_type {
+  OPTION_STRING,
+  OPTION_ULONG,
+} option_type_t;
+
+static const struct {
+  const char *key;
+  option_type_t type;
+} OPTIONS[CMDLINE_OPTIONS_LEN] = {
+  [CMDLINE_ROOT] = { "root", OPTION_STRING },
+  [CMDLINE_ROOTFLAGS] = { "rootflags", OPTION_STRING },
+  [CMDLINE_BTRROLL_ACTION] = { "btrroll.action", OPTION_STRING },
+  [CMDLINE_BTRROLL_CONSOLE] = { "btrroll.console", OPTION_STRING },
+  [CMDLINE_BTRROLL_ENTRY] = { "btrroll.entry", OPTION_STRING },
+  [CMDLINE_BTRROLL_ESP] = { "btrroll.esp", OPTION_STRING },
+  [CMDLINE_BTRROLL_KNOWN_GOOD] = { "btrroll.known_good", OPTION_ULONG },
+  [CMDLINE_BTRROLL_ROOT] = { "btrroll.root", OPTION_STRING },
+  [CMDLINE_BTRROLL_TIMEOUT] = { "btrroll.timeout", OPTION_ULONG },
+  [CMDLINE_BTRROLL_TRACE] = { "btrroll.trace", OPTION_STRING },
+  [CMDLINE_BTRROLL_TRIES] = { "btrroll.tries", OPTION_ULONG },
+};
+
+static cmdline_t kernel;
+static bool kernel_parsed = false;
+
+static bool is_ulong(const char *value) {
+  if (!value[0])
+    return false;
+  for (const char *p = value; *p; ++p)
+    if (*p < '0' || *p > '9')
+      return false;
+  return true;
+}
 
-  FILE * const fp = fopen(CMDLINE_PATH, "rb");
-  if (!fp) {
-    perror("fopen");
-    return -1;
+// Record the pair `key`(=`value`) if it's one of the known options
+static void set_option(cmdline_t *cmdline, const char *key, const char *value) {
+  if (!strncmp(key, "rd.btrroll.", 11))
+    key += 3;
+
+  for (size_t i = 0; i < lenof(OPTIONS); ++i) {
+    if (strcmp(key, OPTIONS[i].key))
+      continue;
+
+    if (OPTIONS[i].type == OPTION_ULONG && !is_ulong(value)) {
+      eprintf("warning: ignoring %s=%s; expected a number\n", key, value);
+      return;
+    }
+    cmdline->values[i] = value;
+    return;
   }
-  
-  if (!fgets(buf, len, fp)) {
-    perror("fgets");
+
+  if (!strncmp(key, "btrroll.", 8))
+    eprintf("warning: unknown option `%s`\n", key);
+}
+
+int cmdline_parse(cmdline_t *cmdline, const char *str) {
+  memset(cmdline, 0, sizeof(cmdline_t));
+
+  // Every key and value is copied out, unquoted and terminated, in one pass;
+  // the result is never longer than the input
+  if (!(cmdline->buf = malloc(strlen(str) + 2))) {
+    perror("malloc");
     return -1;
   }
 
-  // Remove the trailing newline
-  const size_t n = strlen(buf);
-  if (buf[n-1] == '\n')
-    buf[n-1] = '\0';
+  const char *p = str;
+  char *out = cmdline->buf;
+  while (true) {
+    while (*p == ' ' || *p == '\t' || *p == '\n')
+      ++p;
+    if (!*p)
+      break;
+
+    char * const key = out;
+    char *value = NULL;
+    bool quoted = false;
+    for (; *p && (quoted || (*p != ' ' && *p != '\t' && *p != '\n')); ++p) {
+      if (*p == '"')
+        quoted = !quoted;
+      else if (*p == '=' && !value) {
+        *out++ = '\0';
+        value = out;
+      } else
+        *out++ = *p;
+    }
+    *out++ = '\0';
+
+    // Everything after `--` is for init
+    if (!value && !strcmp(key, "--"))
+      break;
+    set_option(cmdline, key, value ? value : "");
+  }
 
   return 0;
 }
 
-// Look up a value by key in the kernel cmdline, with pairs separated by delim
-char *cmdline_find_delim(
-    char * const cmdline,
-    const char * const key,
-    char * const buf,
-    const size_t len,
-    char delim)
-{
-  if (!cmdline || !key || !buf || len == 0 || delim == '\0') {
-    errno = EINVAL;
+void cmdline_free(cmdline_t *cmdline) {
+  free(cmdline->buf);
+  memset(cmdline, 0, sizeof(cmdline_t));
+}
+
+// Read all of /proc/cmdline into a new string
+static char *read_cmdline(void) {
+  const int fd = open(CMDLINE_PATH, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open");
     return NULL;
   }
-  errno = 0;
-
-  const char delim_arr[] = { delim };
-  const size_t cmdline_len = strlen(cmdline);
-
-  const size_t key_len = strlen(key);
-  char *token = strtok(cmdline, delim_arr);
-  char *found = NULL;
-
-  do {
-    // If this token starts with the key we're looking for...
-    if (!strncmp(token, key, key_len)) {
-      char *value = token + key_len;
-      const char next = *value++;
-
-      // The key matches, but there is no associated value
-      if (next == delim || next == '\n' || next == '\0') {
-        buf[0] = '\0';
-        found = token;
-      }
-
-      // The key matches, and there is a value
-      else if (next == '=') {
-        // Copy the value into the output buffer and ensure that it terminates
-        strncpy(buf, value, len);
-        buf[len-1] = '\0';
-
-        // Restore the cmdline string by replacing the strtok-inserted null
-        // byte (if present) with the original delimiter character
-        const size_t value_len = strlen(value);
-        if (value - cmdline + value_len != cmdline_len)
-          value[value_len] = delim;
-
-        found = token;
-      }
-
-      // The key is only a prefix of the token, not a real match. Skip it.
-      else
-        continue;
+
+  size_t len = 0, cap = 0x1000;
+  char *buf = malloc(cap);
+  while (buf) {
+    const ssize_t count = read(fd, buf + len, cap - len - 1);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count < 0) {
+      perror("read");
+      free(buf);
+      buf = NULL;
+      break;
+    }
+    if (count == 0)
+      break;
+
+    len += count;
+    if (len == cap - 1) {
+      char * const tmp = realloc(buf, cap *= 2);
+      if (!tmp)
+        free(buf);
+      buf = tmp;
     }
+  }
+  close(fd);
 
-    // Patch the original delimeter character back into the cmdline string
-    if (token > cmdline)
-      *(token-1) = delim;
-    if (found)
-      return found;
-  } while ((token = strtok(NULL, delim_arr)));
+  if (!buf)
+    return NULL;
+  buf[len] = '\0';
+  return buf;
+}
+
+const cmdline_t *cmdline_kernel(void) {
+  if (!kernel_parsed) {
+    char * const str = read_cmdline();
+    if (!str || cmdline_parse(&kernel, str))
+      memset(&kernel, 0, sizeof(cmdline_t));
+    free(str);
+    kernel_parsed = true;
+  }
+  return &kernel;
+}
 
-  return NULL;
+unsigned long cmdline_get_ulong(
+    const cmdline_t *cmdline, cmdline_option_t option, unsigned long def)
+{
+  const char * const value = cmdline->values[option];
+  return value ? strtoul(value, NULL, 10) : def;
 }
@@ -0,0 +1,270 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmdline.h>
+#include <config.h>
+#include <constants.h>
+#include <macros.h>
+
+static config_t loaded;
+static config_t *current = NULL;
+
+static void config_defaults(config_t *config) {
+  memset(config, 0, sizeof(config_t));
+  memcpy(config->magic, CONFIG_MAGIC, sizeof(config->magic));
+  config->size = sizeof(config_t);
+  config->timeout = TIMEOUT_DEFAULT;
+  strcpy(config->root, BTRFS_MOUNTPOINT);
+  strcpy(config->esp, ESP_MOUNTPOINT);
+}
+
+// Strip leading and trailing whitespace in place
+static char *trim(char *s) {
+  while (isspace(*s))
+    ++s;
+  char *end = s + strlen(s);
+  while (end > s && isspace(end[-1]))
+    *--end = '\0';
+  return s;
+}
+
+static const char *parse_group(config_t *config, char *value) {
+  char *saveptr = NULL;
+  for (char *member = strtok_r(value, " \t", &saveptr); member;
+      member = strtok_r(NULL, " \t", &saveptr))
+  {
+    if (config->group_len == CONFIG_GROUP_MAX)
+      return "too many group members";
+    // Paths are relative to the top-level subvolume either way
+    while (*member == '/')
+      ++member;
+    if (!*member)
+      continue;
+    if (strlen(member) >= CONFIG_VALUE_MAX)
+      return "group member too long";
+    strncpy(config->group[config->group_len++], member, CONFIG_VALUE_MAX);
+  }
+  return NULL;
+}
+
+static const char *parse_path(char *dest, const char *value) {
+  if (value[0] != '/')
+    return "expected an absolute path";
+  if (strlen(value) >= CONFIG_VALUE_MAX)
+    return "path too long";
+  strncpy(dest, value, CONFIG_VALUE_MAX);
+  return NULL;
+}
+
+// Set a single value. Returns what is wrong with it, or NULL if nothing.
+static const char *set_value(config_t *config, const char *key, char *value) {
+  if (!strcmp(key, "timeout")) {
+    char *end;
+    errno = 0;
+    const unsigned long timeout = strtoul(value, &end, 10);
+    if (!isdigit(value[0]) || *end || errno || timeout > UINT32_MAX)
+      return "expected a number of seconds";
+    config->timeout = timeout;
+    return NULL;
+  }
+  if (!strcmp(key, "root"))
+    return parse_path(config->root, value);
+  if (!strcmp(key, "esp"))
+    return parse_path(config->esp, value);
+  if (!strcmp(key, "group"))
+    return parse_group(config, value);
+  return "unknown key";
+}
+
+/* Parse the file into `config`. Lines with problems are skipped, unless
+ * `strict`, in which case they fail the whole file once it has been read.
+ */
+static int parse_file(const char *path, config_t *config, bool strict) {
+  config_defaults(config);
+
+  FILE * const fp = fopen(path, "r");
+  if (!fp)
+    return errno == ENOENT ? 0 : -1;
+
+  int ret = 0;
+  char line[0x400];
+  for (size_t n = 1; fgets(line, sizeof(line), fp); ++n) {
+    line[strcspn(line, "#")] = '\0';
+    char *key = trim(line);
+    if (!*key)
+      continue;
+
+    const char *problem = "expected `key = value`";
+    char *value = strchr(key, '=');
+    if (value) {
+      *value++ = '\0';
+      key = trim(key);
+      problem = set_value(config, key, trim(value));
+    }
+
+    if (problem) {
+      eprintf("%s: %s:%zu: %s\n", strict ? "error" : "warning", path, n, problem);
+      ret = -1;
+    }
+  }
+
+  if (fclose(fp))
+    perror("fclose");
+
+  if (ret && strict) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+int config_load(const char *path, config_t *config) {
+  return parse_file(path, config, false);
+}
+
+void config_free(config_t *config) {
+  config_defaults(config);
+}
+
+int config_compile(const char *path, const char *dest) {
+  CLEANUP_DECLARE(ret);
+
+  config_t config;
+  char *tmp_path = malloc(strlen(dest) + 5);
+  FILE *fp = NULL;
+  if (!tmp_path) {
+    perror("malloc");
+    FAIL(ret);
+  }
+  sprintf(tmp_path, "%s.tmp", dest);
+
+  if (access(path, F_OK)) {
+    perror(path);
+    FAIL(ret);
+  }
+  if (parse_file(path, &config, true)) {
+    FAIL(ret);
+  }
+
+  if (!(fp = fopen(tmp_path, "w"))) {
+    perror("fopen");
+    FAIL(ret);
+  }
+  if (fwrite(&config, sizeof(config), 1, fp) != 1 || fflush(fp) || fsync(fileno(fp))) {
+    perror("fwrite");
+    FAIL(ret);
+  }
+  if (fclose(fp)) {
+    fp = NULL;
+    perror("fclose");
+    FAIL(ret);
+  }
+  fp = NULL;
+
+  if (rename(tmp_path, dest)) {
+    perror("rename");
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (fp) {
+    fclose(fp);
+    remove(tmp_path);
+  }
+  free(tmp_path);
+  return ret;
+}
+
+// Whether a mapped blob was written by this build, and is safe to use as is
+static bool blob_valid(const config_t *config) {
+  if (memcmp(config->magic, CONFIG_MAGIC, sizeof(config->magic)) ||
+      config->size != sizeof(config_t) ||
+      config->group_len > CONFIG_GROUP_MAX ||
+      !memchr(config->root, '\0', sizeof(config->root)) ||
+      !memchr(config->esp, '\0', sizeof(config->esp)))
+    return false;
+
+  for (size_t i = 0; i < config->group_len; ++i)
+    if (!memchr(config->group[i], '\0', sizeof(config->group[i])))
+      return false;
+  return true;
+}
+
+static config_t *map_blob(const char *path) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT)
+      perror("open");
+    return NULL;
+  }
+
+  config_t *config = NULL;
+  struct stat sb;
+  if (fstat(fd, &sb)) {
+    perror("fstat");
+  } else if (sb.st_size == sizeof(config_t)) {
+    // Private, so that command line overrides can be written over it
+    void * const p = mmap(NULL, sizeof(config_t),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+      perror("mmap");
+    else
+      config = p;
+  }
+  close(fd);
+
+  if (config && !blob_valid(config)) {
+    munmap(config, sizeof(config_t));
+    config = NULL;
+  }
+  if (!config)
+    eprintf("warning: ignoring %s, which this btrroll can't use\n", path);
+  return config;
+}
+
+// Let `btrroll.<key>=` on the kernel command line override single values
+static void apply_overrides(config_t *config) {
+  static const struct {
+    const char *key;
+    cmdline_option_t option;
+  } OVERRIDES[] = {
+    { "timeout", CMDLINE_BTRROLL_TIMEOUT },
+    { "root", CMDLINE_BTRROLL_ROOT },
+    { "esp", CMDLINE_BTRROLL_ESP },
+  };
+
+  const cmdline_t * const cmdline = cmdline_kernel();
+  for (size_t i = 0; i < lenof(OVERRIDES); ++i) {
+    const char * const value = cmdline_get(cmdline, OVERRIDES[i].option);
+    if (!value)
+      continue;
+
+    char buf[CONFIG_VALUE_MAX];
+    snprintf(buf, sizeof(buf), "%s", value);
+    const char * const problem = set_value(config, OVERRIDES[i].key, buf);
+    if (problem)
+      eprintf("warning: btrroll.%s: %s\n", OVERRIDES[i].key, problem);
+  }
+}
+
+const config_t *config_get(void) {
+  if (!current) {
+    if (!(current = map_blob(CONFIG_BLOB_PATH))) {
+      if (config_load(CONFIG_PATH, &loaded)) {
+        perror("config_load");
+        config_defaults(&loaded);
+      }
+      current = &loaded;
+    }
+    apply_overrides(current);
+  }
+  return current;
+}
@@ -1,12 +1,17 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <dialog.h>
 #include <macros.h>
 #include <run.h>
+#include <serial.h>
 
 #define BACKTITLE "btrroll 1.0.0"
 
@@ -99,6 +104,66 @@ int check_ret(int ret) {
   return ret;
 }
 
+/* Widgets and their arguments (menu items above all) are passed to dialog in a
+ * file read with `--file`, rather than on the command line, which would limit
+ * how long a list can be. The file is a memfd, inherited by dialog and reused
+ * for every widget; dialog opens it afresh through /proc/self/fd.
+ */
+static FILE *args_begin(dialog_t * const dialog) {
+  if (!dialog->args_file) {
+    const int fd = memfd_create("btrroll-dialog", 0);
+    if (fd < 0) {
+      perror("memfd_create");
+      return NULL;
+    }
+    if (!(dialog->args_file = fdopen(fd, "w"))) {
+      perror("fdopen");
+      close(fd);
+      return NULL;
+    }
+    snprintf(dialog->args_path, sizeof(dialog->args_path), "/proc/self/fd/%d", fd);
+  }
+
+  rewind(dialog->args_file);
+  if (ftruncate(fileno(dialog->args_file), 0)) {
+    perror("ftruncate");
+    return NULL;
+  }
+  return dialog->args_file;
+}
+
+// Write an argument, quoted as dialog expects
+static void args_write(FILE *fp, const char *arg) {
+  putc_unlocked('"', fp);
+  for (const char *p = arg; *p; ++p) {
+    if (*p == '"' || *p == '\\')
+      putc_unlocked('\\', fp);
+    putc_unlocked(*p, fp);
+  }
+  fputs_unlocked("\"\n", fp);
+}
+
+// Returns the path to pass to `--file`, or NULL on error
+static const char *args_end(dialog_t * const dialog) {
+  if (fflush(dialog->args_file)) {
+    perror("fflush");
+    return NULL;
+  }
+  return dialog->args_path;
+}
+
+// Write the arguments of a widget to the args file, returning its path
+static const char *args_widget(
+    dialog_t * const dialog, const char * const *widget, size_t widget_len)
+{
+  FILE * const fp = args_begin(dialog);
+  if (!fp)
+    return NULL;
+  for (size_t i = 0; i < widget_len; ++i)
+    args_write(fp, widget[i]);
+  return args_end(dialog);
+}
+
 void dialog_init(dialog_t * const dialog) {
   /*
    * dialog allows its return values to be changed by env vars (!?)
@@ -112,6 +177,8 @@ void dialog_init(dialog_t * const dialog) {
   dialog_statuses.item_help = get_status_code(DIALOG_ITEM_HELP);
   dialog_statuses.ok = get_status_code(DIALOG_OK);
 
+  dialog->serial = serial_detect();
+  dialog->args_file = NULL;
   dialog_reset(dialog);
 }
 
@@ -125,6 +192,9 @@ void dialog_reset(dialog_t * const dialog) {
 }
 
 void dialog_free(dialog_t * const dialog) {
+  if (dialog->args_file && fclose(dialog->args_file))
+    perror("fclose");
+  dialog->args_file = NULL;
 }
 
 // Choose an item from the given list
@@ -143,17 +213,6 @@ int dialog_choose(
   snprintf(pos_str, sizeof(pos_str), "%zu", (choice ? *choice : 0) + 1);
 
   format_msg(tmp_buf, format);
-  const char * const args_prefix[] = {
-      "dialog",
-      "--backtitle", BACKTITLE,
-      "--title", title,
-      LABEL_ARGS,
-      BUTTON_ARGS,
-      help ? "--item-help" : "--clear",
-      help ? "--help-tags" : "--clear",
-      "--default-item", pos_str,
-      "--menu", tmp_buf, "0", "0", "10"
-  };
 
   // Calculate items_len (if zero) by looking for a NULL item
   if (!items_len)
@@ -162,34 +221,45 @@ int dialog_choose(
   if (!items_len)
     return -EINVAL;
 
-  const int factor = help ? 3 : 2;
-  const size_t args_len = factor*items_len + lenof(args_prefix) + 1;
-  const char **args = malloc(sizeof(char *) * args_len);
+  if (dialog->serial)
+    return serial_choose(dialog, items, help, items_len, choice, title, tmp_buf);
 
-  memcpy(args, args_prefix, sizeof(args_prefix));
+  FILE * const fp = args_begin(dialog);
+  if (!fp)
+    return -1;
 
-  static const size_t tag_len = 8; // TODO
+  const char * const widget[] = { "--menu", tmp_buf, "0", "0", "10" };
+  for (size_t i = 0; i < lenof(widget); ++i)
+    args_write(fp, widget[i]);
   for (size_t i = 0; i < items_len; ++i) {
-    char *tag = malloc(tag_len);
-    snprintf(tag, tag_len, "%zu", i+1);
-
-    args[lenof(args_prefix) + i*factor] = tag;
-    args[lenof(args_prefix) + i*factor + 1] = items[i];
+    fprintf(fp, "%zu\n", i+1);
+    args_write(fp, items[i]);
     if (help)
-      args[lenof(args_prefix) + i*factor + 2] = help[i];
+      args_write(fp, help[i]);
   }
 
-  args[args_len - 1] = NULL;
+  const char * const path = args_end(dialog);
+  if (!path)
+    return -1;
+
+  const char * args[] = {
+      "dialog",
+      "--backtitle", BACKTITLE,
+      "--title", title,
+      LABEL_ARGS,
+      BUTTON_ARGS,
+      help ? "--item-help" : "--clear",
+      help ? "--help-tags" : "--clear",
+      "--default-item", pos_str,
+      "--file", path,
+      NULL
+  };
 
   static const size_t BUF_LEN = 1024;
   char buf[BUF_LEN];
+  memset(buf, 0, BUF_LEN);
 
-  const int ret = run_pipe("dialog", args, NULL, 0, buf, BUF_LEN);
-
-  // Only some elements of `args` are heap-allocated
-  for (size_t i = 0; i < items_len; ++i)
-    free((char*)args[lenof(args_prefix) + i*factor]);
-  free(args);
+  const int ret = run_pipe("dialog", args, NULL, 0, buf, BUF_LEN - 1);
 
   *choice = strtol(buf, NULL, 10) - 1;
   return check_ret(ret);
@@ -209,6 +279,14 @@ int dialog_confirm(
   // The use of --clear here is a hack to avoid dynamic arg allocation
   // It is basically a no-op that can stand in when --defaultno is not needed
   format_msg(tmp_buf, format);
+  if (dialog->serial)
+    return serial_confirm(dialog, default_, title, tmp_buf);
+
+  const char * const widget[] = { "--yesno", tmp_buf, "0", "0" };
+  const char * const path = args_widget(dialog, widget, lenof(widget));
+  if (!path)
+    return -1;
+
   const char * args[] = {
       "dialog",
       "--backtitle", BACKTITLE,
@@ -216,7 +294,7 @@ int dialog_confirm(
       LABEL_ARGS,
       BUTTON_ARGS,
       default_ ? "--clear" : "--defaultno",
-      "--yesno", tmp_buf, "0", "0",
+      "--file", path,
       NULL
   };
 
@@ -234,13 +312,21 @@ int dialog_input(
   }
 
   format_msg(tmp_buf, format);
+  if (dialog->serial)
+    return serial_input(init, out, out_len, title, tmp_buf);
+
+  const char * const widget[] = { "--inputbox", tmp_buf, "0", "0", init ? init : "" };
+  const char * const path = args_widget(dialog, widget, lenof(widget));
+  if (!path)
+    return -1;
+
   const char * args[] = {
       "dialog",
       "--backtitle", BACKTITLE,
       "--title", title,
       LABEL_ARGS,
       BUTTON_ARGS,
-      "--inputbox", tmp_buf, "0", "0", init ? init : "",
+      "--file", path,
       NULL
   };
 
@@ -257,13 +343,21 @@ int dialog_ok(
   }
 
   format_msg(tmp_buf, format);
+  if (dialog->serial)
+    return serial_ok(dialog, title, tmp_buf);
+
+  const char * const widget[] = { "--msgbox", tmp_buf, "0", "0" };
+  const char * const path = args_widget(dialog, widget, lenof(widget));
+  if (!path)
+    return -1;
+
   const char * args[] = {
       "dialog",
       "--backtitle", BACKTITLE,
       "--title", title,
       LABEL_ARGS,
       BUTTON_ARGS,
-      "--msgbox", tmp_buf, "0", "0",
+      "--file", path,
       NULL
   };
 
@@ -281,6 +375,14 @@ int dialog_view_file(
     return -1;
   }
 
+  if (dialog->serial)
+    return serial_view_file(dialog, title, filepath);
+
+  const char * const widget[] = { "--textbox", filepath, "0", "0" };
+  const char * const path = args_widget(dialog, widget, lenof(widget));
+  if (!path)
+    return -1;
+
   const char * args[] = {
       "dialog",
       "--backtitle", BACKTITLE,
@@ -289,13 +391,146 @@ int dialog_view_file(
       BUTTON_ARGS,
       "--tab-correct",
       "--scrollbar",
-      "--textbox", filepath, "0", "0",
+      "--file", path,
       NULL
   };
 
   return check_ret(run("dialog", args));
 }
 
+// Display text as it is produced, e.g. by a long-running search
+int dialog_stream(
+    dialog_t * const dialog,
+    const char * title,
+    dialog_producer_t producer, void *arg)
+{
+  if (!dialog || !title || !producer) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (dialog->serial)
+    return serial_stream(dialog, title, producer, arg);
+
+  const char * const widget[] = { "--programbox", "-1", "-1" };
+  const char * const path = args_widget(dialog, widget, lenof(widget));
+  if (!path)
+    return -1;
+
+  const char * args[] = {
+      "dialog",
+      "--backtitle", BACKTITLE,
+      "--title", title,
+      LABEL_ARGS,
+      BUTTON_ARGS,
+      "--file", path,
+      NULL
+  };
+
+  int fd;
+  pid_t pid = run_spawn("dialog", args, &fd);
+  if (pid < 0)
+    return -1;
+
+  FILE * const fp = fdopen(fd, "w");
+  if (!fp) {
+    perror("fdopen");
+    close(fd);
+    run_wait(pid);
+    return -1;
+  }
+
+  // If dialog goes away early, writes should fail rather than kill btrroll
+  void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+  int err = producer(fp, arg);
+  if (fclose(fp) && errno != EPIPE)
+    perror("fclose");
+  signal(SIGPIPE, sigpipe);
+
+  int ret = run_wait(pid);
+  if (err)
+    return err;
+  return check_ret(ret);
+}
+
+// Show a progress bar, which stays up until dialog_gauge_close
+int dialog_gauge_open(
+    dialog_t * const dialog,
+    dialog_gauge_t * const gauge,
+    const char *title, const char *format, ...)
+{
+  if (!dialog || !gauge || !title || !format) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  format_msg(tmp_buf, format);
+  if (dialog->serial)
+    return serial_gauge_open(gauge, title, tmp_buf);
+
+  const char * const widget[] = { "--gauge", tmp_buf, "0", "0", "0" };
+  const char * const path = args_widget(dialog, widget, lenof(widget));
+  if (!path)
+    return -1;
+
+  const char * args[] = {
+      "dialog",
+      "--backtitle", BACKTITLE,
+      "--title", title,
+      LABEL_ARGS,
+      BUTTON_ARGS,
+      "--file", path,
+      NULL
+  };
+
+  int fd;
+  gauge->serial = false;
+  if ((gauge->pid = run_spawn("dialog", args, &fd)) < 0)
+    return -1;
+
+  if (!(gauge->fp = fdopen(fd, "w"))) {
+    perror("fdopen");
+    close(fd);
+    run_wait(gauge->pid);
+    return -1;
+  }
+
+  // The gauge may be closed from under us, e.g. by Ctrl-C
+  gauge->sigpipe = signal(SIGPIPE, SIG_IGN);
+  return 0;
+}
+
+int dialog_gauge_update(dialog_gauge_t * const gauge, int percent) {
+  if (gauge && gauge->serial)
+    return serial_gauge_update(gauge, percent);
+
+  if (!gauge || !gauge->fp) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (fprintf(gauge->fp, "%d\n", percent) < 0 || fflush(gauge->fp))
+    return -1;
+  return 0;
+}
+
+int dialog_gauge_close(dialog_gauge_t * const gauge) {
+  if (gauge && gauge->serial)
+    return serial_gauge_close(gauge);
+
+  if (!gauge || !gauge->fp) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (fclose(gauge->fp) && errno != EPIPE)
+    perror("fclose");
+  gauge->fp = NULL;
+  signal(SIGPIPE, gauge->sigpipe);
+
+  return check_ret(run_wait(gauge->pid));
+}
+
 // Clear the screen
 int dialog_clear(dialog_t * const dialog) {
   if (!dialog) {
@@ -303,6 +538,10 @@ int dialog_clear(dialog_t * const dialog) {
     return -1;
   }
 
+  // Nothing on a serial console is worth the bytes it takes to clear
+  if (dialog->serial)
+    return 0;
+
   static const char * args[] = {
       "dialog",
       "--clear",
@@ -0,0 +1,626 @@
+#include <btrfsutil.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <boot.h>
+#include <config.h>
+#include <constants.h>
+#include <group.h>
+#include <macros.h>
+#include <path.h>
+#include <snaplist.h>
+#include <snapshot.h>
+#include <subvol.h>
+#include <workers.h>
+
+static char *with_suffix(const char *path) {
+  char *tmp = malloc(strlen(path) + strlen(SUBVOL_DIR_SUFFIX) + 1);
+  if (tmp)
+    sprintf(tmp, "%s" SUBVOL_DIR_SUFFIX, path);
+  return tmp;
+}
+
+static int member_init(group_member_t *member, const char *toplevel, const char *rel) {
+  member->subvol = pathcat(toplevel, rel);
+  member->dir = member->subvol ? with_suffix(member->subvol) : NULL;
+  member->rel = with_suffix(rel);
+  if (!member->dir || !member->rel) {
+    perror("malloc");
+    return -1;
+  }
+  return 0;
+}
+
+int group_load(group_t *group, const char *root_subvol_dir) {
+  CLEANUP_DECLARE(ret);
+  memset(group, 0, sizeof(group_t));
+
+  char *current = pathcat(root_subvol_dir, SUBVOL_CUR_NAME);
+  char *toplevel = current ? get_toplevel_path(current) : NULL;
+  char *real = realpath(root_subvol_dir, NULL);
+  if (!toplevel || !real) {
+    perror("get_toplevel_path");
+    FAIL(ret);
+  }
+
+  // Work out the root's own path within the filesystem, without the `.d`
+  const size_t top_len = strlen(toplevel), real_len = strlen(real);
+  const size_t suffix_len = strlen(SUBVOL_DIR_SUFFIX);
+  if (strncmp(real, toplevel, top_len) || real_len <= top_len + suffix_len ||
+      (real[top_len] != '/' && toplevel[top_len-1] != '/') ||
+      strcmp(real + real_len - suffix_len, SUBVOL_DIR_SUFFIX))
+  {
+    errno = ENOENT;
+    FAIL(ret);
+  }
+  real[real_len - suffix_len] = '\0';
+  const char *root_rel = real + top_len;
+  while (*root_rel == '/')
+    ++root_rel;
+
+  if (member_init(group->members + group->len++, toplevel, root_rel)) {
+    FAIL(ret);
+  }
+
+  const config_t * const config = config_get();
+  for (size_t i = 0; i < config->group_len; ++i) {
+    // The root is always a member, whether or not it is listed
+    if (!strcmp(config->group[i], root_rel))
+      continue;
+    if (member_init(group->members + group->len++, toplevel, config->group[i])) {
+      FAIL(ret);
+    }
+  }
+
+CLEANUP:
+  if (ret)
+    group_free(group);
+  free(real);
+  free(toplevel);
+  free(current);
+  return ret;
+}
+
+void group_free(group_t *group) {
+  for (size_t i = 0; i < group->len; ++i) {
+    free(group->members[i].subvol);
+    free(group->members[i].dir);
+    free(group->members[i].rel);
+  }
+  memset(group, 0, sizeof(group_t));
+}
+
+int group_provision(group_t *group) {
+  for (size_t i = 0; i < group->len; ++i) {
+    char * const subvol = group->members[i].subvol;
+    const int is_provisioned = is_subvol_provisioned(subvol);
+    if (is_provisioned < 0)
+      return -1;
+    if (!is_provisioned && provision_subvol(subvol)) {
+      eprintf("error: failed to provision `%s`\n", subvol);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int group_match_snapshot(
+    const group_member_t *member, const char *name, time_t otime,
+    char *buf, size_t len)
+{
+  char *snapshots = pathcat(member->dir, SUBVOL_SNAP_NAME);
+  char *tagged = snapshots ? pathcat(snapshots, name) : NULL;
+  if (!tagged) {
+    free(snapshots);
+    return -1;
+  }
+
+  // A snapshot taken with the root's, under the same name
+  struct btrfs_util_subvolume_info info;
+  const bool is_tagged = btrfs_util_subvolume_info(tagged, 0, &info) == BTRFS_UTIL_OK;
+  free(tagged);
+  if (is_tagged) {
+    free(snapshots);
+    snprintf(buf, len, "%s", name);
+    return 0;
+  }
+
+  // Otherwise, the one taken closest to it
+  snapshot_list_t list = { 0 };
+  const int err = snapshot_list_index(&list, snapshots);
+  free(snapshots);
+
+  const snapshot_entry_t *best = NULL;
+  time_t best_diff = GROUP_MATCH_WINDOW + 1;
+  for (size_t i = 0; !err && i < list.len; ++i) {
+    const snapshot_entry_t * const entry = list.entries + i;
+    const time_t diff = entry->otime > otime ? entry->otime - otime : otime - entry->otime;
+    if (diff < best_diff) {
+      best = entry;
+      best_diff = diff;
+    }
+  }
+
+  if (best)
+    snprintf(buf, len, "%s", best->path);
+  snapshot_list_free(&list);
+
+  if (!best) {
+    if (!err)
+      errno = ENOENT;
+    return -1;
+  }
+  return 0;
+}
+
+typedef struct snapshot_job {
+  char *src, *dest;
+  int flags;
+  enum btrfs_util_error err;
+} snapshot_job_t;
+
+static void snapshot_job(void *arg) {
+  snapshot_job_t * const job = arg;
+  job->err = btrfs_util_create_snapshot(job->src, job->dest, job->flags, NULL, NULL);
+}
+
+/* Create all of the snapshots at once. Each creation waits on a transaction
+ * commit, and those running concurrently are committed together, rather than
+ * one after another with a commit each.
+ */
+static int create_snapshots(snapshot_job_t *jobs, size_t len) {
+  if (!len)
+    return 0;
+
+  workers_t * const workers = workers_create(len);
+  for (size_t i = 0; i < len; ++i)
+    if (!workers || workers_submit(workers, snapshot_job, jobs + i))
+      snapshot_job(jobs + i);
+  if (workers)
+    workers_destroy(workers);
+
+  int ret = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (jobs[i].err != BTRFS_UTIL_OK) {
+      eprintf("error: %s: %s\n", jobs[i].dest, btrfs_util_strerror(jobs[i].err));
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+static void snapshot_jobs_free(snapshot_job_t *jobs, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    free(jobs[i].src);
+    free(jobs[i].dest);
+  }
+}
+
+int group_snapshot(group_t *group, const char *name, int flags) {
+  snapshot_job_t jobs[CONFIG_GROUP_MAX + 1];
+  size_t len = 0;
+  int ret = 0;
+
+  for (size_t i = 0; i < group->len; ++i) {
+    char *snapshots = pathcat(group->members[i].dir, SUBVOL_SNAP_NAME);
+    snapshot_job_t job = {
+      pathcat(group->members[i].dir, SUBVOL_CUR_NAME),
+      snapshots ? pathcat(snapshots, name) : NULL,
+      flags, BTRFS_UTIL_OK,
+    };
+    free(snapshots);
+
+    if (!job.src || !job.dest) {
+      perror("pathcat");
+      ret = -1;
+    } else if (access(job.dest, F_OK)) {
+      jobs[len++] = job;
+      continue;
+    }
+    snapshot_jobs_free(&job, 1);
+  }
+
+  if (!ret && create_snapshots(jobs, len))
+    ret = -1;
+  snapshot_jobs_free(jobs, len);
+  return ret;
+}
+
+int group_delete_snapshot(group_t *group, const char *name) {
+  int ret = 0;
+  for (size_t i = 1; i < group->len; ++i) {
+    char *snapshots = pathcat(group->members[i].dir, SUBVOL_SNAP_NAME);
+    char *path = snapshots ? pathcat(snapshots, name) : NULL;
+    free(snapshots);
+    if (!path) {
+      ret = -1;
+      continue;
+    }
+
+    enum btrfs_util_error err;
+    if (!access(path, F_OK) &&
+        (err = btrfs_util_delete_subvolume(path, 0)) != BTRFS_UTIL_OK)
+    {
+      eprintf("error: %s: %s\n", path, btrfs_util_strerror(err));
+      ret = -1;
+    }
+    free(path);
+  }
+  return ret;
+}
+
+/* Replace `current` in the `.d` directory `dir` with `new`, then deal with
+ * the old tree as snapshot_restore would. Steps that were already done by an
+ * earlier, interrupted run are skipped, so this can be repeated safely.
+ */
+static int finish_member(const char *dir, const char *backup, snapshot_nested_t nested) {
+  CLEANUP_DECLARE(ret);
+
+  char *current = pathcat(dir, SUBVOL_CUR_NAME);
+  char *new = pathcat(dir, SUBVOL_NEW_NAME);
+  char *snapshots = pathcat(dir, SUBVOL_SNAP_NAME);
+  char *previous = !snapshots ? NULL
+    : backup ? pathcat(snapshots, backup)
+    : pathcat(dir, SUBVOL_OLD_NAME);
+  nested_subvol_t *subvols = NULL;
+  int subvols_len = 0;
+  enum btrfs_util_error err;
+
+  if (!current || !new || !previous) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  // Swap the new tree in, keeping the old one around until its nested
+  // subvolumes have been dealt with
+  if (!access(new, F_OK)) {
+    if (!access(current, F_OK) && rename(current, previous)) {
+      perror("rename");
+      FAIL(ret);
+    }
+    if (rename(new, current)) {
+      perror("rename");
+      FAIL(ret);
+    }
+  }
+
+  if (access(previous, F_OK))
+    goto CLEANUP; // the old tree is already gone
+
+  if (nested != SNAPSHOT_NESTED_NONE) {
+    subvols_len = get_nested_subvols(previous, &subvols);
+    if (subvols_len < 0) {
+      perror("get_nested_subvols");
+      FAIL(ret);
+    }
+  }
+
+  if (nested == SNAPSHOT_NESTED_MOVE &&
+      move_nested_subvols(previous, current, subvols, subvols_len))
+  {
+    perror("move_nested_subvols");
+    FAIL(ret);
+  }
+
+  if (backup) {
+    if ((err = btrfs_util_set_subvolume_read_only(previous, 1)) != BTRFS_UTIL_OK) {
+      eprintf("error: %s\n", btrfs_util_strerror(err));
+      FAIL(ret);
+    }
+  } else {
+    if (nested == SNAPSHOT_NESTED_DELETE &&
+        delete_nested_subvols(previous, subvols, subvols_len))
+    {
+      perror("delete_nested_subvols");
+      FAIL(ret);
+    }
+    if ((err = btrfs_util_delete_subvolume(previous, 0)) != BTRFS_UTIL_OK) {
+      eprintf("error: %s\n", btrfs_util_strerror(err));
+      FAIL(ret);
+    }
+  }
+
+CLEANUP:
+  nested_subvols_free(subvols, subvols_len > 0 ? subvols_len : 0);
+  free(previous);
+  free(snapshots);
+  free(new);
+  free(current);
+  return ret;
+}
+
+/* Write the journal for a group restore to `root.d/.btrroll-journal`. It lists
+ * the `.d` directories (relative to the top-level subvolume) in which `new` is
+ * to replace `current`, the root's first.
+ */
+static int write_journal(
+    const char *root_subvol_dir, const char *backup, snapshot_nested_t nested,
+    const char **rels, size_t len)
+{
+  CLEANUP_DECLARE(ret);
+
+  char *path = pathcat(root_subvol_dir, JOURNAL_FILE);
+  char *tmp_path = pathcat(root_subvol_dir, JOURNAL_FILE ".tmp");
+  FILE *fp = NULL;
+  if (!path || !tmp_path) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  if (!(fp = fopen(tmp_path, "w"))) {
+    perror("fopen");
+    FAIL(ret);
+  }
+
+  fprintf(fp, "nested=%d\n", nested);
+  if (backup)
+    fprintf(fp, "backup=%s\n", backup);
+  for (size_t i = 0; i < len; ++i)
+    fprintf(fp, "member=%s\n", rels[i]);
+
+  if (fflush(fp) || fsync(fileno(fp))) {
+    perror("fsync");
+    FAIL(ret);
+  }
+  if (fclose(fp)) {
+    fp = NULL;
+    perror("fclose");
+    FAIL(ret);
+  }
+  fp = NULL;
+
+  if (rename(tmp_path, path)) {
+    perror("rename");
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (fp)
+    fclose(fp);
+  free(tmp_path);
+  free(path);
+  return ret;
+}
+
+int group_prepare(
+    group_t *group, const char *snapshot, const char *backup,
+    snapshot_nested_t nested)
+{
+  CLEANUP_DECLARE(ret);
+
+  snapshot_job_t jobs[CONFIG_GROUP_MAX + 1];
+  const char *rels[CONFIG_GROUP_MAX + 1];
+  size_t len = 0;
+  bool created = false;
+
+  const char *name = strrchr(snapshot, '/') ? strrchr(snapshot, '/') + 1 : snapshot;
+  if (backup && strrchr(backup, '/'))
+    backup = strrchr(backup, '/') + 1;
+
+  struct btrfs_util_subvolume_info info;
+  enum btrfs_util_error err = btrfs_util_subvolume_info(snapshot, 0, &info);
+  if (err != BTRFS_UTIL_OK) {
+    eprintf("error: %s\n", btrfs_util_strerror(err));
+    FAIL(ret);
+  }
+
+  // Don't start a second restore on top of one that isn't finished yet
+  char *journal = pathcat(group->members[0].dir, JOURNAL_FILE);
+  const bool pending = journal && !access(journal, F_OK);
+  free(journal);
+  if (pending) {
+    eprintf("error: a restore of `%s` is already under way\n", group->members[0].dir);
+    errno = EBUSY;
+    FAIL(ret);
+  }
+
+  // Work out what each member is restored from
+  for (size_t i = 0; i < group->len; ++i) {
+    const group_member_t * const member = group->members + i;
+
+    char match[0x100];
+    if (i && group_match_snapshot(member, name, info.otime.tv_sec, arr_and_size(match))) {
+      eprintf("warning: no snapshot of `%s` matches `%s`; leaving it alone\n",
+          member->subvol, name);
+      continue;
+    }
+
+    char *snapshots = pathcat(member->dir, SUBVOL_SNAP_NAME);
+    snapshot_job_t * const job = jobs + len;
+    job->src = i ? (snapshots ? pathcat(snapshots, match) : NULL) : strdup(snapshot);
+    job->dest = pathcat(member->dir, SUBVOL_NEW_NAME);
+    job->flags = 0;
+    job->err = BTRFS_UTIL_OK;
+    rels[len++] = member->rel;
+
+    char *previous = backup && snapshots ? pathcat(snapshots, backup) : NULL;
+    free(snapshots);
+    if (!job->src || !job->dest || (backup && !previous)) {
+      free(previous);
+      perror("pathcat");
+      FAIL(ret);
+    }
+
+    // Don't clobber a leftover from some other operation
+    const bool exists = !access(job->dest, F_OK) || (previous && !access(previous, F_OK));
+    free(previous);
+    if (exists) {
+      eprintf("error: `%s` already has a `" SUBVOL_NEW_NAME "` subvolume or a "
+          "snapshot named `%s`\n", member->dir, backup ? backup : "");
+      errno = EEXIST;
+      FAIL(ret);
+    }
+  }
+
+  // Make every new tree before touching any of the old ones
+  created = true;
+  if (create_snapshots(jobs, len)) {
+    FAIL(ret);
+  }
+
+  if (write_journal(group->members[0].dir, backup, nested, rels, len)) {
+    FAIL(ret);
+  }
+  created = false; // from here on, the journal will finish the job
+
+CLEANUP:
+  // Don't leave half a set of new trees behind
+  for (size_t i = 0; created && i < len; ++i)
+    if (jobs[i].err == BTRFS_UTIL_OK && jobs[i].dest)
+      btrfs_util_delete_subvolume(jobs[i].dest, 0);
+  snapshot_jobs_free(jobs, len);
+  return ret;
+}
+
+int group_restore(
+    group_t *group, const char *snapshot, const char *backup,
+    snapshot_nested_t nested)
+{
+  // Without any other members, there is nothing to coordinate
+  if (group->len < 2)
+    return snapshot_restore(group->members[0].dir, snapshot, backup, nested);
+
+  if (group_prepare(group, snapshot, backup, nested))
+    return -1;
+  if (group_recover(group->members[0].dir) < 0)
+    return -1;
+
+  restart();
+  return 0;
+}
+
+// A restore left in the journal, with the `.d` directory of every member
+typedef struct journal {
+  snapshot_nested_t nested;
+  char backup[0x100];
+  char *dirs[CONFIG_GROUP_MAX + 1];
+  size_t len;
+} journal_t;
+
+static void journal_free(journal_t *journal) {
+  for (size_t i = 0; i < journal->len; ++i)
+    free(journal->dirs[i]);
+  journal->len = 0;
+}
+
+// Returns 0 if there is no journal, 1 if one was read, or -1 on error
+static int read_journal(const char *root_subvol_dir, journal_t *journal) {
+  CLEANUP_DECLARE(ret);
+  memset(journal, 0, sizeof(journal_t));
+
+  char *path = pathcat(root_subvol_dir, JOURNAL_FILE);
+  char *real = realpath(root_subvol_dir, NULL);
+  FILE *fp = path ? fopen(path, "r") : NULL;
+  if (!fp) {
+    if (path && errno == ENOENT)
+      goto CLEANUP;
+    perror("fopen");
+    FAIL(ret);
+  }
+  if (!real) {
+    perror("realpath");
+    FAIL(ret);
+  }
+
+  char line[0x1000];
+  char *toplevel = NULL;
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (!strncmp(line, "nested=", 7)) {
+      journal->nested = strtol(line + 7, NULL, 10);
+    } else if (!strncmp(line, "backup=", 7)) {
+      snprintf(journal->backup, sizeof(journal->backup), "%s", line + 7);
+    } else if (!strncmp(line, "member=", 7) && journal->len < lenof(journal->dirs)) {
+      const char * const rel = line + 7;
+
+      // The root comes first, and its real path gives away the top-level's
+      if (!toplevel) {
+        const size_t real_len = strlen(real), rel_len = strlen(rel);
+        if (rel_len >= real_len || strcmp(real + real_len - rel_len, rel)) {
+          errno = ENOENT;
+          FAIL(ret);
+        }
+        real[real_len - rel_len] = '\0';
+        toplevel = real;
+      }
+
+      if (!(journal->dirs[journal->len] = pathcat(toplevel, rel))) {
+        perror("pathcat");
+        FAIL(ret);
+      }
+      ++journal->len;
+    }
+  }
+  ret = 1;
+
+CLEANUP:
+  if (ret < 0)
+    journal_free(journal);
+  if (fp && fclose(fp))
+    perror("fclose");
+  free(real);
+  free(path);
+  return ret;
+}
+
+int group_recover(const char *root_subvol_dir) {
+  journal_t journal;
+  const int found = read_journal(root_subvol_dir, &journal);
+  if (found <= 0)
+    return found;
+
+  eprintf("btrroll: carrying out the restore in the journal\n");
+
+  int ret = 1;
+  for (size_t i = 0; i < journal.len; ++i) {
+    if (finish_member(journal.dirs[i],
+          journal.backup[0] ? journal.backup : NULL, journal.nested))
+    {
+      eprintf("error: could not finish restoring `%s`\n", journal.dirs[i]);
+      ret = -1;
+    }
+  }
+  journal_free(&journal);
+
+  // Keep the journal around to try again if anything went wrong
+  char *path = pathcat(root_subvol_dir, JOURNAL_FILE);
+  if (ret > 0 && (!path || remove(path)))
+    perror("remove");
+  free(path);
+  return ret;
+}
+
+int group_cancel(const char *root_subvol_dir) {
+  journal_t journal;
+  const int found = read_journal(root_subvol_dir, &journal);
+  if (found <= 0)
+    return found;
+
+  int ret = 1;
+  for (size_t i = 0; i < journal.len; ++i) {
+    // A member whose `current` was already replaced can't be taken back
+    char *dir = journal.dirs[i];
+    char *new = pathcat(dir, SUBVOL_NEW_NAME);
+    enum btrfs_util_error err = new ? btrfs_util_delete_subvolume(new, 0) : BTRFS_UTIL_OK;
+    if (!new || (err != BTRFS_UTIL_OK && err != BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND &&
+          access(new, F_OK) == 0))
+    {
+      eprintf("error: could not delete `%s`: %s\n", new ? new : dir,
+          new ? btrfs_util_strerror(err) : strerror(errno));
+      ret = -1;
+    }
+    free(new);
+  }
+  journal_free(&journal);
+
+  char *path = pathcat(root_subvol_dir, JOURNAL_FILE);
+  if (ret > 0 && (!path || remove(path))) {
+    perror("remove");
+    ret = -1;
+  }
+  free(path);
+  return ret;
+}
@@ -0,0 +1,353 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boot.h>
+#include <grub.h>
+#include <macros.h>
+#include <path.h>
+
+// See grub-core/lib/envblk.c in GRUB
+#define GRUBENV_HEADER "# GRUB Environment Block\n"
+#define GRUBENV_FILE "grubenv"
+#define GRUB_CFG_FILE "grub.cfg"
+
+// How deeply menus and other blocks may nest in grub.cfg
+#define GRUB_DEPTH_MAX 16
+#define GRUB_WORDS_MAX 64
+
+int grubenv_read(const char *path, grubenv_t *env) {
+  memset(env, 0, sizeof(grubenv_t));
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -1;
+
+  char block[GRUBENV_SIZE + 1];
+  size_t len = 0;
+  ssize_t count;
+  while (len < sizeof(block) &&
+      ((count = read(fd, block + len, sizeof(block) - len)) > 0 ||
+       (count < 0 && errno == EINTR)))
+    if (count > 0)
+      len += count;
+  close(fd);
+
+  if (len != GRUBENV_SIZE || memcmp(block, GRUBENV_HEADER, strlen(GRUBENV_HEADER))) {
+    errno = EINVAL;
+    return -1;
+  }
+  block[GRUBENV_SIZE] = '\0';
+
+  // Values escape backslashes and newlines with a backslash; the block is
+  // padded out with `#`s, which read as a comment
+  char value[GRUBENV_SIZE];
+  for (char *p = block + strlen(GRUBENV_HEADER); *p;) {
+    char * const key = p;
+    p += strcspn(p, "=\n");
+    if (*key == '#' || *p != '=') {
+      p += strcspn(p, "\n");
+      p += !!*p;
+      continue;
+    }
+    *p++ = '\0';
+
+    char *out = value;
+    for (; *p && *p != '\n'; ++p) {
+      if (*p == '\\' && p[1])
+        ++p;
+      *out++ = *p;
+    }
+    *out = '\0';
+    p += !!*p;
+
+    if (grubenv_set(env, key, value)) {
+      grubenv_free(env);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void grubenv_free(grubenv_t *env) {
+  for (size_t i = 0; i < env->len; ++i) {
+    free(env->keys[i]);
+    free(env->values[i]);
+  }
+  memset(env, 0, sizeof(grubenv_t));
+}
+
+const char *grubenv_get(const grubenv_t *env, const char *key) {
+  for (size_t i = 0; i < env->len; ++i)
+    if (!strcmp(env->keys[i], key))
+      return env->values[i];
+  return NULL;
+}
+
+int grubenv_set(grubenv_t *env, const char *key, const char *value) {
+  size_t i = 0;
+  while (i < env->len && strcmp(env->keys[i], key))
+    ++i;
+
+  if (!value) {
+    if (i == env->len)
+      return 0;
+    free(env->keys[i]);
+    free(env->values[i]);
+    --env->len;
+    memmove(env->keys + i, env->keys + i + 1, (env->len - i) * sizeof(char *));
+    memmove(env->values + i, env->values + i + 1, (env->len - i) * sizeof(char *));
+    return 0;
+  }
+
+  char * const copy = strdup(value);
+  if (!copy) {
+    perror("strdup");
+    return -1;
+  }
+
+  if (i < env->len) {
+    free(env->values[i]);
+    env->values[i] = copy;
+    return 0;
+  }
+
+  if (env->len == GRUBENV_VARS_MAX || !(env->keys[i] = strdup(key))) {
+    free(copy);
+    errno = ENOSPC;
+    return -1;
+  }
+  env->values[i] = copy;
+  ++env->len;
+  return 0;
+}
+
+int grubenv_write(const char *path, const grubenv_t *env) {
+  char block[GRUBENV_SIZE];
+  memset(block, '#', sizeof(block));
+
+  size_t pos = strlen(GRUBENV_HEADER);
+  memcpy(block, GRUBENV_HEADER, pos);
+  for (size_t i = 0; i < env->len; ++i) {
+    // Worst case, every character of the value needs escaping
+    const size_t key_len = strlen(env->keys[i]);
+    if (pos + key_len + 1 + 2*strlen(env->values[i]) + 1 > sizeof(block)) {
+      errno = ENOSPC;
+      return -1;
+    }
+
+    memcpy(block + pos, env->keys[i], key_len);
+    pos += key_len;
+    block[pos++] = '=';
+    for (const char *p = env->values[i]; *p; ++p) {
+      if (*p == '\\' || *p == '\n')
+        block[pos++] = '\\';
+      block[pos++] = *p;
+    }
+    block[pos++] = '\n';
+  }
+
+  const int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("open");
+    return -1;
+  }
+
+  // Anything else isn't a block GRUB would write to, so leave it alone
+  struct stat sb;
+  int ret = 0;
+  if (fstat(fd, &sb) || (sb.st_size != 0 && sb.st_size != GRUBENV_SIZE)) {
+    errno = EINVAL;
+    ret = -1;
+  } else {
+    for (size_t done = 0; done < sizeof(block) && !ret;) {
+      const ssize_t count = pwrite(fd, block + done, sizeof(block) - done, done);
+      if (count > 0)
+        done += count;
+      else if (count < 0 && errno != EINTR)
+        ret = -1;
+    }
+    if (!ret && fsync(fd))
+      ret = -1;
+  }
+
+  if (ret)
+    perror("grubenv_write");
+  if (close(fd))
+    perror("close");
+  return ret;
+}
+
+int grub_find(const char *esp_path, char *buf, size_t len) {
+  static const char * const DIRS[] = { "grub", "boot/grub" };
+
+  for (size_t i = 0; i < lenof(DIRS); ++i) {
+    snprintf(buf, len, "%s/%s/" GRUB_CFG_FILE, esp_path, DIRS[i]);
+    if (!access(buf, R_OK)) {
+      *strrchr(buf, '/') = '\0';
+      return 0;
+    }
+  }
+
+  errno = ENOENT;
+  return -1;
+}
+
+/* Split a line of grub.cfg into words in place, undoing quotes and escapes as
+ * the shell does. Comments are dropped. Returns the number of words.
+ */
+static size_t split_words(char *line, char **words, size_t words_len) {
+  size_t len = 0;
+  char *p = line, *out = line;
+  while (len < words_len) {
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == ';')
+      ++p;
+    if (!*p || *p == '#')
+      break;
+
+    words[len++] = out;
+    char quote = '\0';
+    for (; *p && (quote || !strchr(" \t\n;", *p)); ++p) {
+      if (quote && *p == quote)
+        quote = '\0';
+      else if (!quote && (*p == '\'' || *p == '"'))
+        quote = *p;
+      else if (*p == '\\' && quote != '\'' && p[1])
+        *out++ = *++p;
+      else
+        *out++ = *p;
+    }
+    const bool more = *p;
+    *out++ = '\0';
+    p += more;
+  }
+  return len;
+}
+
+typedef struct frame {
+  enum { FRAME_MENUENTRY, FRAME_SUBMENU, FRAME_OTHER } kind;
+  char id[0x100];
+} frame_t;
+
+// The ID GRUB knows the menu (entry) on these words by, within its submenus
+static void entry_id(char **words, size_t len, const frame_t *stack, size_t depth,
+    char *buf, size_t buf_len)
+{
+  const char *id = words[1];
+  for (size_t i = 2; i + 1 < len; ++i)
+    if (!strcmp(words[i], "--id") || !strcmp(words[i], "$menuentry_id_option"))
+      id = words[i + 1];
+
+  buf[0] = '\0';
+  for (size_t i = 0; i < depth; ++i) {
+    if (stack[i].kind != FRAME_SUBMENU)
+      continue;
+    strncat(buf, stack[i].id, buf_len - strlen(buf) - 1);
+    strncat(buf, ">", buf_len - strlen(buf) - 1);
+  }
+  strncat(buf, id, buf_len - strlen(buf) - 1);
+}
+
+int grub_list(const char *grub_dir, bootctl_entry_t *entries, size_t entries_len) {
+  char *path = pathcat(grub_dir, GRUB_CFG_FILE);
+  FILE * const fp = path ? fopen(path, "r") : NULL;
+  if (!fp) {
+    perror("fopen");
+    free(path);
+    return -1;
+  }
+
+  memset(entries, 0, entries_len * sizeof(bootctl_entry_t));
+  frame_t stack[GRUB_DEPTH_MAX];
+  size_t depth = 0, count = 0;
+  bootctl_entry_t *entry = NULL;
+
+  char line[0x1000];
+  char *words[GRUB_WORDS_MAX];
+  while (fgets(line, sizeof(line), fp)) {
+    const size_t len = split_words(line, words, lenof(words));
+    if (!len)
+      continue;
+
+    const bool opens = !strcmp(words[len - 1], "{");
+    const bool menuentry = !strcmp(words[0], "menuentry");
+    if (opens && depth < lenof(stack)) {
+      frame_t * const frame = stack + depth;
+      frame->kind = FRAME_OTHER;
+      if ((menuentry || !strcmp(words[0], "submenu")) && len > 2) {
+        frame->kind = menuentry ? FRAME_MENUENTRY : FRAME_SUBMENU;
+        entry_id(words, len - 1, stack, depth, arr_and_size(frame->id));
+      }
+      ++depth;
+
+      if (menuentry && len > 2 && count < entries_len) {
+        entry = entries + count++;
+        entry->id = strdup(frame->id);
+        entry->title = strdup(words[1]);
+        entry->source = strdup(path);
+      }
+      continue;
+    }
+
+    if (!strcmp(words[0], "}")) {
+      if (depth && stack[--depth].kind == FRAME_MENUENTRY)
+        entry = NULL;
+      continue;
+    }
+
+    // The kernel, and the options it is booted with
+    if (entry && len > 1 && !strncmp(words[0], "linux", 5) && !entry->kernel) {
+      const char *kernel = words[1];
+      if (kernel[0] == '(' && strchr(kernel, ')'))
+        kernel = strchr(kernel, ')') + 1; // e.g. `($root)/vmlinuz-linux`
+      entry->kernel = strdup(kernel);
+
+      char options[0x1000] = "";
+      for (size_t i = 2; i < len; ++i) {
+        strncat(options, words[i], sizeof(options) - strlen(options) - 2);
+        if (i + 1 < len)
+          strcat(options, " ");
+      }
+      entry->options = strdup(options);
+    }
+  }
+
+  if (ferror(fp))
+    perror("fgets");
+  fclose(fp);
+  free(path);
+  return count;
+}
+
+static int grub_set(const char *grub_dir, const char *key, const char *id) {
+  char *path = pathcat(grub_dir, GRUBENV_FILE);
+  if (!path) {
+    perror("pathcat");
+    return -1;
+  }
+
+  grubenv_t env;
+  int ret = -1;
+  if (grubenv_read(path, &env))
+    perror("grubenv_read");
+  else if (!grubenv_set(&env, key, id) && !grubenv_write(path, &env))
+    ret = 0;
+
+  grubenv_free(&env);
+  free(path);
+  return ret;
+}
+
+int grub_set_oneshot(const char *grub_dir, const char *id) {
+  return grub_set(grub_dir, "next_entry", id);
+}
+
+int grub_set_default(const char *grub_dir, const char *id) {
+  return grub_set(grub_dir, "saved_entry", id);
+}
@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <boot.h>
+#include <clone.h>
+#include <grub.h>
+#include <kstore.h>
+#include <macros.h>
+#include <path.h>
+#include <xxhash.h>
+
+// Both relative to the ESP
+#define KSTORE_DIR "btrroll/kernels"
+#define ENTRIES_DIR "loader/entries"
+
+#define KSTORE_BUF_LEN 0x10000
+#define KSTORE_REFS_MAX 0x100
+
+// A file to add to the store
+typedef struct kstore_file {
+  const char *src;
+  char name[0x20]; // in the store, from a hash of the contents
+  off_t size;
+  bool stored;     // already in the store
+} kstore_file_t;
+
+// Hash the whole of the file open on `fd`, leaving it rewound
+static int hash_fd(int fd, uint64_t *hash) {
+  char * const buf = malloc(KSTORE_BUF_LEN);
+  if (!buf) {
+    perror("malloc");
+    return -1;
+  }
+
+  xxh64_state_t state;
+  xxh64_reset(&state, 0);
+
+  ssize_t n;
+  while ((n = read(fd, buf, KSTORE_BUF_LEN)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("read");
+      break;
+    }
+    xxh64_update(&state, buf, n);
+  }
+  free(buf);
+
+  if (n < 0 || lseek(fd, 0, SEEK_SET) < 0)
+    return -1;
+  *hash = xxh64_digest(&state);
+  return 0;
+}
+
+// Work out what `file` is called in the store at `store`, and if it's there
+static int identify_file(const char *store, kstore_file_t *file) {
+  CLEANUP_DECLARE(ret);
+
+  char *path = NULL;
+  const int fd = open(file->src, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open");
+    FAIL(ret);
+  }
+
+  struct stat sb;
+  uint64_t hash;
+  if (fstat(fd, &sb) || hash_fd(fd, &hash)) {
+    perror("hash_fd");
+    FAIL(ret);
+  }
+  file->size = sb.st_size;
+
+  snprintf(file->name, sizeof(file->name), "%016" PRIx64, hash);
+  if (!(path = pathcat(store, file->name))) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  // Another snapshot already brought the same file along
+  struct stat stored;
+  file->stored = !stat(path, &stored) && stored.st_size == sb.st_size;
+
+CLEANUP:
+  if (fd >= 0)
+    close(fd);
+  free(path);
+  return ret;
+}
+
+// Copy `file` into the store at `store`, unless it is already there
+static int store_file(const char *store, const kstore_file_t *file) {
+  CLEANUP_DECLARE(ret);
+
+  if (file->stored)
+    return 0;
+
+  char *path = NULL, *tmp_path = NULL;
+  int out_fd = -1;
+  const int in_fd = open(file->src, O_RDONLY | O_CLOEXEC);
+  if (in_fd < 0) {
+    perror("open");
+    FAIL(ret);
+  }
+
+  if (!(path = pathcat(store, file->name)) || asprintf(&tmp_path, "%s.tmp", path) < 0) {
+    tmp_path = NULL;
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  if ((out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+    perror("open");
+    FAIL(ret);
+  }
+  if (clone_file_data(in_fd, out_fd, file->size) || fsync(out_fd)) {
+    perror("clone_file_data");
+    FAIL(ret);
+  }
+  if (close(out_fd)) {
+    out_fd = -1;
+    perror("close");
+    FAIL(ret);
+  }
+  out_fd = -1;
+
+  if (rename(tmp_path, path)) {
+    perror("rename");
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (out_fd >= 0)
+    close(out_fd);
+  if (ret && tmp_path)
+    unlink(tmp_path);
+  if (in_fd >= 0)
+    close(in_fd);
+  free(tmp_path);
+  free(path);
+  return ret;
+}
+
+/* Add the names of the store files that the entry at `path` boots to `refs`.
+ * Returns -1 if there are more than `refs_max` in all.
+ */
+static int read_entry_refs(
+    const char *path, char (*refs)[0x20], size_t *refs_len, size_t refs_max)
+{
+  static const char PREFIX[] = "/" KSTORE_DIR "/";
+
+  FILE * const fp = fopen(path, "r");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  int ret = 0;
+  char line[0x400];
+  while (!ret && fgets(line, sizeof(line), fp)) {
+    // Every `key value` line; only linux and initrd ever point into the store
+    char *value = line + strcspn(line, " \t");
+    value += strspn(value, " \t");
+    value[strcspn(value, "\r\n")] = '\0';
+    if (strncasecmp(value, PREFIX, strlen(PREFIX)))
+      continue;
+
+    if (*refs_len == refs_max) {
+      errno = ENOBUFS;
+      ret = -1;
+    } else {
+      snprintf(refs[(*refs_len)++], sizeof(*refs), "%s", value + strlen(PREFIX));
+    }
+  }
+
+  if (fclose(fp))
+    perror("fclose");
+  return ret;
+}
+
+/* Delete the files in the store that no boot entry refers to any more, such
+ * as those of a kernel version that has since been provisioned again. Nothing
+ * is deleted unless every entry could be read.
+ */
+static int collect_garbage(const char *esp_path, const char *store) {
+  CLEANUP_DECLARE(ret);
+
+  char refs[KSTORE_REFS_MAX][0x20];
+  size_t refs_len = 0;
+  char *entries = pathcat(esp_path, ENTRIES_DIR);
+  DIR *dp = entries ? opendir(entries) : NULL;
+  if (!dp) {
+    perror("opendir");
+    FAIL(ret);
+  }
+
+  struct dirent *ep;
+  while ((ep = readdir(dp))) {
+    const size_t len = strlen(ep->d_name);
+    if (ep->d_name[0] == '.' || len < 5 || strcasecmp(ep->d_name + len - 5, ".conf"))
+      continue;
+
+    char *path = pathcat(entries, ep->d_name);
+    const int err = !path || read_entry_refs(path, refs, &refs_len, lenof(refs));
+    free(path);
+    if (err) {
+      perror("read_entry_refs");
+      FAIL(ret);
+    }
+  }
+
+  closedir(dp);
+  if (!(dp = opendir(store))) {
+    perror("opendir");
+    FAIL(ret);
+  }
+
+  // Half-copied `.tmp` files are never referred to, so they go too
+  while ((ep = readdir(dp))) {
+    if (ep->d_name[0] == '.')
+      continue;
+
+    bool referenced = false;
+    for (size_t i = 0; i < refs_len && !referenced; ++i)
+      referenced = !strcasecmp(refs[i], ep->d_name);
+    if (!referenced && unlinkat(dirfd(dp), ep->d_name, 0))
+      perror("unlinkat");
+  }
+
+CLEANUP:
+  if (dp && closedir(dp))
+    perror("closedir");
+  free(entries);
+  return ret;
+}
+
+/* Find the initramfs built for `version` in `snapshot`: the one kernel-install
+ * leaves next to the modules, or mkinitcpio's in the snapshot's own /boot.
+ */
+static char *find_initrd(const char *snapshot, const char *modules) {
+  char *path = pathcat(modules, "initrd");
+  if (!path || !access(path, R_OK))
+    return path;
+  free(path);
+
+  char pkgbase[0x80] = "";
+  char *pkgbase_path = pathcat(modules, "pkgbase");
+  FILE * const fp = pkgbase_path ? fopen(pkgbase_path, "r") : NULL;
+  free(pkgbase_path);
+  if (fp) {
+    if (!fgets(pkgbase, sizeof(pkgbase), fp))
+      pkgbase[0] = '\0';
+    pkgbase[strcspn(pkgbase, "\n")] = '\0';
+    fclose(fp);
+  }
+  if (!pkgbase[0] || strchr(pkgbase, '/')) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  char name[0x100];
+  snprintf(name, sizeof(name), "boot/initramfs-%s.img", pkgbase);
+  if ((path = pathcat(snapshot, name)) && access(path, R_OK)) {
+    free(path);
+    errno = ENOENT;
+    return NULL;
+  }
+  return path;
+}
+
+// The options of the entry that was booted, or of any entry with options
+static char *find_options(const char *esp_path) {
+  bootctl_entry_t entries[32];
+  const int num_entries = bootctl_list(esp_path, entries, lenof(entries));
+  if (num_entries < 0) {
+    perror("bootctl_list");
+    return NULL;
+  }
+
+  char selected[0x100];
+  if (efivar_read_string("LoaderEntrySelected", arr_and_size(selected)))
+    selected[0] = '\0';
+
+  const char *options = NULL;
+  for (int i = 0; i < num_entries; ++i) {
+    if (!entries[i].options)
+      continue;
+    if (!options || (entries[i].id && !strcmp(entries[i].id, selected)))
+      options = entries[i].options;
+  }
+
+  char * const ret = options ? strdup(options) : NULL;
+  for (int i = 0; i < num_entries; ++i)
+    bootctl_entry_free(entries + i);
+  if (!options)
+    errno = ENOENT;
+  return ret;
+}
+
+// Write the entry `id` atomically, as the state file is written
+static int write_entry(
+    const char *esp_path, const char *id, const char *version,
+    const char *kernel, const char *initrd, const char *options)
+{
+  CLEANUP_DECLARE(ret);
+
+  char *entries = pathcat(esp_path, ENTRIES_DIR);
+  char *path = entries ? pathcat(entries, id) : NULL;
+  char *tmp_path = NULL;
+  FILE *fp = NULL;
+  if (!path || asprintf(&tmp_path, "%s.tmp", path) < 0) {
+    tmp_path = NULL;
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  if (!(fp = fopen(tmp_path, "w"))) {
+    perror("fopen");
+    FAIL(ret);
+  }
+  fprintf(fp,
+      "title   Linux %s (btrroll)\n"
+      "version %s\n"
+      "linux   /" KSTORE_DIR "/%s\n"
+      "initrd  /" KSTORE_DIR "/%s\n"
+      "options %s\n",
+      version, version, kernel, initrd, options);
+  if (fflush(fp) || fsync(fileno(fp))) {
+    perror("fprintf");
+    FAIL(ret);
+  }
+  if (fclose(fp)) {
+    fp = NULL;
+    perror("fclose");
+    FAIL(ret);
+  }
+  fp = NULL;
+
+  if (rename(tmp_path, path)) {
+    perror("rename");
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (fp)
+    fclose(fp);
+  if (ret && tmp_path)
+    unlink(tmp_path);
+  free(tmp_path);
+  free(path);
+  free(entries);
+  return ret;
+}
+
+int kstore_provision(
+    const char *snapshot, const char *esp_path, const char *version,
+    char *id, size_t id_len)
+{
+  CLEANUP_DECLARE(ret);
+
+  char *modules = NULL, *kernel = NULL, *initrd = NULL, *options = NULL;
+  char *store = NULL;
+
+  // GRUB doesn't read systemd-boot's entries
+  char grub_dir[0x100];
+  if (!grub_find(esp_path, arr_and_size(grub_dir))) {
+    eprintf("btrroll: can't add boot entries for GRUB\n");
+    errno = EOPNOTSUPP;
+    FAIL(ret);
+  }
+
+  if (!version[0] || strchr(version, '/') || !strcmp(version, "..")) {
+    errno = EINVAL;
+    FAIL(ret);
+  }
+
+  char modules_rel[0x200];
+  snprintf(arr_and_size(modules_rel), "usr/lib/modules/%s", version);
+  if (!(modules = pathcat(snapshot, modules_rel)) ||
+      !(kernel = pathcat(modules, "vmlinuz")))
+  {
+    perror("pathcat");
+    FAIL(ret);
+  }
+  if (access(kernel, R_OK)) {
+    eprintf("btrroll: `%s` has no kernel\n", modules_rel);
+    FAIL(ret);
+  }
+  if (!(initrd = find_initrd(snapshot, modules))) {
+    eprintf("btrroll: `%s` has no initramfs\n", snapshot);
+    FAIL(ret);
+  }
+  if (!(options = find_options(esp_path))) {
+    eprintf("btrroll: no boot entry to take kernel options from\n");
+    FAIL(ret);
+  }
+
+  // Create the store if need be
+  char *btrroll_dir = pathcat(esp_path, "btrroll");
+  store = pathcat(esp_path, KSTORE_DIR);
+  const int err = !btrroll_dir || !store ||
+    ((mkdir(btrroll_dir, 0755) && errno != EEXIST) || (mkdir(store, 0755) && errno != EEXIST));
+  free(btrroll_dir);
+  if (err) {
+    perror("mkdir");
+    FAIL(ret);
+  }
+
+  // Make room first, in case an earlier kernel was left behind
+  if (collect_garbage(esp_path, store))
+    perror("collect_garbage");
+
+  kstore_file_t files[] = { { .src = kernel }, { .src = initrd } };
+  for (size_t i = 0; i < lenof(files); ++i) {
+    if (identify_file(store, files + i)) {
+      perror("identify_file");
+      FAIL(ret);
+    }
+  }
+
+  // Don't fill the ESP only to find out at the end that it won't fit
+  uint64_t needed = 0;
+  for (size_t i = 0; i < lenof(files); ++i)
+    if (!files[i].stored && (i == 0 || strcmp(files[i].name, files[0].name)))
+      needed += files[i].size;
+
+  struct statvfs sfb;
+  if (statvfs(store, &sfb)) {
+    perror("statvfs");
+    FAIL(ret);
+  }
+  if ((uint64_t) sfb.f_bavail * sfb.f_frsize < needed) {
+    eprintf("btrroll: not enough space on the ESP for the kernel and initramfs "
+        "of `%s` (%" PRIu64 " MiB needed)\n", snapshot, needed >> 20);
+    errno = ENOSPC;
+    FAIL(ret);
+  }
+
+  for (size_t i = 0; i < lenof(files); ++i) {
+    if (store_file(store, files + i)) {
+      perror("store_file");
+      FAIL(ret);
+    }
+  }
+
+  // One entry per kernel version, booting whichever build was provisioned last
+  snprintf(id, id_len, "btrroll-%s.conf", version);
+  if (write_entry(esp_path, id, version, files[0].name, files[1].name, options)) {
+    perror("write_entry");
+    FAIL(ret);
+  }
+
+  // The build this replaced is now unused
+  if (collect_garbage(esp_path, store))
+    perror("collect_garbage");
+
+CLEANUP:
+  free(store);
+  free(options);
+  free(initrd);
+  free(kernel);
+  free(modules);
+  return ret;
+}
@@ -0,0 +1,215 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lineage.h>
+#include <macros.h>
+#include <snaplist.h>
+
+#define UUID_LEN 16
+#define NONE SIZE_MAX
+
+typedef struct uuid_slot {
+  const uint8_t *uuid; // NULL if empty
+  size_t value;
+} uuid_slot_t;
+
+// Open-addressed map from UUIDs (which are random enough to hash as they are)
+typedef struct uuid_map {
+  uuid_slot_t *slots;
+  size_t mask;
+} uuid_map_t;
+
+static bool uuid_is_null(const uint8_t *uuid) {
+  static const uint8_t NULL_UUID[UUID_LEN] = { 0 };
+  return !memcmp(uuid, NULL_UUID, UUID_LEN);
+}
+
+// Make room for `n` UUIDs, keeping the map at most half full
+static int uuid_map_init(uuid_map_t *map, size_t n) {
+  size_t cap = 0x10;
+  while (cap < 2*n)
+    cap *= 2;
+  map->slots = calloc(cap, sizeof(uuid_slot_t));
+  map->mask = cap - 1;
+  return map->slots ? 0 : -1;
+}
+
+// Find the slot holding `uuid`, or else the empty one it belongs in
+static uuid_slot_t *uuid_map_slot(const uuid_map_t *map, const uint8_t *uuid) {
+  uint64_t hash;
+  memcpy(&hash, uuid, sizeof(hash));
+  for (size_t i = hash & map->mask;; i = (i + 1) & map->mask) {
+    uuid_slot_t * const slot = map->slots + i;
+    if (!slot->uuid || !memcmp(slot->uuid, uuid, UUID_LEN))
+      return slot;
+  }
+}
+
+// Map `uuid` to `value` unless it is null or already mapped
+static void uuid_map_add(uuid_map_t *map, const uint8_t *uuid, size_t value) {
+  if (uuid_is_null(uuid))
+    return;
+  uuid_slot_t * const slot = uuid_map_slot(map, uuid);
+  if (!slot->uuid)
+    *slot = (uuid_slot_t) { uuid, value };
+}
+
+static size_t uuid_map_get(const uuid_map_t *map, const uint8_t *uuid) {
+  if (uuid_is_null(uuid))
+    return NONE;
+  const uuid_slot_t * const slot = uuid_map_slot(map, uuid);
+  return slot->uuid ? slot->value : NONE;
+}
+
+int lineage_build(lineage_t *lineage, const snapshot_list_t *list, const uint8_t *live_uuid) {
+  CLEANUP_DECLARE(ret);
+  memset(lineage, 0, sizeof(lineage_t));
+
+  const size_t n = list->len;
+  const snapshot_entry_t * const entries = list->entries;
+  uuid_map_t nodes = { 0 }, origins = { 0 };
+  size_t *parent = malloc((n + 1) * sizeof(size_t));
+  size_t *group_of = malloc((n + 1) * sizeof(size_t));
+  size_t *children = malloc((n + 1) * sizeof(size_t));
+  size_t *child_start = calloc(n + 2, sizeof(size_t));
+  size_t *stack = malloc((n + 1) * sizeof(size_t));
+  size_t *cursor = NULL, *rank = NULL;
+  bool *visited = calloc(n + 1, sizeof(bool));
+  lineage->order = malloc((n + 1) * sizeof(size_t));
+  lineage->depth = calloc(n + 1, sizeof(size_t));
+  lineage->groups = calloc(n + 1, sizeof(lineage_group_t));
+
+  if (!parent || !group_of || !children || !child_start || !stack || !visited ||
+      !lineage->order || !lineage->depth || !lineage->groups ||
+      uuid_map_init(&nodes, 2*n) || uuid_map_init(&origins, n))
+  {
+    perror("malloc");
+    FAIL(ret);
+  }
+
+  // Received snapshots are known by the UUID they were sent as, too
+  for (size_t i = 0; i < n; ++i) {
+    uuid_map_add(&nodes, entries[i].uuid, i);
+    uuid_map_add(&nodes, entries[i].received_uuid, i);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    parent[i] = uuid_map_get(&nodes, entries[i].parent_uuid);
+    if (parent[i] == i)
+      parent[i] = NONE;
+  }
+
+  // Group each snapshot by its topmost ancestor's origin: the subvolume it was
+  // taken of if that is gone (or live), otherwise the ancestor itself
+  size_t live_group = NONE;
+  for (size_t i = 0; i < n; ++i) {
+    size_t top = i;
+    for (size_t steps = 0; parent[top] != NONE && steps < n; ++steps)
+      top = parent[top];
+
+    const uint8_t *key = uuid_is_null(entries[top].parent_uuid)
+      ? entries[top].uuid : entries[top].parent_uuid;
+    size_t group = uuid_map_get(&origins, key);
+    if (group == NONE) {
+      group = lineage->groups_len++;
+      uuid_map_add(&origins, key, group);
+      if (live_uuid && !memcmp(key, live_uuid, UUID_LEN))
+        live_group = group;
+    }
+    group_of[i] = group;
+    ++lineage->groups[group].len;
+  }
+
+  // Lay the groups out, the running root's first
+  if (!(cursor = malloc(lineage->groups_len * sizeof(size_t))) ||
+      !(rank = malloc(lineage->groups_len * sizeof(size_t))))
+  {
+    perror("malloc");
+    FAIL(ret);
+  }
+  for (size_t g = 0, r = live_group == NONE ? 0 : 1; g < lineage->groups_len; ++g)
+    rank[g] = g == live_group ? 0 : r++;
+
+  lineage_group_t *sorted = calloc(lineage->groups_len + 1, sizeof(lineage_group_t));
+  if (!sorted) {
+    perror("calloc");
+    FAIL(ret);
+  }
+  for (size_t g = 0; g < lineage->groups_len; ++g)
+    sorted[rank[g]].len = lineage->groups[g].len;
+  for (size_t r = 0, first = 0; r < lineage->groups_len; ++r) {
+    sorted[r].first = first;
+    sorted[r].is_live = live_group != NONE && r == 0;
+    first += sorted[r].len;
+  }
+  free(lineage->groups);
+  lineage->groups = sorted;
+  for (size_t g = 0; g < lineage->groups_len; ++g)
+    cursor[g] = sorted[rank[g]].first;
+
+  // Index each snapshot's children, in list order
+  for (size_t i = 0; i < n; ++i)
+    if (parent[i] != NONE)
+      ++child_start[parent[i] + 1];
+  for (size_t i = 0; i < n; ++i)
+    child_start[i + 1] += child_start[i];
+  {
+    size_t *fill = stack; // borrowed until the walk below
+    memcpy(fill, child_start, n * sizeof(size_t));
+    for (size_t i = 0; i < n; ++i)
+      if (parent[i] != NONE)
+        children[fill[parent[i]]++] = i;
+  }
+
+  // Walk each tree from the top, so that descendants follow their ancestors
+  for (size_t i = 0; i < n; ++i) {
+    if (parent[i] != NONE)
+      continue;
+
+    size_t stack_len = 0;
+    stack[stack_len++] = i;
+    visited[i] = true;
+    while (stack_len) {
+      const size_t v = stack[--stack_len];
+      lineage->order[cursor[group_of[v]]++] = v;
+      for (size_t c = child_start[v + 1]; c-- > child_start[v];) {
+        const size_t child = children[c];
+        if (visited[child])
+          continue;
+        visited[child] = true;
+        lineage->depth[child] = lineage->depth[v] + 1;
+        stack[stack_len++] = child;
+      }
+    }
+  }
+
+  // Whatever a parent_uuid cycle kept from being reached goes at the end
+  for (size_t i = 0; i < n; ++i)
+    if (!visited[i])
+      lineage->order[cursor[group_of[i]]++] = i;
+
+CLEANUP:
+  if (ret)
+    lineage_free(lineage);
+  free(origins.slots);
+  free(nodes.slots);
+  free(rank);
+  free(cursor);
+  free(visited);
+  free(stack);
+  free(child_start);
+  free(children);
+  free(group_of);
+  free(parent);
+  return ret;
+}
+
+void lineage_free(lineage_t *lineage) {
+  free(lineage->order);
+  free(lineage->depth);
+  free(lineage->groups);
+  memset(lineage, 0, sizeof(lineage_t));
+}
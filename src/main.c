@@ -11,6 +11,8 @@
 #include <unistd.h>
 
 #include <boot.h>
+#include <cli.h>
+#include <config.h>
 #include <constants.h>
 #include <dialog.h>
 #include <macros.h>
@@ -19,7 +21,9 @@
 #include <run.h>
 #include <snapshot.h>
 #include <subvol.h>
+#include <trace.h>
 #include <ui.h>
+#include <unattended.h>
 
 static const char *btrfs_root_mountpoint = NULL;
 static const char *esp_mountpoint = NULL;
@@ -28,10 +32,15 @@ int wait_for_input(time_t seconds);
 int btrfs_root_mount(const char *mountpoint, char *root, char *flags);
 int esp_mount(const char *mountpoint);
 void unmount_all();
+void trace_exit();
 
 int main(int argc, char **argv) {
   CLEANUP_DECLARE(did_mount_fail);
 
+  // Commands are run on the booted system, not from the initrd
+  if (argc > 1)
+    return cli_main(argc, argv);
+
   // Check that we're in initramfs; otherwise, unexpected behavior may occur
   /*
   if (access(INITRD_RELEASE_PATH, F_OK)) {
@@ -41,9 +50,14 @@ int main(int argc, char **argv) {
   }
   */
 
+  trace("start");
+  atexit(trace_exit);
+
   dialog_t dialog;
   dialog_init(&dialog);
 
+  const config_t * const config = config_get();
+
   // Get the root device and its mount flags from the kernel command line
   char root[0x1000], flags[0x1000];
   if (get_root(arr_and_size(root), arr_and_size(flags))) {
@@ -56,17 +70,18 @@ int main(int argc, char **argv) {
   // Mount the root device, and unmount automatically on exit
   // TODO: segfault if mounts failed
   // TODO: fails if already mounted (use mktemp?)
-  const char *mountpoint = BTRFS_MOUNTPOINT; // TODO: load from config file
+  const char *mountpoint = config->root;
   if (btrfs_root_mount(mountpoint, root, flags)) {
     perror("btrfs_root_mount");
     FAIL(did_mount_fail);
   }
-  if (esp_mount("/esp")) {
+  if (esp_mount(config->esp)) {
     perror("esp_mount");
     FAIL(did_mount_fail);
   }
 
   atexit(unmount_all);
+  trace("mounted");
 
   // Get the path to the root subvolume (distinct from the root _device_)
   char *root_subvol = get_btrfs_root_subvol_path(mountpoint, flags);
@@ -82,7 +97,9 @@ int main(int argc, char **argv) {
   }
 
   { // Check .btrroll-state and act on it if necessary
+    trace("continue");
     int err = snapshot_continue(root_subvol);
+    trace("continue-done");
     if (err < 0) {
       perror("snapshot_continue");
       return EXIT_FAILURE;
@@ -90,9 +107,27 @@ int main(int argc, char **argv) {
       return EXIT_SUCCESS;
   }
 
-  // NOTE: Due to terminal input buffering, we can only wait for Enter.
-  if (wait_for_input(1) == 0) // TODO: load timeout value from config file
+  // Options to run without the console, e.g. for a provisioning system
+  trace("gate");
+  unattended_t plan;
+  if (unattended_read(&plan, root_subvol))
+    perror("unattended_read");
+
+  // NOTE: Due to terminal input buffering, we can only wait for Enter. With no
+  // timeout, the console always comes up, unless there's something to do.
+  if ((plan.timeout || plan.action != UNATTENDED_NONE) &&
+      wait_for_input(plan.timeout) == 0)
+  {
+    trace("gate-done");
+    if (plan.action != UNATTENDED_NONE) {
+      trace("action");
+      if (unattended_run(&plan, root_subvol, config->esp)) {
+        perror("unattended_run");
+        eprintf("btrroll: continuing to boot as normal\n");
+      }
+    }
     return EXIT_SUCCESS;
+  }
 
 CLEANUP:
   if (did_mount_fail) {
@@ -135,7 +170,7 @@ int esp_mount(const char *mountpoint) {
     return -1;
   }
 
-  if (mount_esp("/esp")) {
+  if (mount_esp(mountpoint)) {
     perror("mount_esp");
     return -1;
   }
@@ -165,7 +200,7 @@ int btrfs_root_mount(const char *mountpoint, char *root, char *flags) {
 
   { // Check that the mounted filesystem is actually BTRFS
     struct statfs sfb;
-    if (statfs(BTRFS_MOUNTPOINT, &sfb)) {
+    if (statfs(mountpoint, &sfb)) {
       perror("statfs");
       return -1;
     }
@@ -183,6 +218,11 @@ int btrfs_root_mount(const char *mountpoint, char *root, char *flags) {
   return 0;
 }
 
+// Registered before unmount_all, so it runs after
+void trace_exit() {
+  trace("exit");
+}
+
 void unmount_all() {
   if (btrfs_root_mountpoint && umount(btrfs_root_mountpoint))
       perror("umount");
@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+#include <btrfsutil.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <constants.h>
+#include <macros.h>
+#include <manifest.h>
+#include <path.h>
+#include <tree_search.h>
+#include <workers.h>
+#include <xxhash.h>
+
+#define MANIFEST_VERSION 1
+#define MANIFEST_BUF_LEN 0x20000
+
+// Everything needed to get as far as a login prompt
+static const char *BOOT_PATHS[] = {
+  "etc",
+  "usr/lib/modules",
+  "usr/lib/systemd",
+};
+
+typedef struct manifest_entry {
+  char type; // 'f'ile, 'd'irectory or 'l'ink
+  uint64_t hash, size, ino;
+  struct timespec mtime;
+  char *path; // relative to the snapshot
+} manifest_entry_t;
+
+typedef struct manifest {
+  uint64_t subvol_id, generation;
+  manifest_entry_t *entries;
+  size_t len, cap;
+} manifest_t;
+
+typedef struct hash_job {
+  int root_fd;
+  manifest_entry_t *entry;
+  int err;
+} hash_job_t;
+
+static void manifest_free(manifest_t *manifest) {
+  for (size_t i = 0; i < manifest->len; ++i)
+    free(manifest->entries[i].path);
+  free(manifest->entries);
+  memset(manifest, 0, sizeof(manifest_t));
+}
+
+static manifest_entry_t *manifest_add(manifest_t *manifest) {
+  if (manifest->len == manifest->cap) {
+    const size_t cap = manifest->cap ? 2*manifest->cap : 0x400;
+    manifest_entry_t *tmp = realloc(manifest->entries, cap * sizeof(manifest_entry_t));
+    if (!tmp) {
+      perror("realloc");
+      return NULL;
+    }
+    manifest->entries = tmp;
+    manifest->cap = cap;
+  }
+
+  manifest_entry_t * const entry = manifest->entries + manifest->len++;
+  memset(entry, 0, sizeof(manifest_entry_t));
+  return entry;
+}
+
+char *manifest_path(const char *snapshot) {
+  char *dir_copy = strdup(snapshot), *base_copy = strdup(snapshot);
+  char *dir = dir_copy ? pathcat(dirname(dir_copy), MANIFEST_DIR) : NULL;
+  char *path = dir && base_copy ? pathcat(dir, basename(base_copy)) : NULL;
+  free(dir);
+  free(dir_copy);
+  free(base_copy);
+  return path;
+}
+
+typedef struct dir_entry {
+  char *name;
+  uint64_t ino;
+} dir_entry_t;
+
+static int compare_dir_entries(const void *a, const void *b) {
+  return strcmp(((const dir_entry_t *) a)->name, ((const dir_entry_t *) b)->name);
+}
+
+/* Hash a directory's sorted entry names and inode numbers, which changes if
+ * any entry is added, removed, or replaced by another file.
+ */
+static int hash_dir(int fd, uint64_t *hash) {
+  CLEANUP_DECLARE(ret);
+
+  dir_entry_t *entries = NULL;
+  size_t len = 0, cap = 0;
+
+  DIR * const dp = fdopendir(fd);
+  if (!dp) {
+    close(fd);
+    return -1;
+  }
+
+  struct dirent *ep;
+  errno = 0;
+  while ((ep = readdir(dp))) {
+    if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
+      continue;
+
+    if (len == cap) {
+      cap = cap ? 2*cap : 0x40;
+      dir_entry_t *tmp = realloc(entries, cap * sizeof(dir_entry_t));
+      if (!tmp) {
+        FAIL(ret);
+      }
+      entries = tmp;
+    }
+    entries[len].ino = ep->d_ino;
+    if (!(entries[len++].name = strdup(ep->d_name))) {
+      FAIL(ret);
+    }
+    errno = 0;
+  }
+  if (errno) {
+    FAIL(ret);
+  }
+
+  qsort(entries, len, sizeof(dir_entry_t), compare_dir_entries);
+
+  xxh64_state_t state;
+  xxh64_reset(&state, 0);
+  for (size_t i = 0; i < len; ++i) {
+    const uint64_t ino = htole64(entries[i].ino);
+    xxh64_update(&state, entries[i].name, strlen(entries[i].name) + 1);
+    xxh64_update(&state, &ino, sizeof(ino));
+  }
+  *hash = xxh64_digest(&state);
+
+CLEANUP:
+  for (size_t i = 0; i < len; ++i)
+    free(entries[i].name);
+  free(entries);
+  closedir(dp);
+  return ret;
+}
+
+static int hash_file(int fd, uint64_t *hash) {
+  char * const buf = malloc(MANIFEST_BUF_LEN);
+  if (!buf) {
+    close(fd);
+    return -1;
+  }
+
+  xxh64_state_t state;
+  xxh64_reset(&state, 0);
+
+  ssize_t n;
+  while ((n = read(fd, buf, MANIFEST_BUF_LEN)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    xxh64_update(&state, buf, n);
+  }
+
+  free(buf);
+  close(fd);
+  if (n < 0)
+    return -1;
+
+  *hash = xxh64_digest(&state);
+  return 0;
+}
+
+// Hash the entry at `path` below `root_fd` according to its type
+static int hash_entry(int root_fd, const char *path, char type, uint64_t *hash) {
+  if (type == 'l') {
+    char target[PATH_MAX];
+    const ssize_t len = readlinkat(root_fd, path, target, sizeof(target));
+    if (len < 0)
+      return -1;
+    *hash = xxh64(target, len, 0);
+    return 0;
+  }
+
+  const int fd = openat(root_fd, path,
+      O_RDONLY | O_CLOEXEC | O_NOFOLLOW | (type == 'd' ? O_DIRECTORY : 0));
+  if (fd < 0)
+    return -1;
+  return type == 'd' ? hash_dir(fd, hash) : hash_file(fd, hash);
+}
+
+// Worker job: fill in the hash of a single manifest entry
+static void hash_job(void *arg) {
+  hash_job_t * const job = arg;
+  if (hash_entry(job->root_fd, job->entry->path, job->entry->type, &job->entry->hash)) {
+    job->err = errno;
+    eprintf("error: %s: %s\n", job->entry->path, strerror(errno));
+  }
+}
+
+// nftw() takes no context argument, so the walk goes through these
+static manifest_t *walking;
+static size_t walking_root_len;
+
+static int collect_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  char type;
+  if (S_ISREG(sb->st_mode))
+    type = 'f';
+  else if (S_ISDIR(sb->st_mode))
+    type = 'd';
+  else if (S_ISLNK(sb->st_mode))
+    type = 'l';
+  else
+    return 0;
+
+  // Each entry takes up one line in the manifest
+  const char * const rel = path + walking_root_len + 1;
+  if (strchr(rel, '\n')) {
+    eprintf("warning: skipping `%s`: name contains a newline\n", rel);
+    return 0;
+  }
+
+  manifest_entry_t * const entry = manifest_add(walking);
+  if (!entry || !(entry->path = strdup(rel)))
+    return -1;
+
+  entry->type = type;
+  entry->size = sb->st_size;
+  entry->ino = sb->st_ino;
+  entry->mtime = sb->st_mtim;
+  return 0;
+}
+
+static int manifest_write(const manifest_t *manifest, const char *path) {
+  CLEANUP_DECLARE(ret);
+
+  char *tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+  FILE *fp = NULL;
+  if (!tmp_path) {
+    perror("malloc");
+    FAIL(ret);
+  }
+  sprintf(tmp_path, "%s.tmp", path);
+
+  if (!(fp = fopen(tmp_path, "w"))) {
+    perror("fopen");
+    FAIL(ret);
+  }
+
+  fprintf(fp, "btrroll-manifest %d %" PRIu64 " %" PRIu64 "\n",
+      MANIFEST_VERSION, manifest->subvol_id, manifest->generation);
+  for (size_t i = 0; i < manifest->len; ++i) {
+    const manifest_entry_t * const e = manifest->entries + i;
+    fprintf(fp, "%c %016" PRIx64 " %" PRIu64 " %lld.%09ld %" PRIu64 " %s\n",
+        e->type, e->hash, e->size, (long long) e->mtime.tv_sec, e->mtime.tv_nsec,
+        e->ino, e->path);
+  }
+
+  // Only replace the old manifest once the new one is safely on disk
+  if (fflush(fp) || fsync(fileno(fp))) {
+    perror("fsync");
+    FAIL(ret);
+  }
+  if (fclose(fp)) {
+    fp = NULL;
+    perror("fclose");
+    FAIL(ret);
+  }
+  fp = NULL;
+
+  if (rename(tmp_path, path)) {
+    perror("rename");
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (fp)
+    fclose(fp);
+  if (ret && tmp_path)
+    unlink(tmp_path);
+  free(tmp_path);
+  return ret;
+}
+
+int manifest_create(const char *snapshot) {
+  CLEANUP_DECLARE(ret);
+
+  manifest_t manifest = { 0 };
+  hash_job_t *jobs = NULL;
+  char *path = NULL;
+  int root_fd = -1;
+
+  if (!snapshot) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Take the generation first, so that anything written during the walk is
+  // rechecked later rather than trusted
+  struct btrfs_util_subvolume_info info;
+  enum btrfs_util_error err = btrfs_util_subvolume_info(snapshot, 0, &info);
+  if (err) {
+    eprintf("error: %s\n", btrfs_util_strerror(err));
+    FAIL(ret);
+  }
+  manifest.subvol_id = info.id;
+  manifest.generation = info.generation;
+
+  walking = &manifest;
+  walking_root_len = strlen(snapshot);
+  for (size_t i = 0; i < lenof(BOOT_PATHS); ++i) {
+    char *root = pathcat(snapshot, BOOT_PATHS[i]);
+    if (!root || (nftw(root, collect_entry, 64, FTW_PHYS | FTW_MOUNT) && errno != ENOENT)) {
+      perror("nftw");
+      free(root);
+      walking = NULL;
+      FAIL(ret);
+    }
+    free(root);
+  }
+  walking = NULL;
+
+  if ((root_fd = open(snapshot, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    perror("open");
+    FAIL(ret);
+  }
+
+  // Hashing is the bulk of the work, so spread it over every CPU
+  if (!(jobs = calloc(manifest.len ? manifest.len : 1, sizeof(hash_job_t)))) {
+    perror("calloc");
+    FAIL(ret);
+  }
+
+  workers_t * const workers = workers_create(0);
+  for (size_t i = 0; i < manifest.len; ++i) {
+    jobs[i] = (hash_job_t) { root_fd, manifest.entries + i, 0 };
+    if (!workers || workers_submit(workers, hash_job, jobs + i))
+      hash_job(jobs + i);
+  }
+  if (workers)
+    workers_destroy(workers);
+
+  for (size_t i = 0; i < manifest.len; ++i) {
+    if (jobs[i].err) {
+      errno = jobs[i].err;
+      FAIL(ret);
+    }
+  }
+
+  if (!(path = manifest_path(snapshot))) {
+    perror("manifest_path");
+    FAIL(ret);
+  }
+
+  { // Create the hidden manifests directory beside the snapshot if needed
+    char *copy = strdup(path);
+    if (!copy || (mkdir(dirname(copy), 0755) && errno != EEXIST)) {
+      perror("mkdir");
+      free(copy);
+      FAIL(ret);
+    }
+    free(copy);
+  }
+
+  if (manifest_write(&manifest, path)) {
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (root_fd >= 0)
+    close(root_fd);
+  free(path);
+  free(jobs);
+  manifest_free(&manifest);
+  return ret;
+}
+
+static int manifest_read(const char *path, manifest_t *manifest) {
+  CLEANUP_DECLARE(ret);
+
+  char *line = NULL;
+  size_t line_cap = 0;
+
+  FILE * const fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+
+  int version;
+  if (getline(&line, &line_cap, fp) < 0 ||
+      sscanf(line, "btrroll-manifest %d %" SCNu64 " %" SCNu64,
+        &version, &manifest->subvol_id, &manifest->generation) != 3 ||
+      version != MANIFEST_VERSION)
+  {
+    eprintf("error: %s: not a valid manifest\n", path);
+    errno = EINVAL;
+    FAIL(ret);
+  }
+
+  ssize_t len;
+  while ((len = getline(&line, &line_cap, fp)) > 0) {
+    if (line[len - 1] == '\n')
+      line[len - 1] = '\0';
+
+    manifest_entry_t e;
+    long long sec;
+    int offset = 0;
+    if (sscanf(line, "%c %" SCNx64 " %" SCNu64 " %lld.%ld %" SCNu64 " %n",
+          &e.type, &e.hash, &e.size, &sec, &e.mtime.tv_nsec, &e.ino, &offset) != 6 ||
+        !offset)
+    {
+      eprintf("error: %s: malformed entry: %s\n", path, line);
+      errno = EINVAL;
+      FAIL(ret);
+    }
+    e.mtime.tv_sec = sec;
+
+    manifest_entry_t * const entry = manifest_add(manifest);
+    if (!entry) {
+      FAIL(ret);
+    }
+    *entry = e;
+    if (!(entry->path = strdup(line + offset))) {
+      --manifest->len;
+      FAIL(ret);
+    }
+  }
+
+CLEANUP:
+  free(line);
+  fclose(fp);
+  return ret;
+}
+
+typedef struct changed_inodes {
+  uint64_t transid;
+  uint64_t *inodes; // in ascending order, as found by the tree search
+  size_t len, cap;
+} changed_inodes_t;
+
+static int collect_changed_inode(
+    const struct btrfs_ioctl_search_header *header,
+    const void *item,
+    void *arg)
+{
+  changed_inodes_t * const changed = arg;
+
+  if (header->type != BTRFS_INODE_ITEM_KEY ||
+      header->len < sizeof(struct btrfs_inode_item))
+    return 0;
+
+  // Leaves are filtered by generation, but not the items within them
+  struct btrfs_inode_item inode;
+  memcpy(&inode, item, sizeof(inode));
+  if (le64toh(inode.transid) <= changed->transid)
+    return 0;
+
+  if (changed->len == changed->cap) {
+    const size_t cap = changed->cap ? 2*changed->cap : 0x100;
+    uint64_t *tmp = realloc(changed->inodes, cap * sizeof(uint64_t));
+    if (!tmp) {
+      perror("realloc");
+      return -1;
+    }
+    changed->inodes = tmp;
+    changed->cap = cap;
+  }
+  changed->inodes[changed->len++] = header->objectid;
+  return 0;
+}
+
+static int compare_inodes(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static bool is_boot_path(const char *path) {
+  for (size_t i = 0; i < lenof(BOOT_PATHS); ++i)
+    if (!strcmp(path, BOOT_PATHS[i]))
+      return true;
+  return false;
+}
+
+// Whether the entry still matches what was recorded for it
+static bool entry_intact(int root_fd, const manifest_entry_t *entry) {
+  struct stat sb;
+  if (fstatat(root_fd, entry->path, &sb, AT_SYMLINK_NOFOLLOW))
+    return false;
+
+  const char type = S_ISREG(sb.st_mode) ? 'f'
+    : S_ISDIR(sb.st_mode) ? 'd'
+    : S_ISLNK(sb.st_mode) ? 'l' : '?';
+  if (type != entry->type || sb.st_ino != entry->ino ||
+      (type != 'd' && (uint64_t) sb.st_size != entry->size) ||
+      sb.st_mtim.tv_sec != entry->mtime.tv_sec || sb.st_mtim.tv_nsec != entry->mtime.tv_nsec)
+    return false;
+
+  uint64_t hash;
+  return !hash_entry(root_fd, entry->path, entry->type, &hash) && hash == entry->hash;
+}
+
+int manifest_check(const char *snapshot) {
+  CLEANUP_DECLARE(ret);
+
+  manifest_t manifest = { 0 };
+  changed_inodes_t changed = { 0 };
+  int root_fd = -1;
+
+  if (!snapshot) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  char * const path = manifest_path(snapshot);
+  if (!path) {
+    perror("manifest_path");
+    return -1;
+  }
+
+  if (manifest_read(path, &manifest)) {
+    if (errno == ENOENT) {
+      ret = MANIFEST_MISSING;
+      goto CLEANUP;
+    }
+    FAIL(ret);
+  }
+
+  struct btrfs_util_subvolume_info info;
+  enum btrfs_util_error err = btrfs_util_subvolume_info(snapshot, 0, &info);
+  if (err) {
+    eprintf("error: %s\n", btrfs_util_strerror(err));
+    FAIL(ret);
+  }
+
+  // The manifest belongs to some other subvolume that had the same name
+  if (info.id != manifest.subvol_id) {
+    ret = MANIFEST_MISSING;
+    goto CLEANUP;
+  }
+
+  // Nothing at all has been written to the subvolume since
+  if (info.generation == manifest.generation) {
+    ret = MANIFEST_INTACT;
+    goto CLEANUP;
+  }
+
+  if ((root_fd = open(snapshot, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    perror("open");
+    FAIL(ret);
+  }
+
+  // Every inode in the subvolume written after the manifest was made
+  const struct btrfs_ioctl_search_key key = {
+    .tree_id = 0,
+    .min_objectid = BTRFS_FIRST_FREE_OBJECTID,
+    .max_objectid = BTRFS_LAST_FREE_OBJECTID,
+    .min_type = BTRFS_INODE_ITEM_KEY,
+    .max_type = BTRFS_INODE_ITEM_KEY,
+    .min_offset = 0,
+    .max_offset = UINT64_MAX,
+    .min_transid = manifest.generation + 1,
+    .max_transid = UINT64_MAX,
+  };
+  changed.transid = manifest.generation;
+  if (tree_search(root_fd, &key, collect_changed_inode, &changed)) {
+    perror("tree_search");
+    FAIL(ret);
+  }
+
+  // Only entries whose inodes were written need to be looked at again. Deleting
+  // an entry writes its directory, which is recorded too, except for the boot
+  // paths themselves; those are always looked at.
+  ret = MANIFEST_INTACT;
+  for (size_t i = 0; i < manifest.len; ++i) {
+    const manifest_entry_t * const entry = manifest.entries + i;
+    if ((is_boot_path(entry->path) ||
+          bsearch(&entry->ino, changed.inodes, changed.len, sizeof(uint64_t), compare_inodes)) &&
+        !entry_intact(root_fd, entry))
+    {
+      eprintf("%s: %s has changed\n", snapshot, entry->path);
+      ret = MANIFEST_MODIFIED;
+      break;
+    }
+  }
+
+CLEANUP:
+  if (root_fd >= 0)
+    close(root_fd);
+  free(changed.inodes);
+  manifest_free(&manifest);
+  free(path);
+  return ret;
+}
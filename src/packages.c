@@ -0,0 +1,367 @@
+#include <btrfsutil.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <macros.h>
+#include <packages.h>
+#include <path.h>
+#include <workers.h>
+
+#define CACHE_LEN 16
+
+// Loaded databases, most recently loaded first
+static package_db_t *cache[CACHE_LEN];
+static size_t cache_len = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct desc_job {
+  char *path;
+  size_t index;
+  package_t *package;
+} desc_job_t;
+
+static void package_db_free(package_db_t *db) {
+  for (size_t i = 0; i < db->len; ++i) {
+    free(db->packages[i].name);
+    free(db->packages[i].version);
+  }
+  free(db->packages);
+  free(db);
+}
+
+// Drop a reference to `db`; call with the cache lock held
+static void package_db_unref(package_db_t *db) {
+  if (!--db->refs)
+    package_db_free(db);
+}
+
+/* pacman names each entry of its local database `name-pkgver-pkgrel`, where
+ * neither pkgver nor pkgrel may contain a dash, so the name and version can
+ * be recovered from the entry name alone without opening its `desc` file.
+ */
+static bool split_entry_name(const char *entry, package_t *package) {
+  const char *rel = strrchr(entry, '-');
+  if (!rel || rel == entry || !rel[1])
+    return false;
+
+  const char *ver = rel - 1;
+  while (ver > entry && *ver != '-')
+    --ver;
+  if (ver == entry || ver + 1 == rel)
+    return false;
+
+  package->name = strndup(entry, ver - entry);
+  package->version = strdup(ver + 1);
+  return package->name && package->version;
+}
+
+/* Worker job: read the name and version from a `desc` file. These are the
+ * first two fields, so the rest of the file is never read.
+ */
+static void parse_desc(void *arg) {
+  desc_job_t * const job = arg;
+
+  FILE * const fp = fopen(job->path, "r");
+  if (!fp) {
+    perror("fopen");
+    return;
+  }
+
+  char line[0x400];
+  char **field = NULL;
+  while (fgets(line, sizeof(line), fp) &&
+      !(job->package->name && job->package->version))
+  {
+    line[strcspn(line, "\n")] = '\0';
+
+    if (!strcmp(line, "%NAME%"))
+      field = &job->package->name;
+    else if (!strcmp(line, "%VERSION%"))
+      field = &job->package->version;
+    else if (field && line[0] && !*field)
+      *field = strdup(line);
+    else
+      field = NULL;
+  }
+
+  if (fclose(fp))
+    perror("fclose");
+}
+
+static int compare_packages(const void *a, const void *b) {
+  return strcmp(((const package_t *) a)->name, ((const package_t *) b)->name);
+}
+
+static int package_db_read(const char *root, package_db_t *db) {
+  CLEANUP_DECLARE(ret);
+
+  char *path = pathcat(root, PACMAN_LOCAL_DB);
+  DIR *dp = path ? opendir(path) : NULL;
+  desc_job_t *jobs = NULL;
+  size_t jobs_len = 0, cap = 0;
+
+  if (!dp) {
+    perror("opendir");
+    FAIL(ret);
+  }
+
+  struct dirent *ep;
+  errno = 0;
+  while ((ep = readdir(dp))) {
+    if (ep->d_name[0] == '.' || (ep->d_type != DT_DIR && ep->d_type != DT_UNKNOWN))
+      continue;
+
+    if (db->len == cap) {
+      cap = cap ? 2*cap : 0x400;
+      package_t *tmp = realloc(db->packages, cap * sizeof(package_t));
+      desc_job_t *tmp_jobs = realloc(jobs, cap * sizeof(desc_job_t));
+      if (tmp)
+        db->packages = tmp;
+      if (tmp_jobs)
+        jobs = tmp_jobs;
+      if (!tmp || !tmp_jobs) {
+        perror("realloc");
+        FAIL(ret);
+      }
+    }
+
+    package_t * const package = db->packages + db->len++;
+    memset(package, 0, sizeof(package_t));
+
+    // Fall back to parsing `desc` for entries not named the usual way
+    if (!split_entry_name(ep->d_name, package)) {
+      free(package->name);
+      free(package->version);
+      memset(package, 0, sizeof(package_t));
+
+      char *entry = pathcat(path, ep->d_name);
+      jobs[jobs_len].path = entry ? pathcat(entry, "desc") : NULL;
+      jobs[jobs_len].index = db->len - 1;
+      free(entry);
+      if (!jobs[jobs_len++].path) {
+        perror("pathcat");
+        FAIL(ret);
+      }
+    }
+    errno = 0;
+  }
+  if (errno) {
+    perror("readdir");
+    FAIL(ret);
+  }
+
+  // The package list may have moved while growing, so only now point into it
+  for (size_t i = 0; i < jobs_len; ++i)
+    jobs[i].package = db->packages + jobs[i].index;
+
+  if (jobs_len) {
+    workers_t * const workers = workers_create(0);
+    for (size_t i = 0; i < jobs_len; ++i)
+      if (!workers || workers_submit(workers, parse_desc, jobs + i))
+        parse_desc(jobs + i);
+    workers_destroy(workers);
+  }
+
+  // Drop anything that could not be made sense of
+  size_t len = 0;
+  for (size_t i = 0; i < db->len; ++i) {
+    package_t * const package = db->packages + i;
+    if (package->name && package->version) {
+      db->packages[len++] = *package;
+    } else {
+      free(package->name);
+      free(package->version);
+    }
+  }
+  db->len = len;
+
+  qsort(db->packages, db->len, sizeof(package_t), compare_packages);
+
+CLEANUP:
+  for (size_t i = 0; i < jobs_len; ++i)
+    free(jobs[i].path);
+  free(jobs);
+  if (dp && closedir(dp))
+    perror("closedir");
+  free(path);
+  return ret;
+}
+
+const package_db_t *package_db_load(const char *root) {
+  if (!root) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  // Trees that are not subvolumes can't be cached, since there's no generation
+  struct btrfs_util_subvolume_info info;
+  if (btrfs_util_subvolume_info(root, 0, &info) != BTRFS_UTIL_OK)
+    memset(&info, 0, sizeof(info));
+
+  package_db_t *db = NULL;
+  pthread_mutex_lock(&cache_lock);
+  for (size_t i = 0; i < cache_len && info.id; ++i) {
+    if (cache[i]->subvol_id == info.id && cache[i]->generation == info.generation) {
+      db = cache[i];
+      ++db->refs;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if (db)
+    return db;
+
+  if (!(db = calloc(1, sizeof(package_db_t)))) {
+    perror("calloc");
+    return NULL;
+  }
+  if (package_db_read(root, db)) {
+    const int err = errno;
+    package_db_free(db);
+    errno = err;
+    return NULL;
+  }
+  db->subvol_id = info.id;
+  db->generation = info.generation;
+  db->refs = 1;
+
+  if (!info.id)
+    return db;
+
+  // Put it at the front of the cache, evicting the oldest entry if needed
+  pthread_mutex_lock(&cache_lock);
+  if (cache_len == CACHE_LEN)
+    package_db_unref(cache[--cache_len]);
+  memmove(cache + 1, cache, cache_len * sizeof(package_db_t *));
+  cache[0] = db;
+  ++cache_len;
+  ++db->refs;
+  pthread_mutex_unlock(&cache_lock);
+
+  return db;
+}
+
+void package_db_release(const package_db_t *db) {
+  if (!db)
+    return;
+
+  pthread_mutex_lock(&cache_lock);
+  package_db_unref((package_db_t *) db);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// Compare two version segments as pacman's rpmvercmp does
+static int rpmvercmp(const char *a, const char *b) {
+  if (!strcmp(a, b))
+    return 0;
+
+  const char *one = a, *two = b;
+  while (*one && *two) {
+    const char *sep1 = one, *sep2 = two;
+    while (*one && !isalnum(*one))
+      ++one;
+    while (*two && !isalnum(*two))
+      ++two;
+
+    if (!*one || !*two)
+      break;
+
+    // A longer separator means a newer version
+    if (one - sep1 != two - sep2)
+      return one - sep1 < two - sep2 ? -1 : 1;
+
+    // Grab the next completely numeric or completely alphabetic segment
+    const char *seg1 = one, *seg2 = two;
+    const bool is_num = isdigit(*seg1);
+    if (is_num) {
+      while (isdigit(*one))
+        ++one;
+      while (isdigit(*two))
+        ++two;
+    } else {
+      while (isalpha(*one))
+        ++one;
+      while (isalpha(*two))
+        ++two;
+    }
+
+    // Numeric segments are always newer than alphabetic ones
+    if (two == seg2)
+      return is_num ? 1 : -1;
+
+    if (is_num) {
+      while (*seg1 == '0' && seg1 + 1 < one)
+        ++seg1;
+      while (*seg2 == '0' && seg2 + 1 < two)
+        ++seg2;
+
+      // Without leading zeroes, the longer number is the bigger one
+      if (one - seg1 != two - seg2)
+        return one - seg1 > two - seg2 ? 1 : -1;
+    }
+
+    const size_t len1 = one - seg1, len2 = two - seg2;
+    int rc = strncmp(seg1, seg2, len1 < len2 ? len1 : len2);
+    if (!rc && len1 != len2)
+      rc = len1 < len2 ? -1 : 1;
+    if (rc)
+      return rc < 0 ? -1 : 1;
+  }
+
+  // Every segment matched, but the separators were different
+  if (!*one && !*two)
+    return 0;
+
+  // A remaining alphabetic segment (e.g. `1.0alpha` vs `1.0`) is older
+  if ((!*one && !isalpha(*two)) || isalpha(*one))
+    return -1;
+  return 1;
+}
+
+// Split [epoch:]version[-release] in place
+static void parse_evr(char *evr, const char **epoch, const char **version, const char **release) {
+  char *s = evr;
+  while (isdigit(*s))
+    ++s;
+
+  if (*s == ':') {
+    *epoch = s == evr ? "0" : evr;
+    *s++ = '\0';
+    *version = s;
+  } else {
+    *epoch = "0";
+    *version = evr;
+  }
+
+  char *rel = strrchr(*version, '-');
+  if (rel)
+    *rel++ = '\0';
+  *release = rel;
+}
+
+int package_vercmp(const char *a, const char *b) {
+  if (!strcmp(a, b))
+    return 0;
+
+  char buf_a[0x100], buf_b[0x100];
+  snprintf(buf_a, sizeof(buf_a), "%s", a);
+  snprintf(buf_b, sizeof(buf_b), "%s", b);
+
+  const char *epoch_a, *version_a, *release_a;
+  const char *epoch_b, *version_b, *release_b;
+  parse_evr(buf_a, &epoch_a, &version_a, &release_a);
+  parse_evr(buf_b, &epoch_b, &version_b, &release_b);
+
+  int ret = rpmvercmp(epoch_a, epoch_b);
+  if (!ret)
+    ret = rpmvercmp(version_a, version_b);
+  if (!ret && release_a && release_b)
+    ret = rpmvercmp(release_a, release_b);
+  return ret;
+}
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include <btrfsutil.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/openat2.h>
+#include <mntent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <macros.h>
+#include <probe.h>
+
+// Only the type and mode are ever needed, so don't sync
+#define STATX_FLAGS (AT_STATX_DONT_SYNC | AT_NO_AUTOMOUNT)
+
+static const struct {
+  probe_problem_t problem;
+  const char *description;
+} DESCRIPTIONS[] = {
+  { PROBE_NO_INIT, "no init" },
+  { PROBE_NO_MODULES, "no modules" },
+  { PROBE_NO_FSTAB, "no fstab" },
+  { PROBE_MISSING_SUBVOL, "missing subvolume" },
+};
+
+/* Open `path` as if `root_fd` were the root directory, so that absolute
+ * symlinks (e.g. /sbin/init -> /usr/lib/systemd/systemd) resolve within the
+ * snapshot rather than the initrd.
+ */
+static int open_in_root(int root_fd, const char *path, int flags) {
+  struct open_how how = {
+    .flags = flags | O_CLOEXEC,
+    .resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS,
+  };
+  int fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+  if (fd < 0 && errno == ENOSYS)
+    fd = openat(root_fd, path, flags | O_CLOEXEC); // before Linux 5.6
+  return fd;
+}
+
+static bool has_init(int root_fd) {
+  const int fd = open_in_root(root_fd, "sbin/init", O_PATH);
+  if (fd < 0)
+    return false;
+
+  struct statx stx;
+  const bool ok = !statx(fd, "", AT_EMPTY_PATH | STATX_FLAGS, STATX_TYPE | STATX_MODE, &stx) &&
+    S_ISREG(stx.stx_mode) && (stx.stx_mode & 0111);
+  close(fd);
+  return ok;
+}
+
+// Whether there is at least one kernel's worth of modules
+static bool has_modules(int root_fd) {
+  const int fd = open_in_root(root_fd, "usr/lib/modules", O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return false;
+
+  DIR * const dp = fdopendir(fd);
+  if (!dp) {
+    close(fd);
+    return false;
+  }
+
+  bool found = false;
+  struct dirent *ep;
+  while (!found && (ep = readdir(dp)))
+    found = ep->d_name[0] != '.';
+
+  closedir(dp);
+  return found;
+}
+
+// Get the UUID of the filesystem containing `fd` in its usual text form
+static int get_fsid(int fd, char *buf, size_t len) {
+  struct btrfs_ioctl_fs_info_args args = { 0 };
+  if (ioctl(fd, BTRFS_IOC_FS_INFO, &args) < 0)
+    return -1;
+
+  const uint8_t * const u = args.fsid;
+  snprintf(buf, len,
+      "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+      u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+      u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+  return 0;
+}
+
+// Whether an fstab entry's device refers to the filesystem with UUID `fsid`
+static bool same_filesystem(const char *spec, const char *fsid) {
+  static const char * const PREFIXES[] = { "UUID=", "/dev/disk/by-uuid/" };
+  for (size_t i = 0; i < lenof(PREFIXES); ++i) {
+    const size_t len = strlen(PREFIXES[i]);
+    if (!strncmp(spec, PREFIXES[i], len))
+      return !strcasecmp(spec + len, fsid);
+  }
+
+  // Other kinds of device (labels, device nodes) can't be resolved in here
+  return false;
+}
+
+/* Check that each subvolume mounted by the fstab in `fp` from the filesystem
+ * with UUID `fsid`, whose top-level subvolume is open as `top_fd`, exists.
+ * Entries which are allowed to fail are ignored.
+ */
+static void check_fstab_entries(FILE *fp, int top_fd, const char *fsid, int *problems) {
+  struct mntent ent;
+  char buf[0x1000];
+  while (getmntent_r(fp, &ent, buf, sizeof(buf))) {
+    if (strcmp(ent.mnt_type, "btrfs") || !same_filesystem(ent.mnt_fsname, fsid) ||
+        hasmntopt(&ent, "nofail") || hasmntopt(&ent, "noauto"))
+      continue;
+
+    // hasmntopt matches the option's name only, so skip past the `=` here
+    char *opt;
+    if ((opt = hasmntopt(&ent, "subvol")) && opt[strlen("subvol")] == '=') {
+      opt += strlen("subvol=");
+      opt[strcspn(opt, ",")] = '\0';
+      while (*opt == '/')
+        ++opt;
+      if (!*opt)
+        continue;
+
+      // A plain directory at that path won't do
+      const int fd = openat(top_fd, opt, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0 || btrfs_util_is_subvolume_fd(fd) != BTRFS_UTIL_OK)
+        *problems |= PROBE_MISSING_SUBVOL;
+      if (fd >= 0)
+        close(fd);
+    }
+    else if ((opt = hasmntopt(&ent, "subvolid")) && opt[strlen("subvolid")] == '=') {
+      const uint64_t id = strtoull(opt + strlen("subvolid="), NULL, 10);
+      struct btrfs_util_subvolume_info info;
+      if (id && btrfs_util_subvolume_info_fd(top_fd, id, &info) != BTRFS_UTIL_OK)
+        *problems |= PROBE_MISSING_SUBVOL;
+    }
+  }
+}
+
+// Check the subvolumes mounted by the snapshot's fstab (see check_fstab_entries)
+static int check_fstab(int root_fd, const char *toplevel, int *problems) {
+  const int fd = open_in_root(root_fd, "etc/fstab", O_RDONLY);
+  if (fd < 0) {
+    *problems |= PROBE_NO_FSTAB;
+    return 0;
+  }
+
+  FILE * const fp = fdopen(fd, "r");
+  if (!fp) {
+    close(fd);
+    return -1;
+  }
+
+  const int top_fd = toplevel ? open(toplevel, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+  char fsid[0x30];
+  if (top_fd < 0 || get_fsid(top_fd, arr_and_size(fsid))) {
+    if (top_fd >= 0)
+      close(top_fd);
+    fclose(fp);
+    return 0; // nothing to check the subvolumes against
+  }
+
+  check_fstab_entries(fp, top_fd, fsid, problems);
+
+  close(top_fd);
+  fclose(fp);
+  return 0;
+}
+
+int probe_snapshot(const char *snapshot, const char *toplevel) {
+  if (!snapshot) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  const int root_fd = open(snapshot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0)
+    return -1;
+
+  int problems = 0;
+  if (!has_init(root_fd))
+    problems |= PROBE_NO_INIT;
+  if (!has_modules(root_fd))
+    problems |= PROBE_NO_MODULES;
+  if (check_fstab(root_fd, toplevel, &problems))
+    perror("check_fstab");
+
+  close(root_fd);
+  return problems;
+}
+
+void probe_describe(int problems, char *buf, size_t len) {
+  if (!len)
+    return;
+
+  buf[0] = '\0';
+  if (problems < 0) {
+    snprintf(buf, len, "unknown");
+    return;
+  }
+  if (!problems) {
+    snprintf(buf, len, "ok");
+    return;
+  }
+
+  size_t used = 0;
+  for (size_t i = 0; i < lenof(DESCRIPTIONS) && used < len; ++i)
+    if (problems & DESCRIPTIONS[i].problem)
+      used += snprintf(buf + used, len - used, "%s%s",
+          used ? ", " : "", DESCRIPTIONS[i].description);
+}
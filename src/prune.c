@@ -0,0 +1,257 @@
+#include <btrfsutil.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <macros.h>
+#include <path.h>
+#include <prune.h>
+#include <qgroup.h>
+
+typedef enum bucket {
+  BUCKET_HOUR,
+  BUCKET_DAY,
+  BUCKET_WEEK,
+} bucket_t;
+
+static int parse_size(const char *s, uint64_t *size) {
+  static const char UNITS[] = "KMGTPE";
+
+  char *end;
+  errno = 0;
+  uint64_t n = strtoull(s, &end, 10);
+  if (errno || end == s)
+    return -1;
+
+  if (*end) {
+    const char * const unit = strchr(UNITS, toupper(*end));
+    if (!unit || (end[1] && strcmp(end + 1, "B") && strcmp(end + 1, "iB")))
+      return -1;
+    for (const char *u = UNITS; u <= unit; ++u)
+      n *= 1024;
+  }
+
+  *size = n;
+  return 0;
+}
+
+int prune_policy_parse(prune_policy_t *policy, const char *spec) {
+  memset(policy, 0, sizeof(prune_policy_t));
+
+  char *copy = strdup(spec), *saveptr = NULL;
+  if (!copy)
+    return -1;
+
+  int ret = 0;
+  for (char *word = strtok_r(copy, " \t", &saveptr); word && !ret;
+      word = strtok_r(NULL, " \t", &saveptr))
+  {
+    char *value = strchr(word, '=');
+    if (!value) {
+      ret = -1;
+      break;
+    }
+    *value++ = '\0';
+
+    unsigned long *count = NULL;
+    if (!strcmp(word, "keep-last"))
+      count = &policy->keep_last;
+    else if (!strcmp(word, "hourly"))
+      count = &policy->hourly;
+    else if (!strcmp(word, "daily"))
+      count = &policy->daily;
+    else if (!strcmp(word, "weekly"))
+      count = &policy->weekly;
+    else if (!strcmp(word, "min-free"))
+      ret = parse_size(value, &policy->min_free);
+    else
+      ret = -1;
+
+    if (count) {
+      char *end;
+      *count = strtoul(value, &end, 10);
+      if (!*value || *end)
+        ret = -1;
+    }
+  }
+
+  free(copy);
+  if (ret)
+    errno = EINVAL;
+  return ret;
+}
+
+// Identify the hour, day or week (in local time) that `t` falls into
+static long bucket_key(time_t t, bucket_t bucket) {
+  struct tm tm;
+  localtime_r(&t, &tm);
+
+  switch (bucket) {
+    case BUCKET_HOUR:
+      return ((tm.tm_year * 366L) + tm.tm_yday) * 24 + tm.tm_hour;
+    case BUCKET_DAY:
+      return (tm.tm_year * 366L) + tm.tm_yday;
+    case BUCKET_WEEK: {
+      char week[0x10];
+      strftime(week, sizeof(week), "%G%V", &tm);
+      return atol(week);
+    }
+  }
+  return 0;
+}
+
+// Keep the newest snapshot in each of the `count` newest buckets
+static void keep_buckets(
+    const snapshot_list_t *list, const size_t *order,
+    bucket_t bucket, unsigned long count, bool *keep)
+{
+  long last = 0;
+  bool first = true;
+  for (size_t i = 0; i < list->len && count; ++i) {
+    const long key = bucket_key(list->entries[order[i]].otime, bucket);
+    if (first || key != last) {
+      keep[order[i]] = true;
+      --count;
+    }
+    last = key;
+    first = false;
+  }
+}
+
+// Used by qsort to order snapshots newest first
+static const snapshot_list_t *sorting;
+
+static int compare_newest_first(const void *a, const void *b) {
+  const time_t x = sorting->entries[*(const size_t *) a].otime;
+  const time_t y = sorting->entries[*(const size_t *) b].otime;
+  return x > y ? -1 : x < y;
+}
+
+int prune_plan(
+    const snapshot_list_t *list, const char *path,
+    const prune_policy_t *policy, bool *doomed)
+{
+  CLEANUP_DECLARE(ret);
+
+  size_t *order = malloc((list->len ? list->len : 1) * sizeof(size_t));
+  bool *keep = calloc(list->len ? list->len : 1, sizeof(bool));
+  if (!order || !keep) {
+    perror("malloc");
+    FAIL(ret);
+  }
+
+  for (size_t i = 0; i < list->len; ++i)
+    order[i] = i;
+  sorting = list;
+  qsort(order, list->len, sizeof(size_t), compare_newest_first);
+  sorting = NULL;
+
+  const bool retain_all = !policy->keep_last &&
+    !policy->hourly && !policy->daily && !policy->weekly;
+  for (size_t i = 0; i < list->len; ++i)
+    keep[order[i]] = retain_all || i < policy->keep_last;
+  keep_buckets(list, order, BUCKET_HOUR, policy->hourly, keep);
+  keep_buckets(list, order, BUCKET_DAY, policy->daily, keep);
+  keep_buckets(list, order, BUCKET_WEEK, policy->weekly, keep);
+
+  for (size_t i = 0; i < list->len; ++i) {
+    doomed[i] = !keep[i];
+    ret += doomed[i];
+  }
+
+  if (!policy->min_free)
+    goto CLEANUP;
+
+  struct statvfs sfb;
+  if (statvfs(path, &sfb)) {
+    perror("statvfs");
+    FAIL(ret);
+  }
+  const uint64_t free_bytes = (uint64_t) sfb.f_bavail * sfb.f_frsize;
+
+  const qgroup_table_t * const table = qgroup_table_load(path);
+  if (!table) {
+    if (errno != ENOTSUP) {
+      perror("qgroup_table_load");
+      FAIL(ret);
+    }
+    eprintf("warning: quotas are disabled, so min-free cannot be enforced\n");
+    goto CLEANUP;
+  }
+
+  // Count what the retention rules already free up
+  uint64_t freed = 0;
+  for (size_t i = 0; i < list->len; ++i) {
+    const qgroup_usage_t * const usage = qgroup_table_find(table, list->entries[i].id);
+    if (doomed[i] && usage)
+      freed += usage->exclusive;
+  }
+
+  // Then give up the oldest remaining snapshots, but never the newest one
+  for (size_t i = list->len; i-- > 1 && free_bytes + freed < policy->min_free;) {
+    const size_t j = order[i];
+    if (doomed[j])
+      continue;
+    const qgroup_usage_t * const usage = qgroup_table_find(table, list->entries[j].id);
+    doomed[j] = true;
+    ++ret;
+    if (usage)
+      freed += usage->exclusive;
+  }
+
+CLEANUP:
+  free(keep);
+  free(order);
+  return ret;
+}
+
+int prune_apply(const snapshot_list_t *list, const char *path, const bool *doomed) {
+  const int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    perror("open");
+    return -1;
+  }
+
+  // Deleting only unlinks each subvolume and queues it for the cleaner
+  // thread, so nothing waits on a commit until the end
+  int failed = 0;
+  enum btrfs_util_error err;
+  for (size_t i = 0; i < list->len; ++i) {
+    if (!doomed[i])
+      continue;
+    // Snapshots in subdirectories can't be deleted by name from here
+    const char * const name = list->entries[i].path;
+    if (strchr(name, '/')) {
+      char *snapshot = pathcat(path, name);
+      err = snapshot
+        ? btrfs_util_delete_subvolume(snapshot, 0)
+        : BTRFS_UTIL_ERROR_NO_MEMORY;
+      free(snapshot);
+    } else {
+      err = btrfs_util_delete_subvolume_fd(dir_fd, name, 0);
+    }
+    if (err) {
+      eprintf("error: %s: %s\n", name, btrfs_util_strerror(err));
+      ++failed;
+    }
+  }
+
+  // One commit makes all of the deletions durable at once
+  uint64_t transid;
+  if ((err = btrfs_util_start_sync_fd(dir_fd, &transid)) ||
+      (err = btrfs_util_wait_sync_fd(dir_fd, transid)))
+  {
+    eprintf("error: %s\n", btrfs_util_strerror(err));
+    close(dir_fd);
+    return -1;
+  }
+
+  close(dir_fd);
+  return failed;
+}
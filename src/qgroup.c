@@ -0,0 +1,160 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <macros.h>
+#include <qgroup.h>
+#include <tree_search.h>
+
+static qgroup_table_t cache;
+static bool cache_valid = false;
+
+typedef struct qgroup_status {
+  bool found;
+  uint64_t generation, flags;
+} qgroup_status_t;
+
+static int read_status(
+    const struct btrfs_ioctl_search_header *header,
+    const void *item,
+    void *arg)
+{
+  qgroup_status_t * const status = arg;
+  struct btrfs_qgroup_status_item status_item;
+
+  if (header->type != BTRFS_QGROUP_STATUS_KEY || header->len < sizeof(status_item))
+    return 0;
+
+  memcpy(&status_item, item, sizeof(status_item));
+  status->found = true;
+  status->generation = le64toh(status_item.generation);
+  status->flags = le64toh(status_item.flags);
+  return 1; // there is only one
+}
+
+typedef struct qgroup_read {
+  qgroup_table_t *table;
+  size_t cap;
+} qgroup_read_t;
+
+static int read_info(
+    const struct btrfs_ioctl_search_header *header,
+    const void *item,
+    void *arg)
+{
+  qgroup_read_t * const read = arg;
+  qgroup_table_t * const table = read->table;
+  struct btrfs_qgroup_info_item info;
+
+  // Higher-level qgroups group subvolumes together; only subvolumes matter here
+  if (header->type != BTRFS_QGROUP_INFO_KEY || header->len < sizeof(info) ||
+      btrfs_qgroup_level(header->offset) != 0)
+    return 0;
+
+  if (table->len == read->cap) {
+    const size_t cap = read->cap ? 2*read->cap : 0x40;
+    qgroup_usage_t *tmp = realloc(table->entries, cap * sizeof(qgroup_usage_t));
+    if (!tmp) {
+      perror("realloc");
+      return -1;
+    }
+    table->entries = tmp;
+    read->cap = cap;
+  }
+
+  memcpy(&info, item, sizeof(info));
+  table->entries[table->len++] = (qgroup_usage_t) {
+    .id = header->offset,
+    .referenced = le64toh(info.rfer),
+    .exclusive = le64toh(info.excl),
+  };
+  return 0;
+}
+
+const qgroup_table_t *qgroup_table_load(const char *path) {
+  CLEANUP_DECLARE(ret);
+
+  const int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open");
+    return NULL;
+  }
+
+  // Check the quota status first; it is a single item and cheap to fetch
+  struct btrfs_ioctl_search_key key = {
+    .tree_id = BTRFS_QUOTA_TREE_OBJECTID,
+    .min_objectid = 0,
+    .max_objectid = 0,
+    .min_type = BTRFS_QGROUP_STATUS_KEY,
+    .max_type = BTRFS_QGROUP_STATUS_KEY,
+    .min_offset = 0,
+    .max_offset = UINT64_MAX,
+    .min_transid = 0,
+    .max_transid = UINT64_MAX,
+  };
+
+  qgroup_status_t status = { false, 0, 0 };
+  if (tree_search(fd, &key, read_status, &status) < 0) {
+    // The quota tree only exists while quotas are enabled
+    if (errno == ENOENT)
+      errno = ENOTSUP;
+    else
+      perror("tree_search");
+    FAIL(ret);
+  }
+  if (!status.found || !(status.flags & BTRFS_QGROUP_STATUS_FLAG_ON)) {
+    errno = ENOTSUP;
+    FAIL(ret);
+  }
+
+  // Nothing has been committed to the quota tree since the last read
+  if (cache_valid && cache.generation == status.generation)
+    goto CLEANUP;
+
+  // Read all of the qgroups in one go
+  cache_valid = false;
+  free(cache.entries);
+  memset(&cache, 0, sizeof(cache));
+
+  key.min_type = BTRFS_QGROUP_INFO_KEY;
+  key.max_type = BTRFS_QGROUP_INFO_KEY;
+  qgroup_read_t read = { &cache, 0 };
+  if (tree_search(fd, &key, read_info, &read) < 0) {
+    perror("tree_search");
+    FAIL(ret);
+  }
+
+  // Keys come back in order, so the table is already sorted by ID
+  cache.generation = status.generation;
+  cache.inconsistent = status.flags &
+    (BTRFS_QGROUP_STATUS_FLAG_RESCAN | BTRFS_QGROUP_STATUS_FLAG_INCONSISTENT);
+  cache_valid = true;
+
+CLEANUP:
+  close(fd);
+  return ret ? NULL : &cache;
+}
+
+const qgroup_usage_t *qgroup_table_find(const qgroup_table_t *table, uint64_t id) {
+  if (!table)
+    return NULL;
+
+  size_t lo = 0, hi = table->len;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (table->entries[mid].id < id)
+      lo = mid + 1;
+    else if (table->entries[mid].id > id)
+      hi = mid;
+    else
+      return table->entries + mid;
+  }
+
+  return NULL;
+}
@@ -15,13 +15,16 @@ int get_root(
     char * const root, const size_t root_len,
     char * const flags, const size_t flags_len)
 {
-  char cmdline[0x1000];
-
-  if (cmdline_read(cmdline, sizeof(cmdline))
-      || !cmdline_find(cmdline, "root", root, root_len)
-      || !cmdline_find(cmdline, "rootflags", flags, flags_len))
+  const cmdline_t * const cmdline = cmdline_kernel();
+  const char * const root_value = cmdline_get(cmdline, CMDLINE_ROOT);
+  const char * const flags_value = cmdline_get(cmdline, CMDLINE_ROOTFLAGS);
+  if (!root_value || !flags_value) {
+    errno = ENOENT;
     return -1;
+  }
 
+  snprintf(root, root_len, "%s", root_value);
+  snprintf(flags, flags_len, "%s", flags_value);
   return 0;
 }
 
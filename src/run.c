@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -31,6 +33,17 @@ static int read_into_buf(const int fd, char *buf, size_t len) {
   return 0;
 }
 
+// Convert a status from wait() into the value returned by the run_* functions
+static int convert_status(int status) {
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return -WTERMSIG(status);
+  if (WIFSTOPPED(status))
+    return -WSTOPSIG(status);
+  return -1;
+}
+
 // Run a program, optionally piping its stdout/err into buffers
 int run_pipe(
     char *program, const char **args,
@@ -99,11 +112,61 @@ int run_pipe(
     return -1;
   }
 
-  if (WIFEXITED(status))
-    return WEXITSTATUS(status);
-  if (WIFSIGNALED(status))
-    return -WTERMSIG(status);
-  if (WIFSTOPPED(status))
-    return -WSTOPSIG(status);
-  return -1;
+  return convert_status(status);
+}
+
+// Start a program with its stdin connected to a pipe held by the caller
+pid_t run_spawn(char *program, const char **args, int *stdin_fd) {
+  int fds[2];
+
+  if (!stdin_fd) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Close-on-exec, so that other children never hold the write end open
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    perror("pipe2");
+    return -1;
+  }
+
+  pid_t pid = fork();
+
+  if (pid < 0) { // Failed to fork
+    perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  } else if (pid == 0) { // In child
+    // dup2 clears close-on-exec on the new descriptor
+    if (dup2(fds[0], STDIN_FILENO) < 0) {
+      perror("dup2");
+      exit(errno);
+    }
+
+    const char * empty_args[] = { program, NULL };
+    if (execvp(program, (char * const *) (args ? args : empty_args)) < 0) {
+      perror("execvp");
+      exit(errno);
+    }
+  }
+
+  // In parent
+  close(fds[0]);
+  *stdin_fd = fds[1];
+
+  return pid;
+}
+
+// Wait for a program started by run_spawn to exit
+int run_wait(pid_t pid) {
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      perror("waitpid");
+      return -1;
+    }
+  }
+
+  return convert_status(status);
 }
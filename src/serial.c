@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <linux/serial.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <cmdline.h>
+#include <dialog.h>
+#include <macros.h>
+#include <serial.h>
+
+// How many menu items to show at once
+#define SERIAL_PAGE_LEN 16
+
+#define LABEL(name, default_) \
+  (dialog->labels.name ? dialog->labels.name : (default_))
+
+bool serial_detect(void) {
+  const char * const console = cmdline_get(cmdline_kernel(), CMDLINE_BTRROLL_CONSOLE);
+  if (console)
+    return !strcmp(console, "serial");
+
+  // Only serial drivers answer this; virtual terminals and PTYs don't
+  struct serial_struct serial;
+  return isatty(STDIN_FILENO) && !ioctl(STDIN_FILENO, TIOCGSERIAL, &serial);
+}
+
+static void print_header(const char *title, const char *msg) {
+  printf("\n-- %s --\n%s\n", title, msg);
+}
+
+// Read a line of input without its line ending. Returns -1 on EOF (Ctrl-D).
+static int read_line(char *buf, size_t len) {
+  fflush(stdout);
+  if (!fgets(buf, len, stdin)) {
+    clearerr(stdin);
+    putchar('\n');
+    return -1;
+  }
+
+  // Drop the rest of an overlong line
+  if (!strchr(buf, '\n'))
+    for (int c; (c = getchar()) != EOF && c != '\n';);
+
+  buf[strcspn(buf, "\r\n")] = '\0';
+  return 0;
+}
+
+// Print the keys for the buttons shown, e.g. `[Enter] OK  [q] Cancel`
+static void print_buttons(const dialog_t * const dialog, const char *ok, bool cancel) {
+  printf("[Enter] %s", ok);
+  if (dialog->buttons.extra)
+    printf("  [e] %s", LABEL(extra, "Extra"));
+  if (dialog->buttons.help)
+    printf("  [h] %s", LABEL(help, "Help"));
+  if (cancel && dialog->buttons.cancel)
+    printf("  [q] %s", LABEL(cancel, "Cancel"));
+  printf(": ");
+}
+
+// The response for a button's key, or -1 if `line` is not one
+static int parse_button(const dialog_t * const dialog, const char *line, bool cancel) {
+  if (!line[0])
+    return DIALOG_RESPONSE_OK;
+  if (line[1])
+    return -1;
+  if (line[0] == 'e' && dialog->buttons.extra)
+    return DIALOG_RESPONSE_EXTRA;
+  if (line[0] == 'h' && dialog->buttons.help)
+    return DIALOG_RESPONSE_HELP;
+  if (line[0] == 'q' && cancel && dialog->buttons.cancel)
+    return DIALOG_RESPONSE_CANCEL;
+  return -1;
+}
+
+// Wait for one of the buttons to be picked
+static int ask_buttons(const dialog_t * const dialog, const char *ok, bool cancel) {
+  char line[0x10];
+  while (true) {
+    print_buttons(dialog, ok, cancel);
+    if (read_line(arr_and_size(line)))
+      return DIALOG_RESPONSE_CANCEL;
+
+    const int ret = parse_button(dialog, line, cancel);
+    if (ret >= 0)
+      return ret;
+  }
+}
+
+static void print_page(const char **items, size_t items_len, size_t page, size_t current) {
+  const size_t first = page * SERIAL_PAGE_LEN;
+  for (size_t i = first; i < items_len && i < first + SERIAL_PAGE_LEN; ++i)
+    printf("%c%3zu) %s\n", i == current ? '*' : ' ', i + 1, items[i]);
+
+  if (items_len > SERIAL_PAGE_LEN)
+    printf("      (page %zu of %zu; [n]ext, [p]revious)\n",
+        page + 1, (items_len + SERIAL_PAGE_LEN - 1) / SERIAL_PAGE_LEN);
+}
+
+int serial_choose(
+    const dialog_t * const dialog,
+    const char **items, const char **help,
+    size_t items_len, size_t *choice,
+    const char *title, const char *msg)
+{
+  size_t current = choice && *choice < items_len ? *choice : 0;
+  size_t page = current / SERIAL_PAGE_LEN;
+  const size_t pages = (items_len + SERIAL_PAGE_LEN - 1) / SERIAL_PAGE_LEN;
+
+  print_header(title, msg);
+
+  // Only print the page again when it changes; everything else is a line
+  bool show = true;
+  char line[0x20];
+  int ret;
+  while (true) {
+    if (show)
+      print_page(items, items_len, page, current);
+    show = false;
+
+    printf("Choose 1-%zu%s; ", items_len, help ? " ([?N] describes N)" : "");
+    print_buttons(dialog, LABEL(ok, "OK"), true);
+    if (read_line(arr_and_size(line))) {
+      ret = DIALOG_RESPONSE_CANCEL;
+      break;
+    }
+
+    char *end;
+    const bool describe = help && line[0] == '?';
+    const unsigned long n = strtoul(line + describe, &end, 10);
+    const bool number = line[describe] >= '0' && line[describe] <= '9' && !*end;
+    if (number && n >= 1 && n <= items_len) {
+      if (describe) {
+        printf("%lu) %s\n", n, help[n - 1]);
+        continue;
+      }
+      current = n - 1;
+      ret = DIALOG_RESPONSE_OK;
+      break;
+    }
+
+    if (!strcmp(line, "n") || !strcmp(line, "p")) {
+      if (line[0] == 'n' ? page + 1 < pages : page > 0) {
+        page += line[0] == 'n' ? 1 : -1;
+        show = true;
+      }
+      continue;
+    }
+
+    // The buttons act on the default item, as they would in `dialog`
+    if ((ret = parse_button(dialog, line, true)) >= 0)
+      break;
+    printf("?\n");
+  }
+
+  if (choice)
+    *choice = current;
+  return ret;
+}
+
+int serial_confirm(
+    const dialog_t * const dialog, bool default_,
+    const char *title, const char *msg)
+{
+  const char * const yes = LABEL(yes, "Yes"), * const no = LABEL(no, "No");
+  print_header(title, msg);
+
+  char line[0x10];
+  while (true) {
+    printf("[y] %s  [n] %s", yes, no);
+    if (dialog->buttons.extra)
+      printf("  [e] %s", LABEL(extra, "Extra"));
+    if (dialog->buttons.help)
+      printf("  [h] %s", LABEL(help, "Help"));
+    printf(" (Enter: %s): ", default_ ? yes : no);
+    if (read_line(arr_and_size(line)))
+      return DIALOG_RESPONSE_NO;
+
+    if (!line[0])
+      return default_ ? DIALOG_RESPONSE_YES : DIALOG_RESPONSE_NO;
+    if (!strcmp(line, "y"))
+      return DIALOG_RESPONSE_YES;
+    if (!strcmp(line, "n"))
+      return DIALOG_RESPONSE_NO;
+
+    const int ret = parse_button(dialog, line, false);
+    if (ret > 0)
+      return ret;
+  }
+}
+
+int serial_input(
+    const char *init, char *out, const size_t out_len,
+    const char *title, const char *msg)
+{
+  print_header(title, msg);
+  if (init && init[0])
+    printf("(Enter alone keeps `%s`; Ctrl-D cancels)\n", init);
+  else
+    printf("(Ctrl-D cancels)\n");
+  printf("> ");
+
+  char line[0x400];
+  if (read_line(arr_and_size(line)))
+    return DIALOG_RESPONSE_CANCEL;
+
+  snprintf(out, out_len, "%s", line[0] || !init ? line : init);
+  return DIALOG_RESPONSE_OK;
+}
+
+int serial_ok(const dialog_t * const dialog, const char *title, const char *msg) {
+  print_header(title, msg);
+  return ask_buttons(dialog, LABEL(ok, "OK"), false);
+}
+
+int serial_view_file(
+    const dialog_t * const dialog,
+    const char *title, const char *filepath)
+{
+  FILE * const fp = fopen(filepath, "r");
+  if (!fp) {
+    perror("fopen");
+    return -1;
+  }
+
+  printf("\n-- %s --\n", title);
+  char buf[0x1000];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), fp)))
+    fwrite(buf, 1, len, stdout);
+  fclose(fp);
+
+  return ask_buttons(dialog, LABEL(ok, LABEL(exit, "Exit")), false);
+}
+
+int serial_stream(
+    const dialog_t * const dialog,
+    const char *title, dialog_producer_t producer, void *arg)
+{
+  printf("\n-- %s --\n", title);
+  const int err = producer(stdout, arg);
+  fflush(stdout);
+  if (err)
+    return err;
+  return ask_buttons(dialog, LABEL(ok, "OK"), false);
+}
+
+int serial_gauge_open(dialog_gauge_t * const gauge, const char *title, const char *msg) {
+  memset(gauge, 0, sizeof(dialog_gauge_t));
+  gauge->serial = true;
+  gauge->percent = -1;
+  print_header(title, msg);
+  return serial_gauge_update(gauge, 0);
+}
+
+int serial_gauge_update(dialog_gauge_t * const gauge, int percent) {
+  // Only say something when there's something new to say
+  if (percent == gauge->percent)
+    return 0;
+  gauge->percent = percent;
+
+  printf("\r%3d%%", percent);
+  return fflush(stdout) ? -1 : 0;
+}
+
+int serial_gauge_close(dialog_gauge_t * const gauge) {
+  putchar('\n');
+  fflush(stdout);
+  gauge->serial = false;
+  return DIALOG_RESPONSE_OK;
+}
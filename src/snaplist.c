@@ -0,0 +1,262 @@
+#include <btrfsutil.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <macros.h>
+#include <manifest.h>
+#include <path.h>
+#include <probe.h>
+#include <snaplist.h>
+#include <snapshot.h>
+#include <sources.h>
+#include <subvol.h>
+#include <workers.h>
+
+// Describe a snapshot by what its tool says about it, its last-modified time,
+// supported kernel versions and integrity
+static char *describe_snapshot(const char *snapshot, const char *comment) {
+  // Get the last-modified time for the snapshot
+  struct stat sb;
+  struct tm tm;
+  char mtime[0x100];
+  if (stat(snapshot, &sb)) {
+    perror("stat");
+    strcpy(mtime, "unknown");
+  } else {
+    strftime(mtime, sizeof(mtime), "%c", localtime_r(&sb.st_mtime, &tm));
+  }
+
+  // Get the kernel versions supported by the snapshot
+  char *versions[0x100];
+  char versions_str[0x1000];
+  int num_versions = get_kernel_versions(snapshot, versions, lenof(versions) - 1);
+  if (num_versions < 0) {
+    snprintf(versions_str, sizeof(versions_str), "unknown (%s)", strerror(errno));
+  } else {
+    char *dest = versions_str;
+    *dest = '\0';
+    for (int i = 0; i < num_versions; ++i) {
+      char *v = versions[i];
+      dest += snprintf(dest,
+          sizeof(versions_str) - (dest - versions_str),
+          i == (num_versions-1) ? "%s" : "%s, ", v);
+      free(v);
+    }
+  }
+
+  // Check the snapshot against its manifest, if one was made for it
+  const char *integrity = "";
+  switch (manifest_check(snapshot)) {
+    case MANIFEST_INTACT:
+      integrity = " Integrity: intact.";
+      break;
+    case MANIFEST_MODIFIED:
+      integrity = " Integrity: MODIFIED.";
+      break;
+    case MANIFEST_MISSING:
+      break;
+    default:
+      perror("manifest_check");
+      break;
+  }
+
+  // Compile the final description
+  static const size_t DESC_LEN = 0x1000;
+  char *desc = malloc(DESC_LEN);
+  if (desc)
+    snprintf(desc, DESC_LEN, "%s%sLast modified: %s. Kernel version(s): %s.%s",
+        comment ? comment : "", comment ? ". " : "", mtime, versions_str, integrity);
+  return desc;
+}
+
+// Where a listed snapshot is, given the directory that was scanned
+static char *entry_path(const char *path, const snapshot_entry_t *entry) {
+  return entry->path[0] == '/' ? strdup(entry->path) : pathcat(path, entry->path);
+}
+
+typedef struct describe_job {
+  snapshot_entry_t *entry;
+  const char *path, *toplevel;
+} describe_job_t;
+
+// Worker job: describe and probe a single snapshot
+static void describe_job(void *arg) {
+  describe_job_t * const job = arg;
+
+  char *snapshot = entry_path(job->path, job->entry);
+  if (!snapshot) {
+    perror("pathcat");
+    return;
+  }
+
+  job->entry->description = describe_snapshot(snapshot, job->entry->comment);
+  job->entry->problems = probe_snapshot(snapshot, job->toplevel);
+  free(snapshot);
+}
+
+static int compare_entries(const void *a, const void *b) {
+  return strcmp(((const snapshot_entry_t *) a)->name,
+      ((const snapshot_entry_t *) b)->name);
+}
+
+snapshot_entry_t *snapshot_list_add(
+    snapshot_list_t *list, const char *name, const char *path,
+    const struct btrfs_util_subvolume_info *info)
+{
+  if (list->len == list->cap) {
+    const size_t cap = list->cap ? 2*list->cap : 0x40;
+    snapshot_entry_t *tmp = realloc(list->entries, cap * sizeof(snapshot_entry_t));
+    if (!tmp) {
+      perror("realloc");
+      return NULL;
+    }
+    list->entries = tmp;
+    list->cap = cap;
+  }
+
+  snapshot_entry_t * const entry = list->entries + list->len;
+  memset(entry, 0, sizeof(snapshot_entry_t));
+  entry->name = strdup(name);
+  entry->path = strdup(path);
+  entry->id = info->id;
+  entry->generation = info->generation;
+  entry->otime = info->otime.tv_sec;
+  memcpy(entry->uuid, info->uuid, sizeof(entry->uuid));
+  memcpy(entry->parent_uuid, info->parent_uuid, sizeof(entry->parent_uuid));
+  memcpy(entry->received_uuid, info->received_uuid, sizeof(entry->received_uuid));
+
+  if (!entry->name || !entry->path) {
+    perror("strdup");
+    free(entry->name);
+    free(entry->path);
+    return NULL;
+  }
+  ++list->len;
+  return entry;
+}
+
+// How deep to look for snapshots in directories under the scanned one
+#define INDEX_DEPTH_MAX 8
+
+// Index the directory `rel` (or `root` itself, if NULL) of the scanned one
+static int index_dir(snapshot_list_t *list, const char *root, const char *rel, size_t depth) {
+  CLEANUP_DECLARE(ret);
+
+  char *dir = rel ? pathcat(root, rel) : strdup(root);
+  DIR * const dp = dir ? opendir(dir) : NULL;
+  if (!dp) {
+    perror("opendir");
+    free(dir);
+    return -1;
+  }
+
+  struct dirent *ep;
+  errno = 0;
+  while ((ep = readdir(dp))) {
+    // Only consider non-hidden directories
+    if (ep->d_type != DT_DIR || ep->d_name[0] == '.') {
+      errno = 0;
+      continue;
+    }
+
+    char *snapshot = pathcat(dir, ep->d_name);
+    char *name = rel ? pathcat(rel, ep->d_name) : strdup(ep->d_name);
+    if (!snapshot || !name) {
+      perror("pathcat");
+      free(snapshot);
+      free(name);
+      FAIL(ret);
+    }
+
+    // Subvolumes are snapshots; other directories may hold more of them
+    int failed = 0;
+    struct btrfs_util_subvolume_info info;
+    enum btrfs_util_error err = btrfs_util_subvolume_info(snapshot, 0, &info);
+    if (err == BTRFS_UTIL_OK)
+      failed = !snapshot_list_add(list, name, name, &info);
+    else if (err == BTRFS_UTIL_ERROR_NOT_SUBVOLUME && depth < INDEX_DEPTH_MAX)
+      failed = index_dir(list, root, name, depth + 1);
+
+    free(snapshot);
+    free(name);
+    if (failed) {
+      FAIL(ret);
+    }
+
+    errno = 0;
+  }
+  if (errno) {
+    perror("readdir");
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (closedir(dp))
+    perror("closedir");
+  free(dir);
+  return ret;
+}
+
+int snapshot_list_index(snapshot_list_t *list, const char *path) {
+  const int ret = index_dir(list, path, NULL, 0);
+  qsort(list->entries, list->len, sizeof(snapshot_entry_t), compare_entries);
+  return ret;
+}
+
+int snapshot_list_scan(snapshot_list_t *list, const char *path, const char *root_subvol_dir) {
+  int ret = snapshot_list_index(list, path);
+  if (root_subvol_dir) {
+    if (snapshot_sources_scan(list, root_subvol_dir))
+      ret = -1;
+    qsort(list->entries, list->len, sizeof(snapshot_entry_t), compare_entries);
+  }
+
+  // Describing a snapshot touches several files in it, so do them all at once
+  describe_job_t * const jobs = calloc(list->len ? list->len : 1, sizeof(describe_job_t));
+  char *toplevel = NULL;
+  if (list->len) {
+    char *first = entry_path(path, list->entries);
+    toplevel = first ? get_toplevel_path(first) : NULL;
+    free(first);
+  }
+
+  workers_t * const workers = jobs ? workers_create(0) : NULL;
+  for (size_t i = 0; jobs && i < list->len; ++i) {
+    jobs[i] = (describe_job_t) { list->entries + i, path, toplevel };
+    if (!workers || workers_submit(workers, describe_job, jobs + i))
+      describe_job(jobs + i);
+  }
+  if (workers)
+    workers_destroy(workers);
+  free(toplevel);
+
+  // Every entry needs a description, even if it could not be worked out
+  for (size_t i = 0; i < list->len; ++i) {
+    snapshot_entry_t * const entry = list->entries + i;
+    if (!entry->description && !(entry->description = strdup(""))) {
+      perror("strdup");
+      ret = -1;
+    }
+    if (!jobs)
+      entry->problems = -1;
+  }
+  free(jobs);
+
+  return ret;
+}
+
+void snapshot_list_free(snapshot_list_t *list) {
+  for (size_t i = 0; i < list->len; ++i) {
+    free(list->entries[i].name);
+    free(list->entries[i].path);
+    free(list->entries[i].comment);
+    free(list->entries[i].description);
+  }
+  free(list->entries);
+  memset(list, 0, sizeof(snapshot_list_t));
+}
@@ -8,14 +8,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/reboot.h>
+#include <sys/utsname.h>
 #include <unistd.h>
 
 #include <boot.h>
+#include <bootcount.h>
+#include <config.h>
 #include <constants.h>
 #include <dialog.h>
+#include <group.h>
 #include <kver.h>
 #include <macros.h>
 #include <path.h>
+#include <snaplist.h>
 #include <snapshot.h>
 #include <subvol.h>
 
@@ -36,31 +41,104 @@ static int swap_symlink(const char *path, const char *src_new, const char* src_f
   return 0;
 }
 
-int snapshot_restore(char *root_subvol_dir, const char *snapshot, const char *backup) {
+/* Finish a snapshot_restore that was interrupted while the old root was parked
+ * at `subvol.d/old`, which would otherwise stop every later restore from
+ * parking it there. If `current` was never replaced, the old root goes back;
+ * otherwise, its nested subvolumes are moved over and it is deleted.
+ */
+static int recover_old(const char *root_subvol_dir) {
   CLEANUP_DECLARE(ret);
 
   char *current = pathcat(root_subvol_dir, SUBVOL_CUR_NAME);
+  char *old = pathcat(root_subvol_dir, SUBVOL_OLD_NAME);
+  nested_subvol_t *subvols = NULL;
+  int subvols_len = 0;
+  enum btrfs_util_error err;
+
+  if (!current || !old) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+  if (access(old, F_OK))
+    goto CLEANUP; // nothing was interrupted
+
+  eprintf("btrroll: finishing an interrupted restore\n");
+  if (access(current, F_OK)) {
+    if (rename(old, current)) {
+      perror("rename");
+      FAIL(ret);
+    }
+    goto CLEANUP;
+  }
+
+  subvols_len = get_nested_subvols(old, &subvols);
+  if (subvols_len < 0) {
+    perror("get_nested_subvols");
+    FAIL(ret);
+  }
+  if (move_nested_subvols(old, current, subvols, subvols_len)) {
+    perror("move_nested_subvols");
+    FAIL(ret);
+  }
+  if ((err = btrfs_util_delete_subvolume(old, 0)) != BTRFS_UTIL_OK) {
+    eprintf("error: %s\n", btrfs_util_strerror(err));
+    FAIL(ret);
+  }
+
+CLEANUP:
+  nested_subvols_free(subvols, subvols_len > 0 ? subvols_len : 0);
+  free(old);
+  free(current);
+  return ret;
+}
+
+int snapshot_restore(
+    char *root_subvol_dir, const char *snapshot, const char *backup,
+    snapshot_nested_t nested)
+{
+  CLEANUP_DECLARE(ret);
+
+  char *current = pathcat(root_subvol_dir, SUBVOL_CUR_NAME);
+  char *old = pathcat(root_subvol_dir, SUBVOL_OLD_NAME);
+  nested_subvol_t *subvols = NULL;
+  int subvols_len = 0;
   int err;
 
-  // Back up the current subvolume if desired
-  if (backup) {
-    // Move subvol.d/current to subvol.d/snapshots/backup
-    if (rename(current, backup)) {
+  // Find any subvolumes nested inside subvol.d/current
+  if (nested != SNAPSHOT_NESTED_NONE) {
+    subvols_len = get_nested_subvols(current, &subvols);
+    if (subvols_len < 0) {
+      perror("get_nested_subvols");
+      FAIL(ret);
+    }
+  }
+
+  // Nested subvolumes can only be moved out of a tree that still exists, so
+  // keep the old root around (as the backup or temporarily) in that case.
+  const char *previous = backup;
+  if (!previous && nested == SNAPSHOT_NESTED_MOVE && subvols_len)
+    previous = old;
+
+  // Move subvol.d/current to the backup location if desired...
+  if (previous) {
+    if (rename(current, previous)) {
       perror("rename");
       FAIL(ret);
     }
-    // Make it read-only
-    err = btrfs_util_set_subvolume_read_only(backup, 1);
-    if (err != BTRFS_UTIL_OK) {
+  }
+  // ...otherwise just delete subvol.d/current
+  else {
+    if (nested == SNAPSHOT_NESTED_DELETE &&
+        delete_nested_subvols(current, subvols, subvols_len))
+    {
+      perror("delete_nested_subvols");
+      FAIL(ret);
+    }
+    if ((err = btrfs_util_delete_subvolume(current, 0)) != BTRFS_UTIL_OK) {
       eprintf("error: %s\n", btrfs_util_strerror(err));
       FAIL(ret);
     }
   }
-  // otherwise just delete subvol.d/current
-  else if ((err = btrfs_util_delete_subvolume(current, 0)) != BTRFS_UTIL_OK) {
-    eprintf("error: %s\n", btrfs_util_strerror(err));
-    FAIL(ret);
-  }
 
   // Create an RW copy of the snapshot in place of the old `current` subvolume
   err = btrfs_util_create_snapshot(snapshot, current, 0, NULL, NULL);
@@ -69,20 +147,88 @@ int snapshot_restore(char *root_subvol_dir, const char *snapshot, const char *ba
     FAIL(ret);
   }
 
+  // Carry the nested subvolumes over into the restored tree. This must happen
+  // before the backup is made read-only, which would forbid moving them out.
+  if (nested == SNAPSHOT_NESTED_MOVE && previous &&
+      move_nested_subvols(previous, current, subvols, subvols_len))
+  {
+    perror("move_nested_subvols");
+    FAIL(ret);
+  }
+
+  if (backup) {
+    // Make the backup read-only
+    err = btrfs_util_set_subvolume_read_only(backup, 1);
+    if (err != BTRFS_UTIL_OK) {
+      eprintf("error: %s\n", btrfs_util_strerror(err));
+      FAIL(ret);
+    }
+  } else if (previous) {
+    // The old root is now free of nested subvolumes and can be deleted
+    if ((err = btrfs_util_delete_subvolume(old, 0)) != BTRFS_UTIL_OK) {
+      eprintf("error: %s\n", btrfs_util_strerror(err));
+      FAIL(ret);
+    }
+  }
+
   restart();
 
 CLEANUP:
+  nested_subvols_free(subvols, subvols_len > 0 ? subvols_len : 0);
+  free(old);
   free(current);
   return ret;
 }
 
-int snapshot_boot(char *root_subvol_dir, const char *snapshot) {
+// Replace the state file atomically, so that a crash leaves the old or new one
+static int write_state(const char *root_subvol_dir, const char *state) {
+  CLEANUP_DECLARE(ret);
+
+  char *path = pathcat(root_subvol_dir, STATE_FILE);
+  char *tmp_path = pathcat(root_subvol_dir, STATE_FILE ".tmp");
+  FILE *fp = NULL;
+  if (!path || !tmp_path) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  if (!(fp = fopen(tmp_path, "w"))) {
+    perror("fopen");
+    FAIL(ret);
+  }
+  if (fputs(state, fp) == EOF || fflush(fp) || fsync(fileno(fp))) {
+    perror("fputs");
+    FAIL(ret);
+  }
+  if (fclose(fp)) {
+    fp = NULL;
+    perror("fclose");
+    FAIL(ret);
+  }
+  fp = NULL;
+
+  if (rename(tmp_path, path)) {
+    perror("rename");
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (fp)
+    fclose(fp);
+  free(tmp_path);
+  free(path);
+  return ret;
+}
+
+int snapshot_prepare_boot(const char *root_subvol_dir, const char *snapshot) {
   CLEANUP_DECLARE(ret);
-  char *tmp_path = NULL, *state_path = NULL;
-  FILE *state_file = NULL;
 
   // Make an RW copy of the subvolume to boot in subvol.d/temp
-  tmp_path = pathcat(root_subvol_dir, SUBVOL_TMP_NAME);
+  char *tmp_path = pathcat(root_subvol_dir, SUBVOL_TMP_NAME);
+  if (!tmp_path) {
+    perror("pathcat");
+    FAIL(ret);
+  }
 
   enum btrfs_util_error err = btrfs_util_create_snapshot(
       snapshot, tmp_path, 0, NULL, NULL);
@@ -90,31 +236,50 @@ int snapshot_boot(char *root_subvol_dir, const char *snapshot) {
     eprintf("error: %s\n", btrfs_util_strerror(err));
     FAIL(ret);
   }
-  
+
   // Write state file so btrroll knows what to do upon reboot
-  state_path = pathcat(root_subvol_dir, STATE_FILE);
-  state_file = fopen(state_path, "w");
-  if (!state_file) {
-    perror("fopen");
+  if (write_state(root_subvol_dir, STATE_BOOT_TEMP)) {
+    btrfs_util_delete_subvolume(tmp_path, 0);
     FAIL(ret);
   }
 
-  if (fputs(STATE_BOOT_TEMP, state_file) == EOF && ferror(state_file)) {
-    perror("fputs");
+CLEANUP:
+  free(tmp_path);
+  return ret;
+}
+
+int snapshot_cancel_boot(const char *root_subvol_dir) {
+  CLEANUP_DECLARE(ret);
+
+  char *state_path = pathcat(root_subvol_dir, STATE_FILE);
+  char *tmp_path = pathcat(root_subvol_dir, SUBVOL_TMP_NAME);
+  if (!state_path || !tmp_path) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  enum btrfs_util_error err = btrfs_util_delete_subvolume(tmp_path, 0);
+  if (err != BTRFS_UTIL_OK && err != BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND) {
+    eprintf("btrroll: %s\n", btrfs_util_strerror(err));
+    FAIL(ret);
+  }
+  if (remove(state_path) && errno != ENOENT) {
+    perror("remove");
     FAIL(ret);
   }
 
 CLEANUP:
-  if (state_file)
-    if (fclose(state_file))
-      perror("fclose");
-  free(state_path);
   free(tmp_path);
+  free(state_path);
+  return ret;
+}
 
-  if (!ret)
-    restart();
+int snapshot_boot(char *root_subvol_dir, const char *snapshot) {
+  if (snapshot_prepare_boot(root_subvol_dir, snapshot))
+    return -1;
 
-  return ret;
+  restart();
+  return 0;
 }
 
 int snapshot_continue(char *root_subvol) {
@@ -124,11 +289,25 @@ int snapshot_continue(char *root_subvol) {
   char *state_path = pathcat(root_subvol_dir, STATE_FILE);
   char *tmp_path_rel = pathcat(basename(root_subvol_dir), SUBVOL_TMP_NAME);
   char *cur_path_rel = pathcat(basename(root_subvol_dir), SUBVOL_CUR_NAME);
-  FILE *state_file = fopen(state_path, "r");
+  FILE *state_file = NULL;
+
+  // Finish a group restore that was interrupted before anything else
+  if (group_recover(root_subvol_dir) < 0) {
+    perror("group_recover");
+    FAIL(ret);
+  }
+  if (recover_old(root_subvol_dir)) {
+    FAIL(ret);
+  }
 
+  state_file = fopen(state_path, "r");
   if (!state_file) {
-    if (errno == ENOENT)
-      goto CLEANUP; // no problem
+    if (errno == ENOENT) {
+      // A normal boot; count it, in case it turns out to fail
+      if (bootcount_continue(root_subvol, config_get()->esp))
+        perror("bootcount_continue");
+      goto CLEANUP;
+    }
     perror("fopen");
     FAIL(ret);
   }
@@ -157,14 +336,7 @@ int snapshot_continue(char *root_subvol) {
     }
 
     // Set the post-boot cleanup state for the next reboot
-    state_file = fopen(state_path, "w");
-    if (!state_file) {
-      perror("fopen");
-      FAIL(ret);
-    }
-
-    if (fputs(STATE_BOOT_TEMP_CLEANUP, state_file) == EOF && ferror(state_file)) {
-      perror("fputs");
+    if (write_state(root_subvol_dir, STATE_BOOT_TEMP_CLEANUP)) {
       FAIL(ret);
     }
 
@@ -247,7 +419,7 @@ int get_kernel_versions(
   *p = NULL;
 
 CLEANUP:
-  if (closedir(modules))
+  if (modules && closedir(modules))
     perror("closedir");
   free(path);
   return ret;
@@ -283,20 +455,20 @@ int get_compatible_boot_entries(
     if (!strncmp(entry->id, "auto-", 5) || strncmp(entry->source, esp_path, esp_path_len))
       continue;
 
-    char *ext = strrchr(entry->id, '.');
-    if (!ext)
-      continue;
-
+    // Unified kernel images carry their own version; everything else (BLS
+    // entries and GRUB menu entries alike) names a kernel on the ESP
+    const char *ext = strrchr(entry->id, '.');
     int err;
     char version[0x100];
-    if (!strcmp(".efi", ext))
+    if (ext && !strcmp(".efi", ext))
       err = kver_pe(entry->source, version, sizeof(version));
-    else if (!strcmp(".conf", ext)) {
+    else if (entry->kernel) {
       char *kernel_path = pathcat(esp_path, entry->kernel);
       err = kver(kernel_path, version, sizeof(version));
       eprintf("kver for `%s`: %d: %s\n", kernel_path, err, version);
       free(kernel_path);
-    }
+    } else
+      continue;
 
     if (err) {
       perror("kver");
@@ -307,7 +479,8 @@ int get_compatible_boot_entries(
     for (int j = 0; j < num_versions; ++j) {
       eprintf("%s / %s\n", versions[j], version);
       if (!strncmp(versions[j], version, sizeof(version))) {
-        memcpy(e++, entry, sizeof(struct bootctl_entry));
+        memcpy(e, entry, sizeof(struct bootctl_entry));
+        (e++)->version = strdup(version);
         break;
       }
     }
@@ -315,3 +488,101 @@ int get_compatible_boot_entries(
 
   return e - entries;
 }
+
+bool snapshot_supports_running_kernel(const char *snapshot) {
+  struct utsname uts;
+  char *versions[0x100];
+  if (uname(&uts))
+    return false;
+
+  const int num_versions = get_kernel_versions(snapshot, versions, lenof(versions) - 1);
+  bool found = false;
+  for (int i = 0; i < num_versions; ++i) {
+    found = found || !strcmp(versions[i], uts.release);
+    free(versions[i]);
+  }
+  return found;
+}
+
+int snapshot_compatible_entry(
+    const char *snapshot, const char *esp_path, char *buf, size_t len)
+{
+  if (snapshot_supports_running_kernel(snapshot)) {
+    buf[0] = '\0';
+    return 1;
+  }
+
+  struct bootctl_entry entries[32];
+  const int num_entries = get_compatible_boot_entries(
+      snapshot, esp_path, entries, lenof(entries));
+  if (num_entries > 0)
+    snprintf(buf, len, "%s", entries[0].id);
+  for (int i = 0; i < num_entries; ++i)
+    bootctl_entry_free(entries + i);
+  return num_entries > 0 ? 0 : -1;
+}
+
+// Whether `name` stays inside the snapshots directory
+static bool is_valid_name(const char *name) {
+  if (name[0] == '/')
+    return false;
+
+  for (const char *p = name; (p = strstr(p, "..")); p += 2)
+    if ((p == name || p[-1] == '/') && (p[2] == '/' || p[2] == '\0'))
+      return false;
+
+  return true;
+}
+
+/* Whether the snapshot at `path` is a root that btrroll set aside itself (the
+ * old root before a restore, or a failed one); restoring it would undo that
+ */
+static bool is_set_aside(const char *path) {
+  const char * const slash = strrchr(path, '/');
+  const char * const name = slash ? slash + 1 : path;
+  return !strncmp(name, PRE_RESTORE_PREFIX, strlen(PRE_RESTORE_PREFIX)) ||
+    !strncmp(name, FAILED_PREFIX, strlen(FAILED_PREFIX));
+}
+
+char *snapshot_resolve(const char *snapshots, const char *target) {
+  char name[0x100];
+
+  if (!strcmp(target, "known-good")) {
+    if (bootcount_find_known_good(snapshots, "", arr_and_size(name))) {
+      eprintf("btrroll: there is no known-good snapshot\n");
+      errno = ENOENT;
+      return NULL;
+    }
+  } else if (!strcmp(target, "latest")) {
+    snapshot_list_t list = { 0 };
+    const snapshot_entry_t *latest = NULL;
+    if (!snapshot_list_index(&list, snapshots))
+      for (size_t i = 0; i < list.len; ++i)
+        if (!is_set_aside(list.entries[i].path) &&
+            (!latest || list.entries[i].otime > latest->otime))
+          latest = list.entries + i;
+    if (latest)
+      snprintf(name, sizeof(name), "%s", latest->path);
+    snapshot_list_free(&list);
+    if (!latest) {
+      eprintf("btrroll: there are no snapshots\n");
+      errno = ENOENT;
+      return NULL;
+    }
+  } else {
+    if (!is_valid_name(target)) {
+      eprintf("btrroll: invalid snapshot name `%s`\n", target);
+      errno = EINVAL;
+      return NULL;
+    }
+    snprintf(name, sizeof(name), "%s", target);
+  }
+
+  char *snapshot = pathcat(snapshots, name);
+  if (snapshot && access(snapshot, F_OK)) {
+    eprintf("btrroll: no such snapshot: %s\n", name);
+    free(snapshot);
+    return NULL;
+  }
+  return snapshot;
+}
@@ -0,0 +1,149 @@
+#include <btrfsutil.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <constants.h>
+#include <macros.h>
+#include <path.h>
+#include <snaplist.h>
+#include <sources.h>
+#include <subvol.h>
+#include <xmlscan.h>
+
+typedef struct snapper_info {
+  char type[0x20];
+  char pre_num[0x20];
+  char description[0x200];
+} snapper_info_t;
+
+static int snapper_info_field(const char *path, const char *text, void *arg) {
+  snapper_info_t * const info = arg;
+  if (!strcmp(path, "snapshot/type"))
+    snprintf(info->type, sizeof(info->type), "%s", text);
+  else if (!strcmp(path, "snapshot/pre_num"))
+    snprintf(info->pre_num, sizeof(info->pre_num), "%s", text);
+  else if (!strcmp(path, "snapshot/description"))
+    snprintf(info->description, sizeof(info->description), "%s", text);
+  return 0;
+}
+
+// Describe a snapper snapshot from its info.xml, e.g. `snapper post (of 41): zypp(zypper)`
+static char *describe_snapper(const char *info_path) {
+  snapper_info_t info = { 0 };
+  FILE * const fp = fopen(info_path, "r");
+  if (fp) {
+    if (xml_scan(fp, snapper_info_field, &info) < 0)
+      eprintf("warning: %s: malformed\n", info_path);
+    if (fclose(fp))
+      perror("fclose");
+  }
+
+  static const size_t COMMENT_LEN = 0x300;
+  char *comment = malloc(COMMENT_LEN);
+  if (comment)
+    snprintf(comment, COMMENT_LEN, "snapper %s%s%s%s%s%s",
+        info.type[0] ? info.type : "snapshot",
+        info.pre_num[0] ? " (of " : "", info.pre_num, info.pre_num[0] ? ")" : "",
+        info.description[0] ? ": " : "", info.description);
+  return comment;
+}
+
+/* Add `<dir>/<name>/<subvol>` for each entry in `dir` that has one, as
+ * `<tool>/<name>`. If `info` is given, `<dir>/<name>/<info>` is used to
+ * describe it.
+ */
+static int scan_source(
+    snapshot_list_t *list, const char *dir, const char *tool,
+    const char *subvol, const char *info, char *(*describe)(const char *))
+{
+  DIR * const dp = opendir(dir);
+  if (!dp) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return 0;
+    perror("opendir");
+    return -1;
+  }
+
+  int ret = 0;
+  struct dirent *ep;
+  while ((ep = readdir(dp))) {
+    if (ep->d_type != DT_DIR || ep->d_name[0] == '.')
+      continue;
+
+    char *parent = pathcat(dir, ep->d_name);
+    char *snapshot = parent ? pathcat(parent, subvol) : NULL;
+    char name[0x200];
+    snprintf(name, sizeof(name), "%s/%s", tool, ep->d_name);
+
+    struct btrfs_util_subvolume_info subvol_info;
+    snapshot_entry_t *entry = NULL;
+    if (!snapshot) {
+      perror("pathcat");
+      ret = -1;
+    } else if (btrfs_util_subvolume_info(snapshot, 0, &subvol_info) == BTRFS_UTIL_OK) {
+      if (!(entry = snapshot_list_add(list, name, snapshot, &subvol_info)))
+        ret = -1;
+    }
+
+    if (entry) {
+      char *info_path = info ? pathcat(parent, info) : NULL;
+      entry->comment = describe(info_path);
+      free(info_path);
+    }
+
+    free(snapshot);
+    free(parent);
+  }
+
+  if (closedir(dp))
+    perror("closedir");
+  return ret;
+}
+
+static char *describe_timeshift(const char *info_path) {
+  return strdup("Timeshift snapshot");
+}
+
+static int scan_snapper(snapshot_list_t *list, const char *dir) {
+  return scan_source(list, dir, "snapper", "snapshot", "info.xml", describe_snapper);
+}
+
+static int scan_timeshift(snapshot_list_t *list, const char *dir) {
+  return scan_source(list, dir, "timeshift", "@", NULL, describe_timeshift);
+}
+
+static const struct source {
+  const char *dir; // relative to the root if `in_root`, else to the top level
+  bool in_root;
+  int (*scan)(snapshot_list_t *list, const char *dir);
+} SOURCES[] = {
+  { ".snapshots", true, scan_snapper },
+  { "@snapshots", false, scan_snapper },
+  { "timeshift-btrfs/snapshots", false, scan_timeshift },
+};
+
+int snapshot_sources_scan(snapshot_list_t *list, const char *root_subvol_dir) {
+  char *current = pathcat(root_subvol_dir, SUBVOL_CUR_NAME);
+  char *toplevel = current ? get_toplevel_path(current) : NULL;
+  if (!toplevel) {
+    perror("get_toplevel_path");
+    free(current);
+    return -1;
+  }
+
+  int ret = 0;
+  for (size_t i = 0; i < lenof(SOURCES); ++i) {
+    char *dir = pathcat(SOURCES[i].in_root ? current : toplevel, SOURCES[i].dir);
+    if (!dir || SOURCES[i].scan(list, dir))
+      ret = -1;
+    free(dir);
+  }
+
+  free(toplevel);
+  free(current);
+  return ret;
+}
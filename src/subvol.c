@@ -5,11 +5,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <constants.h>
 #include <macros.h>
+#include <path.h>
+#include <subvol.h>
+#include <workers.h>
 
 /* Utility function. If `str` begins with `target`, return a pointer to the
  * next position in `str` past `target`, otherwise NULL.
@@ -108,6 +112,42 @@ int is_subvol_toplevel(char *path) {
   return id == 5;
 }
 
+char * get_toplevel_path(const char *subvol) {
+  char *real = realpath(subvol, NULL), *rel = NULL;
+  if (!real) {
+    perror("realpath");
+    return NULL;
+  }
+
+  enum btrfs_util_error err = btrfs_util_subvolume_path(subvol, 0, &rel);
+  if (err != BTRFS_UTIL_OK) {
+    eprintf("error: %s\n", btrfs_util_strerror(err));
+    free(real);
+    return NULL;
+  }
+
+  // The subvolume's path within the filesystem must be a suffix of its real path
+  const size_t real_len = strlen(real), rel_len = strlen(rel);
+  if (rel_len && (rel_len >= real_len ||
+        strcmp(real + real_len - rel_len, rel) ||
+        real[real_len - rel_len - 1] != '/'))
+  {
+    free(real);
+    free(rel);
+    errno = ENOENT;
+    return NULL;
+  }
+
+  // Cut off the subvolume's own path, leaving the top-level's mountpoint
+  if (rel_len) {
+    char * const end = real + real_len - rel_len - 1;
+    *(end == real ? end + 1 : end) = '\0';
+  }
+
+  free(rel);
+  return real;
+}
+
 int is_subvol_provisioned(char *path) {
   // Check if the root subvol is already set up for use with btrroll
   struct stat info;
@@ -161,3 +201,196 @@ CLEANUP:
   free(tmp);
   return ret;
 }
+
+int get_nested_subvols(const char *path, nested_subvol_t **subvols) {
+  CLEANUP_DECLARE(ret);
+
+  struct btrfs_util_subvolume_iterator *iter = NULL;
+  nested_subvol_t *list = NULL;
+  uint64_t *stack = NULL; // IDs of the ancestors of the current entry
+  size_t len = 0, cap = 0, stack_len = 0;
+
+  enum btrfs_util_error err = btrfs_util_create_subvolume_iterator(path, 0, 0, &iter);
+  if (err != BTRFS_UTIL_OK) {
+    eprintf("error: %s\n", btrfs_util_strerror(err));
+    FAIL(ret);
+  }
+
+  while (true) {
+    char *subvol_path;
+    struct btrfs_util_subvolume_info info;
+    err = btrfs_util_subvolume_iterator_next_info(iter, &subvol_path, &info);
+    if (err == BTRFS_UTIL_ERROR_STOP_ITERATION)
+      break;
+    if (err != BTRFS_UTIL_OK) {
+      eprintf("error: %s\n", btrfs_util_strerror(err));
+      FAIL(ret);
+    }
+
+    if (len == cap) {
+      cap = cap ? 2*cap : 16;
+      nested_subvol_t *tmp_list = realloc(list, cap * sizeof(nested_subvol_t));
+      uint64_t *tmp_stack = realloc(stack, cap * sizeof(uint64_t));
+      if (tmp_list)
+        list = tmp_list;
+      if (tmp_stack)
+        stack = tmp_stack;
+      if (!tmp_list || !tmp_stack) {
+        free(subvol_path);
+        FAIL(ret);
+      }
+    }
+
+    // The iteration is pre-order, so the parent is always somewhere on the
+    // stack of ancestors; anything above it belongs to a finished subtree.
+    while (stack_len && stack[stack_len-1] != info.parent_id)
+      --stack_len;
+    stack[stack_len++] = info.id;
+
+    list[len].path = subvol_path;
+    list[len].id = info.id;
+    list[len].depth = stack_len;
+    ++len;
+  }
+
+  *subvols = list;
+  ret = len;
+
+CLEANUP:
+  if (ret < 0)
+    nested_subvols_free(list, len);
+  if (iter)
+    btrfs_util_destroy_subvolume_iterator(iter);
+  free(stack);
+  return ret;
+}
+
+void nested_subvols_free(nested_subvol_t *subvols, size_t len) {
+  if (!subvols)
+    return;
+  for (size_t i = 0; i < len; ++i)
+    free(subvols[i].path);
+  free(subvols);
+}
+
+typedef struct delete_job {
+  const char *root;
+  const nested_subvol_t *subvol;
+  atomic_int *failures;
+} delete_job_t;
+
+static void delete_nested_subvol(void *arg) {
+  delete_job_t * const job = arg;
+
+  char *path = pathcat(job->root, job->subvol->path);
+  if (!path) {
+    atomic_fetch_add(job->failures, 1);
+    return;
+  }
+
+  enum btrfs_util_error err = btrfs_util_delete_subvolume(path, 0);
+  if (err != BTRFS_UTIL_OK && err != BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND) {
+    eprintf("error: %s: %s\n", path, btrfs_util_strerror(err));
+    atomic_fetch_add(job->failures, 1);
+  }
+
+  free(path);
+}
+
+int delete_nested_subvols(const char *path, nested_subvol_t *subvols, size_t len) {
+  if (!path || (len && !subvols)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!len)
+    return 0;
+
+  size_t max_depth = 0;
+  for (size_t i = 0; i < len; ++i)
+    if (subvols[i].depth > max_depth)
+      max_depth = subvols[i].depth;
+
+  delete_job_t *jobs = malloc(len * sizeof(delete_job_t));
+  workers_t *workers = jobs ? workers_create(0) : NULL;
+  if (!workers) {
+    free(jobs);
+    return -1;
+  }
+
+  // A subvolume can only be deleted once it is empty of other subvolumes, so
+  // delete one level at a time, starting from the bottom of the tree.
+  atomic_int failures = 0;
+  for (size_t depth = max_depth; depth > 0 && !failures; --depth) {
+    for (size_t i = 0; i < len; ++i) {
+      if (subvols[i].depth != depth)
+        continue;
+      jobs[i] = (delete_job_t) { path, subvols + i, &failures };
+      if (workers_submit(workers, delete_nested_subvol, jobs + i))
+        atomic_fetch_add(&failures, 1);
+    }
+    workers_wait(workers);
+  }
+
+  workers_destroy(workers);
+  free(jobs);
+
+  if (failures) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+// Create every missing parent directory of `path`, like `mkdir -p $(dirname)`
+static int make_parents(char *path) {
+  for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    int err = mkdir(path, 0755) && errno != EEXIST;
+    *p = '/';
+    if (err) {
+      perror("mkdir");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int move_nested_subvols(
+    const char *src, const char *dest,
+    nested_subvol_t *subvols, size_t len)
+{
+  if (!src || !dest || (len && !subvols)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  int ret = 0;
+  for (size_t i = 0; i < len; ++i) {
+    // Deeper subvolumes come along with their outermost ancestor
+    if (subvols[i].depth != 1)
+      continue;
+
+    char *from = pathcat(src, subvols[i].path);
+    char *to = pathcat(dest, subvols[i].path);
+    if (!from || !to) {
+      free(from);
+      free(to);
+      return -1;
+    }
+
+    // A snapshot leaves an empty directory in place of each nested subvolume
+    // of its source; remove it so that the real subvolume can take its place.
+    if (rmdir(to) && errno != ENOENT) {
+      eprintf("error: cannot replace `%s`: %s\n", to, strerror(errno));
+      ret = -1;
+    } else if (make_parents(to) || rename(from, to)) {
+      eprintf("error: cannot move `%s` to `%s`: %s\n", from, to, strerror(errno));
+      ret = -1;
+    }
+
+    free(from);
+    free(to);
+  }
+
+  return ret;
+}
@@ -0,0 +1,26 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cmdline.h>
+#include <trace.h>
+
+#define KMSG_PATH "/dev/kmsg"
+
+void trace(const char *event) {
+  static int fd = -2; // not opened yet
+  if (fd == -2) {
+    fd = -1;
+    if (cmdline_get(cmdline_kernel(), CMDLINE_BTRROLL_TRACE) &&
+        (fd = open(KMSG_PATH, O_WRONLY | O_CLOEXEC)) < 0)
+      perror("open");
+  }
+  if (fd < 0)
+    return;
+
+  // <5> is KERN_NOTICE, which the console shows at the default log level
+  char buf[0x100];
+  const int len = snprintf(buf, sizeof(buf), "<5>btrroll: trace %s\n", event);
+  if (write(fd, buf, len) < 0)
+    perror("write");
+}
@@ -0,0 +1,65 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include <tree_search.h>
+
+int tree_search(
+    int fd,
+    const struct btrfs_ioctl_search_key *key,
+    tree_search_fn_t fn, void *arg)
+{
+  if (fd < 0 || !key || !fn) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct btrfs_ioctl_search_args args;
+  args.key = *key;
+
+  while (true) {
+    args.key.nr_items = UINT32_MAX; // as many as fit in the buffer
+
+    if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args) < 0)
+      return -1;
+    if (args.key.nr_items == 0)
+      return 0;
+
+    struct btrfs_ioctl_search_header header;
+    const char *p = args.buf;
+    for (uint32_t i = 0; i < args.key.nr_items; ++i) {
+      // Headers are packed back-to-back with their items, so may be unaligned
+      memcpy(&header, p, sizeof(header));
+      p += sizeof(header);
+
+      int ret = fn(&header, p, arg);
+      if (ret)
+        return ret;
+      p += header.len;
+    }
+
+    // Resume just past the last key returned
+    args.key.min_objectid = header.objectid;
+    args.key.min_type = header.type;
+    args.key.min_offset = header.offset;
+
+    if (args.key.min_offset < UINT64_MAX) {
+      ++args.key.min_offset;
+    } else if (args.key.min_type < UINT8_MAX) {
+      ++args.key.min_type;
+      args.key.min_offset = 0;
+    } else if (args.key.min_objectid < UINT64_MAX) {
+      ++args.key.min_objectid;
+      args.key.min_type = 0;
+      args.key.min_offset = 0;
+    } else {
+      return 0;
+    }
+
+    if (args.key.min_objectid > args.key.max_objectid)
+      return 0;
+  }
+}
@@ -2,8 +2,10 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <linux/magic.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
@@ -16,15 +18,27 @@
 #include <time.h>
 
 #include <boot.h>
+#include <changes.h>
+#include <clone.h>
+#include <config.h>
 #include <constants.h>
 #include <dialog.h>
+#include <group.h>
+#include <kstore.h>
+#include <lineage.h>
 #include <macros.h>
+#include <packages.h>
 #include <path.h>
+#include <probe.h>
+#include <prune.h>
+#include <qgroup.h>
 #include <root.h>
 #include <run.h>
+#include <snaplist.h>
 #include <snapshot.h>
 #include <subvol.h>
 #include <ui.h>
+#include <verify.h>
 
 int main_menu(dialog_t *dialog, char *root_subvol) {
   __label__ CLEANUP;
@@ -32,6 +46,7 @@ int main_menu(dialog_t *dialog, char *root_subvol) {
 
   static const char *ITEMS[] = {
     "Boot/restore from a snapshot",
+    "Prune snapshots",
     "Launch a shell",
     "Reboot",
     "Shutdown",
@@ -95,6 +110,13 @@ int main_menu(dialog_t *dialog, char *root_subvol) {
             break;
           }
         }
+        { // Provision the rest of the rollback group along with the root
+          group_t group;
+          if (group_load(&group, root_subvol_dir) || group_provision(&group))
+            dialog_ok(dialog, "Error", "Failed to provision the rollback "
+                "group: %s", strerror(errno));
+          group_free(&group);
+        }
         if (chdir(root_subvol_dir)) {
           dialog_ok(dialog, "Error", "Failed to chdir to `%s`: %s",
               root_subvol_dir, strerror(errno));
@@ -103,15 +125,22 @@ int main_menu(dialog_t *dialog, char *root_subvol) {
           chdir("/");
         }
         break;
-      case 1: // Launch a shell
+      case 1: // Prune snapshots
+        if (!is_provisioned)
+          dialog_ok(dialog, "Error", "The root subvolume is not provisioned for "
+              "use with btrroll, so there are no snapshots to prune.");
+        else
+          prune_menu(dialog, root_subvol_dir);
+        break;
+      case 2: // Launch a shell
         dialog_clear(dialog);
         run("sh", NULL);
         break;
-      case 2: // Reboot
+      case 3: // Reboot
         restart();
         ret = 0;
         goto CLEANUP;
-      case 3: // Shut down
+      case 4: // Shut down
         shutdown();
         ret = 0;
         goto CLEANUP;
@@ -125,6 +154,75 @@ CLEANUP:
   return ret;
 }
 
+// Summarize the result of a snapshot's bootability probe, e.g. `[no init]`
+static void format_status(const snapshot_entry_t *entry, char *buf, size_t len) {
+  char problems[0x80];
+  probe_describe(entry->problems, arr_and_size(problems));
+  snprintf(buf, len, "[%s]", problems);
+}
+
+// Rows of the lineage view show either a snapshot or the header of a group
+#define ROW_HEADER(group) (-1 - (ssize_t) (group))
+
+/* Lay the snapshots out by lineage: a header for each group of more than one
+ * snapshot, followed by its members (indented by descent) if it is expanded.
+ * `rows[i]` is set to the list index of the snapshot on row i, or to
+ * ROW_HEADER(group) for a header. Returns the number of rows.
+ */
+static size_t lineage_rows(
+    const lineage_t *lineage, const snapshot_list_t *list, char **base,
+    const bool *expanded, char **text, const char **help, ssize_t *rows)
+{
+  static const size_t ROW_LEN = 0x240;
+  size_t len = 0;
+
+  for (size_t g = 0; g < lineage->groups_len; ++g) {
+    const lineage_group_t * const group = lineage->groups + g;
+    const bool has_header = group->len > 1;
+
+    if (has_header) {
+      const char mark = expanded[g] ? '-' : '+';
+      const char * const top = list->entries[lineage->order[group->first]].name;
+      if ((text[len] = malloc(ROW_LEN))) {
+        if (group->is_live)
+          snprintf(text[len], ROW_LEN, "[%c] Snapshots of the running root (%zu)",
+              mark, group->len);
+        else
+          snprintf(text[len], ROW_LEN, "[%c] Lineage of %s (%zu)", mark, top, group->len);
+      }
+      help[len] = "Select to show or hide the snapshots in this group.";
+      rows[len++] = ROW_HEADER(g);
+      if (!expanded[g])
+        continue;
+    }
+
+    for (size_t k = 0; k < group->len; ++k) {
+      const size_t i = lineage->order[group->first + k];
+      const int indent = 2 * (lineage->depth[i] + has_header);
+      if ((text[len] = malloc(ROW_LEN)))
+        snprintf(text[len], ROW_LEN, "%*s%s", indent, "",
+            base[i] ? base[i] : list->entries[i].name);
+      help[len] = list->entries[i].description;
+      rows[len++] = i;
+    }
+  }
+
+  return len;
+}
+
+// Build the lineage of the listed snapshots, relative to the running root
+static int build_lineage(lineage_t *lineage, const snapshot_list_t *list,
+    const char *root_subvol_dir)
+{
+  char *current = pathcat(root_subvol_dir, SUBVOL_CUR_NAME);
+  struct btrfs_util_subvolume_info info;
+  const bool has_live = current &&
+    btrfs_util_subvolume_info(current, 0, &info) == BTRFS_UTIL_OK;
+  free(current);
+
+  return lineage_build(lineage, list, has_live ? info.uuid : NULL);
+}
+
 void snapshot_menu(dialog_t *dialog, char *root_subvol_dir) {
   // Change to the "snapshots" directory. This is much easier than staying in
   // place and constructing relative paths for each snapshot.
@@ -140,110 +238,133 @@ void snapshot_menu(dialog_t *dialog, char *root_subvol_dir) {
     return;
   }
 
-  DIR * const snapshots_dir = opendir(".");
-  if (!snapshots_dir) {
-    dialog_ok(dialog, "Error", "Failed to open `.`: %s", strerror(errno));
-    return;
-  }
-
   // Collect a list of snapshots and their descriptions.
-  char *snapshots[0x400];
-  char *descriptions[0x100];
-  {
-    struct dirent *ep;
-    char ** const snapshots_end = snapshots + lenof(snapshots) - 1;
-    char **p = snapshots, **q = descriptions;
-    errno = 0;
-    while ((ep = readdir(snapshots_dir)) && p != snapshots_end) {
-      if (errno) {
-        dialog_ok(dialog, "Error (readdir)",
-            "Failed to read snapshots directory: %s", strerror(errno));
-        break;
-      }
-
-      // Record the names of all applicable directories in snapshots/
-      if (ep->d_type == DT_DIR &&                               // Is a directory
-          ep->d_name[0] != '.' &&                               // Is not hidden
-          btrfs_util_is_subvolume(ep->d_name) == BTRFS_UTIL_OK) // Is a subvol
-      {
-        // Note the snapshot name
-        char *snapshot = ep->d_name;
-        *p++ = strdup(snapshot);
-
-        // Get the last-modified time for the snapshot
-        struct stat sb;
-        char mtime[0x100];
-        if (stat(snapshot, &sb)) {
-          perror("stat");
-          strcpy(mtime, "unknown");
-        } else {
-          strftime(mtime, sizeof(mtime), "%c", localtime(&sb.st_mtime));
-        }
-
-        // Get the kernel versions supported by the snapshot
-        char *versions[0x100];
-        char versions_str[0x1000];
-        int num_versions = get_kernel_versions(snapshot, versions, lenof(versions));
-        if (num_versions < 0) {
-          snprintf(versions_str, sizeof(versions_str), "unknown (%s)", strerror(errno));
-        } else {
-          char *dest = versions_str;
-          for (int i = 0; i < num_versions; ++i) {
-            char *v = versions[i];
-            dest += snprintf(dest,
-                sizeof(versions_str) - (dest - versions_str),
-                i == (num_versions-1) ? "%s" : "%s, ", v);
-            free(v);
-          }
-        }
-
-        // Compile the final description
-        static const size_t DESC_LEN = 0x1000;
-        char *desc = malloc(DESC_LEN);
-        snprintf(desc, DESC_LEN, "Last modified: %s. Kernel version(s): %s.",
-            mtime, versions_str);
-
-        *q++ = desc;
-      }
-
-      errno = 0;
-    }
-    *p = NULL;
-
-    if (closedir(snapshots_dir))
-      perror("closedir");
+  snapshot_list_t list = { 0 };
+  if (snapshot_list_scan(&list, ".", root_subvol_dir)) {
+    dialog_ok(dialog, "Error (readdir)",
+        "Failed to read snapshots directory: %s", strerror(errno));
   }
 
-  if (*snapshots == NULL) {
+  if (list.len == 0) {
     dialog_ok(dialog, "Snapshots", "There are no snapshots to display.");
+    snapshot_list_free(&list);
+    if (chdir(".."))
+      perror("chdir");
     return;
   }
 
+  // Flag each snapshot with whether it looks bootable
+  char **items = calloc(list.len, sizeof(char *));
+  const char **descriptions = calloc(list.len, sizeof(char *));
+  char **labels = calloc(list.len, sizeof(char *));
+  static const size_t ITEM_LEN = 0x200;
+  for (size_t i = 0; i < list.len; ++i) {
+    char status[0x80];
+    format_status(list.entries + i, arr_and_size(status));
+    items[i] = malloc(ITEM_LEN);
+    if (items[i])
+      snprintf(items[i], ITEM_LEN, "%-32s %s", list.entries[i].name, status);
+    descriptions[i] = list.entries[i].description;
+  }
+
+  // The lineage view is only worked out once it is first asked for
+  bool show_lineage = false;
+  lineage_t lineage = { 0 };
+  bool *expanded = calloc(list.len, sizeof(bool));
+  char **rows_text = calloc(2 * list.len, sizeof(char *));
+  const char **rows_help = calloc(2 * list.len, sizeof(char *));
+  ssize_t *rows = calloc(2 * list.len, sizeof(ssize_t));
+  size_t rows_len = 0, row_choice = 0;
+
   // Allow the user to choose between the collated snapshots
+  bool show_sizes = false;
   size_t choice = 0;
   while (true) {
+    dialog->buttons.extra = true;
+    dialog->labels.extra = show_sizes ? "Hide sizes" : "Sizes";
+    dialog->buttons.help = expanded && rows_text && rows_help && rows;
+    dialog->labels.help = show_lineage ? "Flat list" : "Lineage";
+
+    char ** const base = show_sizes ? labels : items;
+    if (show_lineage) {
+      for (size_t i = 0; i < rows_len; ++i)
+        free(rows_text[i]);
+      rows_len = lineage_rows(&lineage, &list, base, expanded, rows_text, rows_help, rows);
+      if (row_choice >= rows_len)
+        row_choice = rows_len - 1;
+    }
+
     int ret = dialog_choose(dialog,
-        (const char**)snapshots, (const char**)descriptions, 0, &choice,
-        "Snapshots", "Select a snapshot from the list below.");
+        (const char **)(show_lineage ? rows_text : base),
+        show_lineage ? rows_help : descriptions,
+        show_lineage ? rows_len : list.len,
+        show_lineage ? &row_choice : &choice,
+        "Snapshots", show_sizes
+          ? "Select a snapshot from the list below. Sizes are shown as "
+            "referenced / exclusive."
+          : "Select a snapshot from the list below.");
+
+    dialog_reset(dialog);
 
     if (ret == DIALOG_RESPONSE_CANCEL || ret < 0)
       break;
 
-    // This function repurposes the extra/help buttons as boot/restore
-    char *snapshot = snapshots[choice];
+    // `Sizes` selected; toggle the size columns
+    if (ret == DIALOG_RESPONSE_EXTRA) {
+      show_sizes = !show_sizes;
+      if (show_sizes && !labels[0])
+        snapshot_size_labels(dialog, &list, labels);
+      continue;
+    }
+
+    // `Lineage` selected; toggle between the flat list and lineage groups
+    if (ret == DIALOG_RESPONSE_HELP) {
+      if (!show_lineage && !lineage.order &&
+          build_lineage(&lineage, &list, root_subvol_dir))
+      {
+        dialog_ok(dialog, "Error", "Failed to work out the snapshots' lineage: %s",
+            strerror(errno));
+        continue;
+      }
+      show_lineage = !show_lineage;
+      continue;
+    }
+
+    // Selecting a group header shows or hides its members
+    if (show_lineage) {
+      if (rows[row_choice] < 0) {
+        const size_t group = ROW_HEADER(rows[row_choice]);
+        expanded[group] = !expanded[group];
+        continue;
+      }
+      choice = rows[row_choice];
+    }
+
+    // This function repurposes the ok/extra/help buttons as actions/boot/restore
+    char *snapshot = list.entries[choice].path;
     ret = snapshot_detail_menu(dialog, snapshot);
 
-    static const char *esp_path = "/esp"; // TODO
+    // `Actions` selected
+    if (ret == DIALOG_RESPONSE_OK) {
+      snapshot_actions_menu(dialog, root_subvol_dir, snapshot);
+      continue;
+    }
+
+    const char * const esp_path = config_get()->esp;
 
     // `Boot` selected
     if (ret == DIALOG_RESPONSE_EXTRA) {
-      char *boot_entry = boot_entry_menu(dialog, snapshot, esp_path);
-      if (!boot_entry || bootctl_set_oneshot(esp_path, boot_entry) && errno)
+      char *version = NULL;
+      char *boot_entry = boot_entry_menu(dialog, snapshot, esp_path, &version);
+      if (boot_entry && verify_menu(dialog, snapshot, version))
+        ; // verification failed and the user chose not to continue
+      else if (!boot_entry || bootctl_set_oneshot(esp_path, boot_entry) && errno)
         dialog_ok(dialog, "Error", "Failed to set oneshot boot entry: %s", strerror(errno));
       //else
       //  if (snapshot_boot(root_subvol_dir, snapshot))
       //    dialog_ok(dialog, "Error", "Failed to set up snapshot for booting: %s", strerror(errno));
       free(boot_entry);
+      free(version);
       break;
     }
 
@@ -262,7 +383,11 @@ void snapshot_menu(dialog_t *dialog, char *root_subvol_dir) {
 
         // Allow the user to set a name
         while (true) {
-          snprintf(backup, BACKUP_LEN, "%s.pre-restore", snapshot);
+          // Snapshots in subdirectories or from other tools have slashes in
+          // their names, which a backup name can't
+          snprintf(backup, BACKUP_LEN, "%s.pre-restore", list.entries[choice].name);
+          for (char *p = backup; (p = strchr(p, '/'));)
+            *p = '-';
           if (dialog_input(dialog, backup, backup, BACKUP_LEN, "Backup Name",
                 "What would you like to name the backup?") != DIALOG_RESPONSE_OK)
           {
@@ -284,13 +409,30 @@ void snapshot_menu(dialog_t *dialog, char *root_subvol_dir) {
         }
       }
 
+      // Decide what to do with any subvolumes nested inside the current root
+      snapshot_nested_t nested = SNAPSHOT_NESTED_NONE;
+      if (!cancelled &&
+          nested_subvol_menu(dialog, root_subvol_dir, backup != NULL, &nested))
+        cancelled = true;
+
       if (!cancelled) {
-        char *boot_entry = boot_entry_menu(dialog, snapshot, esp_path);
-        if (!boot_entry || !bootctl_set_default(esp_path, boot_entry) && errno)
+        char *version = NULL;
+        char *boot_entry = boot_entry_menu(dialog, snapshot, esp_path, &version);
+        if (boot_entry && verify_menu(dialog, snapshot, version))
+          ; // verification failed and the user chose not to continue
+        else if (!boot_entry || !bootctl_set_default(esp_path, boot_entry) && errno)
           dialog_ok(dialog, "Error", "Failed to set default boot entry: %s", strerror(errno));
-        else
-          snapshot_restore(root_subvol_dir, snapshot, backup);
+        else {
+          group_t group;
+          if (group_load(&group, root_subvol_dir))
+            dialog_ok(dialog, "Error", "Failed to load the rollback group: %s",
+                strerror(errno));
+          else if (group_restore(&group, snapshot, backup, nested))
+            dialog_ok(dialog, "Error", "Failed to restore: %s", strerror(errno));
+          group_free(&group);
+        }
         free(boot_entry);
+        free(version);
       }
 
       free(backup);
@@ -298,41 +440,500 @@ void snapshot_menu(dialog_t *dialog, char *root_subvol_dir) {
     }
   }
 
-  for (char **p = snapshots; *p; p++)
-    free(*p);
-  for (char **p = descriptions; *p; p++)
-    free(*p);
+  for (size_t i = 0; i < rows_len; ++i)
+    free(rows_text[i]);
+  free(rows);
+  free(rows_help);
+  free(rows_text);
+  free(expanded);
+  lineage_free(&lineage);
+
+  for (size_t i = 0; i < list.len; ++i) {
+    free(labels[i]);
+    free(items[i]);
+  }
+  free(labels);
+  free(descriptions);
+  free(items);
+  snapshot_list_free(&list);
 
   // Return to the parent directory
   if (chdir(".."))
     perror("chdir");
 }
 
+// Format a byte count compactly, e.g. `1.5G`
+static void format_size(uint64_t bytes, char *buf, size_t len) {
+  static const char UNITS[] = "BKMGTPE";
+
+  double size = bytes;
+  size_t unit = 0;
+  while (size >= 1024 && unit < sizeof(UNITS) - 2) {
+    size /= 1024;
+    ++unit;
+  }
+
+  if (unit == 0)
+    snprintf(buf, len, "%" PRIu64 "B", bytes);
+  else
+    snprintf(buf, len, "%.1f%c", size, UNITS[unit]);
+}
+
+void snapshot_size_labels(dialog_t *dialog, snapshot_list_t *list, char **labels) {
+  // Sizes come from qgroups only; walking the snapshots would take far too long
+  const qgroup_table_t *table = qgroup_table_load(".");
+  if (!table && errno != ENOTSUP)
+    dialog_ok(dialog, "Error", "Failed to read quota groups: %s", strerror(errno));
+
+  static const size_t LABEL_LEN = 0x200;
+  for (size_t i = 0; i < list->len; ++i) {
+    const snapshot_entry_t * const entry = list->entries + i;
+    const qgroup_usage_t * const usage = qgroup_table_find(table, entry->id);
+
+    char sizes[0x40];
+    if (usage) {
+      char referenced[0x10], exclusive[0x10];
+      format_size(usage->referenced, arr_and_size(referenced));
+      format_size(usage->exclusive, arr_and_size(exclusive));
+      snprintf(sizes, sizeof(sizes), "%8s / %-8s%s", referenced, exclusive,
+          table->inconsistent ? " (stale)" : "");
+    } else {
+      snprintf(sizes, sizeof(sizes), "%8s", "unknown");
+    }
+
+    char status[0x80];
+    format_status(entry, arr_and_size(status));
+
+    free(labels[i]);
+    labels[i] = malloc(LABEL_LEN);
+    if (labels[i])
+      snprintf(labels[i], LABEL_LEN, "%-32s %s %s", entry->name, status, sizes);
+  }
+}
+
 int snapshot_detail_menu(dialog_t *dialog, const char *snapshot) {
   char *info_file_path = pathcat(snapshot, INFO_FILE);
 
+  // Enough for any info file, which dialog_confirm's buffer must also fit
+  char info[0xc00] = "This snapshot has no info file.";
+  FILE * const fp = info_file_path ? fopen(info_file_path, "r") : NULL;
+  if (fp) {
+    const size_t len = fread(info, 1, sizeof(info) - 1, fp);
+    info[len] = '\0';
+    if (len == sizeof(info) - 1)
+      snprintf(info + len - 4, 4, "...");
+    fclose(fp);
+  }
+  free(info_file_path);
+
+  // A yes/no box is the only kind that can have a fourth button, for Back.
+  // With the extra button, dialog labels it as OK/Cancel rather than Yes/No.
   dialog->buttons.extra = true;
   dialog->buttons.help = true;
 
-  dialog->labels.ok = "Cancel";
+  dialog->labels.ok = dialog->labels.yes = "Actions";
+  dialog->labels.cancel = dialog->labels.no = "Back";
   dialog->labels.extra = "Boot";
   dialog->labels.help = "Restore";
 
-  int ret;
-  if (access(info_file_path, R_OK))
-    ret = dialog_ok(dialog, snapshot, "This snapshot has no info file.");
-  else
-    ret = dialog_view_file(dialog, snapshot, info_file_path);
+  const int ret = dialog_confirm(dialog, true, snapshot, "%s", info);
 
   dialog_reset(dialog);
-  free(info_file_path);
+  return ret;
+}
+
+void snapshot_actions_menu(
+    dialog_t *dialog, const char *root_subvol_dir, const char *snapshot)
+{
+  static const char *ITEMS[] = {
+    "Restore paths",
+    "Changes since",
+    "Package changes",
+    "Back",
+  };
+  static const char *HELP[] = {
+    "Copy selected files or directories from the snapshot into the current "
+      "root, without rebooting.",
+    "List the files in the current root that were added or modified since "
+      "this snapshot.",
+    "List the packages installed, removed, upgraded or downgraded in the "
+      "current root since this snapshot.",
+    "Return to the list of snapshots.",
+  };
+
+  size_t choice = 0;
+  while (true) {
+    dialog->labels.cancel = "Back";
+    int ret = dialog_choose(dialog, ITEMS, HELP, lenof(ITEMS), &choice,
+        snapshot, "What would you like to do with this snapshot?");
+    dialog_reset(dialog);
+    if (ret != DIALOG_RESPONSE_OK)
+      return;
+
+    switch (choice) {
+      case 0:
+        restore_paths_menu(dialog, root_subvol_dir, snapshot);
+        break;
+      case 1:
+        changes_view(dialog, root_subvol_dir, snapshot);
+        break;
+      case 2:
+        package_changes_view(dialog, root_subvol_dir, snapshot);
+        break;
+      default:
+        return;
+    }
+  }
+}
+
+// Check that `path` is absolute, not the root itself, and free of `..`
+static bool is_valid_restore_path(const char *path) {
+  if (path[0] != '/' || path[strspn(path, "/")] == '\0')
+    return false;
+
+  for (const char *p = path; (p = strstr(p, "..")); p += 2)
+    if (p[-1] == '/' && (p[2] == '/' || p[2] == '\0'))
+      return false;
+
+  return true;
+}
+
+void restore_paths_menu(
+    dialog_t *dialog, const char *root_subvol_dir, const char *snapshot)
+{
+  char paths[0x1000], init[sizeof(paths)] = "/etc";
+
+  while (true) {
+    // dialog does not terminate its output, so start from a clean buffer
+    memset(paths, 0, sizeof(paths));
+    if (dialog_input(dialog, init, paths, sizeof(paths) - 1,
+          "Restore Paths", "Which paths should be restored from `%s` into "
+          "the current root? Separate multiple paths with spaces.",
+          snapshot) != DIALOG_RESPONSE_OK)
+      return;
+    strcpy(init, paths);
+
+    // Validate every path before touching anything
+    char copy[sizeof(paths)];
+    strcpy(copy, paths);
+    const char *invalid = NULL;
+    int count = 0;
+    for (char *p = strtok(copy, " \n"); p && !invalid; p = strtok(NULL, " \n"), ++count)
+      if (!is_valid_restore_path(p))
+        invalid = p;
+
+    if (invalid)
+      dialog_ok(dialog, "Error", "`%s` is not a valid path. Paths must be "
+          "absolute, must not contain `..`, and must not be `/`.", invalid);
+    else if (!count)
+      dialog_ok(dialog, "Error", "No paths were given.");
+    else
+      break;
+  }
+
+  if (dialog_confirm(dialog, 0, "Restore Paths",
+        "The following paths in the current root will be replaced with their "
+        "contents in `%s`: %s\n\nContinue?", snapshot, paths)
+      != DIALOG_RESPONSE_YES)
+    return;
 
+  char *current = pathcat(root_subvol_dir, SUBVOL_CUR_NAME);
+  int restored = 0, failed = 0;
+  const char *last_failed = NULL;
+
+  for (char *p = strtok(paths, " \n"); p; p = strtok(NULL, " \n")) {
+    if (current && !restore_path(snapshot, current, p)) {
+      ++restored;
+    } else {
+      perror("restore_path");
+      ++failed;
+      last_failed = p;
+    }
+  }
+  free(current);
+
+  if (failed)
+    dialog_ok(dialog, "Error", "Restored %d path(s), but failed to restore %d, "
+        "including `%s`. Paths that failed were left unchanged.",
+        restored, failed, last_failed);
+  else
+    dialog_ok(dialog, "Restore Paths", "Restored %d path(s).", restored);
+}
+
+typedef struct changes_ctx {
+  FILE *out;
+  const char *snapshot;
+  const char *current;
+  uint64_t transid;
+  size_t count;
+} changes_ctx_t;
+
+static int write_change(change_type_t type, const char *path, bool is_dir, void *arg) {
+  changes_ctx_t * const ctx = arg;
+
+  if (fprintf(ctx->out, "%c /%s%s\n", type == CHANGE_ADDED ? 'A' : 'M',
+        path + (path[0] == '/'), is_dir && strcmp(path, "/") ? "/" : "") < 0)
+    return -1; // the viewer was closed
+
+  // Flush regularly so that the first results show up straight away
+  if (++ctx->count % 64 == 0 && fflush(ctx->out))
+    return -1;
+  return 0;
+}
+
+static int write_changes(FILE *out, void *arg) {
+  changes_ctx_t * const ctx = arg;
+  ctx->out = out;
+
+  fprintf(out, "Files added (A) or modified (M) in the current root since "
+      "`%s` (after transaction %" PRIu64 "):\n\n", ctx->snapshot, ctx->transid);
+  fflush(out);
+
+  int err = find_new(ctx->current, ctx->transid, write_change, ctx);
+  if (err < 0)
+    fprintf(out, "\nError: the search failed: %s\n", strerror(errno));
+  else if (!err)
+    fprintf(out, "\n%zu change(s) found.\n", ctx->count);
+
+  return 0;
+}
+
+void changes_view(
+    dialog_t *dialog, const char *root_subvol_dir, const char *snapshot)
+{
+  char *current = pathcat(root_subvol_dir, SUBVOL_CUR_NAME);
+
+  struct btrfs_util_subvolume_info snapshot_info, current_info;
+  enum btrfs_util_error err = btrfs_util_subvolume_info(snapshot, 0, &snapshot_info);
+  if (err == BTRFS_UTIL_OK)
+    err = btrfs_util_subvolume_info(current, 0, &current_info);
+  if (err != BTRFS_UTIL_OK) {
+    dialog_ok(dialog, "Error", "Failed to get subvolume information: %s",
+        btrfs_util_strerror(err));
+    free(current);
+    return;
+  }
+
+  // If the current root was restored from this snapshot, it has diverged from
+  // it since the restore. Otherwise, assume that the snapshot was taken of the
+  // current root (or one of its ancestors) and compare against its creation.
+  changes_ctx_t ctx = {
+    .snapshot = snapshot,
+    .current = current,
+    .transid = memcmp(current_info.parent_uuid, snapshot_info.uuid,
+        sizeof(snapshot_info.uuid)) ? snapshot_info.otransid : current_info.otransid,
+  };
+
+  char title[0x200];
+  snprintf(title, sizeof(title), "Changes since %s", snapshot);
+  if (dialog_stream(dialog, title, write_changes, &ctx) < 0)
+    dialog_ok(dialog, "Error", "Failed to display changes: %s", strerror(errno));
+
+  free(current);
+}
+
+typedef struct package_changes_ctx {
+  const char *snapshot;
+  const package_db_t *old, *new;
+} package_changes_ctx_t;
+
+static int write_package_changes(FILE *out, void *arg) {
+  const package_changes_ctx_t * const ctx = arg;
+  const package_db_t * const old = ctx->old, * const new = ctx->new;
+
+  static const char *HEADINGS[] = {
+    "Installed", "Removed", "Upgraded", "Downgraded",
+  };
+
+  fprintf(out, "Package changes in the current root since `%s`:\n", ctx->snapshot);
+
+  // Both lists are sorted by name, so one merge pass per section will do
+  size_t total = 0;
+  for (size_t section = 0; section < lenof(HEADINGS); ++section) {
+    size_t count = 0;
+    for (size_t i = 0, j = 0; i < old->len || j < new->len;) {
+      const package_t *a = i < old->len ? old->packages + i : NULL;
+      const package_t *b = j < new->len ? new->packages + j : NULL;
+      int cmp = !a ? 1 : !b ? -1 : strcmp(a->name, b->name);
+
+      const package_t *shown = NULL;
+      const char *from = NULL;
+      if (cmp < 0) {
+        if (section == 1)
+          shown = a;
+        ++i;
+      } else if (cmp > 0) {
+        if (section == 0)
+          shown = b;
+        ++j;
+      } else {
+        int v = package_vercmp(a->version, b->version);
+        if ((section == 2 && v < 0) || (section == 3 && v > 0)) {
+          shown = b;
+          from = a->version;
+        }
+        ++i;
+        ++j;
+      }
+
+      if (!shown)
+        continue;
+      if (!count++)
+        fprintf(out, "\n%s:\n", HEADINGS[section]);
+      if (from)
+        fprintf(out, "  %s %s -> %s\n", shown->name, from, shown->version);
+      else
+        fprintf(out, "  %s %s\n", shown->name, shown->version);
+    }
+    total += count;
+    fflush(out);
+  }
+
+  if (!total)
+    fprintf(out, "\nNo packages have changed.\n");
+
+  return 0;
+}
+
+void package_changes_view(
+    dialog_t *dialog, const char *root_subvol_dir, const char *snapshot)
+{
+  char *current = pathcat(root_subvol_dir, SUBVOL_CUR_NAME);
+
+  package_changes_ctx_t ctx = { snapshot, NULL, NULL };
+  if ((ctx.old = package_db_load(snapshot)))
+    ctx.new = package_db_load(current);
+
+  if (!ctx.old || !ctx.new) {
+    if (errno == ENOENT)
+      dialog_ok(dialog, "Error", "No pacman package database was found in "
+          "`%s`.", ctx.old ? "the current root" : snapshot);
+    else
+      dialog_ok(dialog, "Error", "Failed to read the package database: %s",
+          strerror(errno));
+  } else {
+    char title[0x200];
+    snprintf(title, sizeof(title), "Package changes since %s", snapshot);
+    if (dialog_stream(dialog, title, write_package_changes, &ctx) < 0)
+      dialog_ok(dialog, "Error", "Failed to display package changes: %s",
+          strerror(errno));
+  }
+
+  package_db_release(ctx.old);
+  package_db_release(ctx.new);
+  free(current);
+}
+
+int nested_subvol_menu(
+    dialog_t *dialog, const char *root_subvol_dir, bool backup,
+    snapshot_nested_t *nested)
+{
+  *nested = SNAPSHOT_NESTED_NONE;
+
+  char *current = pathcat(root_subvol_dir, SUBVOL_CUR_NAME);
+  nested_subvol_t *subvols = NULL;
+  int subvols_len = get_nested_subvols(current, &subvols);
+  free(current);
+
+  if (subvols_len < 0) {
+    dialog_ok(dialog, "Error", "Failed to list the subvolumes nested inside "
+        "the current root: %s", strerror(errno));
+    return -1;
+  }
+  if (subvols_len == 0)
+    return 0;
+
+  // With a backup, the nested subvolumes can simply stay inside of it
+  const char *items[] = {
+    "Move them into the restored root",
+    backup ? "Leave them in the backup" : "Delete them",
+  };
+  const char *help[] = {
+    "Rename each nested subvolume into place; no data is copied.",
+    backup ? "The restored root will not contain them."
+           : "Recursively delete every nested subvolume along with the root.",
+  };
+
+  size_t choice = 0;
+  int ret = dialog_choose(dialog, items, help, lenof(items), &choice,
+      "Nested Subvolumes",
+      "The current root contains %d nested subvolume(s), such as `%s`. "
+      "What should happen to them?", subvols_len, subvols[0].path);
+  nested_subvols_free(subvols, subvols_len);
+
+  if (ret != DIALOG_RESPONSE_OK)
+    return -1;
+
+  if (choice == 0)
+    *nested = SNAPSHOT_NESTED_MOVE;
+  else
+    *nested = backup ? SNAPSHOT_NESTED_NONE : SNAPSHOT_NESTED_DELETE;
+  return 0;
+}
+
+/* Offer to boot `snapshot` with a kernel of its own when no entry on the ESP
+ * has a compatible one. Returns the ID of the new entry, or NULL.
+ */
+static char *kernel_provision_menu(
+    dialog_t *dialog, const char *snapshot, const char *esp_path,
+    char **version)
+{
+  char *ret = NULL;
+  if (version)
+    *version = NULL;
+
+  // Only versions that actually ship a kernel will do
+  char *versions[32];
+  const int num_versions = get_kernel_versions(snapshot, versions, lenof(versions) - 1);
+  const char *items[lenof(versions)];
+  size_t items_len = 0;
+  for (int i = 0; i < num_versions; ++i) {
+    char vmlinuz[0x200];
+    snprintf(arr_and_size(vmlinuz), "usr/lib/modules/%s/vmlinuz", versions[i]);
+    char *path = pathcat(snapshot, vmlinuz);
+    if (path && !access(path, R_OK))
+      items[items_len++] = versions[i];
+    free(path);
+  }
+
+  size_t choice = 0;
+  if (!items_len)
+    dialog_ok(dialog, "Error", "There are no boot entries compatible with this "
+        "snapshot, and it has no kernel of its own to boot with.");
+  else if (dialog_confirm(dialog, 0, "No Compatible Boot Entries",
+        "There are no boot entries compatible with this snapshot. Would you "
+        "like to copy the snapshot's own kernel onto the ESP and add an entry "
+        "for it?") != DIALOG_RESPONSE_YES)
+    errno = 0;
+  else if (items_len > 1 &&
+      dialog_choose(dialog, items, NULL, items_len, &choice, "Choose a Kernel",
+        "The snapshot has more than one kernel. Which should it boot with?")
+      != DIALOG_RESPONSE_OK)
+    errno = 0;
+  else {
+    char id[0x200];
+    if (kstore_provision(snapshot, esp_path, items[choice], arr_and_size(id)))
+      dialog_ok(dialog, "Error", "Failed to copy the kernel onto the ESP: %s",
+          strerror(errno));
+    else {
+      ret = strdup(id);
+      if (version)
+        *version = strdup(items[choice]);
+    }
+  }
+
+  for (int i = 0; i < num_versions; ++i)
+    free(versions[i]);
   return ret;
 }
 
-char * boot_entry_menu(dialog_t *dialog, const char *snapshot, const char *esp_path) {
+char * boot_entry_menu(
+    dialog_t *dialog, const char *snapshot, const char *esp_path,
+    char **version)
+{
   __label__ CLEANUP;
   char *ret = NULL;
+  int chosen = -1;
 
   bootctl_entry_t entries[32];
   int num_entries = get_compatible_boot_entries(snapshot, esp_path, entries, lenof(entries));
@@ -341,11 +942,12 @@ char * boot_entry_menu(dialog_t *dialog, const char *snapshot, const char *esp_p
     goto CLEANUP;
   }
   else if (num_entries == 0) {
-    dialog_ok(dialog, "Error", "There are no boot entries compatible with this snapshot.");
-    goto CLEANUP;
+    // Nothing to free, and the version is set (or not) along the way
+    return kernel_provision_menu(dialog, snapshot, esp_path, version);
   }
   else if (num_entries == 1) {
     // Only one compatible entry; no need to select
+    chosen = 0;
     ret = strdup(entries[0].id);
     goto CLEANUP;
   }
@@ -372,6 +974,7 @@ char * boot_entry_menu(dialog_t *dialog, const char *snapshot, const char *esp_p
   }
 
   if  (err == DIALOG_RESPONSE_OK) {
+    chosen = choice;
     ret = strdup(entries[choice].id);
   }
   else if (err == DIALOG_RESPONSE_CANCEL) {
@@ -379,9 +982,160 @@ char * boot_entry_menu(dialog_t *dialog, const char *snapshot, const char *esp_p
   }
 
 CLEANUP:
+  if (version)
+    *version = chosen >= 0 && entries[chosen].version
+      ? strdup(entries[chosen].version) : NULL;
+
   for (int i = 0; i < num_entries; ++i) {
     bootctl_entry_free(entries + i);
   }
 
   return ret;
 }
+
+static volatile sig_atomic_t verify_interrupted = 0;
+
+static void verify_interrupt(int sig) {
+  verify_interrupted = 1;
+}
+
+// Offer to read back the files a boot depends on before committing to it
+int verify_menu(dialog_t *dialog, const char *snapshot, const char *version) {
+  if (dialog_confirm(dialog, 0, "Verify",
+        "Would you like to verify the integrity of the files needed to boot "
+        "`%s` first? This reads every one of them back from disk.", snapshot)
+      != DIALOG_RESPONSE_YES)
+    return 0;
+
+  char modules[0x200];
+  snprintf(arr_and_size(modules), "usr/lib/modules/%s", version ? version : "");
+  const char *paths[] = { version ? modules : "usr/lib/modules", "usr/lib/systemd", "etc" };
+
+  verify_t * const verify = verify_start(snapshot, arr_and_size(paths));
+  if (!verify) {
+    dialog_ok(dialog, "Error", "Failed to start verification: %s", strerror(errno));
+    return -1;
+  }
+
+  // Ctrl-C cancels the verification rather than killing btrroll
+  struct sigaction sa = { .sa_handler = verify_interrupt }, old_sa;
+  sigemptyset(&sa.sa_mask);
+  verify_interrupted = 0;
+  sigaction(SIGINT, &sa, &old_sa);
+
+  dialog_gauge_t gauge;
+  const bool gauge_open = !dialog_gauge_open(dialog, &gauge, "Verify",
+      "Verifying `%s`...\n\nPress Ctrl-C to cancel.", snapshot);
+
+  while (!verify_done(verify)) {
+    if (verify_interrupted)
+      verify_cancel(verify);
+    if (gauge_open)
+      dialog_gauge_update(&gauge, verify_progress(verify));
+    usleep(100000);
+  }
+
+  verify_result_t result;
+  verify_finish(verify, &result);
+  if (gauge_open)
+    dialog_gauge_close(&gauge);
+  sigaction(SIGINT, &old_sa, NULL);
+
+  char size[0x20];
+  format_size(result.bytes, arr_and_size(size));
+
+  int ret = 0;
+  if (result.cancelled) {
+    if (dialog_confirm(dialog, 0, "Verify",
+          "Verification was cancelled after %zu of %zu files (%s). Continue anyway?",
+          result.files, result.files_total, size) != DIALOG_RESPONSE_YES)
+      ret = -1;
+  }
+  else if (result.failed) {
+    char list[0x800] = "";
+    for (size_t i = 0; i < lenof(result.failures) && result.failures[i]; ++i) {
+      strncat(list, "\n  ", sizeof(list) - strlen(list) - 1);
+      strncat(list, result.failures[i], sizeof(list) - strlen(list) - 1);
+    }
+    if (dialog_confirm(dialog, 0, "Verify",
+          "%zu of %zu files could not be read back intact:\n%s\n\n"
+          "Booting this snapshot may fail. Continue anyway?",
+          result.failed, result.files, list) != DIALOG_RESPONSE_YES)
+      ret = -1;
+  }
+  else {
+    dialog_ok(dialog, "Verify", "All %zu files (%s) were verified successfully.",
+        result.files, size);
+  }
+
+  verify_result_free(&result);
+  return ret;
+}
+
+void prune_menu(dialog_t *dialog, char *root_subvol_dir) {
+  char spec[0x200], init[0x200] = "keep-last=10 daily=7 weekly=4";
+  prune_policy_t policy;
+  while (true) {
+    // The output isn't NUL-terminated
+    memset(spec, 0, sizeof(spec));
+    if (dialog_input(dialog, init, spec, sizeof(spec) - 1, "Prune Snapshots",
+          "Which snapshots would you like to keep? Give any of `keep-last=N`, "
+          "`hourly=N`, `daily=N`, `weekly=N` and `min-free=SIZE` (e.g. 20G). "
+          "Everything else will be deleted.") != DIALOG_RESPONSE_OK)
+      return;
+
+    spec[strcspn(spec, "\n")] = '\0';
+    if (!prune_policy_parse(&policy, spec))
+      break;
+    dialog_ok(dialog, "Error", "`%s` is not a valid policy.", spec);
+    snprintf(init, sizeof(init), "%s", spec);
+  }
+
+  char *snapshots = pathcat(root_subvol_dir, SUBVOL_SNAP_NAME);
+  snapshot_list_t list = { 0 };
+  bool *doomed = NULL;
+
+  if (!snapshots || snapshot_list_index(&list, snapshots) ||
+      !(doomed = calloc(list.len ? list.len : 1, sizeof(bool))))
+  {
+    dialog_ok(dialog, "Error", "Failed to read the snapshots directory: %s",
+        strerror(errno));
+    goto CLEANUP;
+  }
+
+  const int count = prune_plan(&list, snapshots, &policy, doomed);
+  if (count < 0) {
+    dialog_ok(dialog, "Error", "Failed to work out what to prune: %s", strerror(errno));
+    goto CLEANUP;
+  }
+  if (count == 0) {
+    dialog_ok(dialog, "Prune Snapshots", "There is nothing to prune.");
+    goto CLEANUP;
+  }
+
+  char names[0x800] = "";
+  for (size_t i = 0; i < list.len; ++i) {
+    if (!doomed[i])
+      continue;
+    strncat(names, "\n  ", sizeof(names) - strlen(names) - 1);
+    strncat(names, list.entries[i].name, sizeof(names) - strlen(names) - 1);
+  }
+
+  if (dialog_confirm(dialog, 0, "Prune Snapshots",
+        "The following %d snapshot(s) will be deleted:\n%s\n\nContinue?",
+        count, names) != DIALOG_RESPONSE_YES)
+    goto CLEANUP;
+
+  const int failed = prune_apply(&list, snapshots, doomed);
+  if (failed < 0)
+    dialog_ok(dialog, "Error", "Failed to prune snapshots: %s", strerror(errno));
+  else if (failed)
+    dialog_ok(dialog, "Error", "%d snapshot(s) could not be deleted.", failed);
+  else
+    dialog_ok(dialog, "Prune Snapshots", "Deleted %d snapshot(s).", count);
+
+CLEANUP:
+  free(doomed);
+  snapshot_list_free(&list);
+  free(snapshots);
+}
@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boot.h>
+#include <cmdline.h>
+#include <config.h>
+#include <constants.h>
+#include <group.h>
+#include <macros.h>
+#include <path.h>
+#include <snapshot.h>
+#include <subvol.h>
+#include <unattended.h>
+
+// Apply the options found in `options`, leaving the others as they are
+static int apply_options(const cmdline_t *options, unattended_t *plan) {
+  const char *action = cmdline_get(options, CMDLINE_BTRROLL_ACTION);
+  if (action) {
+    const char *target = strchr(action, ':');
+    const size_t action_len = target ? (size_t) (target++ - action) : strlen(action);
+
+    if (action_len == 4 && !strncmp(action, "boot", 4))
+      plan->action = UNATTENDED_BOOT;
+    else if (action_len == 7 && !strncmp(action, "restore", 7))
+      plan->action = UNATTENDED_RESTORE;
+    else
+      target = NULL;
+
+    if (!target || !*target) {
+      eprintf("btrroll: expected btrroll.action=boot|restore:<snapshot>\n");
+      errno = EINVAL;
+      return -1;
+    }
+    snprintf(plan->target, sizeof(plan->target), "%s", target);
+  }
+
+  const char * const entry = cmdline_get(options, CMDLINE_BTRROLL_ENTRY);
+  if (entry)
+    snprintf(plan->entry, sizeof(plan->entry), "%s", entry);
+
+  plan->timeout = cmdline_get_ulong(options, CMDLINE_BTRROLL_TIMEOUT, plan->timeout);
+  return 0;
+}
+
+/* Forget a command line action once it's gone from the command line, so that
+ * putting it back does it again; otherwise, drop it if it was already done.
+ */
+static void skip_done_action(unattended_t *plan, char *root_subvol) {
+  char *root_subvol_dir = get_subvol_dir_path(root_subvol);
+  char *path = root_subvol_dir ? pathcat(root_subvol_dir, ACTION_DONE_FILE) : NULL;
+  if (!path) {
+    perror("pathcat");
+    goto CLEANUP;
+  }
+
+  if (!cmdline_get(cmdline_kernel(), CMDLINE_BTRROLL_ACTION)) {
+    if (remove(path) && errno != ENOENT)
+      perror("remove");
+    goto CLEANUP;
+  }
+
+  char done[0x100] = "";
+  FILE * const fp = fopen(path, "r");
+  if (fp) {
+    if (!fgets(done, sizeof(done), fp))
+      done[0] = '\0';
+    fclose(fp);
+  }
+
+  if (plan->cmdline_action[0] && !strcmp(done, plan->cmdline_action)) {
+    eprintf("btrroll: btrroll.action=%s was already done; remove it from the "
+        "kernel command line to stop seeing this\n", plan->cmdline_action);
+    plan->action = UNATTENDED_NONE;
+    plan->cmdline_action[0] = '\0';
+  }
+
+CLEANUP:
+  free(path);
+  free(root_subvol_dir);
+}
+
+// Record the command line's action as done, before it reboots
+static int record_done_action(const char *root_subvol_dir, const char *action) {
+  CLEANUP_DECLARE(ret);
+
+  char *path = pathcat(root_subvol_dir, ACTION_DONE_FILE);
+  FILE *fp = NULL;
+  if (!path) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  if (!(fp = fopen(path, "w"))) {
+    perror("fopen");
+    FAIL(ret);
+  }
+  if (fputs(action, fp) == EOF || fflush(fp) || fsync(fileno(fp))) {
+    perror("fputs");
+    FAIL(ret);
+  }
+
+CLEANUP:
+  if (fp && fclose(fp)) {
+    perror("fclose");
+    ret = -1;
+  }
+  free(path);
+  return ret;
+}
+
+int unattended_read(unattended_t *plan, char *root_subvol) {
+  memset(plan, 0, sizeof(unattended_t));
+  plan->timeout = config_get()->timeout;
+
+  int ret = 0;
+  if (apply_options(cmdline_kernel(), plan))
+    ret = -1;
+
+  const char * const action = cmdline_get(cmdline_kernel(), CMDLINE_BTRROLL_ACTION);
+  if (action)
+    snprintf(plan->cmdline_action, sizeof(plan->cmdline_action), "%s", action);
+
+  char buf[0x1000];
+  if (!efivar_read_string_guid(ACTION_EFIVAR_NAME, ACTION_EFIVAR_GUID, arr_and_size(buf))) {
+    if (efivar_delete(ACTION_EFIVAR_NAME, ACTION_EFIVAR_GUID))
+      perror("efivar_delete");
+
+    cmdline_t options;
+    if (cmdline_parse(&options, buf) || apply_options(&options, plan))
+      ret = -1;
+    else if (cmdline_get(&options, CMDLINE_BTRROLL_ACTION))
+      plan->cmdline_action[0] = '\0';
+    cmdline_free(&options);
+  }
+
+  if (ret)
+    plan->action = UNATTENDED_NONE;
+  else
+    skip_done_action(plan, root_subvol);
+  return ret;
+}
+
+int unattended_run(const unattended_t *plan, char *root_subvol, const char *esp_path) {
+  CLEANUP_DECLARE(ret);
+
+  char *root_subvol_dir = get_subvol_dir_path(root_subvol);
+  char *snapshots = root_subvol_dir ? pathcat(root_subvol_dir, SUBVOL_SNAP_NAME) : NULL;
+  char *snapshot = NULL, *backup = NULL;
+  group_t group = { 0 };
+  if (!snapshots) {
+    perror("pathcat");
+    FAIL(ret);
+  }
+
+  if (!(snapshot = snapshot_resolve(snapshots, plan->target))) {
+    FAIL(ret);
+  }
+  eprintf("btrroll: %s `%s` as requested\n",
+      plan->action == UNATTENDED_BOOT ? "booting" : "restoring", snapshot);
+
+  // Pick the boot entry, unless the running kernel will do
+  char entry[0x100];
+  if (plan->entry[0]) {
+    snprintf(entry, sizeof(entry), "%s", plan->entry);
+  } else if (snapshot_compatible_entry(snapshot, esp_path, arr_and_size(entry)) < 0) {
+    eprintf("btrroll: no boot entry is compatible with `%s`\n", snapshot);
+    errno = ENOENT;
+    FAIL(ret);
+  }
+
+  // From here on, it's done whatever happens; otherwise it would be done again
+  // on every boot, and a restore would reboot forever
+  if (plan->cmdline_action[0] && record_done_action(root_subvol_dir, plan->cmdline_action)) {
+    eprintf("btrroll: not going ahead, since btrroll.action=%s would be done "
+        "again on the next boot\n", plan->cmdline_action);
+    FAIL(ret);
+  }
+
+  if (plan->action == UNATTENDED_BOOT) {
+    // The entry only once `temp` is ready; `current` may not boot with it
+    if (snapshot_prepare_boot(root_subvol_dir, snapshot)) {
+      perror("snapshot_prepare_boot");
+      FAIL(ret);
+    }
+    if (entry[0] && bootctl_set_oneshot(esp_path, entry)) {
+      perror("bootctl_set_oneshot");
+      if (snapshot_cancel_boot(root_subvol_dir))
+        perror("snapshot_cancel_boot");
+      FAIL(ret);
+    }
+    restart();
+  } else if (plan->action == UNATTENDED_RESTORE) {
+    char name[0x40];
+    const time_t now = time(NULL);
+    strftime(name, sizeof(name), PRE_RESTORE_PREFIX "%Y%m%d-%H%M%S", gmtime(&now));
+    if (!(backup = pathcat(snapshots, name))) {
+      perror("pathcat");
+      FAIL(ret);
+    }
+
+    if (entry[0] && bootctl_set_default(esp_path, entry)) {
+      perror("bootctl_set_default");
+      FAIL(ret);
+    }
+    if (group_load(&group, root_subvol_dir)) {
+      perror("group_load");
+      FAIL(ret);
+    }
+    if (group_restore(&group, snapshot, backup, SNAPSHOT_NESTED_MOVE)) {
+      perror("group_restore");
+      FAIL(ret);
+    }
+  }
+
+CLEANUP:
+  group_free(&group);
+  free(backup);
+  free(snapshot);
+  free(snapshots);
+  free(root_subvol_dir);
+  return ret;
+}
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <macros.h>
+#include <path.h>
+#include <verify.h>
+#include <workers.h>
+
+// Reads are I/O-bound, so use more threads than CPUs to keep the queue deep
+#define VERIFY_THREADS 16
+#define VERIFY_BUF_LEN 0x100000
+
+typedef struct verify_file {
+  verify_t *verify;
+  char *path;
+  off_t size;
+} verify_file_t;
+
+struct verify {
+  workers_t *workers;
+  verify_file_t *files;
+  size_t files_len, files_cap;
+  uint64_t bytes_total;
+
+  atomic_size_t files_done, files_read, failed; // done includes those skipped
+  atomic_uint_fast64_t bytes_done;
+  atomic_bool cancelled;
+
+  pthread_mutex_t lock; // protects `failures`
+  verify_result_t result;
+};
+
+// nftw() takes no context argument, so the walk goes through this
+static verify_t *walking;
+
+static int collect_file(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+  verify_t * const v = walking;
+
+  if (flag != FTW_F || !S_ISREG(sb->st_mode))
+    return 0;
+
+  if (v->files_len == v->files_cap) {
+    const size_t cap = v->files_cap ? 2*v->files_cap : 0x400;
+    verify_file_t *tmp = realloc(v->files, cap * sizeof(verify_file_t));
+    if (!tmp) {
+      perror("realloc");
+      return -1;
+    }
+    v->files = tmp;
+    v->files_cap = cap;
+  }
+
+  char *copy = strdup(path);
+  if (!copy)
+    return -1;
+
+  v->files[v->files_len++] = (verify_file_t) { v, copy, sb->st_size };
+  v->bytes_total += sb->st_size;
+  return 0;
+}
+
+static void record_failure(verify_t *v, const char *path) {
+  const size_t n = atomic_fetch_add(&v->failed, 1);
+  eprintf("verify: %s: %s\n", path, strerror(errno));
+
+  pthread_mutex_lock(&v->lock);
+  if (n < lenof(v->result.failures))
+    for (size_t i = 0; i < lenof(v->result.failures); ++i)
+      if (!v->result.failures[i]) {
+        v->result.failures[i] = strdup(path);
+        break;
+      }
+  pthread_mutex_unlock(&v->lock);
+}
+
+// Worker job: read a whole file, so that every extent's checksum is verified
+static void verify_file(void *arg) {
+  verify_file_t * const file = arg;
+  verify_t * const v = file->verify;
+  char *buf = NULL;
+  int fd = -1;
+
+  if (atomic_load(&v->cancelled))
+    goto DONE;
+
+  fd = open(file->path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+  if (fd < 0 && errno == EPERM)
+    fd = open(file->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || !(buf = malloc(VERIFY_BUF_LEN))) {
+    record_failure(v, file->path);
+    atomic_fetch_add(&v->files_read, 1);
+    goto DONE;
+  }
+
+  // Anything already cached would not be read from disk, or verified
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  off_t offset = 0;
+  while (!atomic_load(&v->cancelled)) {
+    ssize_t n = pread(fd, buf, VERIFY_BUF_LEN, offset);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      // EIO here is how BTRFS reports a checksum mismatch
+      record_failure(v, file->path);
+      atomic_fetch_add(&v->files_read, 1);
+      break;
+    }
+    if (n == 0) {
+      atomic_fetch_add(&v->files_read, 1);
+      break;
+    }
+    offset += n;
+    atomic_fetch_add(&v->bytes_done, n);
+  }
+
+  // Don't leave the snapshot's data crowding out the page cache
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+DONE:
+  if (fd >= 0)
+    close(fd);
+  free(buf);
+  atomic_fetch_add(&v->files_done, 1);
+}
+
+verify_t *verify_start(const char *root, const char * const *paths, size_t paths_len) {
+  if (!root || (paths_len && !paths)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  verify_t * const v = calloc(1, sizeof(verify_t));
+  if (!v)
+    return NULL;
+  pthread_mutex_init(&v->lock, NULL);
+
+  // Collect the files up front, so that progress can be reported in bytes
+  walking = v;
+  for (size_t i = 0; i < paths_len; ++i) {
+    char *path = pathcat(root, paths[i]);
+    if (!path || (nftw(path, collect_file, 64, FTW_PHYS | FTW_MOUNT) && errno != ENOENT)) {
+      perror("nftw");
+      free(path);
+      walking = NULL;
+      verify_finish(v, NULL);
+      return NULL;
+    }
+    free(path);
+  }
+  walking = NULL;
+
+  if (v->files_len && !(v->workers = workers_create(VERIFY_THREADS))) {
+    verify_finish(v, NULL);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < v->files_len; ++i)
+    if (workers_submit(v->workers, verify_file, v->files + i))
+      verify_file(v->files + i);
+
+  return v;
+}
+
+int verify_progress(verify_t *verify) {
+  if (!verify->bytes_total)
+    return verify_done(verify) ? 100 : 0;
+  return atomic_load(&verify->bytes_done) * 100 / verify->bytes_total;
+}
+
+bool verify_done(verify_t *verify) {
+  return atomic_load(&verify->files_done) == verify->files_len;
+}
+
+void verify_cancel(verify_t *verify) {
+  atomic_store(&verify->cancelled, true);
+}
+
+void verify_finish(verify_t *verify, verify_result_t *result) {
+  if (verify->workers)
+    workers_destroy(verify->workers);
+
+  verify->result.files = atomic_load(&verify->files_read);
+  verify->result.files_total = verify->files_len;
+  verify->result.failed = atomic_load(&verify->failed);
+  verify->result.bytes = atomic_load(&verify->bytes_done);
+  verify->result.cancelled = atomic_load(&verify->cancelled);
+
+  if (result)
+    *result = verify->result;
+  else
+    verify_result_free(&verify->result);
+
+  for (size_t i = 0; i < verify->files_len; ++i)
+    free(verify->files[i].path);
+  free(verify->files);
+  pthread_mutex_destroy(&verify->lock);
+  free(verify);
+}
+
+void verify_result_free(verify_result_t *result) {
+  for (size_t i = 0; i < lenof(result->failures); ++i) {
+    free(result->failures[i]);
+    result->failures[i] = NULL;
+  }
+}
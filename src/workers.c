@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <workers.h>
+
+#define WORKERS_MAX 64
+
+typedef struct job {
+  worker_fn_t fn;
+  void *arg;
+  struct job *next;
+} job_t;
+
+struct workers {
+  pthread_mutex_t lock;
+  pthread_cond_t work;  // signalled when a job is queued or on shutdown
+  pthread_cond_t idle;  // signalled when the last busy worker goes idle
+  job_t *head, *tail;
+  size_t busy;
+  bool stop;
+
+  pthread_t *threads;
+  size_t threads_len;
+};
+
+static void *worker_main(void *arg) {
+  workers_t * const w = arg;
+
+  pthread_mutex_lock(&w->lock);
+  while (true) {
+    while (!w->head && !w->stop)
+      pthread_cond_wait(&w->work, &w->lock);
+    if (!w->head)
+      break; // stopping, and nothing left to do
+
+    job_t * const job = w->head;
+    if (!(w->head = job->next))
+      w->tail = NULL;
+    ++w->busy;
+    pthread_mutex_unlock(&w->lock);
+
+    job->fn(job->arg);
+    free(job);
+
+    pthread_mutex_lock(&w->lock);
+    if (--w->busy == 0 && !w->head)
+      pthread_cond_broadcast(&w->idle);
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+
+workers_t *workers_create(size_t count) {
+  if (!count) {
+    const long n = sysconf(_SC_NPROCESSORS_ONLN);
+    count = n > 0 ? n : 1;
+  }
+  if (count > WORKERS_MAX)
+    count = WORKERS_MAX;
+
+  workers_t * const w = calloc(1, sizeof(workers_t));
+  if (!w)
+    return NULL;
+
+  w->threads = calloc(count, sizeof(pthread_t));
+  if (!w->threads) {
+    free(w);
+    return NULL;
+  }
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->work, NULL);
+  pthread_cond_init(&w->idle, NULL);
+
+  for (; w->threads_len < count; ++w->threads_len) {
+    int err = pthread_create(w->threads + w->threads_len, NULL, worker_main, w);
+    if (err) {
+      errno = err;
+      perror("pthread_create");
+      break;
+    }
+  }
+
+  // Running with fewer threads than requested is fine, but not with none
+  if (!w->threads_len) {
+    workers_destroy(w);
+    return NULL;
+  }
+
+  return w;
+}
+
+int workers_submit(workers_t *workers, worker_fn_t fn, void *arg) {
+  if (!workers || !fn) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  job_t * const job = malloc(sizeof(job_t));
+  if (!job)
+    return -1;
+  job->fn = fn;
+  job->arg = arg;
+  job->next = NULL;
+
+  pthread_mutex_lock(&workers->lock);
+  if (workers->tail)
+    workers->tail->next = job;
+  else
+    workers->head = job;
+  workers->tail = job;
+  pthread_cond_signal(&workers->work);
+  pthread_mutex_unlock(&workers->lock);
+
+  return 0;
+}
+
+void workers_wait(workers_t *workers) {
+  pthread_mutex_lock(&workers->lock);
+  while (workers->head || workers->busy)
+    pthread_cond_wait(&workers->idle, &workers->lock);
+  pthread_mutex_unlock(&workers->lock);
+}
+
+void workers_destroy(workers_t *workers) {
+  if (!workers)
+    return;
+
+  pthread_mutex_lock(&workers->lock);
+  workers->stop = true;
+  pthread_cond_broadcast(&workers->work);
+  pthread_mutex_unlock(&workers->lock);
+
+  for (size_t i = 0; i < workers->threads_len; ++i)
+    pthread_join(workers->threads[i], NULL);
+
+  pthread_cond_destroy(&workers->idle);
+  pthread_cond_destroy(&workers->work);
+  pthread_mutex_destroy(&workers->lock);
+  free(workers->threads);
+  free(workers);
+}
@@ -0,0 +1,217 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xmlscan.h>
+
+// Skip past the next occurrence of `end`, which must not repeat its first
+// character (e.g. `?>`, `-->`)
+static int skip_past(FILE *fp, const char *end) {
+  const size_t len = strlen(end);
+  size_t matched = 0;
+  int c;
+  while (matched < len && (c = getc_unlocked(fp)) != EOF)
+    matched = c == end[matched] ? matched + 1 : c == end[0];
+  return matched == len ? 0 : -1;
+}
+
+// Encode a code point as UTF-8, returning the number of bytes written
+static size_t utf8_encode(unsigned long cp, char *out) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    out[0] = 0xC0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  } else if (cp < 0x10000) {
+    out[0] = 0xE0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3F);
+    out[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  } else if (cp < 0x110000) {
+    out[0] = 0xF0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3F);
+    out[2] = 0x80 | ((cp >> 6) & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+  }
+  return 0;
+}
+
+// Decode character and entity references in place. Unknown ones are kept.
+static void decode_entities(char *text) {
+  static const struct {
+    const char *name;
+    char c;
+  } ENTITIES[] = {
+    { "lt;", '<' },
+    { "gt;", '>' },
+    { "amp;", '&' },
+    { "quot;", '"' },
+    { "apos;", '\'' },
+  };
+
+  char *out = text;
+  for (char *in = text; *in;) {
+    if (*in != '&') {
+      *out++ = *in++;
+      continue;
+    }
+
+    if (in[1] == '#') {
+      char *end;
+      const unsigned long cp = in[2] == 'x'
+        ? strtoul(in + 3, &end, 16)
+        : strtoul(in + 2, &end, 10);
+      // The encoding is never longer than the reference itself
+      if (*end == ';' && end > in + 2) {
+        const size_t n = utf8_encode(cp, out);
+        if (n) {
+          out += n;
+          in = end + 1;
+          continue;
+        }
+      }
+    } else {
+      size_t i;
+      for (i = 0; i < sizeof(ENTITIES)/sizeof(ENTITIES[0]); ++i) {
+        const size_t len = strlen(ENTITIES[i].name);
+        if (!strncmp(in + 1, ENTITIES[i].name, len)) {
+          *out++ = ENTITIES[i].c;
+          in += len + 1;
+          break;
+        }
+      }
+      if (i < sizeof(ENTITIES)/sizeof(ENTITIES[0]))
+        continue;
+    }
+
+    *out++ = *in++;
+  }
+  *out = '\0';
+}
+
+int xml_scan(FILE *fp, xml_text_fn fn, void *arg) {
+  char path[XML_PATH_MAX], text[XML_TEXT_MAX];
+  size_t path_len = 0, text_len = 0;
+  path[0] = '\0';
+
+  int c;
+  while ((c = getc_unlocked(fp)) != EOF) {
+    if (c != '<') {
+      if (text_len < sizeof(text) - 1)
+        text[text_len++] = c;
+      continue;
+    }
+
+    c = getc_unlocked(fp);
+
+    // Processing instruction, e.g. `<?xml version="1.0"?>`
+    if (c == '?') {
+      if (skip_past(fp, "?>"))
+        goto MALFORMED;
+      continue;
+    }
+
+    // Comment, CDATA section or DOCTYPE
+    if (c == '!') {
+      char head[8] = { 0 };
+      size_t head_len = 0;
+      while (head_len < 2 && (c = getc_unlocked(fp)) != EOF && c != '>')
+        head[head_len++] = c;
+      if (!strcmp(head, "--")) {
+        if (skip_past(fp, "-->"))
+          goto MALFORMED;
+      } else if (!strcmp(head, "[C")) {
+        // `[CDATA[` ... `]]>`: kept as text, as is
+        if (fread(head, 1, 5, fp) != 5 || strncmp(head, "DATA[", 5))
+          goto MALFORMED;
+        int prev2 = 0, prev = 0;
+        while ((c = getc_unlocked(fp)) != EOF &&
+            !(c == '>' && prev == ']' && prev2 == ']'))
+        {
+          if (text_len < sizeof(text) - 1)
+            text[text_len++] = c;
+          prev2 = prev;
+          prev = c;
+        }
+        if (c == EOF)
+          goto MALFORMED;
+        text_len = text_len >= 2 ? text_len - 2 : 0;
+      } else if (c != '>' && skip_past(fp, ">")) {
+        goto MALFORMED;
+      }
+      continue;
+    }
+
+    // Closing tag: hand over the element's text
+    if (c == '/') {
+      char name[XML_PATH_MAX];
+      size_t name_len = 0;
+      while ((c = getc_unlocked(fp)) != EOF && c != '>')
+        if (name_len < sizeof(name) - 1 && c != ' ' && c != '\t' && c != '\n' && c != '\r')
+          name[name_len++] = c;
+      name[name_len] = '\0';
+
+      const char * const last = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+      if (c == EOF || !path_len || strcmp(last, name))
+        goto MALFORMED;
+
+      text[text_len] = '\0';
+      decode_entities(text);
+      const int ret = fn(path, text, arg);
+      if (ret)
+        return ret;
+
+      path_len = last == path ? 0 : last - path - 1;
+      path[path_len] = '\0';
+      text_len = 0;
+      continue;
+    }
+
+    // Opening tag: push its name, and skip its attributes
+    const size_t parent_len = path_len;
+    if (path_len && path_len < sizeof(path) - 1)
+      path[path_len++] = '/';
+    const size_t name_start = path_len;
+    for (; c != EOF && c != '>' && c != '/' && c != ' ' && c != '\t' &&
+        c != '\n' && c != '\r'; c = getc_unlocked(fp))
+    {
+      if (path_len < sizeof(path) - 1)
+        path[path_len++] = c;
+    }
+    path[path_len] = '\0';
+    if (path_len == name_start)
+      goto MALFORMED;
+
+    int quote = 0, prev = 0;
+    for (; c != EOF && (quote || c != '>'); c = getc_unlocked(fp)) {
+      if (quote && c == quote)
+        quote = 0;
+      else if (!quote && (c == '"' || c == '\''))
+        quote = c;
+      prev = c;
+    }
+    if (c == EOF)
+      goto MALFORMED;
+
+    // Self-closing, e.g. `<userdata/>`
+    if (prev == '/') {
+      const int ret = fn(path, "", arg);
+      if (ret)
+        return ret;
+      path_len = parent_len;
+      path[path_len] = '\0';
+    }
+    text_len = 0;
+  }
+
+  if (!path_len)
+    return 0;
+
+MALFORMED:
+  errno = EINVAL;
+  return -1;
+}
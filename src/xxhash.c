@@ -0,0 +1,132 @@
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <xxhash.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return le64toh(v);
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return le32toh(v);
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t val) {
+  acc ^= round64(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* Consume as many whole 32-byte stripes of `p` as possible, returning the
+ * number of bytes consumed. The four lanes are independent, which lets the
+ * CPU (or the compiler's vectorizer) work on them in parallel.
+ */
+static size_t consume_stripes(uint64_t v[4], const uint8_t *p, size_t len) {
+  uint64_t v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+  const uint8_t * const start = p, * const end = p + (len & ~(size_t) 31);
+
+  for (; p < end; p += 32) {
+    v1 = round64(v1, read64(p));
+    v2 = round64(v2, read64(p + 8));
+    v3 = round64(v3, read64(p + 16));
+    v4 = round64(v4, read64(p + 24));
+  }
+
+  v[0] = v1; v[1] = v2; v[2] = v3; v[3] = v4;
+  return p - start;
+}
+
+void xxh64_reset(xxh64_state_t *state, uint64_t seed) {
+  memset(state, 0, sizeof(xxh64_state_t));
+  state->seed = seed;
+  state->v[0] = seed + PRIME64_1 + PRIME64_2;
+  state->v[1] = seed + PRIME64_2;
+  state->v[2] = seed;
+  state->v[3] = seed - PRIME64_1;
+}
+
+void xxh64_update(xxh64_state_t *state, const void *data, size_t len) {
+  const uint8_t *p = data;
+  state->total_len += len;
+
+  // Top up a partial stripe left over from the last update first
+  if (state->buf_len) {
+    const size_t n = len < 32 - state->buf_len ? len : 32 - state->buf_len;
+    memcpy(state->buf + state->buf_len, p, n);
+    state->buf_len += n;
+    p += n;
+    len -= n;
+
+    if (state->buf_len < 32)
+      return;
+    consume_stripes(state->v, state->buf, 32);
+    state->buf_len = 0;
+  }
+
+  const size_t n = consume_stripes(state->v, p, len);
+  memcpy(state->buf, p + n, len - n);
+  state->buf_len = len - n;
+}
+
+uint64_t xxh64_digest(const xxh64_state_t *state) {
+  uint64_t h;
+  if (state->total_len >= 32) {
+    const uint64_t *v = state->v;
+    h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+    for (int i = 0; i < 4; ++i)
+      h = merge_round(h, v[i]);
+  } else {
+    h = state->seed + PRIME64_5;
+  }
+
+  h += state->total_len;
+
+  const uint8_t *p = state->buf, * const end = state->buf + state->buf_len;
+  for (; p + 8 <= end; p += 8) {
+    h ^= round64(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t) read32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= *p * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+  xxh64_state_t state;
+  xxh64_reset(&state, seed);
+  xxh64_update(&state, data, len);
+  return xxh64_digest(&state);
+}